@@ -0,0 +1,544 @@
+/*
+ * asm.c
+ *
+ * This file is part of awl
+ */
+
+#include "asm.h"
+
+#include <ctype.h>
+#include <string.h>
+#include "vec.h"
+#include "mem.h"
+#include "err.h"
+
+#define ASM_MAXWORD 16
+
+/* The text of an asm statement, being read */
+typedef struct Text {
+	File *file;
+	Token token;
+	size_t noperands;
+	const char *at;
+} Text;
+
+static Span span(Text *text, const char *first, const char *last);
+static void skip(Text *text);
+static bool word(Text *text, char *buf);
+static int64_t number(Text *text);
+static int ref(Text *text, uint8_t *size);
+static void memory(Text *text, AsmOperand *operand);
+static void operand(Text *text, AsmOperand *operand);
+static bool findcc(const char *suffix, cond *cc);
+static void mnemonic(Text *text, const char *name, const char *at, AsmInsn *insn);
+static void instruction(Text *text, AsmInsn *insn);
+
+/* Registers by name; those of 1 to 8 bytes are general purpose, the rest XMM and YMM */
+static const struct {
+	const char *names[16];
+	uint8_t size;
+} regnames[] = {
+	{ { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" }, 8 },
+	{ { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+	    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" }, 4 },
+	{ { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+	    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" }, 2 },
+	{ { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+	    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" }, 1 },
+	{ { "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+	    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15" }, 16 },
+	{ { "ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "ymm5", "ymm6", "ymm7",
+	    "ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15" }, 32 },
+};
+
+/* Sizes of memory operands, as in "dword ptr [...]" */
+static const struct {
+	const char *name;
+	uint8_t size;
+} ptrsizes[] = {
+	{ "byte", 1 }, { "word", 2 }, { "dword", 4 }, { "qword", 8 }, { "xmmword", 16 }, { "ymmword", 32 },
+};
+
+/* Condition code suffixes of setcc and cmovcc, with their synonyms */
+static const struct {
+	const char *name;
+	cond cc;
+} ccnames[] = {
+	{ "o", CC_O }, { "no", CC_NO }, { "b", CC_B }, { "c", CC_B }, { "nae", CC_B },
+	{ "ae", CC_AE }, { "nb", CC_AE }, { "nc", CC_AE }, { "e", CC_E }, { "z", CC_E },
+	{ "ne", CC_NE }, { "nz", CC_NE }, { "be", CC_BE }, { "na", CC_BE }, { "a", CC_A },
+	{ "nbe", CC_A }, { "s", CC_S }, { "ns", CC_NS }, { "p", CC_P }, { "pe", CC_P },
+	{ "np", CC_NP }, { "po", CC_NP }, { "l", CC_L }, { "nge", CC_L }, { "ge", CC_GE },
+	{ "nl", CC_GE }, { "le", CC_LE }, { "ng", CC_LE }, { "g", CC_G }, { "nle", CC_G },
+};
+
+/*
+ * Read the instructions of one string of an asm statement, separated by ';'.
+ * Each is a mnemonic, optionally after 'lock', and up to three operands:
+ * registers, immediates, memory as '[base + index * scale + disp]' with an
+ * optional size ('qword ptr'), and references to the operands of the
+ * statement, as '%0' to '%9'. A reference may be given a size, as gcc has
+ * it: '%b0', '%w0', '%k0' and '%q0' for 1, 2, 4 and 8 bytes. Jumps, calls
+ * and returns are not accepted, as the code around the statement is laid
+ * out on the assumption that control leaves it at its end.
+ */
+void asm_parse(File *file, Token token, size_t noperands, AsmInsn **insns, size_t *ninsns)
+{
+	Text text = { .file = file, .token = token, .noperands = noperands, .at = token.content };
+
+	while (true) {
+		skip(&text);
+
+		if (*text.at == ';') {
+			++text.at;
+			continue;
+		}
+
+		if (!*text.at) {
+			break;
+		}
+
+		AsmInsn insn;
+		instruction(&text, &insn);
+		vec_push(*insns, &insn, ninsns, sizeof(AsmInsn));
+
+		skip(&text);
+
+		if (*text.at && *text.at != ';') {
+			err_source(file, span(&text, text.at, text.at + 1), "expected ',' or ';'");
+		}
+	}
+}
+
+/* Characters of the text are one past the opening quote of its token */
+static Span span(Text *text, const char *first, const char *last)
+{
+	int offset = text->token.span.first + 1;
+
+	return (Span){
+		.linendx = text->token.span.linendx,
+		.first = offset + (int)(first - text->token.content),
+		.last = offset + (int)(last - text->token.content),
+	};
+}
+
+static void skip(Text *text)
+{
+	while (isspace(*text->at)) {
+		++text->at;
+	}
+}
+
+/* A word of letters and digits, lowercased; false if there is none */
+static bool word(Text *text, char *buf)
+{
+	const char *first = text->at;
+	size_t n = 0;
+
+	while (isalnum(*text->at)) {
+		if (n == ASM_MAXWORD) {
+			err_source(text->file, span(text, first, text->at), "unknown word");
+		}
+
+		buf[n++] = tolower(*text->at);
+		++text->at;
+	}
+
+	buf[n] = '\0';
+	return n > 0;
+}
+
+/* A decimal or hexadecimal ('0x') integer, which may be negated */
+static int64_t number(Text *text)
+{
+	const char *first = text->at;
+	bool neg = *text->at == '-';
+	uint64_t v = 0;
+
+	if (neg) {
+		++text->at;
+		skip(text);
+	}
+
+	if (!isdigit(*text->at)) {
+		err_source(text->file, span(text, first, text->at + 1), "expected a number");
+	}
+
+	bool hex = text->at[0] == '0' && (text->at[1] == 'x' || text->at[1] == 'X');
+	if (hex) {
+		text->at += 2;
+	}
+
+	while (hex ? isxdigit(*text->at) : isdigit(*text->at)) {
+		char c = tolower(*text->at);
+		uint64_t digit = isdigit(c) ? (uint64_t)(c - '0') : (uint64_t)(c - 'a' + 10);
+		uint64_t base = hex ? 16 : 10;
+
+		if (v > (UINT64_MAX - digit) / base) {
+			err_source(text->file, span(text, first, text->at + 1), "number out of range");
+		}
+
+		v = v * base + digit;
+		++text->at;
+	}
+
+	if (isalnum(*text->at)) {
+		err_source(text->file, span(text, first, text->at + 1), "malformed number");
+	}
+
+	return neg ? -(int64_t)v : (int64_t)v;
+}
+
+bool asm_register(const char *name, reg *r, uint8_t *size)
+{
+	for (size_t i = 0; i < sizeof(regnames) / sizeof(*regnames); ++i) {
+		for (size_t j = 0; j < 16; ++j) {
+			if (!strcmp(regnames[i].names[j], name)) {
+				*r = (reg)j;
+				*size = regnames[i].size;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+reg asm_letter(char c)
+{
+	switch (c) {
+		case 'a': return RAX;
+		case 'b': return RBX;
+		case 'c': return RCX;
+		case 'd': return RDX;
+		case 'S': return RSI;
+		case 'D': return RDI;
+		default: return NOREG;
+	}
+}
+
+/* A reference to an operand of the statement, after its '%': its number, and the size a modifier gives it */
+static int ref(Text *text, uint8_t *size)
+{
+	const char *first = text->at - 1;
+
+	*size = 0;
+	switch (*text->at) {
+		case 'b': *size = 1; break;
+		case 'w': *size = 2; break;
+		case 'k': *size = 4; break;
+		case 'q': *size = 8; break;
+		default: break;
+	}
+
+	if (*size) {
+		++text->at;
+	}
+
+	if (!isdigit(*text->at)) {
+		err_source(text->file, span(text, first, text->at + 1), "expected an operand number");
+	}
+
+	int n = *text->at - '0';
+	++text->at;
+
+	if (isalnum(*text->at) || (size_t)n >= text->noperands) {
+		err_source(text->file, span(text, first, text->at), "no such operand");
+	}
+
+	return n;
+}
+
+/* The address of a memory operand, after its '[' */
+static void memory(Text *text, AsmOperand *operand)
+{
+	const char *first = text->at - 1;
+	bool neg = false;
+
+	operand->op.kind = OPND_MEM;
+	operand->op.mem.base = NOREG;
+	operand->op.mem.index = NOREG;
+	operand->op.mem.scale = 1;
+	operand->op.mem.disp = 0;
+	operand->op.mem.fs = false;
+	operand->op.mem.sym = 0;
+
+	while (true) {
+		skip(text);
+
+		const char *at = text->at;
+		char buf[ASM_MAXWORD + 1];
+		reg r = NOREG;
+		uint8_t size = 0;
+		int n = ASM_NOREF;
+
+		if (isdigit(*text->at)) {
+			int64_t d = number(text);
+			d = neg ? -d : d;
+
+			if (d + (int64_t)operand->op.mem.disp < INT32_MIN || d + (int64_t)operand->op.mem.disp > INT32_MAX) {
+				err_source(text->file, span(text, at, text->at), "displacement out of range");
+			}
+
+			operand->op.mem.disp += (int32_t)d;
+		} else {
+			if (*text->at == '%') {
+				++text->at;
+				n = ref(text, &size);
+			} else if (!word(text, buf) || !asm_register(buf, &r, &size) || size != 8) {
+				err_source(text->file, span(text, at, text->at > at ? text->at : at + 1), "expected a 64-bit register or a displacement");
+			}
+
+			if (neg) {
+				err_source(text->file, span(text, at, text->at), "a register cannot be subtracted");
+			}
+
+			skip(text);
+
+			uint8_t scale = 0;
+			if (*text->at == '*') {
+				++text->at;
+				skip(text);
+
+				const char *s = text->at;
+				int64_t v = number(text);
+
+				if (v != 1 && v != 2 && v != 4 && v != 8) {
+					err_source(text->file, span(text, s, text->at), "scale must be 1, 2, 4 or 8");
+				}
+
+				scale = (uint8_t)v;
+			}
+
+			bool base = !scale && operand->op.mem.base == NOREG && operand->base == ASM_NOREF;
+
+			if (!base && (operand->op.mem.index != NOREG || operand->index != ASM_NOREF)) {
+				err_source(text->file, span(text, at, text->at), "too many registers in address");
+			}
+
+			if (!base && r == RSP) {
+				err_source(text->file, span(text, at, text->at), "rsp cannot be an index");
+			}
+
+			if (base) {
+				operand->op.mem.base = r;
+				operand->base = n;
+			} else {
+				operand->op.mem.index = r;
+				operand->op.mem.scale = scale ? scale : 1;
+				operand->index = n;
+			}
+		}
+
+		skip(text);
+
+		if (*text->at == ']') {
+			++text->at;
+			break;
+		}
+
+		if (*text->at != '+' && *text->at != '-') {
+			err_source(text->file, span(text, first, text->at + 1), "expected '+', '-' or ']'");
+		}
+
+		neg = *text->at == '-';
+		++text->at;
+	}
+}
+
+static void operand(Text *text, AsmOperand *operand)
+{
+	const char *first = text->at;
+	char buf[ASM_MAXWORD + 1];
+
+	operand->op = OPNONE;
+	operand->ref = ASM_NOREF;
+	operand->base = ASM_NOREF;
+	operand->index = ASM_NOREF;
+
+	if (*text->at == '%') {
+		++text->at;
+		operand->ref = ref(text, &operand->op.size);
+		return;
+	}
+
+	if (*text->at == '-' || isdigit(*text->at)) {
+		operand->op = OPIMM(number(text));
+		return;
+	}
+
+	if (*text->at == '[') {
+		++text->at;
+		memory(text, operand);
+		return;
+	}
+
+	if (!word(text, buf)) {
+		err_source(text->file, span(text, first, first + 1), "expected an operand");
+	}
+
+	for (size_t i = 0; i < sizeof(ptrsizes) / sizeof(*ptrsizes); ++i) {
+		if (strcmp(ptrsizes[i].name, buf)) {
+			continue;
+		}
+
+		skip(text);
+
+		if (!word(text, buf) || strcmp(buf, "ptr")) {
+			err_source(text->file, span(text, first, text->at), "expected 'ptr'");
+		}
+
+		skip(text);
+
+		if (*text->at != '[') {
+			err_source(text->file, span(text, first, text->at + 1), "expected '['");
+		}
+
+		++text->at;
+		memory(text, operand);
+		operand->op.size = ptrsizes[i].size;
+		return;
+	}
+
+	reg r = NOREG;
+	uint8_t size = 0;
+
+	if (!asm_register(buf, &r, &size)) {
+		err_source(text->file, span(text, first, text->at), "unknown register '%s'", buf);
+	}
+
+	operand->op = OPREG(r, size);
+}
+
+static bool findcc(const char *suffix, cond *cc)
+{
+	for (size_t i = 0; i < sizeof(ccnames) / sizeof(*ccnames); ++i) {
+		if (!strcmp(ccnames[i].name, suffix)) {
+			*cc = ccnames[i].cc;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * The op of a mnemonic, as the encoder names them. A 'v' in front of an SSE
+ * mnemonic asks for its VEX form, which AVX2 mnemonics and BMI2 always have.
+ */
+static void mnemonic(Text *text, const char *name, const char *at, AsmInsn *insn)
+{
+	Span sp = span(text, at, at + strlen(name));
+
+	insn->op = _X86_NULL;
+	insn->cc = CC_O;
+	insn->vex = false;
+
+	if (!strcmp(name, "call") || !strcmp(name, "jmp") || !strcmp(name, "ret") || !strcmp(name, "leave")
+			|| (name[0] == 'j' && findcc(name + 1, &insn->cc))) {
+		err_source(text->file, sp, "'%s' is not allowed in asm; control must leave it at its end", name);
+	}
+
+	if (!strncmp(name, "set", 3) && findcc(name + 3, &insn->cc)) {
+		insn->op = X86_SETCC;
+		return;
+	}
+
+	if (!strncmp(name, "cmov", 4) && findcc(name + 4, &insn->cc)) {
+		insn->op = X86_CMOVCC;
+		return;
+	}
+
+	/* movq is movd of a 64-bit register, with a VEX prefix or without */
+	if (!strcmp(name, "movq")) {
+		name = "movd";
+	} else if (!strcmp(name, "vmovq")) {
+		name = "vmovd";
+	} else if (!strcmp(name, "sal")) {
+		name = "shl";
+	}
+
+	for (x86_op op = _X86_NULL + 1; op < _X86_COUNT && !insn->op; ++op) {
+		const char *opname = enc_opname(op);
+
+		if (op == X86_JCC || op == X86_SETCC || op == X86_CMOVCC || !opname) {
+			continue;
+		}
+
+		if (!strcmp(opname, name)) {
+			insn->op = op;
+			insn->vex = op >= X86_VPBROADCASTB || (op >= X86_PDEP && op <= X86_SARX);
+		} else if (name[0] == 'v' && op >= X86_MOVDQA && op <= X86_PSADBW && !strcmp(opname, name + 1)) {
+			insn->op = op;
+			insn->vex = true;
+		}
+	}
+
+	if (!insn->op) {
+		err_source(text->file, sp, "unknown instruction '%s'", name);
+	}
+}
+
+/* instruction = ["lock"] mnemonic [operand {"," operand}] */
+static void instruction(Text *text, AsmInsn *insn)
+{
+	const char *first = text->at;
+	const char *at = first;
+	char name[ASM_MAXWORD + 1];
+
+	insn->lock = false;
+
+	if (!word(text, name)) {
+		err_source(text->file, span(text, first, first + 1), "expected an instruction");
+	}
+
+	if (!strcmp(name, "lock")) {
+		insn->lock = true;
+		skip(text);
+
+		at = text->at;
+		if (!word(text, name)) {
+			err_source(text->file, span(text, at, at + 1), "expected an instruction");
+		}
+	}
+
+	mnemonic(text, name, at, insn);
+
+	size_t nops = 0;
+	for (size_t i = 0; i < 3; ++i) {
+		insn->ops[i] = (AsmOperand){ .op = OPNONE, .ref = ASM_NOREF, .base = ASM_NOREF, .index = ASM_NOREF };
+	}
+
+	skip(text);
+
+	while (*text->at && *text->at != ';') {
+		if (nops > 0) {
+			if (*text->at != ',') {
+				break;
+			}
+
+			++text->at;
+			skip(text);
+		}
+
+		if (nops == 3) {
+			err_source(text->file, span(text, text->at, text->at + 1), "too many operands");
+		}
+
+		operand(text, &insn->ops[nops++]);
+		skip(text);
+	}
+
+	if (insn->op == X86_IMUL && nops == 1) {
+		insn->op = X86_IMUL1;
+	}
+
+	/* Trailing blanks are not part of it */
+	const char *last = text->at;
+	while (last > first && isspace(last[-1])) {
+		--last;
+	}
+
+	insn->span = span(text, first, last);
+}
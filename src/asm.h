@@ -0,0 +1,47 @@
+/*
+ * asm.h
+ *
+ * This file is part of awl
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "enc.h"
+#include "file.h"
+#include "lexer.h"
+
+#define ASM_MAXOPERANDS 10 /* %0 to %9 */
+#define ASM_NOREF -1
+
+/*
+ * An operand of an instruction as written in an asm statement. One that
+ * refers to an operand of the statement ("%0") stands for the register or
+ * memory the code generator puts that operand in, and a memory operand may
+ * take its base or index from one ("[%1 + 8]"). A size written with it
+ * ("%k0", "dword ptr") is in 'op'; 0 where the size is left to the operand.
+ */
+typedef struct AsmOperand {
+	Operand op;
+	int ref; /* the operand of the statement this is, or ASM_NOREF */
+	int base; /* of a memory operand: the operand of the statement its base register is, or ASM_NOREF */
+	int index; /* likewise, of its index register */
+} AsmOperand;
+
+/* An instruction of an asm statement, in Intel syntax: destination first */
+typedef struct AsmInsn {
+	Span span; /* of its text, for errors once its operands are known */
+	x86_op op;
+	cond cc;
+	bool vex;
+	bool lock;
+	AsmOperand ops[3];
+} AsmInsn;
+
+void asm_parse(File *file, Token text, size_t noperands, AsmInsn **insns, size_t *ninsns);
+
+/* The register a lowercase name is, and its size: 1 to 8 for a general purpose one, 16 and 32 for XMM and YMM */
+bool asm_register(const char *name, reg *r, uint8_t *size);
+
+/* The register a constraint letter names: 'a', 'b', 'c' and 'd' for rax to rdx, 'S' and 'D' for rsi and rdi; else NOREG */
+reg asm_letter(char c);
@@ -16,10 +16,14 @@
 #define EHSIZE 0x40 /* ELF header size */
 #define SHENTSIZE 0x40 /* Section header size */
 #define STENTSIZE 0x18 /* Symtab entry size */
+#define RELAENTSIZE 0x18 /* Rela entry size */
 
-static uint8_t *createsymtab(Elf *elf, uint64_t *nlocalsyms);
+static uint8_t *createsymtab(Elf *elf, uint64_t *nlocalsyms, size_t *symmap);
+static uint8_t *createrela(ElfSection *sec, size_t *symmap);
 static uint32_t addshstr(Elf *elf, const char *str);
 static uint32_t addstr(Elf *elf, const char *str);
+static uint64_t moved(const uint64_t *from, const uint64_t *to, size_t n, uint64_t at);
+static uint8_t osabi(Elf *elf);
 static void emithdr(Elf *elf);
 static void emitsechdr(Elf *elf, ElfSecHdr hdr);
 static void emit(Elf *elf, void *data, size_t size);
@@ -52,7 +56,7 @@ Elf *elf_new(const char *path)
 	}
 
 	/* Null section */
-	elf_add_section(elf, "", SHT_NULL, 0);
+	elf_add_section(elf, "", SHT_NULL, 0, 0);
 
 	/* Null symbol */
 	elf_add_symbol(elf, SHN_UNDEF, "", STB_LOCAL, STT_NOTYPE, 0);
@@ -60,7 +64,7 @@ Elf *elf_new(const char *path)
 	return elf;
 }
 
-void elf_add_section(Elf *elf, const char *name, uint32_t type, uint64_t flags)
+void elf_add_section(Elf *elf, const char *name, uint32_t type, uint64_t flags, uint64_t addralign)
 {
 	ElfSection *sec = alloct(ElfSection);
 	sec->strname = name;
@@ -73,10 +77,12 @@ void elf_add_section(Elf *elf, const char *name, uint32_t type, uint64_t flags)
 		.size = 0,
 		.link = 0,
 		.info = 0,
-		.addralign = 0,
+		.addralign = addralign,
 		.entsize = 0,
 	};
 	sec->data = NULL;
+	sec->relocs = NULL;
+	sec->nrelocs = 0;
 	vec_push(elf->sections, &sec, &elf->nsections, sizeof(ElfSection *));
 }
 
@@ -92,7 +98,8 @@ void elf_set_section(Elf *elf, const char *name)
 	err_internal("tried to access invalid ELF section '%s'", name);
 }
 
-void elf_add_symbol(Elf *elf, int sec, const char *name, uint8_t binding, uint8_t type, uint64_t value)
+/* Returns the symbol's index for use in relocations; symtab order is decided in elf_end() */
+size_t elf_add_symbol(Elf *elf, int sec, const char *name, uint8_t binding, uint8_t type, uint64_t value)
 {
 	ElfSymbol symbol = {
 		.name = addstr(elf, name),
@@ -103,7 +110,58 @@ void elf_add_symbol(Elf *elf, int sec, const char *name, uint8_t binding, uint8_
 		.size = 0,
 	};
 
+	size_t ndx = elf->nsymbols;
 	vec_push(elf->symbols, &symbol, &elf->nsymbols, sizeof(ElfSymbol));
+
+	return ndx;
+}
+
+/* Set the value of a symbol added before its position was known */
+void elf_set_symbol_value(Elf *elf, size_t symbol, uint64_t value)
+{
+	elf->symbols[symbol].value = value;
+}
+
+/* The size of the object a symbol names */
+void elf_set_symbol_size(Elf *elf, size_t symbol, uint64_t size)
+{
+	elf->symbols[symbol].size = size;
+}
+
+/* Add a relocation to the current section */
+void elf_add_reloc(Elf *elf, uint64_t offset, uint32_t type, size_t symbol, int64_t addend)
+{
+	ElfSection *curr = elf->sections[elf->secndx];
+	ElfReloc reloc = {
+		.offset = offset,
+		.type = type,
+		.symbol = symbol,
+		.addend = addend,
+	};
+
+	vec_push(curr->relocs, &reloc, &curr->nrelocs, sizeof(ElfReloc));
+}
+
+/*
+ * The code of the current section was moved before it was written: what was
+ * at from[i] or after it, up to from[i + 1], is now as far after to[i]. Its
+ * symbols and relocations move with it.
+ */
+void elf_move(Elf *elf, const uint64_t *from, const uint64_t *to, size_t n)
+{
+	ElfSection *curr = elf->sections[elf->secndx];
+
+	for (size_t i = 0; i < elf->nsymbols; ++i) {
+		ElfSymbol *sym = &elf->symbols[i];
+
+		if (sym->shndx == elf->secndx && (sym->info & 0xF) != STT_SECTION) {
+			sym->value = moved(from, to, n, sym->value);
+		}
+	}
+
+	for (size_t i = 0; i < curr->nrelocs; ++i) {
+		curr->relocs[i].offset = moved(from, to, n, curr->relocs[i].offset);
+	}
 }
 
 void elf_write(Elf *elf, uint8_t *data, size_t size)
@@ -112,14 +170,55 @@ void elf_write(Elf *elf, uint8_t *data, size_t size)
 	vec_join(curr->data, data, &curr->header.size, size, sizeof(uint8_t));
 }
 
+/* Grow the current section, which is SHT_NOBITS: it has a size, but no data in the file */
+void elf_reserve(Elf *elf, size_t size)
+{
+	elf->sections[elf->secndx]->header.size += size;
+}
+
 void elf_end(Elf *elf)
 {
+	/* Add a .rela section for each section with relocations; filled in below */
+	size_t nsections = elf->nsections;
+	size_t *relaof = acalloc(nsections, sizeof(size_t));
+
+	for (size_t i = 1; i < nsections; ++i) {
+		ElfSection *sec = elf->sections[i];
+
+		if (sec->nrelocs) {
+			size_t namelen = strlen(sec->strname) + 6;
+			char *name = acalloc(namelen, sizeof(char));
+			strcpy(name, ".rela");
+			strcat(name, sec->strname);
+
+			relaof[i] = elf->nsections;
+			elf_add_section(elf, name, SHT_RELA, SHF_INFO_LINK, 8);
+		}
+	}
+
 	/* Construct symtab */
 	size_t symtabndx = elf->nsections;
-	elf_add_section(elf, ".symtab", SHT_SYMTAB, 0);
+	elf_add_section(elf, ".symtab", SHT_SYMTAB, 0, 8);
 
 	size_t nlocalsyms = 0;
-	uint8_t *symtabdat = createsymtab(elf, &nlocalsyms);
+	size_t *symmap = acalloc(elf->nsymbols + 1, sizeof(size_t));
+	uint8_t *symtabdat = createsymtab(elf, &nlocalsyms, symmap);
+
+	for (size_t i = 1; i < nsections; ++i) {
+		if (relaof[i]) {
+			ElfSection *sec = elf->sections[i];
+			ElfSection *rela = elf->sections[relaof[i]];
+
+			rela->header.link = symtabndx;
+			rela->header.info = i;
+			rela->header.size = sec->nrelocs * RELAENTSIZE;
+			rela->header.entsize = RELAENTSIZE;
+			rela->data = createrela(sec, symmap);
+		}
+	}
+
+	afree(relaof);
+	afree(symmap);
 
 	elf->sections[symtabndx]->header.info = nlocalsyms;
 	elf->sections[symtabndx]->header.size = elf->nsymbols * STENTSIZE;
@@ -128,7 +227,7 @@ void elf_end(Elf *elf)
 
 	/* Construct strtab */
 	size_t strtabndx = elf->nsections;
-	elf_add_section(elf, ".strtab", SHT_STRTAB, 0);
+	elf_add_section(elf, ".strtab", SHT_STRTAB, 0, 1);
 	elf->sections[strtabndx]->header.size = elf->strsize;
 	elf->sections[strtabndx]->data = elf->strdat;
 
@@ -137,17 +236,23 @@ void elf_end(Elf *elf)
 
 	/* Construct shstrtab */
 	size_t shstrtabndx = elf->nsections;
-	elf_add_section(elf, ".shstrtab", SHT_STRTAB, 0);
+	elf_add_section(elf, ".shstrtab", SHT_STRTAB, 0, 1);
 	elf->sections[shstrtabndx]->header.size = elf->shstrsize;
 	elf->sections[shstrtabndx]->data = elf->shstrdat;
 	elf->shstrndx = shstrtabndx;
 
-	/* Set section offset */
+	/* Set section offset, keeping each section's data at its alignment; SHT_NOBITS has none */
 	uint64_t off = EHSIZE + (SHENTSIZE * elf->nsections);
 	for (size_t i = 1; i < elf->nsections; ++i) {
 		ElfSection *sec = elf->sections[i];
+		uint64_t align = sec->header.addralign;
+
+		if (align > 1) {
+			off = (off + align - 1) & ~(align - 1);
+		}
+
 		sec->header.offset = off;
-		off += sec->header.size;
+		off += sec->header.type == SHT_NOBITS ? 0 : sec->header.size;
 	}
 
 	/* Emit ELF header */
@@ -160,9 +265,13 @@ void elf_end(Elf *elf)
 	}
 
 	/* Emit section data */
-	for (size_t i = 0; i < elf->nsections; ++i) {
+	for (size_t i = 1; i < elf->nsections; ++i) {
 		ElfSection *sec = elf->sections[i];
-		emit(elf, sec->data, sec->header.size);
+
+		if (sec->header.type != SHT_NOBITS) {
+			skip(elf, sec->header.offset - elf->curs);
+			emit(elf, sec->data, sec->header.size);
+		}
 	}
 
 	afree(elf);
@@ -170,7 +279,8 @@ void elf_end(Elf *elf)
 
 #define ENTSET(e, t, o, v) (*(t *)(e + o) = v)
 
-static uint8_t *createsymtab(Elf *elf, uint64_t *nlocalsyms)
+/* Locals must precede globals in the symtab; symmap maps symbol indices to symtab ones */
+static uint8_t *createsymtab(Elf *elf, uint64_t *nlocalsyms, size_t *symmap)
 {
 	uint8_t *res = acalloc(elf->nsymbols, STENTSIZE * sizeof(uint8_t));
 
@@ -190,6 +300,7 @@ static uint8_t *createsymtab(Elf *elf, uint64_t *nlocalsyms)
 		ENTSET(ent, uint64_t, 8, sym.value);
 		ENTSET(ent, uint64_t, 16, sym.size);
 
+		symmap[i] = entndx;
 		++entndx;
 		++(*nlocalsyms);
 	}
@@ -208,12 +319,30 @@ static uint8_t *createsymtab(Elf *elf, uint64_t *nlocalsyms)
 		ENTSET(ent, uint64_t, 8, sym.value);
 		ENTSET(ent, uint64_t, 16, sym.size);
 
+		symmap[i] = entndx;
 		++entndx;
 	}
 
 	return res;
 }
 
+static uint8_t *createrela(ElfSection *sec, size_t *symmap)
+{
+	uint8_t *res = acalloc(sec->nrelocs, RELAENTSIZE * sizeof(uint8_t));
+
+	for (size_t i = 0; i < sec->nrelocs; ++i) {
+		ElfReloc reloc = sec->relocs[i];
+		uint64_t info = ((uint64_t)symmap[reloc.symbol] << 32) + reloc.type;
+
+		uint8_t *ent = res + i * RELAENTSIZE;
+		ENTSET(ent, uint64_t, 0, reloc.offset);
+		ENTSET(ent, uint64_t, 8, info);
+		ENTSET(ent, int64_t, 16, reloc.addend);
+	}
+
+	return res;
+}
+
 static uint32_t addshstr(Elf *elf, const char *str)
 {
 	uint32_t off = elf->shstrsize;
@@ -228,6 +357,35 @@ static uint32_t addstr(Elf *elf, const char *str)
 	return off;
 }
 
+static uint64_t moved(const uint64_t *from, const uint64_t *to, size_t n, uint64_t at)
+{
+	size_t lo = 0;
+	size_t hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (from[mid] <= at) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? at - from[lo - 1] + to[lo - 1] : at;
+}
+
+static uint8_t osabi(Elf *elf)
+{
+	for (size_t i = 0; i < elf->nsymbols; ++i) {
+		if ((elf->symbols[i].info & 0xF) == STT_GNU_IFUNC) {
+			return ELFOSABI_GNU;
+		}
+	}
+
+	return ELFOSABI_NONE;
+}
+
 static void emithdr(Elf *elf)
 {
 	emitb(elf, 0x7F); /* EI_MAG0 */
@@ -238,7 +396,7 @@ static void emithdr(Elf *elf)
 	emitb(elf, 0x02); /* EI_CLASS = 64 bit */
 	emitb(elf, 0x01); /* EI_DATA = little endian */
 	emitb(elf, 0x01); /* EI_VERSION */
-	emitb(elf, 0x00); /* EI_OSABI = System V */
+	emitb(elf, osabi(elf)); /* EI_OSABI */
 	emitb(elf, 0x00); /* EI_ABIVERSION */
 
 	skip(elf, 7); /* EI_PAD */
@@ -27,6 +27,17 @@ enum {
 	SHF_EXECINSTR = 0x04,
 	SHF_STRINGS = 0x20,
 	SHF_INFO_LINK = 0x40,
+	SHF_TLS = 0x400,
+};
+
+/* relocation types (x86-64 psABI) */
+enum {
+	R_X86_64_64 = 1,
+	R_X86_64_PC32 = 2,
+	R_X86_64_PLT32 = 4,
+	R_X86_64_GOTTPOFF = 22, /* rip-relative, to a GOT entry holding the offset from the thread pointer */
+	R_X86_64_TPOFF32 = 23, /* the offset from the thread pointer itself */
+	R_X86_64_IRELATIVE = 37, /* made by the linker, for calls to an STT_GNU_IFUNC symbol: the value its resolver returns */
 };
 
 /* specific shndx constants */
@@ -51,6 +62,14 @@ enum {
 	STT_FUNC = 0x02,
 	STT_SECTION = 0x03,
 	STT_FILE = 0x04,
+	STT_TLS = 0x06,
+	STT_GNU_IFUNC = 0x0A, /* the value is that of a resolver, which returns the address of the function */
+};
+
+/* EI_OSABI; GNU, where symbols have GNU extensions such as STT_GNU_IFUNC */
+enum {
+	ELFOSABI_NONE = 0x00,
+	ELFOSABI_GNU = 0x03,
 };
 
 typedef struct ElfSecHdr {
@@ -75,10 +94,20 @@ typedef struct ElfSymbol {
 	uint64_t size;
 } ElfSymbol;
 
+typedef struct ElfReloc {
+	uint64_t offset; /* in the section the relocation applies to */
+	uint32_t type;
+	size_t symbol; /* as returned by elf_add_symbol() */
+	int64_t addend;
+} ElfReloc;
+
 typedef struct ElfSection {
 	ElfSecHdr header;
 	const char *strname;
 	uint8_t *data;
+
+	ElfReloc *relocs; /* emitted as a .rela<name> section */
+	size_t nrelocs;
 } ElfSection;
 
 typedef struct Elf {
@@ -102,8 +131,13 @@ typedef struct Elf {
 } Elf;
 
 Elf *elf_new(const char *path);
-void elf_add_section(Elf *elf, const char *name, uint32_t type, uint64_t flags);
+void elf_add_section(Elf *elf, const char *name, uint32_t type, uint64_t flags, uint64_t addralign);
 void elf_set_section(Elf *elf, const char *name);
-void elf_add_symbol(Elf *elf, int sec, const char *name, uint8_t binding, uint8_t type, uint64_t value);
+size_t elf_add_symbol(Elf *elf, int sec, const char *name, uint8_t binding, uint8_t type, uint64_t value);
+void elf_set_symbol_value(Elf *elf, size_t symbol, uint64_t value);
+void elf_set_symbol_size(Elf *elf, size_t symbol, uint64_t size);
+void elf_add_reloc(Elf *elf, uint64_t offset, uint32_t type, size_t symbol, int64_t addend);
+void elf_move(Elf *elf, const uint64_t *from, const uint64_t *to, size_t n);
 void elf_write(Elf *elf, uint8_t *data, size_t size);
+void elf_reserve(Elf *elf, size_t size);
 void elf_end(Elf *elf);
@@ -0,0 +1,1107 @@
+/*
+ * enc.c
+ *
+ * This file is part of awl
+ */
+
+#include "enc.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include "vec.h"
+#include "mem.h"
+#include "err.h"
+
+#define ENC_INITALLOC 256
+
+/* Operand classes, as they appear in the form table */
+typedef enum opclass {
+	OC_NONE,
+	OC_R, /* register, in ModRM.reg */
+	OC_RM, /* register or memory, in ModRM.rm */
+	OC_M, /* memory only, in ModRM.rm */
+	OC_RO, /* register, added to the last opcode byte */
+	OC_CL, /* the register cl */
+	OC_A, /* the accumulator (al, ax, eax or rax), implied by the opcode */
+	OC_ONE, /* the immediate 1, implied by the opcode */
+	OC_IZ, /* immediate of operand size (at most 32 bits, sign-extended to 64) */
+	OC_I8, /* immediate, sign-extended from 8 bits */
+	OC_IB, /* immediate, unsigned 8 bits */
+	OC_I64, /* immediate, full 64 bits */
+	OC_REL32, /* label, as a 32-bit displacement */
+	OC_V, /* register, in VEX.vvvv */
+} opclass;
+
+/* Operand size masks; 0 means any size */
+#define S1 0x1
+#define S2 0x2
+#define S4 0x4
+#define S8 0x8
+#define S16 0x10 /* XMM */
+#define S32 0x20 /* YMM */
+#define SW (S2 | S4 | S8)
+#define SA (S1 | S2 | S4 | S8)
+#define SX (S16 | S32)
+
+/* Form flags */
+#define F_D64 0x01 /* 64-bit operand size by default; no REX.W */
+#define F_W 0x02 /* always REX.W */
+#define F_CC 0x04 /* condition code added to the last opcode byte */
+#define F_VEX 0x08 /* VEX-encoded; the prefix and opcode map go into the VEX prefix */
+
+/* ModRM.reg holds a register operand */
+#define EXT_R 0xFF
+
+typedef struct Form {
+	x86_op op;
+	opclass cls[3];
+	uint8_t sz[3];
+	uint8_t flags;
+	uint8_t prefix; /* mandatory prefix (e.g. 0xF3), or 0 */
+	uint8_t nopc;
+	uint8_t opc[3];
+	uint8_t ext; /* ModRM.reg opcode extension (/digit), or EXT_R */
+} Form;
+
+#define FORM(o, c0, s0, c1, s1, c2, s2, fl, pre, x, n, ...) \
+	{ .op = o, .cls = { c0, c1, c2 }, .sz = { s0, s1, s2 }, .flags = fl, .prefix = pre, \
+	  .nopc = n, .opc = { __VA_ARGS__ }, .ext = x }
+
+#define F0(o, fl, n, ...) FORM(o, OC_NONE, 0, OC_NONE, 0, OC_NONE, 0, fl, 0, 0, n, __VA_ARGS__)
+#define F1(o, c0, s0, fl, x, n, ...) FORM(o, c0, s0, OC_NONE, 0, OC_NONE, 0, fl, 0, x, n, __VA_ARGS__)
+#define F2(o, c0, s0, c1, s1, fl, x, n, ...) FORM(o, c0, s0, c1, s1, OC_NONE, 0, fl, 0, x, n, __VA_ARGS__)
+#define F3(o, c0, s0, c1, s1, c2, s2, fl, x, n, ...) FORM(o, c0, s0, c1, s1, c2, s2, fl, 0, x, n, __VA_ARGS__)
+
+/*
+ * The eight classic ALU operations share one layout, keyed on a base opcode
+ * and /digit. The accumulator forms have no ModRM; a sign-extended imm8 is
+ * shorter still, except for a byte.
+ */
+#define ALU(o, base, digit) \
+	F2(o, OC_RM, S1, OC_R, S1, 0, EXT_R, 1, base + 0), \
+	F2(o, OC_RM, SW, OC_R, SW, 0, EXT_R, 1, base + 1), \
+	F2(o, OC_R, S1, OC_RM, S1, 0, EXT_R, 1, base + 2), \
+	F2(o, OC_R, SW, OC_RM, SW, 0, EXT_R, 1, base + 3), \
+	F2(o, OC_A, S1, OC_IZ, 0, 0, 0, 1, base + 4), \
+	F2(o, OC_RM, S1, OC_IZ, 0, 0, digit, 1, 0x80), \
+	F2(o, OC_RM, SW, OC_I8, 0, 0, digit, 1, 0x83), \
+	F2(o, OC_A, SW, OC_IZ, 0, 0, 0, 1, base + 5), \
+	F2(o, OC_RM, SW, OC_IZ, 0, 0, digit, 1, 0x81)
+
+/* Group 2 shifts and rotates; by 1, they have no immediate */
+#define SHIFT(o, digit) \
+	F2(o, OC_RM, S1, OC_CL, 0, 0, digit, 1, 0xD2), \
+	F2(o, OC_RM, SW, OC_CL, 0, 0, digit, 1, 0xD3), \
+	F2(o, OC_RM, S1, OC_ONE, 0, 0, digit, 1, 0xD0), \
+	F2(o, OC_RM, SW, OC_ONE, 0, 0, digit, 1, 0xD1), \
+	F2(o, OC_RM, S1, OC_IB, 0, 0, digit, 1, 0xC0), \
+	F2(o, OC_RM, SW, OC_IB, 0, 0, digit, 1, 0xC1)
+
+/* Group 3 unary operations */
+#define UNARY(o, digit) \
+	F1(o, OC_RM, S1, 0, digit, 1, 0xF6), \
+	F1(o, OC_RM, SW, 0, digit, 1, 0xF7)
+
+/* SSE operations of two XMM operands, and their VEX forms of three, of XMM or YMM */
+#define SSE(o, pre, n, ...) \
+	FORM(o, OC_R, S16, OC_RM, S16, OC_NONE, 0, 0, pre, EXT_R, n, __VA_ARGS__), \
+	FORM(o, OC_R, SX, OC_V, SX, OC_RM, SX, F_VEX, pre, EXT_R, n, __VA_ARGS__)
+
+/* The same, with a third operand (an immediate) */
+#define SSEI(o, pre, n, ...) \
+	FORM(o, OC_R, S16, OC_RM, S16, OC_IB, 0, 0, pre, EXT_R, n, __VA_ARGS__), \
+	FORM(o, OC_R, SX, OC_RM, SX, OC_IB, 0, F_VEX, pre, EXT_R, n, __VA_ARGS__)
+
+/* Shifts of each lane by an immediate; the VEX form writes the register in VEX.vvvv */
+#define PSHIFT(o, opc, digit) \
+	FORM(o, OC_RM, S16, OC_IB, 0, OC_NONE, 0, 0, 0x66, digit, 2, 0x0F, opc), \
+	FORM(o, OC_V, SX, OC_RM, SX, OC_IB, 0, F_VEX, 0x66, digit, 2, 0x0F, opc)
+
+/* The same two forms for all else: SSE, and VEX with the same operands */
+#define SSEF(o, c0, s0, c1, s1, c2, s2, fl, pre, n, ...) \
+	FORM(o, c0, s0, c1, s1, c2, s2, fl, pre, EXT_R, n, __VA_ARGS__), \
+	FORM(o, c0, s0 | (s0 == S16 ? S32 : 0), c1, s1 | (s1 == S16 ? S32 : 0), c2, s2, (fl) | F_VEX, pre, EXT_R, n, __VA_ARGS__)
+
+/* AVX only */
+#define AVX(o, c0, s0, c1, s1, c2, s2, fl, n, ...) FORM(o, c0, s0, c1, s1, c2, s2, (fl) | F_VEX, 0x66, EXT_R, n, __VA_ARGS__)
+
+/*
+ * Every encoding known to the encoder. For a given Insn, the first form whose
+ * op, operand classes and sizes match is used; cheaper forms are therefore
+ * listed before more general ones.
+ */
+static const Form forms[] = {
+	F2(X86_MOV, OC_RM, S1, OC_R, S1, 0, EXT_R, 1, 0x88),
+	F2(X86_MOV, OC_RM, SW, OC_R, SW, 0, EXT_R, 1, 0x89),
+	F2(X86_MOV, OC_R, S1, OC_RM, S1, 0, EXT_R, 1, 0x8A),
+	F2(X86_MOV, OC_R, SW, OC_RM, SW, 0, EXT_R, 1, 0x8B),
+	F2(X86_MOV, OC_RO, S1, OC_IZ, 0, 0, 0, 1, 0xB0),
+	F2(X86_MOV, OC_RO, S2 | S4, OC_IZ, 0, 0, 0, 1, 0xB8),
+	F2(X86_MOV, OC_RM, S1, OC_IZ, 0, 0, 0, 1, 0xC6),
+	F2(X86_MOV, OC_RM, SW, OC_IZ, 0, 0, 0, 1, 0xC7),
+	F2(X86_MOV, OC_RO, S8, OC_I64, 0, 0, 0, 1, 0xB8),
+
+	F2(X86_MOVZX, OC_R, SW, OC_RM, S1, 0, EXT_R, 2, 0x0F, 0xB6),
+	F2(X86_MOVZX, OC_R, S4 | S8, OC_RM, S2, 0, EXT_R, 2, 0x0F, 0xB7),
+	F2(X86_MOVSX, OC_R, SW, OC_RM, S1, 0, EXT_R, 2, 0x0F, 0xBE),
+	F2(X86_MOVSX, OC_R, S4 | S8, OC_RM, S2, 0, EXT_R, 2, 0x0F, 0xBF),
+	F2(X86_MOVSXD, OC_R, S8, OC_RM, S4, 0, EXT_R, 1, 0x63),
+	F2(X86_LEA, OC_R, SW, OC_M, 0, 0, EXT_R, 1, 0x8D),
+	F2(X86_XCHG, OC_RM, S1, OC_R, S1, 0, EXT_R, 1, 0x86),
+	F2(X86_XCHG, OC_RM, SW, OC_R, SW, 0, EXT_R, 1, 0x87),
+	F2(X86_XCHG, OC_R, S1, OC_RM, S1, 0, EXT_R, 1, 0x86),
+	F2(X86_XCHG, OC_R, SW, OC_RM, SW, 0, EXT_R, 1, 0x87),
+	F2(X86_XADD, OC_RM, S1, OC_R, S1, 0, EXT_R, 2, 0x0F, 0xC0),
+	F2(X86_XADD, OC_RM, SW, OC_R, SW, 0, EXT_R, 2, 0x0F, 0xC1),
+	F2(X86_CMPXCHG, OC_RM, S1, OC_R, S1, 0, EXT_R, 2, 0x0F, 0xB0),
+	F2(X86_CMPXCHG, OC_RM, SW, OC_R, SW, 0, EXT_R, 2, 0x0F, 0xB1),
+
+	ALU(X86_ADD, 0x00, 0),
+	ALU(X86_OR, 0x08, 1),
+	ALU(X86_AND, 0x20, 4),
+	ALU(X86_SUB, 0x28, 5),
+	ALU(X86_XOR, 0x30, 6),
+	ALU(X86_CMP, 0x38, 7),
+
+	F2(X86_TEST, OC_RM, S1, OC_R, S1, 0, EXT_R, 1, 0x84),
+	F2(X86_TEST, OC_RM, SW, OC_R, SW, 0, EXT_R, 1, 0x85),
+	F2(X86_TEST, OC_A, S1, OC_IZ, 0, 0, 0, 1, 0xA8),
+	F2(X86_TEST, OC_A, SW, OC_IZ, 0, 0, 0, 1, 0xA9),
+	F2(X86_TEST, OC_RM, S1, OC_IZ, 0, 0, 0, 1, 0xF6),
+	F2(X86_TEST, OC_RM, SW, OC_IZ, 0, 0, 0, 1, 0xF7),
+
+	F2(X86_IMUL, OC_R, SW, OC_RM, SW, 0, EXT_R, 2, 0x0F, 0xAF),
+	F3(X86_IMUL, OC_R, SW, OC_RM, SW, OC_I8, 0, 0, EXT_R, 1, 0x6B),
+	F3(X86_IMUL, OC_R, SW, OC_RM, SW, OC_IZ, 0, 0, EXT_R, 1, 0x69),
+	UNARY(X86_NOT, 2),
+	UNARY(X86_NEG, 3),
+	UNARY(X86_MUL, 4),
+	UNARY(X86_IMUL1, 5),
+	UNARY(X86_DIV, 6),
+	UNARY(X86_IDIV, 7),
+
+	SHIFT(X86_ROL, 0),
+	SHIFT(X86_ROR, 1),
+	SHIFT(X86_SHL, 4),
+	SHIFT(X86_SHR, 5),
+	SHIFT(X86_SAR, 7),
+
+	F2(X86_BSF, OC_R, SW, OC_RM, SW, 0, EXT_R, 2, 0x0F, 0xBC),
+	F2(X86_BSR, OC_R, SW, OC_RM, SW, 0, EXT_R, 2, 0x0F, 0xBD),
+	F1(X86_BSWAP, OC_RO, S4 | S8, 0, 0, 2, 0x0F, 0xC8),
+	FORM(X86_POPCNT, OC_R, SW, OC_RM, SW, OC_NONE, 0, 0, 0xF3, EXT_R, 2, 0x0F, 0xB8),
+	FORM(X86_LZCNT, OC_R, SW, OC_RM, SW, OC_NONE, 0, 0, 0xF3, EXT_R, 2, 0x0F, 0xBD),
+	FORM(X86_TZCNT, OC_R, SW, OC_RM, SW, OC_NONE, 0, 0, 0xF3, EXT_R, 2, 0x0F, 0xBC),
+	FORM(X86_PDEP, OC_R, S4, OC_V, S4, OC_RM, S4, F_VEX, 0xF2, EXT_R, 3, 0x0F, 0x38, 0xF5),
+	FORM(X86_PDEP, OC_R, S8, OC_V, S8, OC_RM, S8, F_VEX | F_W, 0xF2, EXT_R, 3, 0x0F, 0x38, 0xF5),
+	FORM(X86_PEXT, OC_R, S4, OC_V, S4, OC_RM, S4, F_VEX, 0xF3, EXT_R, 3, 0x0F, 0x38, 0xF5),
+	FORM(X86_PEXT, OC_R, S8, OC_V, S8, OC_RM, S8, F_VEX | F_W, 0xF3, EXT_R, 3, 0x0F, 0x38, 0xF5),
+	FORM(X86_ANDN, OC_R, S4, OC_V, S4, OC_RM, S4, F_VEX, 0, EXT_R, 3, 0x0F, 0x38, 0xF2),
+	FORM(X86_ANDN, OC_R, S8, OC_V, S8, OC_RM, S8, F_VEX | F_W, 0, EXT_R, 3, 0x0F, 0x38, 0xF2),
+	FORM(X86_BZHI, OC_R, S4, OC_RM, S4, OC_V, S4, F_VEX, 0, EXT_R, 3, 0x0F, 0x38, 0xF5),
+	FORM(X86_BZHI, OC_R, S8, OC_RM, S8, OC_V, S8, F_VEX | F_W, 0, EXT_R, 3, 0x0F, 0x38, 0xF5),
+	FORM(X86_SHLX, OC_R, S4, OC_RM, S4, OC_V, S4, F_VEX, 0x66, EXT_R, 3, 0x0F, 0x38, 0xF7),
+	FORM(X86_SHLX, OC_R, S8, OC_RM, S8, OC_V, S8, F_VEX | F_W, 0x66, EXT_R, 3, 0x0F, 0x38, 0xF7),
+	FORM(X86_SHRX, OC_R, S4, OC_RM, S4, OC_V, S4, F_VEX, 0xF2, EXT_R, 3, 0x0F, 0x38, 0xF7),
+	FORM(X86_SHRX, OC_R, S8, OC_RM, S8, OC_V, S8, F_VEX | F_W, 0xF2, EXT_R, 3, 0x0F, 0x38, 0xF7),
+	FORM(X86_SARX, OC_R, S4, OC_RM, S4, OC_V, S4, F_VEX, 0xF3, EXT_R, 3, 0x0F, 0x38, 0xF7),
+	FORM(X86_SARX, OC_R, S8, OC_RM, S8, OC_V, S8, F_VEX | F_W, 0xF3, EXT_R, 3, 0x0F, 0x38, 0xF7),
+	F2(X86_MOVBE, OC_R, SW, OC_M, SW, 0, EXT_R, 3, 0x0F, 0x38, 0xF0),
+	F2(X86_MOVBE, OC_M, SW, OC_R, SW, 0, EXT_R, 3, 0x0F, 0x38, 0xF1),
+	F0(X86_RDTSC, 0, 2, 0x0F, 0x31),
+	F0(X86_CPUID, 0, 2, 0x0F, 0xA2),
+	F0(X86_XGETBV, 0, 3, 0x0F, 0x01, 0xD0),
+	F1(X86_PREFETCHT0, OC_M, 0, 0, 1, 2, 0x0F, 0x18),
+	F1(X86_PREFETCHT1, OC_M, 0, 0, 2, 2, 0x0F, 0x18),
+	F1(X86_PREFETCHT2, OC_M, 0, 0, 3, 2, 0x0F, 0x18),
+	F1(X86_PREFETCHNTA, OC_M, 0, 0, 0, 2, 0x0F, 0x18),
+	F2(X86_MOVNTI, OC_M, S4 | S8, OC_R, S4 | S8, 0, EXT_R, 2, 0x0F, 0xC3),
+	F0(X86_SFENCE, 0, 3, 0x0F, 0xAE, 0xF8),
+
+	F0(X86_CDQ, 0, 1, 0x99),
+	F0(X86_CQO, F_W, 1, 0x99),
+
+	F1(X86_PUSH, OC_RO, S8, F_D64, 0, 1, 0x50),
+	F1(X86_PUSH, OC_I8, 0, F_D64, 0, 1, 0x6A),
+	F1(X86_PUSH, OC_IZ, 0, F_D64, 0, 1, 0x68),
+	F1(X86_PUSH, OC_RM, S8, F_D64, 6, 1, 0xFF),
+	F1(X86_POP, OC_RO, S8, F_D64, 0, 1, 0x58),
+	F1(X86_POP, OC_RM, S8, F_D64, 0, 1, 0x8F),
+	F1(X86_CALL, OC_REL32, 0, 0, 0, 1, 0xE8),
+	F1(X86_CALL, OC_RM, S8, F_D64, 2, 1, 0xFF),
+	F1(X86_JMP, OC_REL32, 0, 0, 0, 1, 0xE9),
+	F1(X86_JMP, OC_RM, S8, F_D64, 4, 1, 0xFF),
+	F1(X86_JCC, OC_REL32, 0, F_CC, 0, 2, 0x0F, 0x80),
+	F1(X86_SETCC, OC_RM, S1, F_CC, 0, 2, 0x0F, 0x90),
+	F2(X86_CMOVCC, OC_R, SW, OC_RM, SW, F_CC, EXT_R, 2, 0x0F, 0x40),
+	F0(X86_RET, 0, 1, 0xC3),
+	F0(X86_LEAVE, 0, 1, 0xC9),
+	F0(X86_NOP, 0, 1, 0x90),
+	F0(X86_UD2, 0, 2, 0x0F, 0x0B),
+
+	SSEF(X86_MOVDQA, OC_R, S16, OC_RM, S16, OC_NONE, 0, 0, 0x66, 2, 0x0F, 0x6F),
+	SSEF(X86_MOVDQA, OC_M, S16, OC_R, S16, OC_NONE, 0, 0, 0x66, 2, 0x0F, 0x7F),
+	SSEF(X86_MOVDQU, OC_R, S16, OC_RM, S16, OC_NONE, 0, 0, 0xF3, 2, 0x0F, 0x6F),
+	SSEF(X86_MOVDQU, OC_M, S16, OC_R, S16, OC_NONE, 0, 0, 0xF3, 2, 0x0F, 0x7F),
+	SSEF(X86_MOVNTDQ, OC_M, S16, OC_R, S16, OC_NONE, 0, 0, 0x66, 2, 0x0F, 0xE7),
+	FORM(X86_MOVD, OC_R, S16, OC_RM, S4, OC_NONE, 0, 0, 0x66, EXT_R, 2, 0x0F, 0x6E),
+	FORM(X86_MOVD, OC_R, S16, OC_RM, S8, OC_NONE, 0, F_W, 0x66, EXT_R, 2, 0x0F, 0x6E),
+	FORM(X86_MOVD, OC_RM, S4, OC_R, S16, OC_NONE, 0, 0, 0x66, EXT_R, 2, 0x0F, 0x7E),
+	FORM(X86_MOVD, OC_RM, S8, OC_R, S16, OC_NONE, 0, F_W, 0x66, EXT_R, 2, 0x0F, 0x7E),
+	FORM(X86_MOVD, OC_R, S16, OC_RM, S4, OC_NONE, 0, F_VEX, 0x66, EXT_R, 2, 0x0F, 0x6E),
+	FORM(X86_MOVD, OC_R, S16, OC_RM, S8, OC_NONE, 0, F_VEX | F_W, 0x66, EXT_R, 2, 0x0F, 0x6E),
+	FORM(X86_MOVD, OC_RM, S4, OC_R, S16, OC_NONE, 0, F_VEX, 0x66, EXT_R, 2, 0x0F, 0x7E),
+	FORM(X86_MOVD, OC_RM, S8, OC_R, S16, OC_NONE, 0, F_VEX | F_W, 0x66, EXT_R, 2, 0x0F, 0x7E),
+
+	SSE(X86_PADDB, 0x66, 2, 0x0F, 0xFC),
+	SSE(X86_PADDW, 0x66, 2, 0x0F, 0xFD),
+	SSE(X86_PADDD, 0x66, 2, 0x0F, 0xFE),
+	SSE(X86_PADDQ, 0x66, 2, 0x0F, 0xD4),
+	SSE(X86_PSUBB, 0x66, 2, 0x0F, 0xF8),
+	SSE(X86_PSUBW, 0x66, 2, 0x0F, 0xF9),
+	SSE(X86_PSUBD, 0x66, 2, 0x0F, 0xFA),
+	SSE(X86_PSUBQ, 0x66, 2, 0x0F, 0xFB),
+	SSE(X86_PMULLW, 0x66, 2, 0x0F, 0xD5),
+	SSE(X86_PMULLD, 0x66, 3, 0x0F, 0x38, 0x40),
+	SSE(X86_PMULUDQ, 0x66, 2, 0x0F, 0xF4),
+	SSE(X86_PAND, 0x66, 2, 0x0F, 0xDB),
+	SSE(X86_POR, 0x66, 2, 0x0F, 0xEB),
+	SSE(X86_PXOR, 0x66, 2, 0x0F, 0xEF),
+	SSE(X86_PCMPEQB, 0x66, 2, 0x0F, 0x74),
+	SSE(X86_PCMPEQW, 0x66, 2, 0x0F, 0x75),
+	SSE(X86_PCMPEQD, 0x66, 2, 0x0F, 0x76),
+	SSE(X86_PCMPEQQ, 0x66, 3, 0x0F, 0x38, 0x29),
+	SSE(X86_PCMPGTB, 0x66, 2, 0x0F, 0x64),
+	SSE(X86_PCMPGTW, 0x66, 2, 0x0F, 0x65),
+	SSE(X86_PCMPGTD, 0x66, 2, 0x0F, 0x66),
+	SSE(X86_PCMPGTQ, 0x66, 3, 0x0F, 0x38, 0x37),
+	SSE(X86_PUNPCKLBW, 0x66, 2, 0x0F, 0x60),
+	SSE(X86_PUNPCKLWD, 0x66, 2, 0x0F, 0x61),
+	SSE(X86_PUNPCKLDQ, 0x66, 2, 0x0F, 0x62),
+	SSE(X86_PUNPCKLQDQ, 0x66, 2, 0x0F, 0x6C),
+	SSE(X86_PACKSSWB, 0x66, 2, 0x0F, 0x63),
+	SSE(X86_PSADBW, 0x66, 2, 0x0F, 0xF6),
+
+	PSHIFT(X86_PSRLW, 0x71, 2),
+	PSHIFT(X86_PSRAW, 0x71, 4),
+	PSHIFT(X86_PSLLW, 0x71, 6),
+	PSHIFT(X86_PSRLD, 0x72, 2),
+	PSHIFT(X86_PSRAD, 0x72, 4),
+	PSHIFT(X86_PSLLD, 0x72, 6),
+	PSHIFT(X86_PSRLQ, 0x73, 2),
+	PSHIFT(X86_PSLLQ, 0x73, 6),
+
+	SSEI(X86_PSHUFD, 0x66, 2, 0x0F, 0x70),
+	SSEI(X86_PSHUFLW, 0xF2, 2, 0x0F, 0x70),
+	SSEI(X86_PSHUFHW, 0xF3, 2, 0x0F, 0x70),
+
+	SSEF(X86_PMOVMSKB, OC_R, S4, OC_RM, S16, OC_NONE, 0, 0, 0x66, 2, 0x0F, 0xD7),
+	SSEF(X86_MOVMSKPS, OC_R, S4, OC_RM, S16, OC_NONE, 0, 0, 0, 2, 0x0F, 0x50),
+	SSEF(X86_MOVMSKPD, OC_R, S4, OC_RM, S16, OC_NONE, 0, 0, 0x66, 2, 0x0F, 0x50),
+	FORM(X86_PEXTRW, OC_R, S4, OC_RM, S16, OC_IB, 0, 0, 0x66, EXT_R, 2, 0x0F, 0xC5),
+	FORM(X86_PEXTRW, OC_R, S4, OC_RM, S16, OC_IB, 0, F_VEX, 0x66, EXT_R, 2, 0x0F, 0xC5),
+
+	AVX(X86_VPBROADCASTB, OC_R, SX, OC_RM, S16, OC_NONE, 0, 0, 3, 0x0F, 0x38, 0x78),
+	AVX(X86_VPBROADCASTW, OC_R, SX, OC_RM, S16, OC_NONE, 0, 0, 3, 0x0F, 0x38, 0x79),
+	AVX(X86_VPBROADCASTD, OC_R, SX, OC_RM, S16, OC_NONE, 0, 0, 3, 0x0F, 0x38, 0x58),
+	AVX(X86_VPBROADCASTQ, OC_R, SX, OC_RM, S16, OC_NONE, 0, 0, 3, 0x0F, 0x38, 0x59),
+	AVX(X86_VPERMQ, OC_R, S32, OC_RM, S32, OC_IB, 0, F_W, 3, 0x0F, 0x3A, 0x00),
+	AVX(X86_VEXTRACTI128, OC_RM, S16, OC_R, S32, OC_IB, 0, 0, 3, 0x0F, 0x3A, 0x39),
+	FORM(X86_VZEROUPPER, OC_NONE, 0, OC_NONE, 0, OC_NONE, 0, F_VEX, 0, 0, 2, 0x0F, 0x77),
+};
+static const size_t nforms = (sizeof(forms) / sizeof(*forms));
+
+static const char *opnames[_X86_COUNT] = {
+	[X86_MOV] = "mov",
+	[X86_MOVZX] = "movzx",
+	[X86_MOVSX] = "movsx",
+	[X86_MOVSXD] = "movsxd",
+	[X86_LEA] = "lea",
+	[X86_XCHG] = "xchg",
+	[X86_XADD] = "xadd",
+	[X86_CMPXCHG] = "cmpxchg",
+	[X86_ADD] = "add",
+	[X86_OR] = "or",
+	[X86_AND] = "and",
+	[X86_SUB] = "sub",
+	[X86_XOR] = "xor",
+	[X86_CMP] = "cmp",
+	[X86_TEST] = "test",
+	[X86_IMUL] = "imul",
+	[X86_MUL] = "mul",
+	[X86_IMUL1] = "imul",
+	[X86_DIV] = "div",
+	[X86_IDIV] = "idiv",
+	[X86_NEG] = "neg",
+	[X86_NOT] = "not",
+	[X86_ROL] = "rol",
+	[X86_ROR] = "ror",
+	[X86_SHL] = "shl",
+	[X86_SHR] = "shr",
+	[X86_SAR] = "sar",
+	[X86_BSF] = "bsf",
+	[X86_BSR] = "bsr",
+	[X86_BSWAP] = "bswap",
+	[X86_POPCNT] = "popcnt",
+	[X86_LZCNT] = "lzcnt",
+	[X86_TZCNT] = "tzcnt",
+	[X86_PDEP] = "pdep",
+	[X86_PEXT] = "pext",
+	[X86_ANDN] = "andn",
+	[X86_BZHI] = "bzhi",
+	[X86_SHLX] = "shlx",
+	[X86_SHRX] = "shrx",
+	[X86_SARX] = "sarx",
+	[X86_MOVBE] = "movbe",
+	[X86_RDTSC] = "rdtsc",
+	[X86_CPUID] = "cpuid",
+	[X86_XGETBV] = "xgetbv",
+	[X86_PREFETCHT0] = "prefetcht0",
+	[X86_PREFETCHT1] = "prefetcht1",
+	[X86_PREFETCHT2] = "prefetcht2",
+	[X86_PREFETCHNTA] = "prefetchnta",
+	[X86_MOVNTI] = "movnti",
+	[X86_SFENCE] = "sfence",
+	[X86_CDQ] = "cdq",
+	[X86_CQO] = "cqo",
+	[X86_PUSH] = "push",
+	[X86_POP] = "pop",
+	[X86_CALL] = "call",
+	[X86_JMP] = "jmp",
+	[X86_JCC] = "j",
+	[X86_SETCC] = "set",
+	[X86_CMOVCC] = "cmov",
+	[X86_RET] = "ret",
+	[X86_LEAVE] = "leave",
+	[X86_NOP] = "nop",
+	[X86_UD2] = "ud2",
+	[X86_MOVDQA] = "movdqa",
+	[X86_MOVDQU] = "movdqu",
+	[X86_MOVNTDQ] = "movntdq",
+	[X86_MOVD] = "movd",
+	[X86_PADDB] = "paddb",
+	[X86_PADDW] = "paddw",
+	[X86_PADDD] = "paddd",
+	[X86_PADDQ] = "paddq",
+	[X86_PSUBB] = "psubb",
+	[X86_PSUBW] = "psubw",
+	[X86_PSUBD] = "psubd",
+	[X86_PSUBQ] = "psubq",
+	[X86_PMULLW] = "pmullw",
+	[X86_PMULLD] = "pmulld",
+	[X86_PMULUDQ] = "pmuludq",
+	[X86_PAND] = "pand",
+	[X86_POR] = "por",
+	[X86_PXOR] = "pxor",
+	[X86_PCMPEQB] = "pcmpeqb",
+	[X86_PCMPEQW] = "pcmpeqw",
+	[X86_PCMPEQD] = "pcmpeqd",
+	[X86_PCMPEQQ] = "pcmpeqq",
+	[X86_PCMPGTB] = "pcmpgtb",
+	[X86_PCMPGTW] = "pcmpgtw",
+	[X86_PCMPGTD] = "pcmpgtd",
+	[X86_PCMPGTQ] = "pcmpgtq",
+	[X86_PSLLW] = "psllw",
+	[X86_PSLLD] = "pslld",
+	[X86_PSLLQ] = "psllq",
+	[X86_PSRLW] = "psrlw",
+	[X86_PSRLD] = "psrld",
+	[X86_PSRLQ] = "psrlq",
+	[X86_PSRAW] = "psraw",
+	[X86_PSRAD] = "psrad",
+	[X86_PSHUFD] = "pshufd",
+	[X86_PSHUFLW] = "pshuflw",
+	[X86_PSHUFHW] = "pshufhw",
+	[X86_PUNPCKLBW] = "punpcklbw",
+	[X86_PUNPCKLWD] = "punpcklwd",
+	[X86_PUNPCKLDQ] = "punpckldq",
+	[X86_PUNPCKLQDQ] = "punpcklqdq",
+	[X86_PACKSSWB] = "packsswb",
+	[X86_PMOVMSKB] = "pmovmskb",
+	[X86_MOVMSKPS] = "movmskps",
+	[X86_MOVMSKPD] = "movmskpd",
+	[X86_PEXTRW] = "pextrw",
+	[X86_PSADBW] = "psadbw",
+	[X86_VPBROADCASTB] = "vpbroadcastb",
+	[X86_VPBROADCASTW] = "vpbroadcastw",
+	[X86_VPBROADCASTD] = "vpbroadcastd",
+	[X86_VPBROADCASTQ] = "vpbroadcastq",
+	[X86_VPERMQ] = "vpermq",
+	[X86_VEXTRACTI128] = "vextracti128",
+	[X86_VZEROUPPER] = "vzeroupper",
+};
+
+/*
+ * Recommended multi-byte NOP sequences (Intel SDM Vol. 2B, "NOP"), indexed by
+ * length. Padding is made of as few of these as possible, so the decoder
+ * spends one slot per 9 bytes of padding instead of one per byte.
+ */
+#define NOPMAX 9
+static const uint8_t nops[NOPMAX + 1][NOPMAX] = {
+	[1] = { 0x90 },
+	[2] = { 0x66, 0x90 },
+	[3] = { 0x0F, 0x1F, 0x00 },
+	[4] = { 0x0F, 0x1F, 0x40, 0x00 },
+	[5] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+	[6] = { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+	[7] = { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+	[8] = { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	[9] = { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+/* A jump that may be shortened, or padding that may change, as enc_resolve() lays out code */
+typedef struct Item {
+	size_t at; /* offset, before */
+	size_t len;
+	size_t newat; /* after */
+	size_t newlen;
+	Fixup *fixup; /* NULL for padding */
+	size_t to; /* of padding, the alignment */
+	bool keep; /* of a jump, lengthened back for good */
+} Item;
+
+static void layout(Item *items, size_t nitems);
+static size_t moved(Item *items, size_t nitems, size_t pos);
+static const Form *match(Insn *insn);
+static bool matchop(opclass cls, uint8_t sz, Operand o, uint8_t opsize);
+static void reserve(Enc *enc, size_t n);
+static void put(Enc *enc, uint8_t b);
+static void putn(Enc *enc, int64_t v, size_t n);
+static void putrm(Enc *enc, uint8_t regfield, Operand rm);
+static void putvex(Enc *enc, const Form *form, uint8_t rex, Operand *vop, bool wide);
+
+Enc *enc_new()
+{
+	Enc *enc = alloct(Enc);
+	enc->code = acalloc(ENC_INITALLOC, sizeof(uint8_t));
+	enc->size = 0;
+	enc->allocd = ENC_INITALLOC;
+	enc->labels = NULL;
+	enc->nlabels = 0;
+	enc->fixups = NULL;
+	enc->nfixups = 0;
+	enc->aligns = NULL;
+	enc->naligns = 0;
+	enc->movedfrom = NULL;
+	enc->movedto = NULL;
+	enc->nmoved = 0;
+	enc->ripdisp = 0;
+
+	return enc;
+}
+
+label enc_label(Enc *enc)
+{
+	size_t pos = LABEL_UNBOUND;
+	label l = enc->nlabels;
+	vec_push(enc->labels, &pos, &enc->nlabels, sizeof(size_t));
+
+	return l;
+}
+
+label enc_extern(Enc *enc)
+{
+	size_t pos = LABEL_EXTERN;
+	label l = enc->nlabels;
+	vec_push(enc->labels, &pos, &enc->nlabels, sizeof(size_t));
+
+	return l;
+}
+
+void enc_bind(Enc *enc, label l)
+{
+	if (enc->labels[l] != LABEL_UNBOUND) {
+		err_internal("label %d bound twice", l);
+	}
+
+	enc->labels[l] = enc->size;
+}
+
+size_t enc_labelpos(Enc *enc, label l)
+{
+	return enc->labels[l];
+}
+
+void enc_insn(Enc *enc, Insn insn)
+{
+	const Form *form = match(&insn);
+	if (!form) {
+		err_internal("no encoding for '%s' with the given operands", enc_opname(insn.op));
+	}
+
+	/* The operand size is that of the first sized operand */
+	uint8_t opsize = 0;
+	for (size_t i = 0; i < 3 && !opsize; ++i) {
+		opsize = insn.ops[i].size;
+	}
+
+	/* Assign the operands to their fields */
+	Operand *regop = NULL;
+	Operand *rmop = NULL;
+	Operand *roop = NULL;
+	Operand *immop = NULL;
+	opclass immcls = OC_NONE;
+	Operand *relop = NULL;
+	Operand *vop = NULL;
+
+	for (size_t i = 0; i < 3; ++i) {
+		switch (form->cls[i]) {
+			case OC_R: regop = &insn.ops[i]; break;
+			case OC_V: vop = &insn.ops[i]; break;
+			case OC_RM:
+			case OC_M: rmop = &insn.ops[i]; break;
+			case OC_RO: roop = &insn.ops[i]; break;
+			case OC_IZ:
+			case OC_I8:
+			case OC_IB:
+			case OC_I64: immop = &insn.ops[i]; immcls = form->cls[i]; break;
+			case OC_REL32: relop = &insn.ops[i]; break;
+			default: break;
+		}
+	}
+
+	reserve(enc, 16);
+
+	size_t start = enc->size;
+	bool vex = form->flags & F_VEX;
+
+	/* Prefixes; those of VEX forms go into the VEX prefix */
+	if (rmop && rmop->kind == OPND_MEM && rmop->mem.fs) {
+		put(enc, 0x64);
+	}
+
+	if (insn.lock) {
+		put(enc, 0xF0);
+	}
+
+	if (opsize == 2 && !(form->flags & F_D64)) {
+		put(enc, 0x66);
+	}
+
+	if (form->prefix && !vex) {
+		put(enc, form->prefix);
+	}
+
+	/* REX */
+	uint8_t rex = 0;
+	bool needrex = false;
+
+	if ((opsize == 8 && !(form->flags & F_D64)) || (form->flags & F_W)) {
+		rex |= 0x08;
+	}
+
+	if (regop) {
+		rex |= (regop->reg >> 3) << 2;
+		needrex |= (regop->size == 1 && regop->reg >= RSP && regop->reg <= RDI);
+	}
+
+	if (rmop && rmop->kind == OPND_REG) {
+		rex |= rmop->reg >> 3;
+		needrex |= (rmop->size == 1 && rmop->reg >= RSP && rmop->reg <= RDI);
+	} else if (rmop && rmop->kind == OPND_MEM) {
+		if (rmop->mem.base != NOREG && rmop->mem.base != RIP) {
+			rex |= rmop->mem.base >> 3;
+		}
+		if (rmop->mem.index != NOREG) {
+			rex |= (rmop->mem.index >> 3) << 1;
+		}
+	}
+
+	if (roop) {
+		rex |= roop->reg >> 3;
+		needrex |= (roop->size == 1 && roop->reg >= RSP && roop->reg <= RDI);
+	}
+
+	if (vex) {
+		bool wide = false;
+		for (size_t i = 0; i < 3; ++i) {
+			wide |= insn.ops[i].kind == OPND_REG && insn.ops[i].size == 32;
+		}
+
+		putvex(enc, form, rex, vop, wide);
+	} else if (rex || needrex) {
+		put(enc, 0x40 | rex);
+	}
+
+	/* Opcode; the VEX prefix stands for all but the last byte */
+	for (size_t i = vex ? form->nopc - 1u : 0; i < form->nopc; ++i) {
+		uint8_t b = form->opc[i];
+
+		if (i == form->nopc - 1u) {
+			if (form->flags & F_CC) b += insn.cc;
+			if (roop) b += roop->reg & 7;
+		}
+
+		put(enc, b);
+	}
+
+	/* ModRM, SIB, displacement */
+	if (rmop) {
+		uint8_t regfield = (form->ext == EXT_R ? regop->reg : form->ext);
+		putrm(enc, regfield, *rmop);
+	}
+
+	/* Immediate */
+	if (immop) {
+		switch (immcls) {
+			case OC_I8:
+			case OC_IB: putn(enc, immop->imm, 1); break;
+			case OC_IZ: putn(enc, immop->imm, (opsize && opsize < 4 ? opsize : 4)); break;
+			case OC_I64: putn(enc, immop->imm, 8); break;
+			default: break;
+		}
+	}
+
+	/* Relative displacement to a label; patched in enc_resolve() */
+	if (relop) {
+		Fixup fixup = {
+			.at = enc->size,
+			.end = enc->size + 4,
+			.label = relop->label,
+			.start = start,
+			.shortopc = insn.op == X86_JMP ? 0xEB : insn.op == X86_JCC ? 0x70 + insn.cc : 0,
+			.near = false,
+		};
+		vec_push(enc->fixups, &fixup, &enc->nfixups, sizeof(Fixup));
+
+		putn(enc, 0, 4);
+	}
+}
+
+void enc_bytes(Enc *enc, const uint8_t *data, size_t size)
+{
+	reserve(enc, size);
+	memcpy(enc->code + enc->size, data, size);
+	enc->size += size;
+}
+
+/* Pad with NOPs up to the next multiple of 'to' */
+void enc_align(Enc *enc, size_t to)
+{
+	if (to <= 1) {
+		return;
+	}
+
+	size_t pad = (to - (enc->size & (to - 1))) & (to - 1);
+
+	Align align = {
+		.at = enc->size,
+		.pad = pad,
+		.to = to,
+	};
+	vec_push(enc->aligns, &align, &enc->naligns, sizeof(Align));
+
+	while (pad > 0) {
+		size_t n = pad > NOPMAX ? NOPMAX : pad;
+		enc_bytes(enc, nops[n], n);
+		pad -= n;
+	}
+}
+
+/*
+ * Patch every fixup, once all labels are bound. Jumps are encoded with a
+ * rel32, and shortened here to their rel8 form (2 bytes, from 5 or 6) where
+ * the target is near enough. That moves the code after them, and so changes
+ * the padding in front of aligned code; each round lays the code out anew
+ * with the jumps shortened so far, then shortens those now in range, and
+ * lengthens back for good any that padding has put out of range, until
+ * nothing changes. Each jump changes at most twice.
+ */
+void enc_resolve(Enc *enc)
+{
+	Item *items = NULL;
+	size_t nitems = 0;
+
+	/* Fixups and padding are both in the order they were encoded in; merge them */
+	for (size_t i = 0, j = 0; i < enc->nfixups || j < enc->naligns;) {
+		Fixup *fixup = i < enc->nfixups ? &enc->fixups[i] : NULL;
+		Align *align = j < enc->naligns ? &enc->aligns[j] : NULL;
+
+		if (fixup && enc->labels[fixup->label] == LABEL_UNBOUND) {
+			err_internal("reference to unbound label %d", fixup->label);
+		}
+
+		Item item = {
+			.fixup = NULL,
+			.keep = false,
+		};
+
+		if (fixup && (!align || fixup->start < align->at)) {
+			++i;
+
+			if (!fixup->shortopc || enc->labels[fixup->label] == LABEL_EXTERN) {
+				continue;
+			}
+
+			item.at = fixup->start;
+			item.len = fixup->end - fixup->start;
+			item.fixup = fixup;
+		} else {
+			++j;
+			item.at = align->at;
+			item.len = align->pad;
+			item.to = align->to;
+		}
+
+		vec_push(items, &item, &nitems, sizeof(Item));
+	}
+
+	for (bool changed = true; changed;) {
+		changed = false;
+		layout(items, nitems);
+
+		for (size_t i = 0; i < nitems; ++i) {
+			Item *item = &items[i];
+
+			if (!item->fixup || item->keep) {
+				continue;
+			}
+
+			int64_t rel = (int64_t)moved(items, nitems, enc->labels[item->fixup->label]) - (int64_t)(item->newat + 2);
+			bool reach = rel >= INT8_MIN && rel <= INT8_MAX;
+
+			if (reach != item->fixup->near) {
+				item->fixup->near = reach;
+				item->keep = !reach;
+				changed = true;
+			}
+		}
+	}
+
+	/* Copy the code between items, and put the items in anew */
+	uint8_t *code = acalloc(enc->allocd, sizeof(uint8_t));
+	size_t size = 0;
+	size_t from = 0;
+
+	for (size_t i = 0; i < nitems; ++i) {
+		Item *item = &items[i];
+
+		memcpy(code + size, enc->code + from, item->at - from);
+		size += item->at - from;
+		from = item->at + item->len;
+
+		if (item->fixup && item->fixup->near) {
+			code[size++] = item->fixup->shortopc;
+			code[size++] = 0;
+		} else if (item->fixup) {
+			memcpy(code + size, enc->code + item->at, item->len);
+			size += item->len;
+		} else {
+			for (size_t pad = item->newlen; pad > 0;) {
+				size_t n = pad > NOPMAX ? NOPMAX : pad;
+				memcpy(code + size, nops[n], n);
+				size += n;
+				pad -= n;
+			}
+		}
+	}
+
+	memcpy(code + size, enc->code + from, enc->size - from);
+	size += enc->size - from;
+
+	afree(enc->code);
+	enc->code = code;
+	enc->size = size;
+
+	/* Calls, and jumps to other objects, move with the code around them */
+	for (size_t i = 0; i < enc->nfixups; ++i) {
+		Fixup *fixup = &enc->fixups[i];
+
+		if (!fixup->shortopc || enc->labels[fixup->label] == LABEL_EXTERN) {
+			fixup->at = moved(items, nitems, fixup->at);
+			fixup->end = moved(items, nitems, fixup->end);
+		}
+	}
+
+	enc->movedfrom = acalloc(nitems + 1, sizeof(uint64_t));
+	enc->movedto = acalloc(nitems + 1, sizeof(uint64_t));
+	enc->nmoved = nitems;
+
+	for (size_t i = 0; i < nitems; ++i) {
+		Fixup *fixup = items[i].fixup;
+
+		if (fixup && fixup->near) {
+			fixup->at = items[i].newat + 1;
+			fixup->end = items[i].newat + 2;
+		} else if (fixup) {
+			fixup->at = items[i].newat + (fixup->at - fixup->start);
+			fixup->end = items[i].newat + items[i].newlen;
+		}
+
+		enc->movedfrom[i] = items[i].at + items[i].len;
+		enc->movedto[i] = items[i].newat + items[i].newlen;
+	}
+
+	for (size_t l = 0; l < enc->nlabels; ++l) {
+		if (enc->labels[l] != LABEL_EXTERN && enc->labels[l] != LABEL_UNBOUND) {
+			enc->labels[l] = moved(items, nitems, enc->labels[l]);
+		}
+	}
+
+	for (size_t i = 0; i < enc->nfixups; ++i) {
+		Fixup *fixup = &enc->fixups[i];
+		size_t target = enc->labels[fixup->label];
+
+		if (target == LABEL_EXTERN) {
+			continue;
+		}
+
+		int64_t rel = (int64_t)target - (int64_t)fixup->end;
+
+		if (fixup->near) {
+			enc->code[fixup->at] = (uint8_t)(int8_t)rel;
+		} else {
+			int32_t rel32 = (int32_t)rel;
+			memcpy(enc->code + fixup->at, &rel32, sizeof(int32_t));
+		}
+	}
+
+	afree(items);
+}
+
+/* The offsets items take, with the jumps shortened so far */
+static void layout(Item *items, size_t nitems)
+{
+	int64_t shift = 0;
+
+	for (size_t i = 0; i < nitems; ++i) {
+		Item *item = &items[i];
+		item->newat = (size_t)((int64_t)item->at + shift);
+
+		if (item->fixup) {
+			item->newlen = item->fixup->near ? 2 : item->len;
+		} else {
+			item->newlen = (item->to - (item->newat & (item->to - 1))) & (item->to - 1);
+		}
+
+		shift += (int64_t)item->newlen - (int64_t)item->len;
+	}
+}
+
+/* Where code at an offset is once items are laid out: as far after the end of the last item before it */
+static size_t moved(Item *items, size_t nitems, size_t pos)
+{
+	size_t lo = 0;
+	size_t hi = nitems;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (items[mid].at + items[mid].len <= pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (!lo) {
+		return pos;
+	}
+
+	Item *item = &items[lo - 1];
+	return pos - (item->at + item->len) + item->newat + item->newlen;
+}
+
+/*
+ * Whether an instruction has an encoding, with operands that agree in size
+ * where its form has them of the same sizes. The code generator never gives
+ * them otherwise, but instructions written in asm may.
+ */
+bool enc_encodable(Insn insn)
+{
+	const Form *form = match(&insn);
+
+	for (size_t i = 0; form && i < 3; ++i) {
+		for (size_t j = i + 1; j < 3; ++j) {
+			if (form->sz[i] && form->sz[i] == form->sz[j] && insn.ops[i].size != insn.ops[j].size) {
+				return false;
+			}
+		}
+	}
+
+	return form != NULL;
+}
+
+const char *enc_opname(x86_op op)
+{
+	return opnames[op];
+}
+
+static const Form *match(Insn *insn)
+{
+	uint8_t opsize = 0;
+	for (size_t i = 0; i < 3 && !opsize; ++i) {
+		opsize = insn->ops[i].size;
+	}
+
+	for (size_t i = 0; i < nforms; ++i) {
+		const Form *form = &forms[i];
+
+		if (form->op != insn->op || !(form->flags & F_VEX) != !insn->vex) {
+			continue;
+		}
+
+		bool ok = true;
+		for (size_t j = 0; j < 3 && ok; ++j) {
+			ok = matchop(form->cls[j], form->sz[j], insn->ops[j], opsize);
+		}
+
+		if (ok) {
+			return form;
+		}
+	}
+
+	return NULL;
+}
+
+static bool matchop(opclass cls, uint8_t sz, Operand o, uint8_t opsize)
+{
+	if (sz && !(sz & o.size)) {
+		return false;
+	}
+
+	switch (cls) {
+		case OC_NONE: return o.kind == OPND_NONE;
+		case OC_R:
+		case OC_RO:
+		case OC_V: return o.kind == OPND_REG;
+		case OC_RM: return o.kind == OPND_REG || o.kind == OPND_MEM;
+		case OC_M: return o.kind == OPND_MEM;
+		case OC_CL: return o.kind == OPND_REG && o.reg == RCX;
+		case OC_A: return o.kind == OPND_REG && o.reg == RAX;
+		case OC_ONE: return o.kind == OPND_IMM && o.imm == 1;
+		case OC_I8: return o.kind == OPND_IMM && o.imm >= INT8_MIN && o.imm <= INT8_MAX;
+		case OC_IB: return o.kind == OPND_IMM && o.imm >= 0 && o.imm <= UINT8_MAX;
+		case OC_I64: return o.kind == OPND_IMM;
+		case OC_REL32: return o.kind == OPND_LABEL;
+		case OC_IZ: {
+			if (o.kind != OPND_IMM) {
+				return false;
+			}
+
+			switch (opsize) {
+				case 1: return o.imm >= INT8_MIN && o.imm <= UINT8_MAX;
+				case 2: return o.imm >= INT16_MIN && o.imm <= UINT16_MAX;
+				case 4: return o.imm >= INT32_MIN && o.imm <= UINT32_MAX;
+				default: return o.imm >= INT32_MIN && o.imm <= INT32_MAX;
+			}
+		}
+	}
+
+	return false;
+}
+
+static void reserve(Enc *enc, size_t n)
+{
+	if (enc->size + n <= enc->allocd) {
+		return;
+	}
+
+	size_t allocd = enc->allocd * 2;
+	while (allocd < enc->size + n) {
+		allocd *= 2;
+	}
+
+	enc->code = arecalloc(enc->code, allocd, sizeof(uint8_t));
+	enc->allocd = allocd;
+}
+
+static void put(Enc *enc, uint8_t b)
+{
+	enc->code[enc->size++] = b;
+}
+
+static void putn(Enc *enc, int64_t v, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		put(enc, (v >> (8 * i)) & 0xFF);
+	}
+}
+
+/* Emit ModRM (and SIB and displacement, for memory operands) */
+static void putrm(Enc *enc, uint8_t regfield, Operand rm)
+{
+	regfield &= 7;
+
+	if (rm.kind == OPND_REG) {
+		put(enc, 0xC0 | (regfield << 3) | (rm.reg & 7));
+		return;
+	}
+
+	reg base = rm.mem.base;
+	reg index = rm.mem.index;
+	int32_t disp = rm.mem.disp;
+
+	/* [rip + disp32]; cannot have an index */
+	if (base == RIP) {
+		put(enc, 0x05 | (regfield << 3));
+		enc->ripdisp = enc->size;
+		putn(enc, disp, 4);
+		return;
+	}
+
+	/* No base: [index*scale + disp32], or [disp32] */
+	if (base == NOREG) {
+		put(enc, 0x04 | (regfield << 3));
+
+		uint8_t ss = (index == NOREG ? 0 : rm.mem.scale == 8 ? 3 : rm.mem.scale == 4 ? 2 : rm.mem.scale == 2 ? 1 : 0);
+		uint8_t idx = (index == NOREG ? RSP : index) & 7;
+		put(enc, (ss << 6) | (idx << 3) | 0x05);
+		enc->ripdisp = enc->size;
+		putn(enc, disp, 4);
+		return;
+	}
+
+	/* rbp/r13 cannot be a base without a displacement */
+	uint8_t mod = 0;
+	if (disp == 0 && (base & 7) != RBP) {
+		mod = 0;
+	} else if (disp >= INT8_MIN && disp <= INT8_MAX) {
+		mod = 1;
+	} else {
+		mod = 2;
+	}
+
+	/* rsp/r12 as a base, or any index, requires a SIB */
+	if (index != NOREG || (base & 7) == RSP) {
+		uint8_t ss = (index == NOREG ? 0 : rm.mem.scale == 8 ? 3 : rm.mem.scale == 4 ? 2 : rm.mem.scale == 2 ? 1 : 0);
+		uint8_t idx = (index == NOREG ? RSP : index) & 7;
+
+		put(enc, (mod << 6) | (regfield << 3) | 0x04);
+		put(enc, (ss << 6) | (idx << 3) | (base & 7));
+	} else {
+		put(enc, (mod << 6) | (regfield << 3) | (base & 7));
+	}
+
+	if (mod == 1) {
+		putn(enc, disp, 1);
+	} else if (mod == 2) {
+		putn(enc, disp, 4);
+	}
+}
+
+/*
+ * The VEX prefix, in its two-byte form where it can be: it carries the
+ * inverted REX.R, X and B bits, the opcode map (0F, 0F 38 or 0F 3A), REX.W,
+ * the inverted extra source register, the vector length (L: 256 bits) and
+ * the mandatory prefix.
+ */
+static void putvex(Enc *enc, const Form *form, uint8_t rex, Operand *vop, bool wide)
+{
+	static const uint8_t pps[256] = { [0x66] = 1, [0xF3] = 2, [0xF2] = 3 };
+
+	uint8_t map = form->nopc == 3 ? (form->opc[1] == 0x38 ? 2 : 3) : 1;
+	uint8_t vvvv = vop ? (~vop->reg & 0xF) : 0xF;
+	uint8_t last = (vvvv << 3) | (wide << 2) | pps[form->prefix];
+	bool w = form->flags & F_W;
+
+	if (map == 1 && !w && !(rex & 0x3)) {
+		put(enc, 0xC5);
+		put(enc, (!(rex & 0x4) << 7) | last);
+		return;
+	}
+
+	put(enc, 0xC4);
+	put(enc, (!(rex & 0x4) << 7) | (!(rex & 0x2) << 6) | (!(rex & 0x1) << 5) | map);
+	put(enc, (w << 7) | last);
+}
@@ -0,0 +1,294 @@
+/*
+ * enc.h
+ *
+ * This file is part of awl
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* x86-64 general purpose register numbers */
+typedef enum reg {
+	RAX = 0,
+	RCX = 1,
+	RDX = 2,
+	RBX = 3,
+	RSP = 4,
+	RBP = 5,
+	RSI = 6,
+	RDI = 7,
+	R8 = 8,
+	R9 = 9,
+	R10 = 10,
+	R11 = 11,
+	R12 = 12,
+	R13 = 13,
+	R14 = 14,
+	R15 = 15,
+
+	/* XMM and YMM registers are numbered 0 to 15 as well; operands of 16 and 32 bytes name them */
+
+	RIP = 0x10, /* as a base only: [rip + disp32], relative to the end of the instruction */
+	NOREG = 0xFF, /* no base/index in a memory operand */
+} reg;
+
+/* Condition codes, in the order of their encoding (the low nibble of Jcc etc.) */
+typedef enum cond {
+	CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+	CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
+} cond;
+
+#define CC_NEGATE(cc) ((cond)((cc) ^ 1))
+
+/* Mnemonics; each has one or more encodings in the form table in enc.c */
+typedef enum x86_op {
+	_X86_NULL,
+
+	X86_MOV,
+	X86_MOVZX,
+	X86_MOVSX,
+	X86_MOVSXD,
+	X86_LEA,
+	X86_XCHG, /* locked by itself where it has a memory operand */
+	X86_XADD, /* used with the lock prefix; see Insn */
+	X86_CMPXCHG, /* likewise; compares with, and loads into, rax */
+
+	X86_ADD,
+	X86_OR,
+	X86_AND,
+	X86_SUB,
+	X86_XOR,
+	X86_CMP,
+	X86_TEST,
+
+	X86_IMUL,
+	X86_MUL,
+	X86_IMUL1, /* one-operand imul; rdx:rax = rax * r/m */
+	X86_DIV,
+	X86_IDIV,
+	X86_NEG,
+	X86_NOT,
+
+	X86_ROL,
+	X86_ROR,
+	X86_SHL,
+	X86_SHR,
+	X86_SAR,
+
+	X86_BSF,
+	X86_BSR,
+	X86_BSWAP,
+	X86_POPCNT, /* POPCNT */
+	X86_LZCNT, /* LZCNT */
+	X86_TZCNT, /* BMI1 */
+	X86_PDEP, /* BMI2; VEX-encoded, see Insn */
+	X86_PEXT,
+	X86_ANDN, /* BMI1; VEX-encoded */
+	X86_BZHI, /* BMI2; likewise */
+	X86_SHLX,
+	X86_SHRX,
+	X86_SARX,
+	X86_MOVBE, /* a load or store that swaps the bytes of the value */
+	X86_RDTSC,
+	X86_CPUID,
+	X86_XGETBV,
+	X86_PREFETCHT0,
+	X86_PREFETCHT1,
+	X86_PREFETCHT2,
+	X86_PREFETCHNTA,
+	X86_MOVNTI, /* a store that bypasses the cache */
+	X86_SFENCE,
+
+	X86_CDQ,
+	X86_CQO,
+
+	X86_PUSH,
+	X86_POP,
+	X86_CALL,
+	X86_JMP,
+	X86_JCC,
+	X86_SETCC,
+	X86_CMOVCC,
+	X86_RET,
+	X86_LEAVE,
+	X86_NOP,
+	X86_UD2,
+
+	/* SSE2, and their VEX forms; see Insn */
+	X86_MOVDQA,
+	X86_MOVDQU,
+	X86_MOVNTDQ,
+	X86_MOVD, /* movd, or movq with a 64-bit register */
+	X86_PADDB,
+	X86_PADDW,
+	X86_PADDD,
+	X86_PADDQ,
+	X86_PSUBB,
+	X86_PSUBW,
+	X86_PSUBD,
+	X86_PSUBQ,
+	X86_PMULLW,
+	X86_PMULLD, /* SSE4.1; used where the target has it, or under VEX */
+	X86_PMULUDQ,
+	X86_PAND,
+	X86_POR,
+	X86_PXOR,
+	X86_PCMPEQB,
+	X86_PCMPEQW,
+	X86_PCMPEQD,
+	X86_PCMPEQQ, /* SSE4.1; likewise */
+	X86_PCMPGTB,
+	X86_PCMPGTW,
+	X86_PCMPGTD,
+	X86_PCMPGTQ, /* SSE4.2; used under VEX only */
+	X86_PSLLW,
+	X86_PSLLD,
+	X86_PSLLQ,
+	X86_PSRLW,
+	X86_PSRLD,
+	X86_PSRLQ,
+	X86_PSRAW,
+	X86_PSRAD,
+	X86_PSHUFD,
+	X86_PSHUFLW,
+	X86_PSHUFHW,
+	X86_PUNPCKLBW,
+	X86_PUNPCKLWD,
+	X86_PUNPCKLDQ,
+	X86_PUNPCKLQDQ,
+	X86_PACKSSWB,
+	X86_PMOVMSKB,
+	X86_MOVMSKPS,
+	X86_MOVMSKPD,
+	X86_PEXTRW,
+	X86_PSADBW,
+
+	/* AVX2 only */
+	X86_VPBROADCASTB,
+	X86_VPBROADCASTW,
+	X86_VPBROADCASTD,
+	X86_VPBROADCASTQ,
+	X86_VPERMQ,
+	X86_VEXTRACTI128,
+	X86_VZEROUPPER,
+
+	_X86_COUNT,
+} x86_op;
+
+typedef int label;
+
+typedef enum operand_kind {
+	OPND_NONE,
+	OPND_REG,
+	OPND_IMM,
+	OPND_MEM,
+	OPND_LABEL,
+} operand_kind;
+
+typedef struct Operand {
+	operand_kind kind;
+	uint8_t size; /* Bytes; 0 for immediates, labels and untyped memory (lea) */
+
+	union {
+		reg reg;
+		int64_t imm;
+		label label;
+
+		struct {
+			reg base;
+			reg index;
+			uint8_t scale;
+			int32_t disp;
+			bool fs; /* relative to the thread pointer: the %fs segment */
+			uint32_t sym; /* an ELF symbol the displacement is relative to, once relocated; 0 for none */
+		} mem;
+	};
+} Operand;
+
+#define OPNONE ((Operand){ .kind = OPND_NONE })
+#define OPREG(r, sz) ((Operand){ .kind = OPND_REG, .size = (sz), .reg = (r) })
+#define OPIMM(v) ((Operand){ .kind = OPND_IMM, .imm = (v) })
+#define OPLABEL(l) ((Operand){ .kind = OPND_LABEL, .label = (l) })
+#define OPMEM(b, i, s, d, sz) ((Operand){ .kind = OPND_MEM, .size = (sz), .mem = { .base = (b), .index = (i), .scale = (s), .disp = (d) } })
+
+/*
+ * An SSE instruction with 'vex' set is encoded in its AVX form, which takes
+ * a source operand of its own in place of reading its destination: 'vpaddb
+ * x0, x1, x2' for the 'paddb x0, x2' that would read x0. Only VEX forms may
+ * have 32-byte (YMM) operands. One with 'lock' set is a locked (atomic)
+ * read-modify-write of its memory operand.
+ */
+typedef struct Insn {
+	x86_op op;
+	cond cc; /* for X86_JCC, X86_SETCC and X86_CMOVCC */
+	bool vex;
+	bool lock;
+	bool ordered; /* an atomic access, which other memory accesses are not moved across */
+	Operand ops[3];
+} Insn;
+
+typedef struct Fixup {
+	size_t at; /* offset of the rel32 field, or of the rel8 once shortened */
+	size_t end; /* offset of the end of the instruction containing it */
+	label label;
+	size_t start; /* offset of the instruction */
+	uint8_t shortopc; /* the opcode of its rel8 form, for a jump; 0 if it has none */
+	bool near; /* shortened to its rel8 form */
+} Fixup;
+
+/* Padding before code aligned to 'to', which changes as jumps before it are shortened */
+typedef struct Align {
+	size_t at;
+	size_t pad;
+	size_t to;
+} Align;
+
+/*
+ * A growable code buffer; it is filled by encoding Insns into it, and grows
+ * geometrically so appending is amortised O(1). Jumps/calls to labels that are
+ * not yet bound are recorded as Fixups and patched in enc_resolve(), which
+ * shortens jumps to a rel8 where it reaches, and so moves the code after them.
+ */
+typedef struct Enc {
+	uint8_t *code;
+	size_t size;
+	size_t allocd;
+
+	size_t *labels; /* label -> offset, or LABEL_UNBOUND */
+	size_t nlabels;
+
+	Fixup *fixups;
+	size_t nfixups;
+
+	Align *aligns;
+	size_t naligns;
+
+	/*
+	 * Where enc_resolve() moved code: what was at movedfrom[i] or after it,
+	 * up to movedfrom[i + 1], is now as far after movedto[i]. Offsets taken
+	 * while encoding (of symbols and relocations) are moved the same way.
+	 */
+	uint64_t *movedfrom;
+	uint64_t *movedto;
+	size_t nmoved;
+
+	size_t ripdisp; /* offset of the disp32 of the last rip-relative or baseless operand, for relocations */
+} Enc;
+
+#define LABEL_UNBOUND ((size_t)-1)
+#define LABEL_EXTERN ((size_t)-2) /* outside the buffer; its fixups are left to relocations */
+
+Enc *enc_new();
+label enc_label(Enc *enc);
+label enc_extern(Enc *enc);
+void enc_bind(Enc *enc, label l);
+size_t enc_labelpos(Enc *enc, label l);
+void enc_insn(Enc *enc, Insn insn);
+bool enc_encodable(Insn insn);
+void enc_bytes(Enc *enc, const uint8_t *data, size_t size);
+void enc_align(Enc *enc, size_t to);
+void enc_resolve(Enc *enc);
+const char *enc_opname(x86_op op);
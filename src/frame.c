@@ -0,0 +1,298 @@
+/*
+ * frame.c
+ *
+ * This file is part of awl
+ */
+
+#include "frame.h"
+
+#include "vec.h"
+#include "mem.h"
+
+static void live_block(Frame *frame, TBlock *block);
+static void live_expr(Frame *frame, TExpression *expression);
+static void define(Frame *frame, varndx var);
+static void use(Frame *frame, varndx var);
+static void loopend(Frame *frame, size_t from);
+
+Frame *frame_new()
+{
+	Frame *frame = alloct(Frame);
+	frame->tfile = NULL;
+	frame->point = 0;
+	frame->start = NULL;
+	frame->end = NULL;
+	frame->vars = NULL;
+	frame->nvars = 0;
+	frame->homed = NULL;
+	frame->slotof = NULL;
+	frame->slots = NULL;
+	frame->nslots = 0;
+	frame->size = 0;
+	frame->align = 1;
+
+	return frame;
+}
+
+/* Compute the lifetimes of the variables of a function, and start on an empty frame */
+void frame_run(Frame *frame, TFile *tfile, TFun *tfun)
+{
+	if (frame->tfile != tfile) {
+		frame_reset(frame);
+		frame->tfile = tfile;
+		frame->start = acalloc(tfile->ntvariables + 1, sizeof(size_t));
+		frame->end = acalloc(tfile->ntvariables + 1, sizeof(size_t));
+		frame->homed = acalloc(tfile->ntvariables + 1, sizeof(bool));
+		frame->slotof = acalloc(tfile->ntvariables + 1, sizeof(size_t));
+	}
+
+	for (size_t i = 0; i < frame->nvars; ++i) {
+		frame->homed[frame->vars[i]] = false;
+	}
+
+	afree(frame->vars);
+	afree(frame->slots);
+	frame->vars = NULL;
+	frame->nvars = 0;
+	frame->slots = NULL;
+	frame->nslots = 0;
+	frame->size = 0;
+	frame->align = 1;
+	frame->point = 0;
+
+	for (size_t i = 0; i < tfun->nparams; ++i) {
+		define(frame, tfun->params[i]);
+	}
+
+	live_block(frame, tfun->block);
+}
+
+/* Ask for a slot for a variable of the current function */
+void frame_add(Frame *frame, varndx var)
+{
+	frame->homed[var] = true;
+}
+
+/* Give each variable asked for a slot, and each slot its place */
+void frame_layout(Frame *frame)
+{
+	TFile *tfile = frame->tfile;
+
+	/* Laid out again from scratch, as the code generator may add slots once it knows the frame is realigned */
+	frame->nslots = 0;
+	frame->align = 1;
+
+	/* Variables were recorded in order of definition */
+	for (size_t i = 0; i < frame->nvars; ++i) {
+		varndx v = frame->vars[i];
+		TVariable *tvar = tfile->tvariables[v];
+		Type *type = tfile->types[tvar->type];
+		size_t size = type->size;
+		size_t align = tvar->align > type->align ? tvar->align : type->align;
+		size_t s = 0;
+
+		if (!frame->homed[v]) {
+			continue;
+		}
+
+		while (s < frame->nslots && (frame->slots[s].size != size || frame->slots[s].align != align
+				|| frame->slots[s].end >= frame->start[v])) {
+			++s;
+		}
+
+		if (s == frame->nslots) {
+			Slot slot = { .size = size, .align = align, .end = 0, .disp = 0 };
+			vec_push(frame->slots, &slot, &frame->nslots, sizeof(Slot));
+		}
+
+		if (frame->end[v] > frame->slots[s].end) {
+			frame->slots[s].end = frame->end[v];
+		}
+
+		frame->slotof[v] = s;
+		frame->align = align > frame->align ? align : frame->align;
+	}
+
+	/* Slots grow down from rbp, so a slot is aligned where the offset of its lowest byte is */
+	size_t offset = frame->align > FRAME_MAXALIGN ? 8 : 0;
+	for (size_t align = frame->align; align > 0; align >>= 1) {
+		for (size_t s = 0; s < frame->nslots; ++s) {
+			if (frame->slots[s].align == align) {
+				offset = (offset + frame->slots[s].size + align - 1) & ~(align - 1);
+				frame->slots[s].disp = -(int32_t)offset;
+			}
+		}
+	}
+
+	frame->size = (offset + 15) & ~(size_t)15;
+}
+
+/* The displacement from rbp of a variable's slot */
+int32_t frame_disp(Frame *frame, varndx var)
+{
+	return frame->slots[frame->slotof[var]].disp;
+}
+
+void frame_reset(Frame *frame)
+{
+	afree(frame->start);
+	afree(frame->end);
+	afree(frame->homed);
+	afree(frame->slotof);
+	afree(frame->vars);
+	afree(frame->slots);
+
+	frame->tfile = NULL;
+	frame->start = NULL;
+	frame->end = NULL;
+	frame->homed = NULL;
+	frame->slotof = NULL;
+	frame->vars = NULL;
+	frame->nvars = 0;
+	frame->slots = NULL;
+	frame->nslots = 0;
+}
+
+/* Number the statements of a block in the order they run, noting where each variable is defined and used */
+static void live_block(Frame *frame, TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		++frame->point;
+
+		switch (statement->variant) {
+			case TSTATEMENT_RETURN:
+			case TSTATEMENT_BUILTIN: live_expr(frame, statement->expr); break;
+			case TSTATEMENT_SWITCH: {
+				TSwitch *sw = statement->sw;
+				live_expr(frame, sw->expr);
+
+				for (size_t j = 0; j < sw->ncases; ++j) {
+					live_block(frame, sw->cases[j]->block);
+				}
+
+				if (sw->def) {
+					live_block(frame, sw->def);
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				live_expr(frame, statement->tif->cond);
+				live_block(frame, statement->tif->then);
+
+				if (statement->tif->els) {
+					live_block(frame, statement->tif->els);
+				}
+				break;
+			}
+			case TSTATEMENT_VAR: {
+				live_expr(frame, statement->assign->value);
+				define(frame, statement->assign->var);
+				break;
+			}
+			case TSTATEMENT_ASSIGN: {
+				live_expr(frame, statement->assign->value);
+				use(frame, statement->assign->var);
+				break;
+			}
+			case TSTATEMENT_STORE: {
+				live_expr(frame, statement->store->value);
+				live_expr(frame, statement->store->place);
+				break;
+			}
+			case TSTATEMENT_CHECK: {
+				live_expr(frame, statement->check->index);
+
+				if (statement->check->bound != NONDX) {
+					use(frame, statement->check->bound);
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				TWhile *loop = statement->loop;
+				live_expr(frame, loop->guard);
+				live_block(frame, loop->pre);
+
+				size_t from = ++frame->point;
+				live_block(frame, loop->block);
+
+				++frame->point;
+				live_expr(frame, loop->cond);
+				loopend(frame, from);
+				break;
+			}
+			case TSTATEMENT_ASM: {
+				for (size_t j = 0; j < statement->tasm->noperands; ++j) {
+					live_expr(frame, statement->tasm->operands[j].expr);
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+static void live_expr(Frame *frame, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: use(frame, expression->var); break;
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				live_expr(frame, expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			live_expr(frame, expression->binary->lhs);
+			live_expr(frame, expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: live_expr(frame, expression->unary->operand); break;
+		case TEXPRESSION_FIELD: live_expr(frame, expression->field->base); break;
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				live_expr(frame, expression->builtin->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			TExpression *base = expression->index->base;
+			live_expr(frame, base);
+			live_expr(frame, expression->index->index);
+
+			/* An element of a slice is checked against its length */
+			if (frame->tfile->types[base->type]->kind == TYPE_SLICE) {
+				use(frame, frame->tfile->tvariables[base->var]->length);
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+static void define(Frame *frame, varndx var)
+{
+	frame->start[var] = frame->point;
+	frame->end[var] = frame->point;
+	vec_push(frame->vars, &var, &frame->nvars, sizeof(varndx));
+}
+
+static void use(Frame *frame, varndx var)
+{
+	if (frame->point > frame->end[var]) {
+		frame->end[var] = frame->point;
+	}
+}
+
+/* Variables defined before a loop and used in it are live throughout it */
+static void loopend(Frame *frame, size_t from)
+{
+	for (size_t i = 0; i < frame->nvars; ++i) {
+		varndx v = frame->vars[i];
+
+		if (frame->start[v] < from && frame->end[v] >= from) {
+			frame->end[v] = frame->point;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/*
+ * frame.h
+ *
+ * This file is part of awl
+ */
+
+#pragma once
+
+#include "type.h"
+
+/* Most alignment rbp gives a slot as it is; a frame whose slots need more realigns rbp */
+#define FRAME_MAXALIGN 16
+
+/* A stack slot, shared by variables whose lifetimes do not overlap */
+typedef struct Slot {
+	size_t size;
+	size_t align;
+	size_t end; /* last point at which a variable in it is live */
+	int32_t disp; /* from rbp */
+} Slot;
+
+/*
+ * The frame of a function, below the saved rbp. Statements are numbered in
+ * the order they run, and each variable is live from its definition (point 0
+ * for arguments) to its last use. A variable defined outside a loop and used
+ * inside it is live to the end of the loop, as the next iteration may use it
+ * again. Variables given slots are taken in order of definition, and each
+ * reuses a slot of its size and alignment that all previous occupants are
+ * dead by; slots are then laid out most aligned first, so that little space
+ * goes to padding. A realigned frame keeps the caller's rbp in its top 8
+ * bytes, to return by.
+ */
+typedef struct Frame {
+	TFile *tfile;
+
+	/* Lifetimes */
+	size_t point;
+	size_t *start; /* varndx -> point of definition */
+	size_t *end; /* varndx -> last point of use */
+	varndx *vars; /* those of the current function */
+	size_t nvars;
+
+	/* Slots */
+	bool *homed; /* varndx -> whether it is to be given a slot */
+	size_t *slotof; /* varndx -> index into slots */
+	Slot *slots;
+	size_t nslots;
+	size_t size; /* bytes, a multiple of 16 */
+	size_t align; /* most any slot needs; above FRAME_MAXALIGN, rbp is realigned to it */
+} Frame;
+
+Frame *frame_new();
+void frame_run(Frame *frame, TFile *tfile, TFun *tfun);
+void frame_add(Frame *frame, varndx var);
+void frame_layout(Frame *frame);
+int32_t frame_disp(Frame *frame, varndx var);
+void frame_reset(Frame *frame);
@@ -6,62 +6,481 @@
 
 #include "gen.h"
 
+#include <cpuid.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "vec.h"
 #include "mem.h"
 #include "err.h"
 
-#define STACKOFF_DEFAULT 4
+/* Integer argument registers of the System V AMD64 calling convention */
+#define NPARAMREG 6
+static const reg paramreg[NPARAMREG] = { RDI, RSI, RDX, RCX, R8, R9 };
 
-/* Get the nth byte of some value */
-#define NBYTE(v, n) ((v >> 8 * n) & 0xFF)
+/* Registers free for use as scratch, in order of preference; all are caller-saved */
+#define NSCRATCH 9
+static const reg scratch[NSCRATCH] = { RAX, RCX, RDX, RSI, RDI, R8, R9, R10, R11 };
 
-/* Get the nth bit of some value */
-#define NBIT(v, n) ((v >> n) & 1)
+/* Callee-saved registers; used to keep common subexpressions across calls */
+#define NCALLEESAVED 5
+static const reg calleesaved[NCALLEESAVED] = { RBX, R12, R13, R14, R15 };
 
-/* Set the nth bit of some value to state (s) */
-#define NBITSET(v, n, s) (v |= s << n)
+/* Scratch registers a leaf function leaves free for expressions when giving locals registers */
+#define MINFREE 4
 
-/* Register number */
-typedef unsigned char reg;
+#define REGBIT(r) ((uint16_t)(1u << (r)))
 
-static const reg RAX = 0;
-static const reg RCX = 1;
-static const reg RDX = 2;
-static const reg RBP = 5;
-static const reg RSI = 6;
-static const reg RDI = 7;
+/* XMM registers; all are caller-saved, and the first eight pass vector arguments */
+#define NXMM 16
 
-static const reg paramreg[4] = { RDI, RSI, RDX, RCX };
+/* XMM registers a leaf function leaves free for expressions when giving vector locals registers */
+#define XMINFREE 8
 
-static uint8_t stack(Gen *gen, uint8_t size);
-static uint8_t modrm(uint8_t mod, uint8_t op, uint8_t rm);
+/* XMM registers a vector operation may need at once: its right-hand operand and two temporaries; see vvalue() */
+#define XSPARE 3
+
+/* Offset of the first stack-passed argument from rbp (past saved rbp and return address) */
+#define STACKARG_OFFSET 16
+
+/*
+ * Switches with at most SWITCH_LINEAR cases compare against each in turn;
+ * larger ones use a jump table where it has at most SWITCH_DENSITY slots per
+ * case, and split around the middle case into a binary search otherwise.
+ */
+#define SWITCH_LINEAR 4
+#define SWITCH_DENSITY 3
+
+/* Largest struct or array cleared by straight-line stores; larger ones are cleared in a loop */
+#define ZERO_MAXUNROLL 64
+
+/* Magic numbers for division by a constant take up to 65 bits, and their products 128; see magicu() */
+__extension__ typedef unsigned __int128 uint128;
+
+/* A target of -march=, and the extensions it has */
+typedef struct March {
+	const char *name;
+	uint32_t isa;
+} March;
+
+static const March marches[] = {
+	{ "x86-64", 0 },
+	{ "x86-64-v2", ISA_V2 },
+	{ "x86-64-v3", ISA_V3 },
+	{ "x86-64-v4", ISA_V3 },
+};
+
+/* Words of CPUID, and of XGETBV, that the extensions of ISA_* are reported in */
+typedef enum cpuid_word {
+	CPUID_1ECX, /* leaf 1 */
+	CPUID_7EBX, /* leaf 7, subleaf 0 */
+	CPUID_X1ECX, /* leaf 0x80000001 */
+	CPUID_XCR0, /* XGETBV of XCR0, where leaf 1 reports OSXSAVE */
+	CPUID_NWORDS,
+} cpuid_word;
+
+/*
+ * The bits of a word an extension needs set; one with several entries needs
+ * all of them. AVX also needs the OS to save the YMM registers on a context
+ * switch, which it says it does by setting bits 1 and 2 (SSE and AVX state)
+ * of XCR0.
+ */
+typedef struct Feature {
+	uint32_t isa;
+	cpuid_word word;
+	uint32_t bits;
+} Feature;
+
+static const Feature features[] = {
+	{ ISA_POPCNT, CPUID_1ECX, bit_POPCNT },
+	{ ISA_LZCNT, CPUID_X1ECX, bit_LZCNT },
+	{ ISA_BMI1, CPUID_7EBX, bit_BMI },
+	{ ISA_BMI2, CPUID_7EBX, bit_BMI2 },
+	{ ISA_SSE4, CPUID_1ECX, bit_SSE4_1 | bit_SSE4_2 },
+	{ ISA_MOVBE, CPUID_1ECX, bit_MOVBE },
+	{ ISA_AVX2, CPUID_1ECX, bit_OSXSAVE | bit_AVX },
+	{ ISA_AVX2, CPUID_7EBX, bit_AVX2 },
+	{ ISA_AVX2, CPUID_XCR0, 0x6 },
+};
+
+/* A clone of a function with target_clones; see gen_clones() */
+typedef struct Clone {
+	Token target;
+	uint32_t isa;
+	label entry;
+	size_t sym;
+} Clone;
+
+/* A local variable, and how deeply it is nested in loops */
+typedef struct Local {
+	varndx var;
+	size_t depth;
+} Local;
+
+typedef struct SwitchCase {
+	uint64_t value;
+	label target;
+} SwitchCase;
+
+/*
+ * The right-hand operand of an operation, once evaluated: an immediate, the
+ * home of a variable, a scratch register, or (where no register was free) a
+ * spill slot on the stack.
+ */
+typedef struct Value {
+	Operand op;
+	bool temp; /* op is a scratch register to be freed */
+	size_t spill; /* depth at which op was pushed, or 0 */
+	size_t release; /* of a vector spill: the bytes of stack it takes, padding included */
+} Value;
+
+/* A register copied into another, as one of several copies made at once; see shuffle() */
+typedef struct Move {
+	reg dest;
+	reg src;
+} Move;
+
+static void emit(Gen *gen, x86_op op, Operand a, Operand b);
+static void emit3(Gen *gen, x86_op op, Operand a, Operand b, Operand c);
+static void emitcc(Gen *gen, x86_op op, cond cc, Operand a, Operand b);
+static void emitbmi(Gen *gen, x86_op op, Operand a, Operand b, Operand c);
+static void emitatomic(Gen *gen, x86_op op, Operand a, Operand b, bool ordered);
+static void issue(Gen *gen, Insn insn);
+static void encode(Gen *gen, Insn insn);
+static void flush(Gen *gen);
+static void bind(Gen *gen, label l);
+static void align(Gen *gen, size_t n);
+static reg regalloc(Gen *gen, uint16_t avoid);
+static void regfree(Gen *gen, reg r);
+static void save(Gen *gen, uint16_t regs);
+static void restore(Gen *gen, uint16_t regs);
+static reg borrow(Gen *gen, uint16_t avoid, bool *pushed);
+static uint16_t regsof(Operand op);
+static void giveback(Gen *gen, reg r, bool pushed);
+static uint8_t width(Type *type);
+static void narrow(Gen *gen, Type *type, reg r);
+static bool isconst(TExpression *expression);
+static uint64_t constval(TExpression *expression);
+static bool hascall(TExpression *expression);
+static TExpression *statement_expr(TStatement *statement);
+static TBlock *statement_block(TStatement *statement, size_t i);
+static bool isleaf(TBlock *block);
+static bool callscold(Gen *gen, TExpression *expression);
+static bool iscold(Gen *gen, TBlock *block);
+static bool emitted(Gen *gen, TFun *tfun);
+static Enc *funenc(Gen *gen, TFun *tfun);
+static const char *funsection(TFun *tfun);
+static void tls(Gen *gen);
+static size_t globalsym(Gen *gen, globalndx global);
+static void cse_collect(Gen *gen, TExpression *expression, bool fixed);
+static Cse *cse_find(Gen *gen, TExpression *expression);
+static void cse_keep(Gen *gen, Cse *cse, Type *type, reg src);
+static void cse_use(Gen *gen, Cse *cse);
+static void cse_drop(Gen *gen);
+static void cse_reserve(Gen *gen, TExpression *expression);
+static void cse_scan(Gen *gen, TBlock *block);
+static void load(Gen *gen, Operand src, Type *type, reg dest);
+static label trap(Gen *gen);
+static void scale(Gen *gen, reg r, size_t by);
+static bool direct(Gen *gen, TExpression *place);
+static bool inmemory(Gen *gen, TExpression *expression);
+static Operand address(Gen *gen, TExpression *place, reg dest);
+static Operand element(Gen *gen, TIndex *index, reg dest);
+static Value value(Gen *gen, TExpression *expression, uint16_t avoid, bool noimm, reg dest);
+static Operand valueop(Gen *gen, Value *val, uint8_t size);
+static void valuefree(Gen *gen, Value *val);
+static bool mulconst(Gen *gen, TExpression *lhs, uint64_t c, Type *type, reg dest);
+static bool divconst(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_div(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_shift(Gen *gen, TBinary *binary, Type *type, reg dest);
+static Operand bitmask(Gen *gen, reg k, uint8_t w, uint64_t c);
+static bool fusable(Gen *gen, TExpression *expression);
+static TExpression *lowbits(Gen *gen, TExpression *expression);
+static bool andbits(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_popcount(Gen *gen, Type *type, reg dest);
+static void gen_bitcount(Gen *gen, TUnary *unary, Type *type, reg dest);
+static void gen_deposit(Gen *gen, TBinary *binary, Type *type, reg dest);
+static TBinary *canonical(TBinary *binary);
+static cond compare(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_compare(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_binary(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_unary(Gen *gen, TUnary *unary, Type *type, reg dest);
+static void gen_call(Gen *gen, TCall *call, reg dest);
+static void gen_builtin(Gen *gen, TBuiltin *builtin, reg dest);
+static void gen_atomic(Gen *gen, TBuiltin *builtin, reg dest);
 static void gen_expr(Gen *gen, TExpression *expression, reg dest);
-static void gen_statement(Gen *gen, TStatement *statement);
-static void gen_fun(Gen *gen, size_t ndx);
-static const char *fileext(const char *path);
+static reg xalloc(Gen *gen, uint16_t avoid);
+static void xfree(Gen *gen, reg r);
+static reg xtemp(Gen *gen, uint16_t avoid);
+static void xsave(Gen *gen, uint16_t regs);
+static void xrestore(Gen *gen, uint16_t regs);
+static void vemit(Gen *gen, x86_op op, Operand a, Operand b);
+static void vemit3(Gen *gen, x86_op op, Operand a, Operand b, Operand c);
+static void vshift(Gen *gen, x86_op op, Operand d, Operand s, uint8_t n);
+static void vmove(Gen *gen, Operand dest, Operand src);
+static bool iswide(Gen *gen, TExpression *expression);
+static bool haswide(Gen *gen, TBlock *block);
+static bool funwide(Gen *gen, TFun *tfun);
+static size_t lanelog(Gen *gen, Type *type);
+static void vnot(Gen *gen, reg r, uint8_t size);
+static void broadcast(Gen *gen, Type *type, reg dest);
+static void vconst(Gen *gen, Type *type, uint64_t c, reg dest);
+static Value vvalue(Gen *gen, TExpression *expression, reg dest);
+static void vvaluefree(Gen *gen, Value *val);
+static void vmul32(Gen *gen, Operand d, Operand s);
+static void gen_vcompare(Gen *gen, TBinary *binary, Type *type, reg dest);
+static void gen_vbinary(Gen *gen, TBinary *binary, Type *type, reg dest);
+static bool paired(const uint8_t *lanes, size_t n);
+static void gen_shuffle(Gen *gen, TUnary *unary, Type *type, reg dest);
+static void gen_vunary(Gen *gen, TUnary *unary, Type *type, reg dest);
+static void gen_lane(Gen *gen, TUnary *unary, Type *type, reg dest);
+static void gen_reduce(Gen *gen, TUnary *unary, Type *type, reg dest);
+static void gen_mask(Gen *gen, TUnary *unary, reg dest);
+static void gen_vexpr(Gen *gen, TExpression *expression, reg dest);
+static int casecmp_signed(const void *a, const void *b);
+static int casecmp_unsigned(const void *a, const void *b);
+static void cmpconst(Gen *gen, reg r, uint8_t w, uint64_t v);
+static void gen_jumptable(Gen *gen, SwitchCase *cases, size_t n, reg r, uint8_t w, label def);
+static void gen_cases(Gen *gen, SwitchCase *cases, size_t n, reg r, Type *type, label def);
+static void gen_switch(Gen *gen, TSwitch *sw, bool last);
+static void gen_branch(Gen *gen, TExpression *expression, bool jumpif, label target);
+static void defer(Gen *gen, TBlock *block, label at, label resume);
+static void gen_if(Gen *gen, TIf *tif, bool last);
+static void gen_while(Gen *gen, TWhile *loop);
+static void zero(Gen *gen, Operand dest, size_t size);
+static void gen_assign(Gen *gen, TAssign *assign);
+static void gen_vassign(Gen *gen, TAssign *assign, Operand home, Type *type);
+static void gen_store(Gen *gen, TExpression *place, TExpression *value, x86_op op, bool ordered);
+static void gen_check(Gen *gen, TCheck *check);
+static uint16_t asmregs(TAsm *tasm);
+static void shuffle(Gen *gen, Move *moves, size_t n);
+static Operand asmop(Gen *gen, TAsm *tasm, AsmOperand *operand, reg *regs, Operand *mems);
+static void gen_asm(Gen *gen, TAsm *tasm);
+static bool endsinreturn(TBlock *block);
+static void gen_block(Gen *gen, TBlock *block, bool last);
+static void gen_statement(Gen *gen, TStatement *statement, bool last);
+static void locals(Gen *gen, TBlock *block, size_t depth, Local **list, size_t *n);
+static int localcmp(const void *a, const void *b);
+static void gen_fun(Gen *gen, TFun *tfun, label entry, size_t sym);
+static void gen_clones(Gen *gen, size_t ndx);
+static int clonecmp(const void *a, const void *b);
+static void resolver(Gen *gen, Clone *clones, size_t nclones);
+static uint32_t native();
+static uint32_t supported(const uint32_t *words);
 
 Gen *gen_new()
 {
 	Gen *gen = alloct(Gen);
 	gen->tfile = NULL;
+	gen->unit = NULL;
 	gen->elf = NULL;
+	gen->enc = NULL;
+	gen->text = NULL;
+	gen->unlikely = NULL;
+	gen->rodata = NULL;
+	gen->rodatasize = 0;
+	gen->tableents = NULL;
+	gen->ntableents = 0;
+	gen->textsym = 0;
+	gen->rodatasym = 0;
+	gen->unlikelysym = 0;
+	gen->globalsyms = NULL;
+	gen->vars = NULL;
+	gen->funs = NULL;
+	gen->funsyms = NULL;
+	gen->frame = NULL;
+	gen->retlabel = 0;
+	gen->trap = 0;
+	gen->traps = false;
+	gen->depth = 0;
+	gen->framed = false;
+	gen->busy = 0;
+	gen->xbusy = 0;
+	gen->avx = false;
+	gen->ymm = false;
+	gen->saved = 0;
+	gen->colds = NULL;
+	gen->ncolds = 0;
+	gen->ncses = 0;
+	gen->funalign = GEN_ALIGN_DEFAULT;
+	gen->loopalign = GEN_ALIGN_DEFAULT;
+	gen->isa = 0;
+	gen->tls = TLS_LOCAL_EXEC;
+	gen->tune = sched_tune("generic");
+	gen->schedule = true;
+	gen->sched = NULL;
 
 	return gen;
 }
 
-void gen_run(Gen *gen, const char *srcpath, TFile *tfile)
+/* The extensions of a target named as -march= takes it; false if there is no such target */
+bool gen_march(const char *name, uint32_t *isa)
+{
+	if (!strcmp(name, "native")) {
+		*isa = native();
+		return true;
+	}
+
+	for (size_t i = 0; i < sizeof(marches) / sizeof(*marches); ++i) {
+		if (!strcmp(marches[i].name, name)) {
+			*isa = marches[i].isa;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* The extensions of the machine compiling, as CPUID reports them */
+static uint32_t native()
+{
+	unsigned int eax = 0;
+	unsigned int ebx = 0;
+	unsigned int ecx = 0;
+	unsigned int edx = 0;
+	uint32_t words[CPUID_NWORDS] = { 0 };
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		words[CPUID_1ECX] = ecx;
+	}
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		words[CPUID_7EBX] = ebx;
+	}
+
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+		words[CPUID_X1ECX] = ecx;
+	}
+
+	if (words[CPUID_1ECX] & bit_OSXSAVE) {
+		__asm__("xgetbv" : "=a"(words[CPUID_XCR0]) : "c"(0) : "edx");
+	}
+
+	return supported(words);
+}
+
+/* The extensions of which CPUID words have every bit set */
+static uint32_t supported(const uint32_t *words)
 {
-	const char *elfpath = fileext(srcpath);
+	uint32_t isa = 0;
+
+	for (size_t i = 0; i < sizeof(features) / sizeof(*features); ++i) {
+		isa |= features[i].isa;
+	}
+
+	for (size_t i = 0; i < sizeof(features) / sizeof(*features); ++i) {
+		if ((words[features[i].word] & features[i].bits) != features[i].bits) {
+			isa &= ~features[i].isa;
+		}
+	}
+
+	return isa;
+}
 
+/* Generate an object with the functions defined in 'unit', or all of them if it is NULL */
+void gen_run(Gen *gen, const char *elfpath, TFile *tfile, File *unit)
+{
 	gen->tfile = tfile;
+	gen->unit = unit;
 	gen->elf = elf_new(elfpath);
-	gen->stackoff = STACKOFF_DEFAULT;
+	gen->text = enc_new();
+	gen->unlikely = NULL;
+	gen->rodata = NULL;
+	gen->rodatasize = 0;
+	gen->tableents = NULL;
+	gen->ntableents = 0;
+	gen->frame = frame_new();
+	gen->vars = acalloc(tfile->ntvariables + 1, sizeof(Operand));
+	gen->funs = acalloc(tfile->ntfuns + 1, sizeof(label));
+	gen->funsyms = acalloc(tfile->ntfuns + 1, sizeof(size_t));
+	gen->globalsyms = acalloc(tfile->ntglobals + 1, sizeof(size_t));
+	gen->sched = gen->schedule ? sched_new(gen->tune) : NULL;
+
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		if (tfile->tfuns[i]->cold && emitted(gen, tfile->tfuns[i])) {
+			gen->unlikely = enc_new();
+		}
+	}
+
+	/* .text must be at least as aligned as anything placed in it */
+	size_t textalign = gen->funalign > gen->loopalign ? gen->funalign : gen->loopalign;
+	elf_add_section(gen->elf, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, textalign);
+	elf_add_section(gen->elf, ".rodata", SHT_PROGBITS, SHF_ALLOC, 8);
+	if (gen->unlikely) {
+		elf_add_section(gen->elf, ".text.unlikely", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, textalign);
+	}
+
+	/* Section symbols, which relocations between sections refer to */
+	elf_set_section(gen->elf, ".text");
+	gen->textsym = elf_add_symbol(gen->elf, SHN_CUR, "", STB_LOCAL, STT_SECTION, 0);
+	elf_set_section(gen->elf, ".rodata");
+	gen->rodatasym = elf_add_symbol(gen->elf, SHN_CUR, "", STB_LOCAL, STT_SECTION, 0);
+	if (gen->unlikely) {
+		elf_set_section(gen->elf, ".text.unlikely");
+		gen->unlikelysym = elf_add_symbol(gen->elf, SHN_CUR, "", STB_LOCAL, STT_SECTION, 0);
+	}
+
+	tls(gen);
+
+	/*
+	 * Every function gets its label and symbol up front, so calls may refer
+	 * forward; symbols get their values once the functions are placed. Those
+	 * of other objects get undefined symbols once called. Only an object of
+	 * the whole program can keep what is not exported to itself. The symbol
+	 * of a function with clones is that of their resolver.
+	 */
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		TFun *tfun = tfile->tfuns[i];
+		uint8_t binding = tfun->exported || unit ? STB_GLOBAL : STB_LOCAL;
+		uint8_t type = tfun->nclones ? STT_GNU_IFUNC : STT_FUNC;
+
+		if (!emitted(gen, tfun)) {
+			continue;
+		}
 
-	elf_add_section(gen->elf, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+		gen->funs[i] = enc_label(funenc(gen, tfun));
+		elf_set_section(gen->elf, funsection(tfun));
+		gen->funsyms[i] = elf_add_symbol(gen->elf, SHN_CUR, tfun->identifier.content, binding, type, 0);
+	}
 
 	for (size_t i = 0; i < tfile->ntfuns; ++i) {
-		gen_fun(gen, i);
+		TFun *tfun = tfile->tfuns[i];
+
+		if (emitted(gen, tfun) && tfun->nclones) {
+			gen_clones(gen, i);
+		} else if (emitted(gen, tfun)) {
+			gen_fun(gen, tfun, gen->funs[i], gen->funsyms[i]);
+		}
+	}
+
+	/*
+	 * Each section's code is encoded into one buffer, and handed to the ELF
+	 * writer at once; shortening jumps moves its symbols and relocations
+	 */
+	enc_resolve(gen->text);
+	elf_set_section(gen->elf, ".text");
+	elf_move(gen->elf, gen->text->movedfrom, gen->text->movedto, gen->text->nmoved);
+	elf_write(gen->elf, gen->text->code, gen->text->size);
+
+	if (gen->unlikely) {
+		enc_resolve(gen->unlikely);
+		elf_set_section(gen->elf, ".text.unlikely");
+		elf_move(gen->elf, gen->unlikely->movedfrom, gen->unlikely->movedto, gen->unlikely->nmoved);
+		elf_write(gen->elf, gen->unlikely->code, gen->unlikely->size);
+	}
+
+	/* Jump table entries hold the offset of their target from the table */
+	elf_set_section(gen->elf, ".rodata");
+	if (gen->rodatasize) {
+		elf_write(gen->elf, gen->rodata, gen->rodatasize);
+	}
+
+	for (size_t i = 0; i < gen->ntableents; ++i) {
+		TableEntry *entry = &gen->tableents[i];
+		int64_t target = enc_labelpos(entry->enc, entry->target);
+		size_t sym = entry->enc == gen->text ? gen->textsym : gen->unlikelysym;
+
+		elf_add_reloc(gen->elf, entry->at, R_X86_64_PC32, sym, target + (int64_t)(entry->at - entry->base));
 	}
 
 	elf_end(gen->elf);
@@ -70,183 +489,4339 @@ void gen_run(Gen *gen, const char *srcpath, TFile *tfile)
 void gen_reset(Gen *gen)
 {
 	gen->tfile = NULL;
+	gen->unit = NULL;
 	gen->elf = NULL;
+	gen->enc = NULL;
+	gen->text = NULL;
+	gen->unlikely = NULL;
+	gen->vars = NULL;
+	gen->funs = NULL;
+	gen->funsyms = NULL;
+	gen->globalsyms = NULL;
+	gen->sched = NULL;
+}
+
+static void emit(Gen *gen, x86_op op, Operand a, Operand b)
+{
+	emit3(gen, op, a, b, OPNONE);
+}
+
+static void emit3(Gen *gen, x86_op op, Operand a, Operand b, Operand c)
+{
+	Insn insn = {
+		.op = op,
+		.cc = CC_O,
+		.ops = { a, b, c },
+	};
+
+	issue(gen, insn);
 }
 
-static uint8_t stack(Gen *gen, uint8_t size)
+static void emitcc(Gen *gen, x86_op op, cond cc, Operand a, Operand b)
 {
-	uint8_t curr = gen->stackoff;
-	gen->stackoff += size;
-	return -curr;
+	Insn insn = {
+		.op = op,
+		.cc = cc,
+		.ops = { a, b, OPNONE },
+	};
+
+	issue(gen, insn);
 }
 
-static uint8_t modrm(uint8_t mod, uint8_t op, uint8_t rm)
+/* A VEX-encoded instruction of general purpose registers, as BMI2 has */
+static void emitbmi(Gen *gen, x86_op op, Operand a, Operand b, Operand c)
 {
-	uint8_t i = 0;
+	Insn insn = {
+		.op = op,
+		.cc = CC_O,
+		.vex = true,
+		.ops = { a, b, c },
+	};
+
+	issue(gen, insn);
+}
 
-	/* r/m */
-	NBITSET(i, 0, NBIT(rm, 0));
-	NBITSET(i, 1, NBIT(rm, 1));
-	NBITSET(i, 2, NBIT(rm, 2));
+/* An atomic access; xadd and cmpxchg are locked, as xchg is by itself */
+static void emitatomic(Gen *gen, x86_op op, Operand a, Operand b, bool ordered)
+{
+	Insn insn = {
+		.op = op,
+		.cc = CC_O,
+		.lock = op == X86_XADD || op == X86_CMPXCHG,
+		.ordered = ordered,
+		.ops = { a, b, OPNONE },
+	};
 
-	/* op */
-	NBITSET(i, 3, NBIT(op, 0));
-	NBITSET(i, 4, NBIT(op, 1));
-	NBITSET(i, 5, NBIT(op, 2));
+	issue(gen, insn);
+}
 
-	/* mod */
-	NBITSET(i, 6, NBIT(mod, 0));
-	NBITSET(i, 7, NBIT(mod, 1));
+/* Instructions go through the scheduler, up to the end of their basic block */
+static void issue(Gen *gen, Insn insn)
+{
+	if (gen->sched && !sched_barrier(insn)) {
+		sched_insn(gen->sched, gen->enc, insn);
+		return;
+	}
 
-	return i;
+	flush(gen);
+	encode(gen, insn);
 }
 
-static void gen_expr(Gen *gen, TExpression *expression, reg dest)
+/* Encode an instruction in place, past any the scheduler holds; those must be flushed first */
+static void encode(Gen *gen, Insn insn)
+{
+	enc_insn(gen->enc, insn);
+
+	/* Thread-locals of local-exec, at their offset from the thread pointer */
+	for (size_t i = 0; i < 3; ++i) {
+		if (insn.ops[i].kind == OPND_MEM && insn.ops[i].mem.sym) {
+			elf_add_reloc(gen->elf, gen->enc->ripdisp, R_X86_64_TPOFF32, insn.ops[i].mem.sym, insn.ops[i].mem.disp);
+		}
+	}
+}
+
+static void flush(Gen *gen)
+{
+	if (gen->sched) {
+		sched_flush(gen->sched, gen->enc);
+	}
+}
+
+/* A label starts a basic block */
+static void bind(Gen *gen, label l)
+{
+	flush(gen);
+	enc_bind(gen->enc, l);
+}
+
+static void align(Gen *gen, size_t n)
+{
+	flush(gen);
+	enc_align(gen->enc, n);
+}
+
+/* Take a free scratch register not in 'avoid', or NOREG if there is none */
+static reg regalloc(Gen *gen, uint16_t avoid)
+{
+	for (size_t i = 0; i < NSCRATCH; ++i) {
+		reg r = scratch[i];
+
+		if (!((gen->busy | avoid) & REGBIT(r))) {
+			gen->busy |= REGBIT(r);
+			return r;
+		}
+	}
+
+	return NOREG;
+}
+
+static void regfree(Gen *gen, reg r)
+{
+	gen->busy &= ~REGBIT(r);
+}
+
+/* Push those of 'regs' that are busy; restore() pops them again */
+static void save(Gen *gen, uint16_t regs)
+{
+	for (reg r = RAX; r <= R15; ++r) {
+		if (regs & gen->busy & REGBIT(r)) {
+			emit(gen, X86_PUSH, OPREG(r, 8), OPNONE);
+			gen->depth += 8;
+		}
+	}
+}
+
+static void restore(Gen *gen, uint16_t regs)
+{
+	for (reg r = R15 + 1; r-- > RAX;) {
+		if (regs & gen->busy & REGBIT(r)) {
+			emit(gen, X86_POP, OPREG(r, 8), OPNONE);
+			gen->depth -= 8;
+		}
+	}
+}
+
+/*
+ * A scratch register outside 'avoid', for a few instructions that need more
+ * than their operands; where none is free, a busy one is pushed around them
+ */
+static reg borrow(Gen *gen, uint16_t avoid, bool *pushed)
+{
+	reg r = regalloc(gen, avoid);
+	*pushed = r == NOREG;
+
+	for (size_t i = 0; i < NSCRATCH && r == NOREG; ++i) {
+		if (!(avoid & REGBIT(scratch[i]))) {
+			r = scratch[i];
+		}
+	}
+
+	if (*pushed) {
+		emit(gen, X86_PUSH, OPREG(r, 8), OPNONE);
+		gen->depth += 8;
+	}
+
+	return r;
+}
+
+static void giveback(Gen *gen, reg r, bool pushed)
+{
+	if (pushed) {
+		emit(gen, X86_POP, OPREG(r, 8), OPNONE);
+		gen->depth -= 8;
+	} else {
+		regfree(gen, r);
+	}
+}
+
+/* The general purpose registers an operand is, or addresses memory with */
+static uint16_t regsof(Operand op)
+{
+	uint16_t regs = 0;
+
+	if (op.kind == OPND_REG && op.size <= 8) {
+		regs |= REGBIT(op.reg);
+	} else if (op.kind == OPND_MEM) {
+		regs |= op.mem.base <= R15 ? REGBIT(op.mem.base) : 0;
+		regs |= op.mem.index <= R15 ? REGBIT(op.mem.index) : 0;
+	}
+
+	return regs;
+}
+
+/*
+ * Values live in registers in a canonical form: values narrower than 32 bits
+ * are zero- or sign-extended to 32 bits, which is also what gcc and clang
+ * expect of arguments. Arithmetic is therefore done at 32 or 64 bits.
+ */
+static uint8_t width(Type *type)
+{
+	return type->size == 8 ? 8 : 4;
+}
+
+/* Bring a register back into canonical form after arithmetic that may have left it */
+static void narrow(Gen *gen, Type *type, reg r)
+{
+	if (type->size == 1 || type->size == 2) {
+		emit(gen, type->signd ? X86_MOVSX : X86_MOVZX, OPREG(r, 4), OPREG(r, type->size));
+	}
+}
+
+static bool isconst(TExpression *expression)
+{
+	return expression->variant == TEXPRESSION_NUMLIT;
+}
+
+static uint64_t constval(TExpression *expression)
+{
+	return expression->number->u64;
+}
+
+static bool hascall(TExpression *expression)
 {
 	switch (expression->variant) {
-		case TEXPRESSION_NUMLIT: {
-			Number *number = expression->number;
-
-			uint8_t *data = NULL;
-			size_t ndata = 0;
-
-			switch (number->bits) {
-				case 8: {
-					uint8_t temp[] = {
-						0xB8 + dest,
-						number->u8,
-						0x00,
-						0x00,
-						0x00,
-					};
-					ndata = sizeof(temp);
-					data = acalloc(ndata, sizeof(uint8_t));
-					data = temp;
-					break;
-				}
+		case TEXPRESSION_CALL: return true;
+		case TEXPRESSION_BINARY: return hascall(expression->binary->lhs) || hascall(expression->binary->rhs);
+		case TEXPRESSION_UNARY: return hascall(expression->unary->operand);
+		case TEXPRESSION_FIELD: return hascall(expression->field->base);
+		case TEXPRESSION_INDEX: return hascall(expression->index->base) || hascall(expression->index->index);
+		default: return false;
+	}
+}
 
-				case 16: {
-					uint8_t temp[] = {
-						0xB8 + dest,
-						NBYTE(number->u16, 0),
-						NBYTE(number->u16, 1),
-						0x00,
-						0x00,
-					};
-					ndata = sizeof(temp);
-					data = acalloc(ndata, sizeof(uint8_t));
-					data = temp;
-					break;
-				}
+/* The expression a statement evaluates before anything else, if any */
+static TExpression *statement_expr(TStatement *statement)
+{
+	switch (statement->variant) {
+		case TSTATEMENT_RETURN:
+		case TSTATEMENT_BUILTIN: return statement->expr;
+		case TSTATEMENT_SWITCH: return statement->sw->expr;
+		case TSTATEMENT_IF: return statement->tif->cond;
+		case TSTATEMENT_VAR:
+		case TSTATEMENT_ASSIGN: return statement->assign->value;
+		case TSTATEMENT_STORE: return statement->store->value;
+		case TSTATEMENT_WHILE: return statement->loop->guard;
+		case TSTATEMENT_CHECK: return statement->check->index;
+		default: return NULL;
+	}
+}
 
-				case 32: {
-					uint8_t temp[] = {
-						0xB8 + dest,
-						NBYTE(number->u32, 0),
-						NBYTE(number->u32, 1),
-						NBYTE(number->u32, 2),
-						NBYTE(number->u32, 3),
-					};
-					ndata = sizeof(temp);
-					data = acalloc(ndata, sizeof(uint8_t));
-					data = temp;
-					break;
-				}
-				
-				case 64: {
-					uint8_t temp[] = {
-						0x48,
-						0xB8 + dest,
-						NBYTE(number->u64, 0),
-						NBYTE(number->u64, 1),
-						NBYTE(number->u64, 2),
-						NBYTE(number->u64, 3),
-						NBYTE(number->u64, 4),
-						NBYTE(number->u64, 5),
-						NBYTE(number->u64, 6),
-						NBYTE(number->u64, 7),
-					};
-
-					ndata = sizeof(temp);
-					data = acalloc(ndata, sizeof(uint8_t));
-					data = temp;
-					break;
-				}
-				default: break;
+/* The blocks nested directly in a statement, in order; NULL past the last */
+static TBlock *statement_block(TStatement *statement, size_t i)
+{
+	switch (statement->variant) {
+		case TSTATEMENT_SWITCH: {
+			TSwitch *sw = statement->sw;
+			return i < sw->ncases ? sw->cases[i]->block : i == sw->ncases ? sw->def : NULL;
+		}
+		case TSTATEMENT_IF: return i == 0 ? statement->tif->then : i == 1 ? statement->tif->els : NULL;
+		case TSTATEMENT_WHILE: return i == 0 ? statement->loop->pre : i == 1 ? statement->loop->block : NULL;
+		default: return NULL;
+	}
+}
+
+/* Whether a block makes no calls; a leaf keeps its arguments in their registers */
+static bool isleaf(TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+		TExpression *expr = statement_expr(statement);
+
+		if (expr && hascall(expr)) {
+			return false;
+		}
+
+		/* The place of a store is evaluated after its value, and may make calls of its own */
+		if (statement->variant == TSTATEMENT_STORE && hascall(statement->store->place)) {
+			return false;
+		}
+
+		TBlock *nested = NULL;
+		for (size_t j = 0; (nested = statement_block(statement, j)); ++j) {
+			if (!isleaf(nested)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool callscold(Gen *gen, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			if (gen->tfile->tfuns[expression->call->fun]->cold) {
+				return true;
 			}
 
-			if (!data) {
-				err_internal("data is NULL, some fatal error has occurred; sign=%d, bits=%ld", number->sig, number->bits);
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				if (callscold(gen, expression->call->args[i])) {
+					return true;
+				}
 			}
-			elf_write(gen->elf, data, ndata);
 
-			break;
+			return false;
 		}
-		default: break;
+		case TEXPRESSION_BINARY: return callscold(gen, expression->binary->lhs) || callscold(gen, expression->binary->rhs);
+		case TEXPRESSION_UNARY: return callscold(gen, expression->unary->operand);
+		case TEXPRESSION_FIELD: return callscold(gen, expression->field->base);
+		case TEXPRESSION_INDEX: return callscold(gen, expression->index->base) || callscold(gen, expression->index->index);
+		default: return false;
 	}
 }
 
-static void gen_statement(Gen *gen, TStatement *statement)
+/* Whether a block calls a cold function, directly or in a nested block; such blocks are assumed rarely taken */
+static bool iscold(Gen *gen, TBlock *block)
 {
-	switch (statement->variant) {
-		case TSTATEMENT_RETURN: {
-			gen_expr(gen, statement->expr, RAX);
-			break;
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+		TExpression *expr = statement_expr(statement);
+
+		if (expr && callscold(gen, expr)) {
+			return true;
+		}
+
+		if (statement->variant == TSTATEMENT_STORE && callscold(gen, statement->store->place)) {
+			return true;
+		}
+
+		TBlock *nested = NULL;
+		for (size_t j = 0; (nested = statement_block(statement, j)); ++j) {
+			if (iscold(gen, nested)) {
+				return true;
+			}
 		}
-		default: break;
 	}
+
+	return false;
 }
 
-static void gen_fun(Gen *gen, size_t ndx)
+/* Whether a function is in the object being generated; dead ones are in none */
+static bool emitted(Gen *gen, TFun *tfun)
 {
-	TFun *tfun = gen->tfile->tfuns[ndx];
+	return tfun->live && (!gen->unit || tfun->file == gen->unit);
+}
 
-	elf_set_section(gen->elf, ".text");
+/* Cold functions are kept apart from the rest, in .text.unlikely; NULL for those in other objects */
+static Enc *funenc(Gen *gen, TFun *tfun)
+{
+	if (!emitted(gen, tfun)) {
+		return NULL;
+	}
 
-	size_t value = gen->elf->sections[gen->elf->secndx]->header.size;
+	return tfun->cold ? gen->unlikely : gen->text;
+}
 
-	elf_add_symbol(gen->elf, SHN_CUR, tfun->identifier.content, STB_GLOBAL, STT_FUNC, value);
+static const char *funsection(TFun *tfun)
+{
+	return tfun->cold ? ".text.unlikely" : ".text";
+}
 
-	uint8_t prologue[] = {
-		0x55, 			/* push %rbp */
-		0x48, 0x89, 0xE5 	/* mov %rsi, %rbp */
-	};
-	elf_write(gen->elf, prologue, sizeof(prologue));
+/*
+ * The thread-locals this object defines: those with an initial value in
+ * .tdata, which each thread's copy is made from, and the rest in .tbss,
+ * which is zeroed. Each section is as aligned as the most aligned in it.
+ */
+static void tls(Gen *gen)
+{
+	TFile *tfile = gen->tfile;
+	size_t align[2] = { 0, 0 }; /* of .tbss and .tdata; 0 while empty */
+	size_t at[2] = { 0, 0 };
+
+	for (size_t pass = 0; pass < 2; ++pass) {
+		if (pass && align[1]) {
+			elf_add_section(gen->elf, ".tdata", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE | SHF_TLS, align[1]);
+		}
+
+		if (pass && align[0]) {
+			elf_add_section(gen->elf, ".tbss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE | SHF_TLS, align[0]);
+		}
 
-	/* Move parameters onto stack */
-	Scope *scope = gen->tfile->scopes[tfun->scope];
-	for (size_t i = 0; i < scope->nvars; ++i) {
-		TVariable *v = gen->tfile->tvariables[scope->vars[i]];
-		Type *t = gen->tfile->types[v->type];
+		for (size_t i = 0; i < tfile->ntglobals; ++i) {
+			TGlobal *g = tfile->tglobals[i];
+			Type *type = tfile->types[g->type];
+			size_t a = g->align > type->align ? g->align : type->align;
+			bool data = g->value != 0;
 
-		uint8_t data[] = {
-			0x48, 0x89, modrm(1, paramreg[i], RBP), stack(gen, t->size),
-		};
+			if (gen->unit && g->file != gen->unit) {
+				continue;
+			}
+
+			if (!pass) {
+				align[data] = a > align[data] ? a : align[data];
+				continue;
+			}
+
+			size_t pad = (a - at[data] % a) % a;
+			elf_set_section(gen->elf, data ? ".tdata" : ".tbss");
 
-		elf_write(gen->elf, data, sizeof(data));
+			if (data) {
+				uint8_t *bytes = acalloc(pad + type->size, sizeof(uint8_t));
+				memcpy(bytes + pad, &g->value, type->size);
+				elf_write(gen->elf, bytes, pad + type->size);
+				afree(bytes);
+			} else {
+				elf_reserve(gen->elf, pad + type->size);
+			}
+
+			at[data] += pad;
+			gen->globalsyms[i] = elf_add_symbol(gen->elf, SHN_CUR, g->identifier.content, STB_GLOBAL, STT_TLS, at[data]);
+			elf_set_symbol_size(gen->elf, gen->globalsyms[i], type->size);
+			at[data] += type->size;
+		}
 	}
+}
 
-	for (size_t i = 0; i < tfun->block->nstatements; ++i) {
-		TStatement *statement = tfun->block->statements[i];
-		gen_statement(gen, statement);
+/* The symbol of a thread-local; those of other objects get undefined ones once used */
+static size_t globalsym(Gen *gen, globalndx global)
+{
+	if (!gen->globalsyms[global]) {
+		const char *name = gen->tfile->tglobals[global]->identifier.content;
+		gen->globalsyms[global] = elf_add_symbol(gen->elf, SHN_UNDEF, name, STB_GLOBAL, STT_TLS, 0);
 	}
 
-	elf_set_section(gen->elf, ".text");
-	uint8_t epilogue[] = {
-		0x5D, 			/* pop %rbp */
-		0xC3, 			/* ret */
-	};
-	elf_write(gen->elf, epilogue, sizeof(epilogue));
+	return gen->globalsyms[global];
+}
+
+/*
+ * Find the common subexpressions of a statement: binary and unary nodes that
+ * the typechecker found more than one use of. In statements without calls
+ * they are kept in scratch registers, taken when they are first computed and
+ * freed after their last use; in statements with calls they are kept in
+ * callee-saved registers, reserved up front, so that calls preserve them.
+ */
+static void cse_collect(Gen *gen, TExpression *expression, bool fixed)
+{
+	if (cse_find(gen, expression)) {
+		return;
+	}
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			/* Repeated calls are one node only where the function is pure */
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				cse_collect(gen, expression->call->args[i], fixed);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			cse_collect(gen, expression->binary->lhs, fixed);
+			cse_collect(gen, expression->binary->rhs, fixed);
+			break;
+		}
+		case TEXPRESSION_UNARY: cse_collect(gen, expression->unary->operand, fixed); break;
+		case TEXPRESSION_FIELD: cse_collect(gen, expression->field->base, fixed); return;
+		case TEXPRESSION_INDEX: {
+			/* Loads are used in place, like variables; only their indexes may be shared */
+			cse_collect(gen, expression->index->base, fixed);
+			cse_collect(gen, expression->index->index, fixed);
+			return;
+		}
+		default: return;
+	}
+
+	/* Vectors are recomputed; they would take XMM registers, which calls do not preserve */
+	size_t limit = fixed ? NCALLEESAVED : GEN_MAXCSE;
+	if (expression->uses < 2 || gen->ncses == limit || gen->tfile->types[expression->type]->kind == TYPE_VECTOR) {
+		return;
+	}
 
-	gen->stackoff = STACKOFF_DEFAULT;
+	Cse *cse = &gen->cses[gen->ncses];
+	cse->expr = expression;
+	cse->reg = fixed ? calleesaved[gen->ncses] : NOREG;
+	cse->left = 0;
+	cse->ready = false;
+	cse->fixed = fixed;
+	++gen->ncses;
 }
 
-static const char *fileext(const char *path)
+static Cse *cse_find(Gen *gen, TExpression *expression)
 {
-	size_t length = strlen(path);
-	char *res = acalloc(length + 2, sizeof(char));
-	res = strdup(path);
-	strncat(res, ".o", 3);
+	for (size_t i = 0; i < gen->ncses; ++i) {
+		if (gen->cses[i].expr == expression) {
+			return &gen->cses[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Keep a just-computed common subexpression for its later uses */
+static void cse_keep(Gen *gen, Cse *cse, Type *type, reg src)
+{
+	if (!cse->fixed && (cse->reg = regalloc(gen, REGBIT(src))) == NOREG) {
+		return;
+	}
+
+	emit(gen, X86_MOV, OPREG(cse->reg, width(type)), OPREG(src, width(type)));
+	cse->left = cse->expr->uses - 1;
+	cse->ready = true;
+}
+
+static void cse_use(Gen *gen, Cse *cse)
+{
+	if (--cse->left == 0) {
+		cse->ready = false;
+
+		if (!cse->fixed) {
+			regfree(gen, cse->reg);
+		}
+	}
+}
+
+/* Forget the common subexpressions of a statement; any left unused (none should be) are freed */
+static void cse_drop(Gen *gen)
+{
+	for (size_t i = 0; i < gen->ncses; ++i) {
+		if (gen->cses[i].ready && !gen->cses[i].fixed) {
+			regfree(gen, gen->cses[i].reg);
+		}
+	}
+
+	gen->ncses = 0;
+}
+
+/* Mark the callee-saved registers the common subexpressions of an expression need as used */
+static void cse_reserve(Gen *gen, TExpression *expression)
+{
+	gen->ncses = 0;
+	if (hascall(expression)) {
+		cse_collect(gen, expression, true);
+	}
+
+	for (size_t i = 0; i < gen->ncses; ++i) {
+		gen->saved |= REGBIT(gen->cses[i].reg);
+	}
+}
+
+/* Find the callee-saved registers the statements of a block (and those nested in it) use */
+static void cse_scan(Gen *gen, TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+		TExpression *expr = statement_expr(statement);
+
+		if (expr) {
+			cse_reserve(gen, expr);
+		}
+
+		/* Callee-saved registers an asm statement names are the function's to save */
+		if (statement->variant == TSTATEMENT_ASM) {
+			for (size_t j = 0; j < NCALLEESAVED; ++j) {
+				gen->saved |= asmregs(statement->tasm) & REGBIT(calleesaved[j]);
+			}
+		}
+
+		/* A loop's condition is evaluated again at its bottom, in another form */
+		if (statement->variant == TSTATEMENT_WHILE) {
+			cse_reserve(gen, statement->loop->cond);
+		}
+
+		TBlock *nested = NULL;
+		for (size_t j = 0; (nested = statement_block(statement, j)); ++j) {
+			cse_scan(gen, nested);
+		}
+	}
+
+	gen->ncses = 0;
+}
+
+/* Load a value of some type into a register, in canonical form */
+static void load(Gen *gen, Operand src, Type *type, reg dest)
+{
+	src.size = type->size;
+
+	switch (type->size) {
+		case 1:
+		case 2: emit(gen, type->signd ? X86_MOVSX : X86_MOVZX, OPREG(dest, 4), src); break;
+		case 4:
+		case 8: {
+			if (src.kind != OPND_REG || src.reg != dest) {
+				emit(gen, X86_MOV, OPREG(dest, type->size), src);
+			}
+			break;
+		}
+		default: err_internal("cannot load a value of %ld bytes", type->size);
+	}
+}
+
+/* Where indexes out of bounds go: a ud2 after the rest of the function */
+static label trap(Gen *gen)
+{
+	if (!gen->traps) {
+		gen->trap = enc_label(gen->enc);
+		gen->traps = true;
+	}
+
+	return gen->trap;
+}
+
+/* Multiply a 64-bit register by a constant */
+static void scale(Gen *gen, reg r, size_t by)
+{
+	if (by & (by - 1)) {
+		emit3(gen, X86_IMUL, OPREG(r, 8), OPREG(r, 8), OPIMM(by));
+	} else if (by > 1) {
+		emit(gen, X86_SHL, OPREG(r, 8), OPIMM(__builtin_ctzll(by)));
+	}
+}
+
+/*
+ * Whether a place is addressed without a register: a variable, or a field or
+ * constant element of one. Elements of a slice are at an address it holds,
+ * and thread-locals are too, but for local-exec.
+ */
+static bool direct(Gen *gen, TExpression *place)
+{
+	switch (place->variant) {
+		case TEXPRESSION_VARIABLE: return gen->tfile->types[place->type]->kind != TYPE_SLICE;
+		case TEXPRESSION_GLOBAL: return gen->tls == TLS_LOCAL_EXEC;
+		case TEXPRESSION_FIELD: return direct(gen, place->field->base);
+		case TEXPRESSION_INDEX: return isconst(place->index->index) && direct(gen, place->index->base);
+		default: return false;
+	}
+}
+
+/* Whether a value is loaded from memory, at an address() that may be used in place of the load */
+static bool inmemory(Gen *gen, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: return gen->vars[expression->var].kind == OPND_MEM && fusable(gen, expression);
+		case TEXPRESSION_GLOBAL:
+		case TEXPRESSION_FIELD:
+		case TEXPRESSION_INDEX: return fusable(gen, expression);
+		default: return false;
+	}
+}
+
+/*
+ * Where a variable or thread-local, or a field or element of one, lives.
+ * Fields are at a fixed displacement from their struct; elements at a
+ * variable index take 'dest', which must be free, as the index register, and
+ * it stays in use until the operand is. A thread-local is at an offset from
+ * the thread pointer the linker fills in, or, under initial-exec, loads
+ * into 'dest' from the GOT.
+ */
+static Operand address(Gen *gen, TExpression *place, reg dest)
+{
+	Operand op = OPNONE;
+
+	switch (place->variant) {
+		case TEXPRESSION_VARIABLE: return gen->vars[place->var];
+		case TEXPRESSION_GLOBAL: {
+			size_t sym = globalsym(gen, place->global);
+
+			if (gen->tls == TLS_LOCAL_EXEC) {
+				op = OPMEM(NOREG, NOREG, 1, 0, 0);
+				op.mem.sym = sym;
+			} else {
+				emit(gen, X86_MOV, OPREG(dest, 8), OPMEM(RIP, NOREG, 1, 0, 8));
+				elf_add_reloc(gen->elf, gen->enc->ripdisp, R_X86_64_GOTTPOFF, sym, -(int64_t)(gen->enc->size - gen->enc->ripdisp));
+				op = OPMEM(dest, NOREG, 1, 0, 0);
+			}
+
+			op.mem.fs = true;
+			break;
+		}
+		case TEXPRESSION_FIELD: {
+			op = address(gen, place->field->base, dest);
+			op.mem.disp += place->field->offset;
+			break;
+		}
+		case TEXPRESSION_INDEX: op = element(gen, place->index, dest); break;
+		default: err_internal("cannot take the address of an expression");
+	}
+
+	op.size = gen->tfile->types[place->type]->size;
+	return op;
+}
+
+/*
+ * An element of an array: the index is checked against the length, unless
+ * it need not be, and scaled by the stride. The addressing mode scales by 1,
+ * 2, 4 or 8 itself; an element of an element (of an array of arrays) adds a
+ * second index to the first, which is first turned into bytes. The elements
+ * of a slice are based at its pointer, which is loaded into 'dest' unless it
+ * is in a register already, and then the index is added to that likewise.
+ */
+static Operand element(Gen *gen, TIndex *index, reg dest)
+{
+	bool slice = gen->tfile->types[index->base->type]->kind == TYPE_SLICE;
+	Operand op = OPNONE;
+
+	if (!slice) {
+		op = address(gen, index->base, dest);
+	} else if (gen->vars[index->base->var].kind == OPND_REG) {
+		op = OPMEM(gen->vars[index->base->var].reg, NOREG, 1, 0, 0);
+	} else {
+		Operand ptr = gen->vars[index->base->var];
+		ptr.size = 8;
+
+		emit(gen, X86_MOV, OPREG(dest, 8), ptr);
+		op = OPMEM(dest, NOREG, 1, 0, 0);
+	}
+
+	op.mem.disp += index->offset;
+
+	if (isconst(index->index) && !(slice && index->checked)) {
+		uint64_t c = constval(index->index);
+
+		/* Constants are checked by the typechecker, but may since have been put in place of a parameter */
+		if (index->checked && c >= index->length) {
+			emit(gen, X86_JMP, OPLABEL(trap(gen)), OPNONE);
+		} else {
+			op.mem.disp += c * index->stride;
+		}
+
+		return op;
+	}
+
+	bool simple = index->stride == 1 || index->stride == 2 || index->stride == 4 || index->stride == 8;
+	bool taken = op.mem.index != NOREG || op.mem.base == dest;
+	reg r = dest;
+
+	if (taken) {
+		if (op.mem.index != NOREG) {
+			scale(gen, dest, op.mem.scale);
+			op.mem.scale = 1;
+		}
+
+		gen->busy |= REGBIT(dest);
+		if ((r = regalloc(gen, 0)) == NOREG) {
+			/* Keep the first index on the stack while the second is computed */
+			emit(gen, X86_PUSH, OPREG(dest, 8), OPNONE);
+			gen->depth += 8;
+			regfree(gen, dest);
+			r = dest;
+		} else {
+			regfree(gen, r);
+		}
+	}
+
+	gen_expr(gen, index->index, r);
+
+	if (index->checked && slice) {
+		Type *itype = gen->tfile->types[index->index->type];
+		Operand length = gen->vars[gen->tfile->tvariables[index->base->var]->length];
+		length.size = 8;
+
+		/* A slice may be longer than a narrow index can count; a negative one must not wrap into it */
+		if (itype->signd && itype->size < 8) {
+			emit(gen, X86_MOVSXD, OPREG(r, 8), OPREG(r, 4));
+		}
+
+		emit(gen, X86_CMP, OPREG(r, 8), length);
+		emitcc(gen, X86_JCC, CC_AE, OPLABEL(trap(gen)), OPNONE);
+	} else if (index->checked) {
+		emit(gen, X86_CMP, OPREG(r, 8), OPIMM(index->length));
+		emitcc(gen, X86_JCC, CC_AE, OPLABEL(trap(gen)), OPNONE);
+	}
+
+	if (!taken) {
+		if (!simple) {
+			scale(gen, r, index->stride);
+		}
+
+		op.mem.index = r;
+		op.mem.scale = simple ? index->stride : 1;
+	} else if (r == dest) {
+		scale(gen, dest, index->stride);
+		emit(gen, X86_ADD, OPREG(dest, 8), OPMEM(RSP, NOREG, 1, 0, 8));
+		emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(8));
+		gen->depth -= 8;
+	} else if (simple) {
+		emit(gen, X86_LEA, OPREG(dest, 8), OPMEM(dest, r, index->stride, 0, 0));
+		regfree(gen, dest);
+	} else {
+		scale(gen, r, index->stride);
+		emit(gen, X86_ADD, OPREG(dest, 8), OPREG(r, 8));
+		regfree(gen, dest);
+	}
+
+	return op;
+}
+
+/*
+ * Evaluate the right-hand operand of an operation whose left-hand operand is
+ * in 'dest'. Constants and full-width variables are used in place; anything
+ * else is evaluated into a scratch register outside 'avoid', or, if none is
+ * free, into 'dest' after pushing the left-hand operand, the two being
+ * swapped afterwards so the operand ends up in the spill slot.
+ */
+static Value value(Gen *gen, TExpression *expression, uint16_t avoid, bool noimm, reg dest)
+{
+	Type *type = gen->tfile->types[expression->type];
+	uint8_t w = width(type);
+	Value val = { .op = OPNONE, .temp = false, .spill = 0 };
+	Cse *cse = cse_find(gen, expression);
+
+	if (cse && cse->ready) {
+		val.op = OPREG(cse->reg, w);
+
+		/* A scratch register is freed with the Value after its last use */
+		if (cse->left == 1 && !cse->fixed) {
+			cse->left = 0;
+			cse->ready = false;
+			val.temp = true;
+		} else {
+			cse_use(gen, cse);
+		}
+
+		return val;
+	}
+
+	if (!noimm && isconst(expression)) {
+		int64_t c = (int64_t)constval(expression);
+
+		if ((w == 4 && (uint64_t)c <= UINT32_MAX) || (c >= INT32_MIN && c <= INT32_MAX)) {
+			val.op = OPIMM(c);
+			return val;
+		}
+	}
+
+	if (direct(gen, expression) && type->size >= 4) {
+		Operand home = address(gen, expression, NOREG);
+
+		if (home.kind == OPND_MEM || !(avoid & REGBIT(home.reg))) {
+			val.op = home;
+			return val;
+		}
+	}
+
+	reg r = regalloc(gen, avoid);
+	if (r != NOREG) {
+		regfree(gen, r);
+		gen_expr(gen, expression, r);
+		gen->busy |= REGBIT(r);
+
+		val.op = OPREG(r, w);
+		val.temp = true;
+		return val;
+	}
+
+	emit(gen, X86_PUSH, OPREG(dest, 8), OPNONE);
+	gen->depth += 8;
+	regfree(gen, dest);
+
+	gen_expr(gen, expression, dest);
+	emit(gen, X86_XCHG, OPMEM(RSP, NOREG, 1, 0, 8), OPREG(dest, 8));
+	gen->busy |= REGBIT(dest);
+
+	val.spill = gen->depth;
+	val.op = OPMEM(RSP, NOREG, 1, 0, w);
+	return val;
+}
+
+/* The operand of a Value, at some size; spill slots move as the stack does */
+static Operand valueop(Gen *gen, Value *val, uint8_t size)
+{
+	Operand op = val->op;
+
+	if (val->spill) {
+		op.mem.disp = gen->depth - val->spill;
+	}
+
+	if (op.kind == OPND_REG || op.kind == OPND_MEM) {
+		op.size = size;
+	}
+
+	return op;
+}
+
+static void valuefree(Gen *gen, Value *val)
+{
+	if (val->temp) {
+		regfree(gen, val->op.reg);
+	}
+
+	if (val->spill) {
+		emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(8));
+		gen->depth -= 8;
+	}
+}
+
+/*
+ * Multiplication by a constant, with shifts and lea where they are shorter
+ * than imul (3 cycles): 2^k, {3,5,9}, {3,5,9} * 2^k, {3,5,9} * {3,5,9} and
+ * 2^k +/- 1. Returns false if none of these apply.
+ */
+static bool mulconst(Gen *gen, TExpression *lhs, uint64_t c, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	uint64_t mask = (w == 8 ? UINT64_MAX : UINT32_MAX);
+	c &= mask;
+
+	Operand d = OPREG(dest, w);
+	int k = __builtin_ctzll(c | ((uint64_t)1 << 63));
+	uint64_t odd = c >> k;
+
+	/* One lea: x * {3,5,9} is [x + x*{2,4,8}] */
+	#define LEA(m) emit(gen, X86_LEA, d, OPMEM(dest, dest, (m) - 1, 0, 0))
+	#define ISLEA(m) ((m) == 3 || (m) == 5 || (m) == 9)
+
+	int plan = 0;
+	uint64_t a = 0;
+	uint64_t b = 0;
+	reg t = NOREG;
+
+	if (c == 0 || c == 1 || odd == 1) {
+		plan = 1;
+	} else if (ISLEA(odd)) {
+		plan = 2;
+	} else if (k == 0 && ((ISLEA(a = 3) && c % 3 == 0 && ISLEA(b = c / 3))
+			|| (ISLEA(a = 5) && c % 5 == 0 && ISLEA(b = c / 5))
+			|| (ISLEA(a = 9) && c % 9 == 0 && ISLEA(b = c / 9)))) {
+		plan = 3;
+	} else if (k == 0 && ((((c - 1) & (c - 2)) == 0) || (((c + 1) & c) == 0 && c != mask))) {
+		/* 2^k + 1 or 2^k - 1; needs a second register */
+		t = regalloc(gen, REGBIT(dest));
+		plan = (t == NOREG ? 0 : 4);
+	}
+
+	if (!plan) {
+		return false;
+	}
+
+	gen_expr(gen, lhs, dest);
+
+	switch (plan) {
+		case 1: {
+			if (c == 0) {
+				emit(gen, X86_XOR, OPREG(dest, 4), OPREG(dest, 4));
+			} else if (k > 0) {
+				emit(gen, X86_SHL, d, OPIMM(k));
+			}
+			break;
+		}
+		case 2: {
+			LEA(odd);
+			if (k > 0) {
+				emit(gen, X86_SHL, d, OPIMM(k));
+			}
+			break;
+		}
+		case 3: {
+			LEA(a);
+			LEA(b);
+			break;
+		}
+		case 4: {
+			bool plus = ((c - 1) & (c - 2)) == 0;
+			int sh = __builtin_ctzll(plus ? c - 1 : c + 1);
+
+			emit(gen, X86_MOV, OPREG(t, w), d);
+			emit(gen, X86_SHL, d, OPIMM(sh));
+			emit(gen, plus ? X86_ADD : X86_SUB, d, OPREG(t, w));
+			regfree(gen, t);
+			break;
+		}
+	}
+
+	#undef LEA
+	#undef ISLEA
+
+	narrow(gen, type, dest);
+	return true;
+}
+
+/*
+ * Magic number for unsigned division by d of values below 2^n (Granlund and
+ * Montgomery; Hacker's Delight, 10-9): the smallest s for which
+ * m = ceil(2^(n+s) / d) satisfies m*d - 2^(n+s) <= 2^s, so that
+ * x / d == (x * m) >> (n + s) for every x < 2^n. m may take n + 1 bits.
+ */
+static void magicu(uint64_t d, int n, uint128 *m, int *s)
+{
+	for (int sh = 0;; ++sh) {
+		uint128 p = (uint128)1 << (n + sh);
+		uint128 mm = (p + d - 1) / d;
+
+		if (mm * d - p <= ((uint128)1 << sh)) {
+			*m = mm;
+			*s = sh;
+			return;
+		}
+	}
+}
+
+/*
+ * Division and modulo by a constant, without div (20-40 cycles):
+ *
+ *  - unsigned by 2^k: shr, or and with 2^k - 1
+ *  - unsigned by anything else: multiply-high by a magic number; 32-bit
+ *    values whose magic fits 32 bits need only imul and shr
+ *  - signed by 2^k: an arithmetic shift, biased by 2^k - 1 for negative values
+ *    so that the quotient rounds towards zero
+ *
+ * The remainder is x - (x / d) * d. Returns false if none of these apply.
+ */
+static bool divconst(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	bool mod = binary->op == BINOP_MOD;
+	uint8_t w = width(type);
+	int n = w * 8;
+	uint64_t d = constval(binary->rhs) & (w == 8 ? UINT64_MAX : UINT32_MAX);
+	Operand x = OPREG(dest, w);
+
+	if (d == 0 || (type->signd && (d >> (n - 1)))) {
+		return false;
+	}
+
+	bool pow2 = (d & (d - 1)) == 0;
+	int k = __builtin_ctzll(d);
+
+	if (d == 1) {
+		gen_expr(gen, binary->lhs, dest);
+		if (mod) {
+			emit(gen, X86_XOR, OPREG(dest, 4), OPREG(dest, 4));
+		}
+		return true;
+	}
+
+	if (!type->signd && pow2) {
+		gen_expr(gen, binary->lhs, dest);
+
+		if (!mod) {
+			emit(gen, X86_SHR, x, OPIMM(k));
+		} else if (k < 32) {
+			emit(gen, X86_AND, x, OPIMM((int64_t)(d - 1)));
+		} else {
+			emit(gen, X86_SHL, x, OPIMM(n - k));
+			emit(gen, X86_SHR, x, OPIMM(n - k));
+		}
+
+		return true;
+	}
+
+	if (type->signd) {
+		if (!pow2) {
+			return false;
+		}
+
+		reg t = regalloc(gen, REGBIT(dest));
+		if (t == NOREG) {
+			return false;
+		}
+
+		gen_expr(gen, binary->lhs, dest);
+		gen->busy |= REGBIT(dest);
+
+		/* t = x + (x < 0 ? 2^k - 1 : 0) */
+		Operand bias = OPREG(t, w);
+		emit(gen, X86_MOV, bias, x);
+		if (k > 1) {
+			emit(gen, X86_SAR, bias, OPIMM(n - 1));
+		}
+		emit(gen, X86_SHR, bias, OPIMM(n - k));
+		emit(gen, X86_ADD, bias, x);
+
+		if (!mod) {
+			emit(gen, X86_SAR, bias, OPIMM(k));
+			emit(gen, X86_MOV, x, bias);
+		} else {
+			if (k < 32) {
+				emit(gen, X86_AND, bias, OPIMM(-(int64_t)d));
+			} else {
+				emit(gen, X86_SHR, bias, OPIMM(k));
+				emit(gen, X86_SHL, bias, OPIMM(k));
+			}
+			emit(gen, X86_SUB, x, bias);
+		}
+
+		gen->busy &= ~(REGBIT(dest) | REGBIT(t));
+		narrow(gen, type, dest);
+		return true;
+	}
+
+	/* Unsigned division by a constant that is not a power of two */
+	uint128 m = 0;
+	int s = 0;
+
+	if (n == 64 && (d >> 63)) {
+		return false;
+	}
+
+	magicu(d, n, &m, &s);
+
+	/* 32-bit values: (x * m) >> (32 + s) fits in 64 bits when m does in 32 */
+	if (n == 32 && m <= UINT32_MAX) {
+		reg q = dest;
+		reg c = NOREG;
+
+		if (mod && (q = regalloc(gen, REGBIT(dest))) == NOREG) {
+			goto mulhi;
+		}
+		if ((m > INT32_MAX || (mod && d > INT32_MAX)) && (c = regalloc(gen, REGBIT(dest) | REGBIT(q))) == NOREG) {
+			if (q != dest) regfree(gen, q);
+			goto mulhi;
+		}
+
+		gen_expr(gen, binary->lhs, dest);
+		gen->busy |= REGBIT(dest);
+
+		if (q != dest) {
+			emit(gen, X86_MOV, OPREG(q, 4), x);
+		}
+
+		if (c == NOREG) {
+			emit3(gen, X86_IMUL, OPREG(q, 8), OPREG(q, 8), OPIMM((int64_t)m));
+		} else {
+			emit(gen, X86_MOV, OPREG(c, 4), OPIMM((int64_t)m));
+			emit(gen, X86_IMUL, OPREG(q, 8), OPREG(c, 8));
+		}
+
+		emit(gen, X86_SHR, OPREG(q, 8), OPIMM(32 + s));
+
+		if (mod) {
+			if (d <= INT32_MAX) {
+				emit3(gen, X86_IMUL, OPREG(q, 4), OPREG(q, 4), OPIMM((int64_t)d));
+			} else {
+				emit(gen, X86_MOV, OPREG(c, 4), OPIMM((int64_t)d));
+				emit(gen, X86_IMUL, OPREG(q, 4), OPREG(c, 4));
+			}
+			emit(gen, X86_SUB, x, OPREG(q, 4));
+		}
+
+		gen->busy &= ~(REGBIT(dest) | REGBIT(q) | (c != NOREG ? REGBIT(c) : 0));
+		return true;
+	}
+
+mulhi:;
+	/*
+	 * rdx = (x * M) >> 64. For 32-bit values M = floor(2^64 / d) + 1 is exact;
+	 * 64-bit values use m from magicu(), which may be 65 bits, in which case
+	 * the quotient is (((x - t) >> 1) + t) >> (s - 1), with t = (x * (m - 2^64)) >> 64.
+	 */
+	uint64_t M = 0;
+	bool addind = false;
+
+	if (n == 32) {
+		M = (uint64_t)(((uint128)1 << 64) / d + 1);
+		s = 0;
+	} else {
+		addind = m >> 64;
+		M = (uint64_t)m;
+	}
+
+	gen_expr(gen, binary->lhs, dest);
+	gen->busy |= REGBIT(dest);
+
+	uint16_t clobber = (REGBIT(RAX) | REGBIT(RDX)) & ~REGBIT(dest);
+	save(gen, clobber);
+
+	bool keepx = addind || mod;
+	if (keepx) {
+		emit(gen, X86_PUSH, OPREG(dest, 8), OPNONE);
+		gen->depth += 8;
+	}
+
+	reg src = dest;
+	if (dest == RAX) {
+		emit(gen, X86_MOV, OPREG(RDX, 8), OPREG(RAX, 8));
+		src = RDX;
+	}
+
+	emit(gen, X86_MOV, OPREG(RAX, M <= UINT32_MAX ? 4 : 8), OPIMM((int64_t)M));
+	emit(gen, X86_MUL, OPREG(src, 8), OPNONE);
+
+	Operand savedx = OPMEM(RSP, NOREG, 1, 0, 8);
+
+	if (addind) {
+		emit(gen, X86_MOV, OPREG(RAX, 8), savedx);
+		emit(gen, X86_SUB, OPREG(RAX, 8), OPREG(RDX, 8));
+		emit(gen, X86_SHR, OPREG(RAX, 8), OPIMM(1));
+		emit(gen, X86_ADD, OPREG(RAX, 8), OPREG(RDX, 8));
+		if (s > 1) {
+			emit(gen, X86_SHR, OPREG(RAX, 8), OPIMM(s - 1));
+		}
+		emit(gen, X86_MOV, OPREG(RDX, 8), OPREG(RAX, 8));
+	} else if (s > 0) {
+		emit(gen, X86_SHR, OPREG(RDX, 8), OPIMM(s));
+	}
+
+	reg result = RDX;
+
+	if (mod) {
+		if (d <= INT32_MAX) {
+			emit3(gen, X86_IMUL, OPREG(RDX, w), OPREG(RDX, w), OPIMM((int64_t)d));
+		} else {
+			emit(gen, X86_MOV, OPREG(RAX, w), OPIMM((int64_t)d));
+			emit(gen, X86_IMUL, OPREG(RDX, w), OPREG(RAX, w));
+		}
+
+		emit(gen, X86_MOV, OPREG(RAX, w), OPMEM(RSP, NOREG, 1, 0, w));
+		emit(gen, X86_SUB, OPREG(RAX, w), OPREG(RDX, w));
+		result = RAX;
+	}
+
+	if (keepx) {
+		emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(8));
+		gen->depth -= 8;
+	}
+
+	if (result != dest) {
+		emit(gen, X86_MOV, OPREG(dest, w), OPREG(result, w));
+	}
+
+	restore(gen, clobber);
+	regfree(gen, dest);
+
+	return true;
+}
+
+/* Division and modulo with div/idiv; the dividend goes in rdx:rax */
+static void gen_div(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	bool mod = binary->op == BINOP_MOD;
+
+	gen_expr(gen, binary->lhs, dest);
+	gen->busy |= REGBIT(dest);
+
+	Value divisor = value(gen, binary->rhs, REGBIT(RAX) | REGBIT(RDX), true, dest);
+
+	uint16_t clobber = (REGBIT(RAX) | REGBIT(RDX)) & ~REGBIT(dest);
+	save(gen, clobber);
+
+	if (dest != RAX) {
+		emit(gen, X86_MOV, OPREG(RAX, w), OPREG(dest, w));
+	}
+
+	if (type->signd) {
+		emit(gen, w == 8 ? X86_CQO : X86_CDQ, OPNONE, OPNONE);
+		emit(gen, X86_IDIV, valueop(gen, &divisor, w), OPNONE);
+	} else {
+		emit(gen, X86_XOR, OPREG(RDX, 4), OPREG(RDX, 4));
+		emit(gen, X86_DIV, valueop(gen, &divisor, w), OPNONE);
+	}
+
+	reg result = mod ? RDX : RAX;
+	if (result != dest) {
+		emit(gen, X86_MOV, OPREG(dest, w), OPREG(result, w));
+	}
+
+	restore(gen, clobber);
+	valuefree(gen, &divisor);
+	regfree(gen, dest);
+
+	narrow(gen, type, dest);
+}
+
+/*
+ * Shifts and rotates by a variable count take it in cl; narrow values rotate
+ * at their own width. BMI2 shifts by a count in any register.
+ */
+static void gen_shift(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	bool rotate = binary->op == BINOP_ROTL || binary->op == BINOP_ROTR;
+	uint8_t s = rotate && type->size < 4 ? type->size : w;
+	x86_op op = X86_SHL;
+
+	switch (binary->op) {
+		case BINOP_SHR: op = type->signd ? X86_SAR : X86_SHR; break;
+		case BINOP_ROTL: op = X86_ROL; break;
+		case BINOP_ROTR: op = X86_ROR; break;
+		default: break;
+	}
+
+	gen_expr(gen, binary->lhs, dest);
+	gen->busy |= REGBIT(dest);
+
+	Value count = value(gen, binary->rhs, 0, false, dest);
+	Operand c = valueop(gen, &count, w);
+
+	if (c.kind == OPND_IMM) {
+		emit(gen, op, OPREG(dest, s), OPIMM(c.imm & (s * 8 - 1)));
+	} else if ((gen->isa & ISA_BMI2) && !rotate) {
+		x86_op x = op == X86_SHL ? X86_SHLX : op == X86_SHR ? X86_SHRX : X86_SARX;
+		bool pushed = false;
+		reg k = c.kind == OPND_REG ? c.reg : NOREG;
+
+		if (k == NOREG) {
+			k = borrow(gen, REGBIT(dest) | regsof(c), &pushed);
+			emit(gen, X86_MOV, OPREG(k, w), valueop(gen, &count, w));
+		}
+
+		emitbmi(gen, x, OPREG(dest, w), OPREG(dest, w), OPREG(k, w));
+
+		if (c.kind != OPND_REG) {
+			giveback(gen, k, pushed);
+		}
+	} else if (dest == RCX) {
+		/* Swap the value and the count, shift, and swap back */
+		if (c.kind == OPND_REG) {
+			emit(gen, X86_XCHG, OPREG(c.reg, 8), OPREG(RCX, 8));
+			emit(gen, op, OPREG(c.reg, s), OPREG(RCX, 1));
+			emit(gen, X86_XCHG, OPREG(c.reg, 8), OPREG(RCX, 8));
+		} else {
+			emit(gen, X86_XCHG, c, OPREG(RCX, w));
+			emit(gen, op, valueop(gen, &count, s), OPREG(RCX, 1));
+			emit(gen, X86_XCHG, c, OPREG(RCX, w));
+		}
+	} else if (c.kind == OPND_REG && c.reg == RCX) {
+		emit(gen, op, OPREG(dest, s), OPREG(RCX, 1));
+	} else {
+		save(gen, REGBIT(RCX));
+		emit(gen, X86_MOV, OPREG(RCX, w), valueop(gen, &count, w));
+		emit(gen, op, OPREG(dest, s), OPREG(RCX, 1));
+		restore(gen, REGBIT(RCX));
+	}
+
+	valuefree(gen, &count);
+	regfree(gen, dest);
+
+	if (binary->op != BINOP_SHR) {
+		narrow(gen, type, dest);
+	}
+}
+
+/* A constant to and with: an immediate at 32 bits; at 64, it takes register 'k' */
+static Operand bitmask(Gen *gen, reg k, uint8_t w, uint64_t c)
+{
+	if (w == 4) {
+		return OPIMM(c & UINT32_MAX);
+	}
+
+	emit(gen, X86_MOV, OPREG(k, 8), OPIMM((int64_t)c));
+	return OPREG(k, 8);
+}
+
+/* Whether an expression may be taken apart by the instruction that uses it; a common subexpression is kept whole */
+static bool fusable(Gen *gen, TExpression *expression)
+{
+	return !cse_find(gen, expression);
+}
+
+/* The count n of a mask of the n low bits, (1 << n) - 1, that may be taken apart; else NULL */
+static TExpression *lowbits(Gen *gen, TExpression *expression)
+{
+	if (expression->variant != TEXPRESSION_BINARY || expression->binary->op != BINOP_SUB || !fusable(gen, expression)) {
+		return NULL;
+	}
+
+	TExpression *shift = expression->binary->lhs;
+	TExpression *one = expression->binary->rhs;
+
+	if (!isconst(one) || constval(one) != 1 || shift->variant != TEXPRESSION_BINARY || shift->binary->op != BINOP_SHL
+			|| !fusable(gen, shift) || !isconst(shift->binary->lhs) || constval(shift->binary->lhs) != 1
+			|| isconst(shift->binary->rhs)) {
+		return NULL;
+	}
+
+	return shift->binary->rhs;
+}
+
+/*
+ * An and with a complement, x & ~y, is BMI1's andn; one with a mask of the
+ * low bits, x & ((1 << n) - 1), is BMI2's bzhi, which zeroes the bits from
+ * n up. The shift takes its count modulo the width, and so must bzhi's,
+ * which would otherwise keep all bits for a count past it; narrow values
+ * are left alone, as their mask is narrowed before the and. Returns false
+ * if neither applies.
+ */
+static bool andbits(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	Operand d = OPREG(dest, w);
+	TExpression *lhs = binary->lhs;
+	TExpression *rhs = binary->rhs;
+	TExpression *n = NULL;
+
+	if ((gen->isa & ISA_BMI2) && type->size >= 4 && ((n = lowbits(gen, rhs)) || (n = lowbits(gen, lhs)))) {
+		gen_expr(gen, lowbits(gen, rhs) ? lhs : rhs, dest);
+		gen->busy |= REGBIT(dest);
+
+		Value count = value(gen, n, 0, true, dest);
+		bool pushed = false;
+		reg k = count.temp ? count.op.reg : borrow(gen, REGBIT(dest) | regsof(count.op), &pushed);
+
+		if (!count.temp) {
+			emit(gen, X86_MOV, OPREG(k, w), valueop(gen, &count, w));
+		}
+
+		emit(gen, X86_AND, OPREG(k, 4), OPIMM(w * 8 - 1));
+		emitbmi(gen, X86_BZHI, d, d, OPREG(k, w));
+
+		if (!count.temp) {
+			giveback(gen, k, pushed);
+		}
+
+		valuefree(gen, &count);
+		regfree(gen, dest);
+		return true;
+	}
+
+	TExpression *inverted = NULL;
+	TExpression *other = NULL;
+
+	for (size_t i = 0; i < 2 && !inverted && (gen->isa & ISA_BMI1); ++i) {
+		TExpression *e = i ? lhs : rhs;
+
+		if (e->variant == TEXPRESSION_UNARY && e->unary->op == UNOP_NOT && fusable(gen, e)) {
+			inverted = e;
+			other = i ? rhs : lhs;
+		}
+	}
+
+	if (!inverted) {
+		return false;
+	}
+
+	gen_expr(gen, inverted->unary->operand, dest);
+	gen->busy |= REGBIT(dest);
+
+	Value val = value(gen, other, 0, true, dest);
+	emitbmi(gen, X86_ANDN, d, d, valueop(gen, &val, w));
+
+	valuefree(gen, &val);
+	regfree(gen, dest);
+	return true;
+}
+
+/*
+ * Without popcnt, bits are summed in pairs, then in nibbles, then in bytes,
+ * and a multiplication adds the bytes up into the top one (Hacker's Delight,
+ * 5-1)
+ */
+static void gen_popcount(Gen *gen, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	Operand d = OPREG(dest, w);
+
+	if (gen->isa & ISA_POPCNT) {
+		emit(gen, X86_POPCNT, d, d);
+		return;
+	}
+
+	bool tpushed = false;
+	bool kpushed = false;
+	reg t = borrow(gen, REGBIT(dest), &tpushed);
+	reg k = w == 8 ? borrow(gen, REGBIT(dest) | REGBIT(t), &kpushed) : NOREG;
+	Operand tt = OPREG(t, w);
+
+	emit(gen, X86_MOV, tt, d);
+	emit(gen, X86_SHR, tt, OPIMM(1));
+	emit(gen, X86_AND, tt, bitmask(gen, k, w, 0x5555555555555555));
+	emit(gen, X86_SUB, d, tt);
+
+	emit(gen, X86_MOV, tt, d);
+	Operand m = bitmask(gen, k, w, 0x3333333333333333);
+	emit(gen, X86_AND, d, m);
+	emit(gen, X86_SHR, tt, OPIMM(2));
+	emit(gen, X86_AND, tt, m);
+	emit(gen, X86_ADD, d, tt);
+
+	emit(gen, X86_MOV, tt, d);
+	emit(gen, X86_SHR, tt, OPIMM(4));
+	emit(gen, X86_ADD, d, tt);
+	emit(gen, X86_AND, d, bitmask(gen, k, w, 0x0F0F0F0F0F0F0F0F));
+
+	if (w == 8) {
+		emit(gen, X86_MOV, OPREG(k, 8), OPIMM(0x0101010101010101));
+		emit(gen, X86_IMUL, d, OPREG(k, 8));
+	} else {
+		emit3(gen, X86_IMUL, d, d, OPIMM(0x01010101));
+	}
+	emit(gen, X86_SHR, d, OPIMM(w * 8 - 8));
+
+	if (k != NOREG) {
+		giveback(gen, k, kpushed);
+	}
+	giveback(gen, t, tpushed);
+}
+
+/*
+ * popcount, clz, ctz and bswap. Narrow values are zero-extended and counted
+ * at 32 bits. Without lzcnt and tzcnt, bsr and bsf find the highest and
+ * lowest set bit, but leave their result undefined for 0, which a cmov
+ * then replaces. movbe swaps the bytes of a value as it loads it.
+ */
+static void gen_bitcount(Gen *gen, TUnary *unary, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	size_t bits = type->size * 8;
+	Operand d = OPREG(dest, w);
+
+	if (unary->op == UNOP_BSWAP && type->size >= 2 && (gen->isa & ISA_MOVBE) && inmemory(gen, unary->operand)) {
+		emit(gen, X86_MOVBE, OPREG(dest, type->size), address(gen, unary->operand, dest));
+		narrow(gen, type, dest);
+		return;
+	}
+
+	gen_expr(gen, unary->operand, dest);
+
+	if (unary->op == UNOP_BSWAP) {
+		if (type->size == 2) {
+			emit(gen, X86_ROL, OPREG(dest, 2), OPIMM(8));
+			narrow(gen, type, dest);
+		} else if (type->size > 2) {
+			emit(gen, X86_BSWAP, d, OPNONE);
+		}
+		return;
+	}
+
+	if (type->size < 4 && type->signd) {
+		emit(gen, X86_MOVZX, OPREG(dest, 4), OPREG(dest, type->size));
+	}
+
+	gen->busy |= REGBIT(dest);
+
+	if (unary->op == UNOP_POPCOUNT) {
+		gen_popcount(gen, type, dest);
+	} else if (unary->op == UNOP_CLZ && (gen->isa & ISA_LZCNT)) {
+		emit(gen, X86_LZCNT, d, d);
+		if (type->size < 4) {
+			emit(gen, X86_SUB, d, OPIMM(32 - bits));
+		}
+	} else if (unary->op == UNOP_CTZ && type->size < 4) {
+		/* A bit just above the value stops the count at its width, so bsf never sees 0 */
+		emit(gen, X86_OR, d, OPIMM((int64_t)1 << bits));
+		emit(gen, X86_BSF, d, d);
+	} else if (unary->op == UNOP_CTZ && (gen->isa & ISA_BMI1)) {
+		emit(gen, X86_TZCNT, d, d);
+	} else {
+		bool pushed = false;
+		reg t = borrow(gen, REGBIT(dest), &pushed);
+		Operand tt = OPREG(t, w);
+
+		if (unary->op == UNOP_CLZ) {
+			/* (bits - 1) - the index of the highest set bit, which is -1 for 0 */
+			emit(gen, X86_BSR, tt, d);
+			emit(gen, X86_MOV, d, OPIMM(-1));
+			emitcc(gen, X86_CMOVCC, CC_NE, d, tt);
+			emit(gen, X86_NEG, d, OPNONE);
+			emit(gen, X86_ADD, d, OPIMM(bits - 1));
+		} else {
+			emit(gen, X86_BSF, tt, d);
+			emit(gen, X86_MOV, d, OPIMM(bits));
+			emitcc(gen, X86_CMOVCC, CC_NE, d, tt);
+		}
+
+		giveback(gen, t, pushed);
+	}
+
+	regfree(gen, dest);
+}
+
+/*
+ * pdep and pext. Without BMI2, a loop visits the set bits of the mask, lowest
+ * first, taking the lowest bit of the mask left as m & -m: pdep moves the
+ * value's bits out at the bottom, one per bit of the mask, and sets that bit
+ * where the value's is set; pext tests the value at that bit, and sets the
+ * next bit of the result where it is set.
+ */
+static void gen_deposit(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	uint8_t w = width(type);
+	bool pext = binary->op == BINOP_PEXT;
+	Operand d = OPREG(dest, w);
+
+	gen_expr(gen, binary->lhs, dest);
+	gen->busy |= REGBIT(dest);
+
+	/* A narrow signed mask is sign-extended; gathering the bits above it must find zeros */
+	if (pext && type->size < 4 && type->signd) {
+		emit(gen, X86_MOVZX, OPREG(dest, 4), OPREG(dest, type->size));
+	}
+
+	Value mask = value(gen, binary->rhs, 0, true, dest);
+
+	if (gen->isa & ISA_BMI2) {
+		emitbmi(gen, pext ? X86_PEXT : X86_PDEP, d, d, valueop(gen, &mask, w));
+	} else {
+		uint16_t avoid = REGBIT(dest) | (mask.op.kind == OPND_REG ? REGBIT(mask.op.reg) : 0);
+		bool pushed[4] = { false };
+		reg m = borrow(gen, avoid, &pushed[0]);
+		reg r = borrow(gen, avoid | REGBIT(m), &pushed[1]);
+		reg low = borrow(gen, avoid | REGBIT(m) | REGBIT(r), &pushed[2]);
+		reg bit = pext ? borrow(gen, avoid | REGBIT(m) | REGBIT(r) | REGBIT(low), &pushed[3]) : NOREG;
+		label loop = enc_label(gen->enc);
+		label skip = enc_label(gen->enc);
+		label done = enc_label(gen->enc);
+
+		emit(gen, X86_MOV, OPREG(m, w), valueop(gen, &mask, w));
+		emit(gen, X86_XOR, OPREG(r, 4), OPREG(r, 4));
+		if (pext) {
+			emit(gen, X86_MOV, OPREG(bit, 4), OPIMM(1));
+		}
+
+		bind(gen, loop);
+		emit(gen, X86_TEST, OPREG(m, w), OPREG(m, w));
+		emitcc(gen, X86_JCC, CC_E, OPLABEL(done), OPNONE);
+		emit(gen, X86_MOV, OPREG(low, w), OPREG(m, w));
+		emit(gen, X86_NEG, OPREG(low, w), OPNONE);
+		emit(gen, X86_AND, OPREG(low, w), OPREG(m, w));
+		emit(gen, X86_XOR, OPREG(m, w), OPREG(low, w));
+
+		if (pext) {
+			emit(gen, X86_TEST, d, OPREG(low, w));
+			emitcc(gen, X86_JCC, CC_E, OPLABEL(skip), OPNONE);
+			emit(gen, X86_OR, OPREG(r, w), OPREG(bit, w));
+			bind(gen, skip);
+			emit(gen, X86_ADD, OPREG(bit, w), OPREG(bit, w));
+		} else {
+			emit(gen, X86_TEST, d, OPIMM(1));
+			emitcc(gen, X86_JCC, CC_E, OPLABEL(skip), OPNONE);
+			emit(gen, X86_OR, OPREG(r, w), OPREG(low, w));
+			bind(gen, skip);
+			emit(gen, X86_SHR, d, OPIMM(1));
+		}
+
+		emit(gen, X86_JMP, OPLABEL(loop), OPNONE);
+		bind(gen, done);
+		emit(gen, X86_MOV, d, OPREG(r, w));
+
+		if (pext) {
+			giveback(gen, bit, pushed[3]);
+		}
+		giveback(gen, low, pushed[2]);
+		giveback(gen, r, pushed[1]);
+		giveback(gen, m, pushed[0]);
+	}
+
+	valuefree(gen, &mask);
+	regfree(gen, dest);
+	narrow(gen, type, dest);
+}
+
+/* Compare the operands of a comparison, leaving the result in the flags; against zero, test will do */
+static cond compare(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	static const cond signedcc[] = {
+		[BINOP_EQ] = CC_E, [BINOP_NE] = CC_NE,
+		[BINOP_LT] = CC_L, [BINOP_LE] = CC_LE, [BINOP_GT] = CC_G, [BINOP_GE] = CC_GE,
+	};
+	static const cond unsignedcc[] = {
+		[BINOP_EQ] = CC_E, [BINOP_NE] = CC_NE,
+		[BINOP_LT] = CC_B, [BINOP_LE] = CC_BE, [BINOP_GT] = CC_A, [BINOP_GE] = CC_AE,
+	};
+
+	uint8_t w = width(type);
+	cond cc = (type->signd ? signedcc : unsignedcc)[binary->op];
+	reg lhs = dest;
+
+	/* Values in registers are canonical, so a variable kept in one is compared where it is */
+	if (binary->lhs->variant == TEXPRESSION_VARIABLE && gen->vars[binary->lhs->var].kind == OPND_REG) {
+		lhs = gen->vars[binary->lhs->var].reg;
+	} else {
+		gen_expr(gen, binary->lhs, dest);
+		gen->busy |= REGBIT(dest);
+	}
+
+	if (isconst(binary->rhs) && constval(binary->rhs) == 0) {
+		emit(gen, X86_TEST, OPREG(lhs, w), OPREG(lhs, w));
+	} else {
+		Value rhs = value(gen, binary->rhs, 0, false, dest);
+		emit(gen, X86_CMP, OPREG(lhs, w), valueop(gen, &rhs, w));
+		valuefree(gen, &rhs);
+	}
+
+	regfree(gen, dest);
+	return cc;
+}
+
+/* Comparisons produce a bool (0 or 1) */
+static void gen_compare(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	cond cc = compare(gen, binary, type, dest);
+
+	emitcc(gen, X86_SETCC, cc, OPREG(dest, 1), OPNONE);
+	emit(gen, X86_MOVZX, OPREG(dest, 4), OPREG(dest, 1));
+}
+
+/* Put constants on the right, and calls on the left, where the operator allows */
+static TBinary *canonical(TBinary *binary)
+{
+	bool commutes = binary->op == BINOP_ADD || binary->op == BINOP_MUL || binary->op == BINOP_AND
+		|| binary->op == BINOP_OR || binary->op == BINOP_XOR || binary->op == BINOP_EQ || binary->op == BINOP_NE;
+	bool orders = binary->op >= BINOP_LT;
+
+	if ((commutes || orders) && ((isconst(binary->lhs) && !isconst(binary->rhs))
+			|| (hascall(binary->rhs) && !hascall(binary->lhs)))) {
+		static const binop mirror[] = {
+			[BINOP_LT] = BINOP_GT, [BINOP_LE] = BINOP_GE, [BINOP_GT] = BINOP_LT, [BINOP_GE] = BINOP_LE,
+		};
+
+		TBinary *swapped = alloct(TBinary);
+		swapped->op = orders ? mirror[binary->op] : binary->op;
+		swapped->lhs = binary->rhs;
+		swapped->rhs = binary->lhs;
+		return swapped;
+	}
+
+	return binary;
+}
+
+static void gen_binary(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	binary = canonical(binary);
+
+	/* The type of the operands; that of the expression for all but comparisons */
+	type = gen->tfile->types[binary->lhs->type];
+	uint8_t w = width(type);
+
+	switch (binary->op) {
+		case BINOP_MUL: {
+			if (isconst(binary->rhs) && mulconst(gen, binary->lhs, constval(binary->rhs), type, dest)) {
+				return;
+			}
+			break;
+		}
+		case BINOP_DIV:
+		case BINOP_MOD: {
+			if (isconst(binary->rhs) && divconst(gen, binary, type, dest)) {
+				return;
+			}
+
+			gen_div(gen, binary, type, dest);
+			return;
+		}
+		case BINOP_SHL:
+		case BINOP_SHR:
+		case BINOP_ROTL:
+		case BINOP_ROTR: gen_shift(gen, binary, type, dest); return;
+		case BINOP_PDEP:
+		case BINOP_PEXT: gen_deposit(gen, binary, type, dest); return;
+		case BINOP_EQ:
+		case BINOP_NE:
+		case BINOP_LT:
+		case BINOP_LE:
+		case BINOP_GT:
+		case BINOP_GE: gen_compare(gen, binary, type, dest); return;
+		case BINOP_AND: {
+			if (andbits(gen, binary, type, dest)) {
+				return;
+			}
+			break;
+		}
+		default: break;
+	}
+
+	static const x86_op ops[] = {
+		[BINOP_ADD] = X86_ADD, [BINOP_SUB] = X86_SUB, [BINOP_MUL] = X86_IMUL,
+		[BINOP_AND] = X86_AND, [BINOP_OR] = X86_OR, [BINOP_XOR] = X86_XOR,
+	};
+
+	gen_expr(gen, binary->lhs, dest);
+	gen->busy |= REGBIT(dest);
+
+	Value rhs = value(gen, binary->rhs, 0, false, dest);
+	Operand r = valueop(gen, &rhs, w);
+
+	if (binary->op == BINOP_MUL && r.kind == OPND_IMM) {
+		emit3(gen, X86_IMUL, OPREG(dest, w), OPREG(dest, w), r);
+	} else {
+		emit(gen, ops[binary->op], OPREG(dest, w), r);
+	}
+
+	valuefree(gen, &rhs);
+	regfree(gen, dest);
+
+	if (binary->op == BINOP_ADD || binary->op == BINOP_SUB || binary->op == BINOP_MUL) {
+		narrow(gen, type, dest);
+	}
+}
+
+static void gen_unary(Gen *gen, TUnary *unary, Type *type, reg dest)
+{
+	/* Scalars taken from vectors, and the pointer of a slice, which loads as any variable does */
+	switch (unary->op) {
+		case UNOP_LANE: gen_lane(gen, unary, type, dest); return;
+		case UNOP_REDUCE_ADD:
+		case UNOP_REDUCE_AND:
+		case UNOP_REDUCE_OR:
+		case UNOP_REDUCE_XOR: gen_reduce(gen, unary, type, dest); return;
+		case UNOP_MASK: gen_mask(gen, unary, dest); return;
+		case UNOP_ADDRESS: gen_expr(gen, unary->operand, dest); return;
+		case UNOP_POPCOUNT:
+		case UNOP_CLZ:
+		case UNOP_CTZ:
+		case UNOP_BSWAP: gen_bitcount(gen, unary, type, dest); return;
+		default: break;
+	}
+
+	gen_expr(gen, unary->operand, dest);
+	emit(gen, unary->op == UNOP_NEG ? X86_NEG : X86_NOT, OPREG(dest, width(type)), OPNONE);
+	narrow(gen, type, dest);
+}
+
+/*
+ * Live scratch registers, and XMM registers, are saved around the call.
+ * Arguments are then evaluated so that nothing clobbers an argument register
+ * once it has been written: arguments that themselves make calls are
+ * evaluated first and pushed, then stack arguments are pushed right to left,
+ * and finally the register arguments are loaded, vectors first. Vectors go
+ * in xmm0 to xmm7, and are counted apart from the other arguments. A vector
+ * result comes back in xmm0, and 'dest' is an XMM register.
+ */
+static void gen_call(Gen *gen, TCall *call, reg dest)
+{
+	uint16_t live = gen->busy;
+	uint16_t xlive = gen->xbusy;
+	save(gen, live);
+	xsave(gen, xlive);
+	gen->busy = 0;
+	gen->xbusy = 0;
+
+	size_t *slots = acalloc(call->nargs + 1, sizeof(size_t)); /* the argument register of each, or past them */
+	bool *vector = acalloc(call->nargs + 1, sizeof(bool));
+	size_t nint = 0;
+	size_t nvector = 0;
+	bool wide = false;
+
+	for (size_t i = 0; i < call->nargs; ++i) {
+		Type *t = gen->tfile->types[call->args[i]->type];
+
+		vector[i] = t->kind == TYPE_VECTOR;
+		slots[i] = vector[i] ? nvector++ : nint++;
+		wide |= vector[i] && t->size == 32;
+	}
+
+	size_t nstack = nint > NPARAMREG ? nint - NPARAMREG : 0;
+	size_t spilled = 0;
+	size_t *temps = acalloc(call->nargs + 1, sizeof(size_t)); /* depth at which a temporary was pushed */
+
+	for (size_t i = 0; i < call->nargs; ++i) {
+		if (!hascall(call->args[i])) {
+			continue;
+		}
+
+		if (vector[i]) {
+			uint8_t size = gen->tfile->types[call->args[i]->type]->size;
+
+			gen_vexpr(gen, call->args[i], (reg)0);
+			emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(size));
+			vmove(gen, OPMEM(RSP, NOREG, 1, 0, size), OPREG((reg)0, size));
+			gen->depth += size;
+			spilled += size;
+		} else {
+			gen_expr(gen, call->args[i], RAX);
+			emit(gen, X86_PUSH, OPREG(RAX, 8), OPNONE);
+			gen->depth += 8;
+			spilled += 8;
+		}
+
+		temps[i] = gen->depth;
+	}
+
+	/* rsp must be 16-byte aligned at the call */
+	size_t pad = ((gen->depth + nstack * 8) & 15) ? 8 : 0;
+	if (pad) {
+		emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(pad));
+		gen->depth += pad;
+	}
+
+	for (size_t i = call->nargs; i-- > 0;) {
+		TExpression *arg = call->args[i];
+
+		if (vector[i] || slots[i] < NPARAMREG) {
+			continue;
+		}
+
+		if (temps[i]) {
+			emit(gen, X86_PUSH, OPMEM(RSP, NOREG, 1, gen->depth - temps[i], 8), OPNONE);
+		} else if (isconst(arg) && constval(arg) <= INT32_MAX) {
+			emit(gen, X86_PUSH, OPIMM(constval(arg)), OPNONE);
+		} else {
+			gen_expr(gen, arg, RAX);
+			emit(gen, X86_PUSH, OPREG(RAX, 8), OPNONE);
+		}
+
+		gen->depth += 8;
+	}
+
+	for (size_t i = 0; i < call->nargs; ++i) {
+		if (!vector[i]) {
+			continue;
+		}
+
+		Operand x = OPREG((reg)slots[i], gen->tfile->types[call->args[i]->type]->size);
+
+		if (temps[i]) {
+			vmove(gen, x, OPMEM(RSP, NOREG, 1, gen->depth - temps[i], x.size));
+		} else {
+			gen_vexpr(gen, call->args[i], x.reg);
+		}
+
+		gen->xbusy |= REGBIT(x.reg);
+	}
+
+	for (size_t i = 0; i < call->nargs; ++i) {
+		if (vector[i] || slots[i] >= NPARAMREG) {
+			continue;
+		}
+
+		reg r = paramreg[slots[i]];
+
+		if (temps[i]) {
+			emit(gen, X86_MOV, OPREG(r, 8), OPMEM(RSP, NOREG, 1, gen->depth - temps[i], 8));
+		} else {
+			gen_expr(gen, call->args[i], r);
+		}
+
+		gen->busy |= REGBIT(r);
+	}
+
+	/* Callees may use SSE, which is slow while the upper halves of YMM registers are dirty */
+	if (gen->ymm && !wide) {
+		vemit3(gen, X86_VZEROUPPER, OPNONE, OPNONE, OPNONE);
+	}
+
+	TFun *callee = gen->tfile->tfuns[call->fun];
+
+	if (funenc(gen, callee) == gen->enc && !callee->nclones) {
+		emit(gen, X86_CALL, OPLABEL(gen->funs[call->fun]), OPNONE);
+	} else {
+		/*
+		 * Calls between .text and .text.unlikely, and to other objects, are
+		 * left to the linker, as are those to a function with clones: they go
+		 * through a PLT entry the clone its resolver picks is put in.
+		 */
+		if (!gen->funsyms[call->fun]) {
+			gen->funsyms[call->fun] = elf_add_symbol(gen->elf, SHN_UNDEF, callee->identifier.content, STB_GLOBAL, STT_NOTYPE, 0);
+		}
+
+		emit(gen, X86_CALL, OPLABEL(enc_extern(gen->enc)), OPNONE);
+		elf_add_reloc(gen->elf, gen->enc->size - 4, R_X86_64_PLT32, gen->funsyms[call->fun], -4);
+	}
+
+	size_t release = nstack * 8 + pad + spilled;
+	if (release) {
+		emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(release));
+		gen->depth -= release;
+	}
+
+	afree(temps);
+	afree(vector);
+	afree(slots);
+
+	Type *ret = gen->tfile->types[callee->rettype];
+	if (ret->kind == TYPE_VECTOR) {
+		vmove(gen, OPREG(dest, ret->size), OPREG((reg)0, ret->size));
+	} else if (dest != RAX) {
+		emit(gen, X86_MOV, OPREG(dest, 8), OPREG(RAX, 8));
+	}
+
+	gen->xbusy = xlive;
+	xrestore(gen, xlive);
+	gen->busy = live;
+	restore(gen, live);
+}
+
+/* rdtsc leaves the counter in edx:eax */
+static void gen_builtin(Gen *gen, TBuiltin *builtin, reg dest)
+{
+	switch (builtin->op) {
+		case BUILTIN_RDTSC: {
+			uint16_t clobber = (REGBIT(RAX) | REGBIT(RDX)) & ~REGBIT(dest);
+
+			save(gen, clobber);
+			emit(gen, X86_RDTSC, OPNONE, OPNONE);
+			emit(gen, X86_SHL, OPREG(RDX, 8), OPIMM(32));
+			emit(gen, X86_OR, OPREG(RAX, 8), OPREG(RDX, 8));
+			if (dest != RAX) {
+				emit(gen, X86_MOV, OPREG(dest, 8), OPREG(RAX, 8));
+			}
+			restore(gen, clobber);
+			break;
+		}
+		case BUILTIN_PREFETCH: {
+			static const x86_op hints[] = { X86_PREFETCHNTA, X86_PREFETCHT2, X86_PREFETCHT1, X86_PREFETCHT0 };
+			TExpression *place = builtin->args[0];
+
+			reg index = regalloc(gen, 0);
+			if (index == NOREG && !direct(gen, place)) {
+				err_internal("no register free for an index");
+			}
+
+			if (index != NOREG) {
+				regfree(gen, index);
+			}
+
+			Operand addr = address(gen, place, index);
+			addr.size = 1;
+			emit(gen, hints[builtin->args[1]->number->u64], addr, OPNONE);
+			break;
+		}
+		case BUILTIN_STREAM: gen_store(gen, builtin->args[0], builtin->args[1], X86_MOVNTI, false); break;
+		case BUILTIN_SFENCE: emit(gen, X86_SFENCE, OPNONE, OPNONE); break;
+		default: gen_atomic(gen, builtin, dest); break;
+	}
+}
+
+/*
+ * An atomic builtin. Under x86-TSO plain loads acquire and plain stores
+ * release, so only a sequentially consistent store needs more: xchg, which
+ * is a full fence. Read-modify-writes are locked, and fences, whatever
+ * their ordering. What they give is in 'dest', if it is not NOREG.
+ */
+static void gen_atomic(Gen *gen, TBuiltin *builtin, reg dest)
+{
+	TExpression *place = builtin->args[0];
+	Type *type = gen->tfile->types[place->type];
+	bool ordered = builtin->order != ORDER_RELAXED;
+
+	switch (builtin->op) {
+		case BUILTIN_LOAD: {
+			Operand src = address(gen, place, dest);
+			src.size = type->size;
+
+			if (type->size < 4) {
+				emitatomic(gen, type->signd ? X86_MOVSX : X86_MOVZX, OPREG(dest, 4), src, ordered);
+			} else {
+				emitatomic(gen, X86_MOV, OPREG(dest, type->size), src, ordered);
+			}
+			return;
+		}
+		case BUILTIN_STORE: {
+			gen_store(gen, place, builtin->args[1], builtin->order == ORDER_SEQCST ? X86_XCHG : X86_MOV, ordered);
+			return;
+		}
+		default: break;
+	}
+
+	uint16_t keep = dest != NOREG ? REGBIT(dest) : 0;
+	bool cmpxchg = builtin->op == BUILTIN_CMPXCHG;
+
+	/* cmpxchg compares with rax, and loads what the place held into it */
+	if (cmpxchg) {
+		save(gen, REGBIT(RAX) & ~keep);
+		gen_expr(gen, builtin->args[1], RAX);
+	}
+
+	uint16_t was = gen->busy & REGBIT(RAX);
+	gen->busy |= cmpxchg ? REGBIT(RAX) : 0;
+
+	reg r = dest;
+	if ((dest == NOREG || (cmpxchg && dest == RAX)) && (r = regalloc(gen, 0)) == NOREG) {
+		err_internal("no register free for an atomic");
+	}
+
+	regfree(gen, r);
+	gen_expr(gen, builtin->args[cmpxchg ? 2 : 1], r);
+	gen->busy |= REGBIT(r);
+
+	reg index = regalloc(gen, 0);
+	if (index == NOREG && !direct(gen, place)) {
+		err_internal("no register free for an index");
+	}
+
+	if (index != NOREG) {
+		regfree(gen, index);
+	}
+
+	Operand addr = address(gen, place, index);
+	x86_op op = builtin->op == BUILTIN_FETCHADD ? X86_XADD : cmpxchg ? X86_CMPXCHG : X86_XCHG;
+	emitatomic(gen, op, addr, OPREG(r, type->size), true);
+
+	if (cmpxchg && dest != NOREG && dest != RAX) {
+		emit(gen, X86_MOV, OPREG(dest, width(type)), OPREG(RAX, width(type)));
+	}
+
+	if (dest != NOREG) {
+		narrow(gen, type, dest);
+	}
+
+	regfree(gen, r);
+
+	if (cmpxchg) {
+		gen->busy = (gen->busy & ~REGBIT(RAX)) | was;
+		restore(gen, REGBIT(RAX) & ~keep);
+	}
+}
+
+/* Evaluate an expression into 'dest', which must not be busy */
+static void gen_expr(Gen *gen, TExpression *expression, reg dest)
+{
+	Type *type = gen->tfile->types[expression->type];
+	Cse *cse = cse_find(gen, expression);
+
+	if (cse && cse->ready) {
+		emit(gen, X86_MOV, OPREG(dest, width(type)), OPREG(cse->reg, width(type)));
+		cse_use(gen, cse);
+		return;
+	}
+
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT: {
+			uint64_t c = constval(expression);
+
+			/* Writing a 32-bit register zero-extends; only wider values need 64 bits */
+			if (c == 0) {
+				emit(gen, X86_XOR, OPREG(dest, 4), OPREG(dest, 4));
+			} else if (c <= UINT32_MAX) {
+				emit(gen, X86_MOV, OPREG(dest, 4), OPIMM(c));
+			} else {
+				emit(gen, X86_MOV, OPREG(dest, 8), OPIMM((int64_t)c));
+			}
+
+			break;
+		}
+		case TEXPRESSION_VARIABLE:
+		case TEXPRESSION_GLOBAL:
+		case TEXPRESSION_FIELD:
+		case TEXPRESSION_INDEX: load(gen, address(gen, expression, dest), type, dest); break;
+		case TEXPRESSION_CALL: gen_call(gen, expression->call, dest); break;
+		case TEXPRESSION_BINARY: gen_binary(gen, expression->binary, type, dest); break;
+		case TEXPRESSION_UNARY: gen_unary(gen, expression->unary, type, dest); break;
+		case TEXPRESSION_BUILTIN: gen_builtin(gen, expression->builtin, dest); break;
+		default: break;
+	}
+
+	if (cse) {
+		cse_keep(gen, cse, type, dest);
+	}
+}
+
+/* Take a free XMM register not in 'avoid', or NOREG if there is none */
+static reg xalloc(Gen *gen, uint16_t avoid)
+{
+	for (size_t i = 0; i < NXMM; ++i) {
+		reg r = (reg)i;
+
+		if (!((gen->xbusy | avoid) & REGBIT(r))) {
+			gen->xbusy |= REGBIT(r);
+			return r;
+		}
+	}
+
+	return NOREG;
+}
+
+static void xfree(Gen *gen, reg r)
+{
+	gen->xbusy &= ~REGBIT(r);
+}
+
+/* An XMM register for a temporary; vvalue() spills to leave an operation the XSPARE it may take */
+static reg xtemp(Gen *gen, uint16_t avoid)
+{
+	reg r = xalloc(gen, avoid);
+	if (r == NOREG) {
+		err_internal("no vector register free for an expression");
+	}
+
+	return r;
+}
+
+/* Spill those of 'regs' that are busy, whole (as YMM where the function has 256-bit vectors); xrestore() reloads them */
+static void xsave(Gen *gen, uint16_t regs)
+{
+	uint8_t size = gen->ymm ? 32 : 16;
+
+	for (size_t i = 0; i < NXMM; ++i) {
+		if (regs & gen->xbusy & REGBIT(i)) {
+			emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(size));
+			vmove(gen, OPMEM(RSP, NOREG, 1, 0, size), OPREG((reg)i, size));
+			gen->depth += size;
+		}
+	}
+}
+
+static void xrestore(Gen *gen, uint16_t regs)
+{
+	uint8_t size = gen->ymm ? 32 : 16;
+
+	for (size_t i = NXMM; i-- > 0;) {
+		if (regs & gen->xbusy & REGBIT(i)) {
+			vmove(gen, OPREG((reg)i, size), OPMEM(RSP, NOREG, 1, 0, size));
+			emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(size));
+			gen->depth -= size;
+		}
+	}
+}
+
+/*
+ * A two-operand SSE instruction, 'op a, b'; under AVX its VEX form, which
+ * takes 'a' as its first source too: 'vop a, a, b'
+ */
+static void vemit(Gen *gen, x86_op op, Operand a, Operand b)
+{
+	Insn insn = {
+		.op = op,
+		.cc = CC_O,
+		.vex = gen->avx,
+		.ops = { a, gen->avx ? a : b, gen->avx ? b : OPNONE },
+	};
+
+	issue(gen, insn);
+}
+
+/* An SSE instruction whose VEX form has the same operands; those only AVX has are only used under it */
+static void vemit3(Gen *gen, x86_op op, Operand a, Operand b, Operand c)
+{
+	Insn insn = {
+		.op = op,
+		.cc = CC_O,
+		.vex = gen->avx,
+		.ops = { a, b, c },
+	};
+
+	issue(gen, insn);
+}
+
+/* Shift each lane of 's' into 'd'; SSE shifts in place, so 's' is copied first */
+static void vshift(Gen *gen, x86_op op, Operand d, Operand s, uint8_t n)
+{
+	if (gen->avx) {
+		vemit3(gen, op, d, s, OPIMM(n));
+		return;
+	}
+
+	vmove(gen, d, s);
+	vemit(gen, op, d, OPIMM(n));
+}
+
+/* Copy a vector; between registers aligned, to and from memory not, as YMM frame slots are only 16-byte aligned */
+static void vmove(Gen *gen, Operand dest, Operand src)
+{
+	if (dest.kind == OPND_REG && src.kind == OPND_REG) {
+		if (dest.reg != src.reg) {
+			vemit3(gen, X86_MOVDQA, dest, src, OPNONE);
+		}
+
+		return;
+	}
+
+	vemit3(gen, X86_MOVDQU, dest, src, OPNONE);
+}
+
+/* Whether an expression computes a 256-bit vector anywhere, which only AVX2 has instructions for */
+static bool iswide(Gen *gen, TExpression *expression)
+{
+	Type *type = gen->tfile->types[expression->type];
+
+	if (type->kind == TYPE_VECTOR && type->size == 32) {
+		return true;
+	}
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				if (iswide(gen, expression->call->args[i])) {
+					return true;
+				}
+			}
+
+			return false;
+		}
+		case TEXPRESSION_BINARY: return iswide(gen, expression->binary->lhs) || iswide(gen, expression->binary->rhs);
+		case TEXPRESSION_UNARY: return iswide(gen, expression->unary->operand);
+		default: return false;
+	}
+}
+
+static bool haswide(Gen *gen, TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+		TExpression *expr = statement_expr(statement);
+
+		if (expr && iswide(gen, expr)) {
+			return true;
+		}
+
+		if (statement->variant == TSTATEMENT_WHILE && iswide(gen, statement->loop->cond)) {
+			return true;
+		}
+
+		TBlock *nested = NULL;
+		for (size_t j = 0; (nested = statement_block(statement, j)); ++j) {
+			if (haswide(gen, nested)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Whether a function takes, returns or computes a 256-bit vector */
+static bool funwide(Gen *gen, TFun *tfun)
+{
+	Type *rettype = gen->tfile->types[tfun->rettype];
+	if (rettype->kind == TYPE_VECTOR && rettype->size == 32) {
+		return true;
+	}
+
+	for (size_t i = 0; i < tfun->nparams; ++i) {
+		Type *t = gen->tfile->types[gen->tfile->tvariables[tfun->params[i]]->type];
+		if (t->kind == TYPE_VECTOR && t->size == 32) {
+			return true;
+		}
+	}
+
+	return haswide(gen, tfun->block);
+}
+
+/* log2 of the size of the lanes of a vector type; instructions come in one per lane size */
+static size_t lanelog(Gen *gen, Type *type)
+{
+	return (size_t)__builtin_ctzll(gen->tfile->types[type->elem]->size);
+}
+
+/* Invert every bit of a register, by xor with all ones */
+static void vnot(Gen *gen, reg r, uint8_t size)
+{
+	reg ones = xtemp(gen, REGBIT(r));
+
+	vemit(gen, X86_PCMPEQD, OPREG(ones, size), OPREG(ones, size));
+	vemit(gen, X86_PXOR, OPREG(r, size), OPREG(ones, size));
+	xfree(gen, ones);
+}
+
+/* Copy the first lane of a register to all the others; AVX2 has an instruction for this */
+static void broadcast(Gen *gen, Type *type, reg dest)
+{
+	static const x86_op vpbroadcast[] = { X86_VPBROADCASTB, X86_VPBROADCASTW, X86_VPBROADCASTD, X86_VPBROADCASTQ };
+
+	size_t lg = lanelog(gen, type);
+	Operand d = OPREG(dest, 16);
+
+	if (gen->avx) {
+		vemit3(gen, vpbroadcast[lg], OPREG(dest, type->size), d, OPNONE);
+		return;
+	}
+
+	/* Bytes and words are doubled up to a doubleword first */
+	if (lg == 0) {
+		vemit(gen, X86_PUNPCKLBW, d, d);
+	}
+
+	if (lg <= 1) {
+		vemit(gen, X86_PUNPCKLWD, d, d);
+	}
+
+	if (lg <= 2) {
+		vemit3(gen, X86_PSHUFD, d, d, OPIMM(0));
+	} else {
+		vemit(gen, X86_PUNPCKLQDQ, d, d);
+	}
+}
+
+/* A constant in every lane: zero and all ones have idioms; other values come from a general purpose register */
+static void vconst(Gen *gen, Type *type, uint64_t c, reg dest)
+{
+	size_t lanesize = gen->tfile->types[type->elem]->size;
+	uint64_t mask = lanesize == 8 ? UINT64_MAX : ((uint64_t)1 << (lanesize * 8)) - 1;
+	Operand d = OPREG(dest, type->size);
+
+	c &= mask;
+
+	if (c == 0) {
+		vemit(gen, X86_PXOR, d, d);
+		return;
+	}
+
+	if (c == mask) {
+		vemit(gen, X86_PCMPEQD, d, d);
+		return;
+	}
+
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free for a vector constant");
+	}
+
+	uint8_t w = c <= UINT32_MAX ? 4 : 8;
+	emit(gen, X86_MOV, OPREG(r, w), OPIMM((int64_t)c));
+	vemit3(gen, X86_MOVD, OPREG(dest, 16), OPREG(r, w), OPNONE);
+	regfree(gen, r);
+
+	broadcast(gen, type, dest);
+}
+
+/*
+ * Evaluate the right-hand operand of a vector operation whose left-hand
+ * operand is in 'dest': variables are used where they live (frame slots are
+ * as aligned as SSE needs), and anything else is evaluated into a scratch
+ * register. Where that would leave fewer than XSPARE free, as deep in a
+ * nested expression, the left-hand operand is pushed instead, and the
+ * right-hand one evaluated into 'dest', pushed in turn, and used from the
+ * stack, which is aligned for it first.
+ */
+static Value vvalue(Gen *gen, TExpression *expression, reg dest)
+{
+	Type *type = gen->tfile->types[expression->type];
+	Value val = { .op = OPNONE, .temp = false, .spill = 0 };
+
+	if (expression->variant == TEXPRESSION_VARIABLE) {
+		val.op = gen->vars[expression->var];
+		return val;
+	}
+
+	size_t nfree = 0;
+	for (size_t i = 0; i < NXMM; ++i) {
+		nfree += !((gen->xbusy | REGBIT(dest)) & REGBIT(i));
+	}
+
+	if (nfree >= XSPARE) {
+		reg r = xtemp(gen, REGBIT(dest));
+		xfree(gen, r);
+		gen_vexpr(gen, expression, r);
+		gen->xbusy |= REGBIT(r);
+
+		val.op = OPREG(r, type->size);
+		val.temp = true;
+		return val;
+	}
+
+	uint8_t size = gen->ymm ? 32 : 16;
+	size_t pad = (16 - (gen->depth + (gen->framed ? 0 : 8)) % 16) % 16;
+	bool held = gen->xbusy & REGBIT(dest);
+
+	if (pad) {
+		emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(pad));
+		gen->depth += pad;
+	}
+
+	xsave(gen, REGBIT(dest));
+	xfree(gen, dest);
+
+	gen_vexpr(gen, expression, dest);
+	gen->xbusy |= REGBIT(dest);
+	xsave(gen, REGBIT(dest));
+
+	if (held) {
+		vmove(gen, OPREG(dest, size), OPMEM(RSP, NOREG, 1, size, size));
+	} else {
+		xfree(gen, dest);
+	}
+
+	val.op = OPMEM(RSP, NOREG, 1, 0, type->size);
+	val.spill = gen->depth;
+	val.release = pad + (held ? 2 : 1) * size;
+	return val;
+}
+
+static void vvaluefree(Gen *gen, Value *val)
+{
+	if (val->temp) {
+		xfree(gen, val->op.reg);
+	}
+
+	if (val->spill) {
+		emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(val->release));
+		gen->depth -= val->release;
+	}
+}
+
+/* pmulld (of SSE4.1) from two pmuludq, of the even lanes and of the odd ones, whose products are then interleaved */
+static void vmul32(Gen *gen, Operand d, Operand s)
+{
+	reg a = xtemp(gen, 0);
+	reg b = xtemp(gen, 0);
+	Operand odd = OPREG(a, 16);
+
+	vemit3(gen, X86_PSHUFD, odd, d, OPIMM(0xF5));
+	vemit3(gen, X86_PSHUFD, OPREG(b, 16), s, OPIMM(0xF5));
+	vemit(gen, X86_PMULUDQ, d, s);
+	vemit(gen, X86_PMULUDQ, odd, OPREG(b, 16));
+	vemit3(gen, X86_PSHUFD, d, d, OPIMM(0x08));
+	vemit3(gen, X86_PSHUFD, odd, odd, OPIMM(0x08));
+	vemit(gen, X86_PUNPCKLDQ, d, odd);
+
+	xfree(gen, a);
+	xfree(gen, b);
+}
+
+/*
+ * Comparisons set each lane to all ones where they hold, and to zero where
+ * not. There are only instructions for equality and signed 'greater than':
+ * 'less than' swaps the operands, the rest invert the result of one of
+ * those, and unsigned lanes are compared with their sign bits flipped.
+ * pcmpeqq is SSE4.1; with SSE2, both halves of a quadword must be equal.
+ */
+static void gen_vcompare(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	static const x86_op cmpeq[] = { X86_PCMPEQB, X86_PCMPEQW, X86_PCMPEQD, X86_PCMPEQQ };
+	static const x86_op cmpgt[] = { X86_PCMPGTB, X86_PCMPGTW, X86_PCMPGTD, X86_PCMPGTQ };
+
+	size_t lg = lanelog(gen, type);
+	uint8_t size = type->size;
+	Operand d = OPREG(dest, size);
+	bool eq = binary->op == BINOP_EQ || binary->op == BINOP_NE;
+	bool swap = binary->op == BINOP_LT || binary->op == BINOP_GE;
+	bool invert = binary->op == BINOP_NE || binary->op == BINOP_LE || binary->op == BINOP_GE;
+
+	gen_vexpr(gen, swap ? binary->rhs : binary->lhs, dest);
+	gen->xbusy |= REGBIT(dest);
+
+	Value rhs = vvalue(gen, swap ? binary->lhs : binary->rhs, dest);
+
+	if (eq && lg == 3 && !gen->avx && !(gen->isa & ISA_SSE4)) {
+		reg t = xtemp(gen, 0);
+
+		vemit(gen, X86_PCMPEQD, d, rhs.op);
+		vemit3(gen, X86_PSHUFD, OPREG(t, 16), d, OPIMM(0xB1));
+		vemit(gen, X86_PAND, d, OPREG(t, 16));
+		xfree(gen, t);
+	} else if (eq) {
+		vemit(gen, cmpeq[lg], d, rhs.op);
+	} else {
+		if (!gen->tfile->types[type->elem]->signd) {
+			reg bias = xtemp(gen, 0);
+			Operand b = OPREG(bias, size);
+
+			/* The sign bit of each lane, from all ones; bytes saturate to it from words */
+			vemit(gen, X86_PCMPEQD, b, b);
+			switch (lg) {
+				case 0: vemit(gen, X86_PSLLW, b, OPIMM(15)); vemit(gen, X86_PACKSSWB, b, b); break;
+				case 1: vemit(gen, X86_PSLLW, b, OPIMM(15)); break;
+				case 2: vemit(gen, X86_PSLLD, b, OPIMM(31)); break;
+				default: vemit(gen, X86_PSLLQ, b, OPIMM(63)); break;
+			}
+
+			if (!rhs.temp) {
+				reg r = xtemp(gen, 0);
+				vmove(gen, OPREG(r, size), rhs.op);
+
+				rhs.op = OPREG(r, size);
+				rhs.temp = true;
+			}
+
+			vemit(gen, X86_PXOR, d, b);
+			vemit(gen, X86_PXOR, rhs.op, b);
+			xfree(gen, bias);
+		}
+
+		vemit(gen, cmpgt[lg], d, rhs.op);
+	}
+
+	vvaluefree(gen, &rhs);
+
+	if (invert) {
+		vnot(gen, dest, size);
+	}
+
+	xfree(gen, dest);
+}
+
+/*
+ * Lane-wise arithmetic. Types only allow what there are instructions for,
+ * bar pmulld, which SSE2 makes of others; shifts are by a constant.
+ */
+static void gen_vbinary(Gen *gen, TBinary *binary, Type *type, reg dest)
+{
+	static const x86_op add[] = { X86_PADDB, X86_PADDW, X86_PADDD, X86_PADDQ };
+	static const x86_op sub[] = { X86_PSUBB, X86_PSUBW, X86_PSUBD, X86_PSUBQ };
+	static const x86_op sll[] = { _X86_NULL, X86_PSLLW, X86_PSLLD, X86_PSLLQ };
+	static const x86_op srl[] = { _X86_NULL, X86_PSRLW, X86_PSRLD, X86_PSRLQ };
+	static const x86_op sra[] = { _X86_NULL, X86_PSRAW, X86_PSRAD, _X86_NULL };
+
+	binary = canonical(binary);
+
+	/* The type of the operands; that of the expression, for comparisons too */
+	type = gen->tfile->types[binary->lhs->type];
+	size_t lg = lanelog(gen, type);
+	Operand d = OPREG(dest, type->size);
+
+	if (binary->op >= BINOP_EQ) {
+		gen_vcompare(gen, binary, type, dest);
+		return;
+	}
+
+	gen_vexpr(gen, binary->lhs, dest);
+
+	if (binary->op == BINOP_SHL || binary->op == BINOP_SHR) {
+		bool signd = gen->tfile->types[type->elem]->signd;
+		x86_op op = binary->op == BINOP_SHL ? sll[lg] : signd ? sra[lg] : srl[lg];
+
+		vemit(gen, op, d, OPIMM(constval(binary->rhs)));
+		return;
+	}
+
+	gen->xbusy |= REGBIT(dest);
+	Value rhs = vvalue(gen, binary->rhs, dest);
+
+	switch (binary->op) {
+		case BINOP_ADD: vemit(gen, add[lg], d, rhs.op); break;
+		case BINOP_SUB: vemit(gen, sub[lg], d, rhs.op); break;
+		case BINOP_AND: vemit(gen, X86_PAND, d, rhs.op); break;
+		case BINOP_OR: vemit(gen, X86_POR, d, rhs.op); break;
+		case BINOP_XOR: vemit(gen, X86_PXOR, d, rhs.op); break;
+		case BINOP_MUL: {
+			if (lg == 1) {
+				vemit(gen, X86_PMULLW, d, rhs.op);
+			} else if (gen->avx || (gen->isa & ISA_SSE4)) {
+				vemit(gen, X86_PMULLD, d, rhs.op);
+			} else {
+				vmul32(gen, d, rhs.op);
+			}
+			break;
+		}
+		default: err_internal("no lane-wise operation %d", binary->op);
+	}
+
+	vvaluefree(gen, &rhs);
+
+	xfree(gen, dest);
+}
+
+/* Whether lanes move in aligned pairs, so that a shuffle of them is one of lanes twice the size */
+static bool paired(const uint8_t *lanes, size_t n)
+{
+	for (size_t i = 0; i < n; i += 2) {
+		if (lanes[i] % 2 || lanes[i + 1] != lanes[i] + 1) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * A shuffle is done with the widest lanes that move as a whole: pshufd for
+ * doublewords and quadwords, vpermq for quadwords across the halves of a
+ * YMM register, and pshuflw and pshufhw for words that stay in their half.
+ * YMM registers are shuffled as two XMM ones where both halves move alike.
+ * Anything else goes through the stack, a lane at a time.
+ */
+static void gen_shuffle(Gen *gen, TUnary *unary, Type *type, reg dest)
+{
+	uint8_t lanes[TYPE_MAXLANES];
+	size_t n = type->length;
+	size_t lg = lanelog(gen, type);
+	Operand d = OPREG(dest, type->size);
+
+	memcpy(lanes, unary->lanes, n);
+	gen_vexpr(gen, unary->operand, dest);
+
+	for (; lg < 3 && paired(lanes, n); ++lg) {
+		n /= 2;
+		for (size_t i = 0; i < n; ++i) {
+			lanes[i] = lanes[2 * i] / 2;
+		}
+	}
+
+	bool identity = true;
+	for (size_t i = 0; i < n; ++i) {
+		identity &= lanes[i] == i;
+	}
+
+	if (identity) {
+		return;
+	}
+
+	if (type->size == 32 && lg == 3) {
+		vemit3(gen, X86_VPERMQ, d, d, OPIMM(lanes[0] | lanes[1] << 2 | lanes[2] << 4 | lanes[3] << 6));
+		return;
+	}
+
+	/* The lanes of a half, where the other moves alike */
+	size_t half = 16 >> lg;
+	bool alike = true;
+	for (size_t i = 0; i < n; ++i) {
+		alike &= lanes[i] / half == i / half && lanes[i] % half == lanes[i % half];
+	}
+
+	if (alike && lg == 3) {
+		uint8_t a = lanes[0] * 2;
+		uint8_t b = lanes[1] * 2;
+
+		vemit3(gen, X86_PSHUFD, d, d, OPIMM(a | (a + 1) << 2 | b << 4 | (b + 1) << 6));
+		return;
+	}
+
+	if (alike && lg == 2) {
+		vemit3(gen, X86_PSHUFD, d, d, OPIMM(lanes[0] | lanes[1] << 2 | lanes[2] << 4 | lanes[3] << 6));
+		return;
+	}
+
+	bool low = true;
+	bool high = true;
+	for (size_t i = 0; i < 4; ++i) {
+		low &= lanes[i] < 4;
+		high &= lanes[i + 4] >= 4;
+	}
+
+	if (alike && lg == 1 && low && high) {
+		if (lanes[0] != 0 || lanes[1] != 1 || lanes[2] != 2 || lanes[3] != 3) {
+			vemit3(gen, X86_PSHUFLW, d, d, OPIMM(lanes[0] | lanes[1] << 2 | lanes[2] << 4 | lanes[3] << 6));
+		}
+
+		if (lanes[4] != 4 || lanes[5] != 5 || lanes[6] != 6 || lanes[7] != 7) {
+			vemit3(gen, X86_PSHUFHW, d, d, OPIMM((lanes[4] - 4) | (lanes[5] - 4) << 2 | (lanes[6] - 4) << 4 | (lanes[7] - 4) << 6));
+		}
+
+		return;
+	}
+
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free for a shuffle");
+	}
+
+	/* The vector above, its shuffled lanes below */
+	uint8_t size = type->size;
+	uint8_t w = (uint8_t)(1u << lg);
+
+	emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(2 * size));
+	gen->depth += 2 * size;
+	vmove(gen, OPMEM(RSP, NOREG, 1, size, size), d);
+
+	for (size_t i = 0; i < n; ++i) {
+		Operand src = OPMEM(RSP, NOREG, 1, size + lanes[i] * w, w);
+
+		emit(gen, w < 4 ? X86_MOVZX : X86_MOV, OPREG(r, w < 4 ? 4 : w), src);
+		emit(gen, X86_MOV, OPMEM(RSP, NOREG, 1, i * w, w), OPREG(r, w));
+	}
+
+	vmove(gen, d, OPMEM(RSP, NOREG, 1, 0, size));
+	emit(gen, X86_ADD, OPREG(RSP, 8), OPIMM(2 * size));
+	gen->depth -= 2 * size;
+	regfree(gen, r);
+}
+
+/* Unary operations whose result is a vector */
+static void gen_vunary(Gen *gen, TUnary *unary, Type *type, reg dest)
+{
+	static const x86_op sub[] = { X86_PSUBB, X86_PSUBW, X86_PSUBD, X86_PSUBQ };
+
+	Operand d = OPREG(dest, type->size);
+
+	switch (unary->op) {
+		case UNOP_NEG: {
+			Value x = vvalue(gen, unary->operand, dest);
+
+			vemit(gen, X86_PXOR, d, d);
+			vemit(gen, sub[lanelog(gen, type)], d, x.op);
+
+			vvaluefree(gen, &x);
+			break;
+		}
+		case UNOP_NOT: {
+			gen_vexpr(gen, unary->operand, dest);
+			vnot(gen, dest, type->size);
+			break;
+		}
+		case UNOP_SPLAT: {
+			if (isconst(unary->operand)) {
+				vconst(gen, type, constval(unary->operand), dest);
+				break;
+			}
+
+			reg r = regalloc(gen, 0);
+			if (r == NOREG) {
+				err_internal("no register free for a splat");
+			}
+
+			regfree(gen, r);
+			gen_expr(gen, unary->operand, r);
+			vemit3(gen, X86_MOVD, OPREG(dest, 16), OPREG(r, gen->tfile->types[type->elem]->size == 8 ? 8 : 4), OPNONE);
+			broadcast(gen, type, dest);
+			break;
+		}
+		case UNOP_SHUFFLE: gen_shuffle(gen, unary, type, dest); break;
+		default: err_internal("no vector operation %d", unary->op);
+	}
+}
+
+/* One lane of a vector, extended as values in registers are; those of the upper half of a YMM register are moved down first */
+static void gen_lane(Gen *gen, TUnary *unary, Type *type, reg dest)
+{
+	Type *vtype = gen->tfile->types[unary->operand->type];
+	size_t lg = lanelog(gen, vtype);
+	uint8_t lane = unary->lanes[0];
+	reg t = xtemp(gen, 0);
+	Operand x = OPREG(t, 16);
+
+	xfree(gen, t);
+	gen_vexpr(gen, unary->operand, t);
+
+	if ((size_t)lane << lg >= 16) {
+		vemit3(gen, X86_VEXTRACTI128, x, OPREG(t, 32), OPIMM(1));
+		lane -= 16 >> lg;
+	}
+
+	switch (lg) {
+		case 3: {
+			if (lane) {
+				vemit3(gen, X86_PSHUFD, x, x, OPIMM(0x4E));
+			}
+
+			vemit3(gen, X86_MOVD, OPREG(dest, 8), x, OPNONE);
+			break;
+		}
+		case 2: {
+			if (lane) {
+				vemit3(gen, X86_PSHUFD, x, x, OPIMM(lane));
+			}
+
+			vemit3(gen, X86_MOVD, OPREG(dest, 4), x, OPNONE);
+			break;
+		}
+		case 1: vemit3(gen, X86_PEXTRW, OPREG(dest, 4), x, OPIMM(lane)); break;
+		default: {
+			vemit3(gen, X86_PEXTRW, OPREG(dest, 4), x, OPIMM(lane / 2));
+
+			if (lane % 2) {
+				emit(gen, X86_SHR, OPREG(dest, 4), OPIMM(8));
+			}
+			break;
+		}
+	}
+
+	if (lg == 0 || type->signd) {
+		narrow(gen, type, dest);
+	}
+}
+
+/*
+ * A horizontal reduction: the upper half of the vector is folded onto the
+ * lower, and again, until one lane is left. Bytes are summed by psadbw,
+ * against zero, which adds up each group of eight into a quadword.
+ */
+static void gen_reduce(Gen *gen, TUnary *unary, Type *type, reg dest)
+{
+	static const x86_op add[] = { X86_PADDB, X86_PADDW, X86_PADDD, X86_PADDQ };
+
+	Type *vtype = gen->tfile->types[unary->operand->type];
+	size_t lg = lanelog(gen, vtype);
+	reg t = xtemp(gen, 0);
+
+	xfree(gen, t);
+	gen_vexpr(gen, unary->operand, t);
+	gen->xbusy |= REGBIT(t);
+
+	reg u = xtemp(gen, 0);
+	Operand x = OPREG(t, 16);
+	Operand y = OPREG(u, 16);
+	x86_op op = X86_PXOR;
+
+	switch (unary->op) {
+		case UNOP_REDUCE_ADD: op = add[lg]; break;
+		case UNOP_REDUCE_AND: op = X86_PAND; break;
+		case UNOP_REDUCE_OR: op = X86_POR; break;
+		default: break;
+	}
+
+	if (vtype->size == 32) {
+		vemit3(gen, X86_VEXTRACTI128, y, OPREG(t, 32), OPIMM(1));
+		vemit(gen, op, x, y);
+	}
+
+	if (unary->op == UNOP_REDUCE_ADD && lg == 0) {
+		vemit(gen, X86_PXOR, y, y);
+		vemit(gen, X86_PSADBW, x, y);
+		op = X86_PADDQ;
+		lg = 3;
+	}
+
+	vemit3(gen, X86_PSHUFD, y, x, OPIMM(0x4E));
+	vemit(gen, op, x, y);
+
+	if (lg <= 2) {
+		vemit3(gen, X86_PSHUFD, y, x, OPIMM(0xB1));
+		vemit(gen, op, x, y);
+	}
+
+	if (lg <= 1) {
+		vshift(gen, X86_PSRLD, y, x, 16);
+		vemit(gen, op, x, y);
+	}
+
+	if (lg == 0) {
+		vshift(gen, X86_PSRLW, y, x, 8);
+		vemit(gen, op, x, y);
+	}
+
+	vemit3(gen, X86_MOVD, OPREG(dest, width(type)), x, OPNONE);
+	narrow(gen, type, dest);
+
+	xfree(gen, u);
+	xfree(gen, t);
+}
+
+/*
+ * The top bit of each lane, as a bit of a u32: pmovmskb for bytes, and
+ * movmskps and movmskpd for doublewords and quadwords. Words are packed to
+ * bytes, which keeps their sign, and which AVX2 does within each half.
+ */
+static void gen_mask(Gen *gen, TUnary *unary, reg dest)
+{
+	Type *vtype = gen->tfile->types[unary->operand->type];
+	size_t lg = lanelog(gen, vtype);
+	reg t = xtemp(gen, 0);
+	Operand x = OPREG(t, vtype->size);
+	Operand r = OPREG(dest, 4);
+
+	xfree(gen, t);
+	gen_vexpr(gen, unary->operand, t);
+
+	switch (lg) {
+		case 0: vemit3(gen, X86_PMOVMSKB, r, x, OPNONE); break;
+		case 1: {
+			vemit(gen, X86_PACKSSWB, x, x);
+
+			if (vtype->size == 32) {
+				vemit3(gen, X86_VPERMQ, x, x, OPIMM(0x08));
+			}
+
+			vemit3(gen, X86_PMOVMSKB, r, OPREG(t, 16), OPNONE);
+
+			if (vtype->size == 16) {
+				emit(gen, X86_AND, r, OPIMM(0xFF));
+			}
+			break;
+		}
+		case 2: vemit3(gen, X86_MOVMSKPS, r, x, OPNONE); break;
+		default: vemit3(gen, X86_MOVMSKPD, r, x, OPNONE); break;
+	}
+}
+
+/* Evaluate a vector expression into XMM (or YMM) register 'dest', which must not be busy */
+static void gen_vexpr(Gen *gen, TExpression *expression, reg dest)
+{
+	Type *type = gen->tfile->types[expression->type];
+
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT: vconst(gen, type, constval(expression), dest); break;
+		case TEXPRESSION_VARIABLE:
+		case TEXPRESSION_GLOBAL:
+		case TEXPRESSION_FIELD:
+		case TEXPRESSION_INDEX: {
+			reg index = NOREG;
+
+			if (!direct(gen, expression) && (index = regalloc(gen, 0)) == NOREG) {
+				err_internal("no register free for an index");
+			}
+
+			if (index != NOREG) {
+				regfree(gen, index);
+			}
+
+			vmove(gen, OPREG(dest, type->size), address(gen, expression, index));
+			break;
+		}
+		case TEXPRESSION_CALL: gen_call(gen, expression->call, dest); break;
+		case TEXPRESSION_BINARY: gen_vbinary(gen, expression->binary, type, dest); break;
+		case TEXPRESSION_UNARY: gen_vunary(gen, expression->unary, type, dest); break;
+		default: break;
+	}
+}
+
+static int casecmp_signed(const void *a, const void *b)
+{
+	int64_t x = (int64_t)((const SwitchCase *)a)->value;
+	int64_t y = (int64_t)((const SwitchCase *)b)->value;
+
+	return (x > y) - (x < y);
+}
+
+static int casecmp_unsigned(const void *a, const void *b)
+{
+	uint64_t x = ((const SwitchCase *)a)->value;
+	uint64_t y = ((const SwitchCase *)b)->value;
+
+	return (x > y) - (x < y);
+}
+
+/* Compare a register with a constant; 64-bit constants beyond imm32 go through a register */
+static void cmpconst(Gen *gen, reg r, uint8_t w, uint64_t v)
+{
+	if (w == 4 || ((int64_t)v >= INT32_MIN && (int64_t)v <= INT32_MAX)) {
+		emit(gen, X86_CMP, OPREG(r, w), OPIMM((int64_t)v));
+		return;
+	}
+
+	reg t = regalloc(gen, 0);
+	if (t == NOREG) {
+		err_internal("no register free for a switch");
+	}
+
+	emit(gen, X86_MOV, OPREG(t, 8), OPIMM((int64_t)v));
+	emit(gen, X86_CMP, OPREG(r, 8), OPREG(t, 8));
+	regfree(gen, t);
+}
+
+/*
+ * Jump through a table in .rodata of 32-bit offsets from the table itself,
+ * which keeps the table position-independent:
+ *
+ *   r -= min; if (r > max - min) goto default
+ *   b = &table; r = b + (int32_t)b[r]; goto *r
+ *
+ * r may be clobbered, as nothing after the indirect jump uses it.
+ */
+static void gen_jumptable(Gen *gen, SwitchCase *cases, size_t n, reg r, uint8_t w, label def)
+{
+	uint64_t min = cases[0].value;
+	uint64_t range = cases[n - 1].value - min + 1;
+
+	reg b = regalloc(gen, 0);
+	if (b == NOREG) {
+		err_internal("no register free for a switch");
+	}
+
+	if (min == 0) {
+		/* nothing to subtract */
+	} else if (w == 4 || ((int64_t)min >= INT32_MIN && (int64_t)min <= INT32_MAX)) {
+		emit(gen, X86_SUB, OPREG(r, w), OPIMM((int64_t)min));
+	} else {
+		emit(gen, X86_MOV, OPREG(b, 8), OPIMM((int64_t)min));
+		emit(gen, X86_SUB, OPREG(r, 8), OPREG(b, 8));
+	}
+
+	emit(gen, X86_CMP, OPREG(r, w), OPIMM((int64_t)(range - 1)));
+	emitcc(gen, X86_JCC, CC_A, OPLABEL(def), OPNONE);
+
+	/* The table; every slot without a case goes to the default */
+	gen->rodatasize = (gen->rodatasize + 3) & ~(size_t)3;
+	size_t base = gen->rodatasize;
+	uint8_t zero[4] = { 0 };
+
+	for (uint64_t i = 0, c = 0; i < range; ++i) {
+		TableEntry entry = {
+			.at = gen->rodatasize,
+			.base = base,
+			.enc = gen->enc,
+			.target = def,
+		};
+
+		if (cases[c].value - min == i) {
+			entry.target = cases[c++].target;
+		}
+
+		vec_push(gen->tableents, &entry, &gen->ntableents, sizeof(TableEntry));
+		vec_join(gen->rodata, zero, &gen->rodatasize, sizeof(zero), sizeof(uint8_t));
+	}
+
+	/* Values are written at 32 bits or more, so r's upper half is clear for 4-byte types */
+	emit(gen, X86_LEA, OPREG(b, 8), OPMEM(RIP, NOREG, 1, 0, 0));
+	elf_add_reloc(gen->elf, gen->enc->ripdisp, R_X86_64_PC32, gen->rodatasym, (int64_t)base - (int64_t)(gen->enc->size - gen->enc->ripdisp));
+
+	emit(gen, X86_MOVSXD, OPREG(r, 8), OPMEM(b, r, 4, 0, 4));
+	emit(gen, X86_ADD, OPREG(r, 8), OPREG(b, 8));
+	emit(gen, X86_JMP, OPREG(r, 8), OPNONE);
+
+	regfree(gen, b);
+}
+
+/* Dispatch on r to the (sorted) cases, or to 'def' if none matches */
+static void gen_cases(Gen *gen, SwitchCase *cases, size_t n, reg r, Type *type, label def)
+{
+	uint8_t w = width(type);
+
+	if (n <= SWITCH_LINEAR) {
+		for (size_t i = 0; i < n; ++i) {
+			cmpconst(gen, r, w, cases[i].value);
+			emitcc(gen, X86_JCC, CC_E, OPLABEL(cases[i].target), OPNONE);
+		}
+
+		emit(gen, X86_JMP, OPLABEL(def), OPNONE);
+		return;
+	}
+
+	uint64_t span = cases[n - 1].value - cases[0].value;
+	if (span / SWITCH_DENSITY < n) {
+		gen_jumptable(gen, cases, n, r, w, def);
+		return;
+	}
+
+	/* Binary search: cases below the middle one fall through, those above are jumped to */
+	size_t mid = n / 2;
+	label above = enc_label(gen->enc);
+
+	cmpconst(gen, r, w, cases[mid].value);
+	emitcc(gen, X86_JCC, CC_E, OPLABEL(cases[mid].target), OPNONE);
+	emitcc(gen, X86_JCC, type->signd ? CC_G : CC_A, OPLABEL(above), OPNONE);
+
+	gen_cases(gen, cases, mid, r, type, def);
+
+	bind(gen, above);
+	gen_cases(gen, cases + mid + 1, n - mid - 1, r, type, def);
+}
+
+static void gen_switch(Gen *gen, TSwitch *sw, bool last)
+{
+	Type *type = gen->tfile->types[sw->expr->type];
+
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free for a switch");
+	}
+
+	regfree(gen, r);
+	gen_expr(gen, sw->expr, r);
+	gen->busy |= REGBIT(r);
+	cse_drop(gen);
+
+	label end = enc_label(gen->enc);
+	label def = sw->def ? enc_label(gen->enc) : end;
+	label *arms = acalloc(sw->ncases + 1, sizeof(label));
+
+	SwitchCase *cases = NULL;
+	size_t ncases = 0;
+
+	for (size_t i = 0; i < sw->ncases; ++i) {
+		arms[i] = enc_label(gen->enc);
+
+		for (size_t j = 0; j < sw->cases[i]->nvalues; ++j) {
+			SwitchCase c = { .value = sw->cases[i]->values[j], .target = arms[i] };
+			vec_push(cases, &c, &ncases, sizeof(SwitchCase));
+		}
+	}
+
+	if (ncases) {
+		qsort(cases, ncases, sizeof(SwitchCase), type->signd ? casecmp_signed : casecmp_unsigned);
+	}
+
+	gen_cases(gen, cases, ncases, r, type, def);
+	regfree(gen, r);
+
+	/* Arms are laid out in order; all but the last jump past the rest when done */
+	for (size_t i = 0; i < sw->ncases; ++i) {
+		bool final = (i == sw->ncases - 1 && !sw->def);
+		TBlock *block = sw->cases[i]->block;
+
+		bind(gen, arms[i]);
+		gen_block(gen, block, last && final);
+
+		if (!final && !endsinreturn(block)) {
+			emit(gen, X86_JMP, OPLABEL(end), OPNONE);
+		}
+	}
+
+	if (sw->def) {
+		bind(gen, def);
+		gen_block(gen, sw->def, last);
+	}
+
+	bind(gen, end);
+
+	afree(arms);
+	afree(cases);
+}
+
+/* Jump to 'target' if a bool is 'jumpif'; comparisons branch on their flags rather than materialise a bool */
+static void gen_branch(Gen *gen, TExpression *expression, bool jumpif, label target)
+{
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free for a branch");
+	}
+
+	regfree(gen, r);
+
+	if (expression->variant == TEXPRESSION_BINARY && expression->binary->op >= BINOP_EQ && !cse_find(gen, expression)) {
+		TBinary *binary = canonical(expression->binary);
+		cond cc = compare(gen, binary, gen->tfile->types[binary->lhs->type], r);
+
+		emitcc(gen, X86_JCC, jumpif ? cc : CC_NEGATE(cc), OPLABEL(target), OPNONE);
+		return;
+	}
+
+	gen_expr(gen, expression, r);
+	emit(gen, X86_TEST, OPREG(r, 4), OPREG(r, 4));
+	emitcc(gen, X86_JCC, jumpif ? CC_NE : CC_E, OPLABEL(target), OPNONE);
+}
+
+/* Defer a cold block to the end of the function; control comes back to 'resume' */
+static void defer(Gen *gen, TBlock *block, label at, label resume)
+{
+	ColdBlock cold = {
+		.at = at,
+		.block = block,
+		.resume = resume,
+		.depth = gen->depth,
+		.busy = gen->busy,
+		.xbusy = gen->xbusy,
+	};
+
+	vec_push(gen->colds, &cold, &gen->ncolds, sizeof(ColdBlock));
+}
+
+/*
+ * The arm expected to be taken falls through from the condition. An arm that
+ * is cold, because of a hint or because it calls a cold function (and the
+ * other does not), is moved past the end of the function, out of the way of
+ * the hot path in the instruction cache; the hot path then has no taken
+ * branch at all.
+ */
+static void gen_if(Gen *gen, TIf *tif, bool last)
+{
+	bool thencold = tif->hint == HINT_UNLIKELY
+		|| (tif->hint == HINT_NONE && iscold(gen, tif->then) && !(tif->els && iscold(gen, tif->els)));
+	bool elsecold = tif->els && (tif->hint == HINT_LIKELY
+		|| (tif->hint == HINT_NONE && iscold(gen, tif->els) && !iscold(gen, tif->then)));
+
+	label end = enc_label(gen->enc);
+
+	if (thencold || elsecold) {
+		label cold = enc_label(gen->enc);
+		TBlock *hot = thencold ? tif->els : tif->then;
+
+		gen_branch(gen, tif->cond, thencold, cold);
+		cse_drop(gen);
+
+		defer(gen, thencold ? tif->then : tif->els, cold, end);
+
+		if (hot) {
+			gen_block(gen, hot, last);
+		}
+
+		bind(gen, end);
+		return;
+	}
+
+	label other = tif->els ? enc_label(gen->enc) : end;
+
+	gen_branch(gen, tif->cond, false, other);
+	cse_drop(gen);
+
+	gen_block(gen, tif->then, last && !tif->els);
+
+	if (tif->els) {
+		if (!endsinreturn(tif->then)) {
+			emit(gen, X86_JMP, OPLABEL(end), OPNONE);
+		}
+
+		bind(gen, other);
+		gen_block(gen, tif->els, last);
+	}
+
+	bind(gen, end);
+}
+
+/*
+ * Loops are entered through a test of the condition, and repeat through a
+ * test at the bottom, so that each iteration takes one branch. The
+ * preheader goes between the two, and the top of the loop is aligned.
+ */
+static void gen_while(Gen *gen, TWhile *loop)
+{
+	label top = enc_label(gen->enc);
+	label exit = enc_label(gen->enc);
+
+	gen_branch(gen, loop->guard, false, exit);
+	cse_drop(gen);
+
+	gen_block(gen, loop->pre, false);
+
+	/* Cold code is packed tightly; see gen_fun() */
+	if (gen->enc != gen->unlikely) {
+		align(gen, gen->loopalign);
+	}
+
+	bind(gen, top);
+	gen_block(gen, loop->block, false);
+
+	gen->ncses = 0;
+	cse_collect(gen, loop->cond, hascall(loop->cond));
+	gen_branch(gen, loop->cond, true, top);
+	cse_drop(gen);
+
+	bind(gen, exit);
+}
+
+/* Clear 'size' bytes of memory, widest stores first; large arrays in a loop of quadwords */
+static void zero(Gen *gen, Operand dest, size_t size)
+{
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free to clear a struct");
+	}
+
+	emit(gen, X86_XOR, OPREG(r, 4), OPREG(r, 4));
+
+	reg count = size > ZERO_MAXUNROLL ? regalloc(gen, REGBIT(r)) : NOREG;
+
+	if (count != NOREG) {
+		size_t n = size / 8;
+		label top = enc_label(gen->enc);
+
+		/* The count runs up from -n to 0, so the flags of the increment end the loop */
+		emit(gen, X86_MOV, OPREG(count, 8), OPIMM(-(int64_t)n));
+		bind(gen, top);
+		emit(gen, X86_MOV, OPMEM(dest.mem.base, count, 8, dest.mem.disp + (int32_t)(n * 8), 8), OPREG(r, 8));
+		emit(gen, X86_ADD, OPREG(count, 8), OPIMM(1));
+		emitcc(gen, X86_JCC, CC_NE, OPLABEL(top), OPNONE);
+
+		regfree(gen, count);
+		dest.mem.disp += n * 8;
+		size -= n * 8;
+	}
+
+	for (uint8_t w = 8; w > 0; w >>= 1) {
+		for (; size >= w; size -= w) {
+			dest.size = w;
+			emit(gen, X86_MOV, dest, OPREG(r, w));
+			dest.mem.disp += w;
+		}
+	}
+
+	regfree(gen, r);
+}
+
+/*
+ * A variable whose new value is its old one combined with a constant or a
+ * variable is updated in place; anything else is computed into a scratch
+ * register and stored. Structs and arrays are only ever assigned their
+ * initial zero.
+ */
+static void gen_assign(Gen *gen, TAssign *assign)
+{
+	static const x86_op ops[] = {
+		[BINOP_ADD] = X86_ADD, [BINOP_SUB] = X86_SUB,
+		[BINOP_AND] = X86_AND, [BINOP_OR] = X86_OR, [BINOP_XOR] = X86_XOR,
+	};
+
+	Operand home = gen->vars[assign->var];
+	Type *type = gen->tfile->types[gen->tfile->tvariables[assign->var]->type];
+	TExpression *value = assign->value;
+	bool inreg = home.kind == OPND_REG;
+
+	if (type->kind == TYPE_VECTOR) {
+		gen_vassign(gen, assign, home, type);
+		return;
+	}
+
+	if (type->kind != TYPE_PRIMITIVE) {
+		zero(gen, home, type->size);
+		return;
+	}
+
+	uint8_t w = inreg ? width(type) : type->size;
+
+	if (value->variant == TEXPRESSION_BINARY && (inreg || type->size >= 4)) {
+		TBinary *binary = canonical(value->binary);
+		TExpression *rhs = binary->rhs;
+		Operand src = OPNONE;
+
+		bool inplace = binary->op == BINOP_ADD || binary->op == BINOP_SUB
+			|| binary->op == BINOP_AND || binary->op == BINOP_OR || binary->op == BINOP_XOR;
+
+		if (!inplace || binary->lhs->variant != TEXPRESSION_VARIABLE || binary->lhs->var != assign->var) {
+			/* not an update */
+		} else if (isconst(rhs)) {
+			int64_t c = (int64_t)constval(rhs);
+
+			if ((w == 4 && (uint64_t)c <= UINT32_MAX) || (c >= INT32_MIN && c <= INT32_MAX)) {
+				src = OPIMM(c);
+			}
+		} else if (rhs->variant == TEXPRESSION_VARIABLE && type->size >= 4
+				&& (inreg || gen->vars[rhs->var].kind == OPND_REG)) {
+			src = gen->vars[rhs->var];
+			src.size = w;
+		}
+
+		if (src.kind != OPND_NONE) {
+			home.size = w;
+			emit(gen, ops[binary->op], home, src);
+
+			if (inreg && (binary->op == BINOP_ADD || binary->op == BINOP_SUB)) {
+				narrow(gen, type, home.reg);
+			}
+
+			return;
+		}
+	}
+
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free for an assignment");
+	}
+
+	regfree(gen, r);
+	gen_expr(gen, value, r);
+
+	home.size = w;
+	emit(gen, X86_MOV, home, OPREG(r, w));
+}
+
+/*
+ * A vector kept in a register is updated in place by lane-wise addition,
+ * subtraction and logic with the other operand; anything else is computed
+ * into a scratch register and moved.
+ */
+static void gen_vassign(Gen *gen, TAssign *assign, Operand home, Type *type)
+{
+	static const x86_op ops[][4] = {
+		[BINOP_ADD] = { X86_PADDB, X86_PADDW, X86_PADDD, X86_PADDQ },
+		[BINOP_SUB] = { X86_PSUBB, X86_PSUBW, X86_PSUBD, X86_PSUBQ },
+		[BINOP_AND] = { X86_PAND, X86_PAND, X86_PAND, X86_PAND },
+		[BINOP_OR] = { X86_POR, X86_POR, X86_POR, X86_POR },
+		[BINOP_XOR] = { X86_PXOR, X86_PXOR, X86_PXOR, X86_PXOR },
+	};
+
+	TExpression *value = assign->value;
+
+	if (home.kind == OPND_REG && value->variant == TEXPRESSION_BINARY) {
+		TBinary *binary = canonical(value->binary);
+		binop op = binary->op;
+
+		bool inplace = op == BINOP_ADD || op == BINOP_SUB || op == BINOP_AND || op == BINOP_OR || op == BINOP_XOR;
+
+		if (inplace && binary->lhs->variant == TEXPRESSION_VARIABLE && binary->lhs->var == assign->var) {
+			Value rhs = vvalue(gen, binary->rhs, home.reg);
+
+			vemit(gen, ops[op][lanelog(gen, type)], home, rhs.op);
+
+			vvaluefree(gen, &rhs);
+
+			return;
+		}
+	}
+
+	reg r = xtemp(gen, 0);
+	xfree(gen, r);
+	gen_vexpr(gen, value, r);
+	vmove(gen, home, OPREG(r, type->size));
+}
+
+/*
+ * A store to a field or an element; constants are stored as immediates. The
+ * value is computed first, so an index register is only held for the store.
+ * It is done by 'op': mov, or movnti for a non-temporal store (movntdq for a
+ * vector), or xchg for a sequentially consistent one; only mov stores an
+ * immediate. An 'ordered' store is an atomic one that must stay in place.
+ * A plain store of a value with its bytes swapped is a movbe of the value.
+ */
+static void gen_store(Gen *gen, TExpression *place, TExpression *value, x86_op op, bool ordered)
+{
+	size_t size = gen->tfile->types[place->type]->size;
+	bool vector = gen->tfile->types[place->type]->kind == TYPE_VECTOR;
+	Operand src = OPNONE;
+	reg r = NOREG;
+
+	if (op == X86_MOV && !ordered && size >= 2 && (gen->isa & ISA_MOVBE) && value->variant == TEXPRESSION_UNARY
+			&& value->unary->op == UNOP_BSWAP && fusable(gen, value)) {
+		op = X86_MOVBE;
+		value = value->unary->operand;
+	}
+
+	if (vector) {
+		r = xtemp(gen, 0);
+		xfree(gen, r);
+		gen_vexpr(gen, value, r);
+		gen->xbusy |= REGBIT(r);
+		src = OPREG(r, size);
+	} else if (op == X86_MOV && isconst(value)) {
+		int64_t c = (int64_t)constval(value);
+
+		if (size < 8 || (c >= INT32_MIN && c <= INT32_MAX)) {
+			src = OPIMM(c);
+		}
+	}
+
+	if (src.kind == OPND_NONE) {
+		if ((r = regalloc(gen, 0)) == NOREG) {
+			err_internal("no register free for a store");
+		}
+
+		regfree(gen, r);
+		gen_expr(gen, value, r);
+		gen->busy |= REGBIT(r);
+		src = OPREG(r, size);
+	}
+
+	reg index = regalloc(gen, 0);
+	if (index == NOREG && !direct(gen, place)) {
+		err_internal("no register free for an index");
+	}
+
+	if (index != NOREG) {
+		regfree(gen, index);
+	}
+
+	Operand dest = address(gen, place, index);
+
+	if (vector) {
+		if (op == X86_MOV) {
+			vmove(gen, dest, src);
+		} else {
+			vemit3(gen, X86_MOVNTDQ, dest, src, OPNONE);
+		}
+
+		xfree(gen, r);
+		return;
+	}
+
+	if (ordered) {
+		emitatomic(gen, op, dest, src, true);
+	} else {
+		emit(gen, op, dest, src);
+	}
+
+	if (r != NOREG) {
+		regfree(gen, r);
+	}
+}
+
+/* A bounds check hoisted out of a loop; it traps as the checks it stands for would have */
+static void gen_check(Gen *gen, TCheck *check)
+{
+	Type *itype = gen->tfile->types[check->index->type];
+	Operand length = OPIMM(check->length);
+
+	if (check->bound != NONDX) {
+		length = gen->vars[check->bound];
+		length.size = 8;
+	}
+
+	reg r = regalloc(gen, 0);
+	if (r == NOREG) {
+		err_internal("no register free for a bounds check");
+	}
+
+	regfree(gen, r);
+	gen_expr(gen, check->index, r);
+
+	if (itype->signd && itype->size < 8) {
+		emit(gen, X86_MOVSXD, OPREG(r, 8), OPREG(r, 4));
+	}
+
+	emit(gen, X86_CMP, OPREG(r, 8), length);
+	emitcc(gen, X86_JCC, CC_AE, OPLABEL(trap(gen)), OPNONE);
+}
+
+/* The registers an asm statement names: those of its operands' letters, and those it clobbers */
+static uint16_t asmregs(TAsm *tasm)
+{
+	uint16_t regs = tasm->clobbers;
+
+	for (size_t i = 0; i < tasm->noperands; ++i) {
+		reg r = asm_letter(tasm->operands[i].constraint);
+
+		if (r != NOREG) {
+			regs |= REGBIT(r);
+		}
+	}
+
+	return regs;
+}
+
+/*
+ * Copy registers into others all at once, each destination getting what its
+ * source held before any of them is written. A destination no copy still to
+ * be made reads is written first; once every one left is read by another,
+ * they form cycles, which are turned by exchanges.
+ */
+static void shuffle(Gen *gen, Move *moves, size_t n)
+{
+	while (n) {
+		size_t i = 0;
+
+		for (; i < n; ++i) {
+			size_t j = 0;
+			while (j < n && moves[j].src != moves[i].dest) {
+				++j;
+			}
+
+			if (j == n) {
+				break;
+			}
+		}
+
+		if (i < n) {
+			emit(gen, X86_MOV, OPREG(moves[i].dest, 8), OPREG(moves[i].src, 8));
+		} else {
+			/* The destination now holds what its source did, and the source what it did */
+			i = 0;
+			emit(gen, X86_XCHG, OPREG(moves[i].dest, 8), OPREG(moves[i].src, 8));
+
+			for (size_t j = 1; j < n; ++j) {
+				if (moves[j].src == moves[i].dest) {
+					moves[j].src = moves[i].src;
+				}
+			}
+		}
+
+		moves[i] = moves[--n];
+
+		/* An exchange may have left a copy in place */
+		for (size_t j = n; j-- > 0;) {
+			if (moves[j].dest == moves[j].src) {
+				moves[j] = moves[--n];
+			}
+		}
+	}
+}
+
+/*
+ * An operand of an instruction of an asm statement, with its references to
+ * the statement's operands resolved. A reference takes the size of its
+ * operand's type unless it is given one of its own.
+ */
+static Operand asmop(Gen *gen, TAsm *tasm, AsmOperand *operand, reg *regs, Operand *mems)
+{
+	Operand op = operand->op;
+
+	if (operand->ref != ASM_NOREF) {
+		TAsmOperand *of = &tasm->operands[operand->ref];
+		uint8_t size = op.size ? op.size : gen->tfile->types[of->expr->type]->size;
+
+		if (of->constraint == 'i') {
+			op = OPIMM((int64_t)of->expr->number->u64);
+		} else if (of->constraint == 'm') {
+			op = mems[operand->ref];
+			op.size = size;
+		} else {
+			op = OPREG(regs[operand->ref], size);
+		}
+	}
+
+	if (operand->base != ASM_NOREF) {
+		op.mem.base = regs[operand->base];
+	}
+
+	if (operand->index != ASM_NOREF) {
+		op.mem.index = regs[operand->index];
+	}
+
+	return op;
+}
+
+/*
+ * An asm statement. Each output is put in the register its letter names, or
+ * else that of its variable where no other operand needs it, or else any
+ * free one. The inputs are then computed, wherever they can be, and copied
+ * into their registers at once (see shuffle()); constants and variables in
+ * memory are loaded straight into theirs afterwards. The registers of memory
+ * operands are kept apart from all those the asm changes. Registers it
+ * names that hold variables, other than its outputs', are saved around it,
+ * and the outputs are written back to their variables after it.
+ */
+static void gen_asm(Gen *gen, TAsm *tasm)
+{
+	uint16_t busy = gen->busy;
+	uint16_t fixed = asmregs(tasm);
+	uint16_t homes = 0;
+
+	reg regs[ASM_MAXOPERANDS]; /* the register each operand is in, but for constants and memory */
+	reg srcs[ASM_MAXOPERANDS]; /* where each input is computed, or NOREG if it is loaded afterwards */
+	Operand mems[ASM_MAXOPERANDS];
+	Move moves[ASM_MAXOPERANDS];
+	size_t nmoves = 0;
+
+	for (size_t i = 0; i < tasm->nouts; ++i) {
+		Operand home = gen->vars[tasm->operands[i].expr->var];
+
+		if (home.kind == OPND_REG) {
+			homes |= REGBIT(home.reg);
+		}
+	}
+
+	uint16_t saved = busy & fixed & ~homes;
+	xsave(gen, tasm->xclobbers);
+	save(gen, saved);
+
+	uint16_t reserved = fixed;
+	for (size_t i = 0; i < tasm->nouts; ++i) {
+		Operand home = gen->vars[tasm->operands[i].expr->var];
+		reg r = asm_letter(tasm->operands[i].constraint);
+
+		if (r == NOREG && home.kind == OPND_REG && !(reserved & REGBIT(home.reg))) {
+			r = home.reg;
+		} else if (r == NOREG && (r = regalloc(gen, reserved)) == NOREG) {
+			err_source(tasm->file, tasm->span, "not enough registers free for the outputs of asm");
+		}
+
+		regs[i] = r;
+		reserved |= REGBIT(r);
+	}
+
+	for (size_t i = tasm->nouts; i < tasm->noperands; ++i) {
+		TAsmOperand *in = &tasm->operands[i];
+		TExpression *e = in->expr;
+
+		regs[i] = NOREG;
+		srcs[i] = NOREG;
+
+		if (in->constraint == 'i') {
+			continue;
+		}
+
+		if (in->constraint == 'm') {
+			reg index = regalloc(gen, reserved);
+			if (index == NOREG && !direct(gen, e)) {
+				err_source(tasm->file, tasm->span, "not enough registers free for the operands of asm");
+			}
+
+			if (index != NOREG) {
+				regfree(gen, index);
+			}
+
+			Operand op = address(gen, e, index);
+			reg *used[2] = { &op.mem.base, &op.mem.index };
+
+			for (size_t j = 0; j < 2; ++j) {
+				if (*used[j] != NOREG && *used[j] != RBP) {
+					gen->busy |= REGBIT(*used[j]);
+				}
+			}
+
+			/* The asm may change the registers it names before it reads memory */
+			for (size_t j = 0; j < 2; ++j) {
+				if (*used[j] == NOREG || *used[j] == RBP || !(reserved & REGBIT(*used[j]))) {
+					continue;
+				}
+
+				reg r = regalloc(gen, reserved);
+				if (r == NOREG) {
+					err_source(tasm->file, tasm->span, "not enough registers free for the operands of asm");
+				}
+
+				emit(gen, X86_MOV, OPREG(r, 8), OPREG(*used[j], 8));
+				*used[j] = r;
+			}
+
+			mems[i] = op;
+			continue;
+		}
+
+		if (e->variant == TEXPRESSION_VARIABLE && gen->vars[e->var].kind == OPND_REG) {
+			srcs[i] = gen->vars[e->var].reg;
+		} else if (e->variant != TEXPRESSION_VARIABLE && !isconst(e)) {
+			reg r = regalloc(gen, reserved);
+			if (r == NOREG && (r = regalloc(gen, 0)) == NOREG) {
+				err_source(tasm->file, tasm->span, "not enough registers free for the operands of asm");
+			}
+
+			regfree(gen, r);
+			gen_expr(gen, e, r);
+			gen->busy |= REGBIT(r);
+			srcs[i] = r;
+		}
+	}
+
+	/* Inputs in a register of no other operand are used where they are */
+	uint16_t dests = 0;
+	for (size_t i = tasm->nouts; i < tasm->noperands; ++i) {
+		char c = tasm->operands[i].constraint;
+		reg r = asm_letter(c);
+
+		if (c == 'i' || c == 'm') {
+			continue;
+		}
+
+		if (c >= '0' && c <= '9') {
+			r = regs[c - '0'];
+		} else if (r == NOREG && srcs[i] != NOREG && !((reserved | dests) & REGBIT(srcs[i]))) {
+			r = srcs[i];
+		} else if (r == NOREG && (r = regalloc(gen, reserved | dests)) == NOREG) {
+			err_source(tasm->file, tasm->span, "not enough registers free for the operands of asm");
+		}
+
+		regs[i] = r;
+		dests |= REGBIT(r);
+
+		if (srcs[i] != NOREG && srcs[i] != r) {
+			moves[nmoves++] = (Move){ .dest = r, .src = srcs[i] };
+		}
+	}
+
+	shuffle(gen, moves, nmoves);
+
+	for (size_t i = tasm->nouts; i < tasm->noperands; ++i) {
+		if (regs[i] != NOREG && srcs[i] == NOREG) {
+			gen_expr(gen, tasm->operands[i].expr, regs[i]);
+		}
+	}
+
+	/* What is written in asm is laid down as it is */
+	flush(gen);
+
+	uint16_t resized = 0; /* outputs referred to at a size of other than their type */
+	for (size_t i = 0; i < tasm->ninsns; ++i) {
+		AsmInsn *ai = &tasm->insns[i];
+		Insn insn = {
+			.op = ai->op,
+			.cc = ai->cc,
+			.vex = ai->vex,
+			.lock = ai->lock,
+		};
+
+		for (size_t j = 0; j < 3; ++j) {
+			insn.ops[j] = asmop(gen, tasm, &ai->ops[j], regs, mems);
+
+			int ref = ai->ops[j].ref;
+			if (ref != ASM_NOREF && (size_t)ref < tasm->nouts && ai->ops[j].op.size) {
+				resized |= 1u << ref;
+			}
+		}
+
+		/* Memory of no size written takes that of a register beside it; lea and prefetches take none */
+		bool sizeless = insn.op == X86_LEA || (insn.op >= X86_PREFETCHT0 && insn.op <= X86_PREFETCHNTA);
+		for (size_t j = 0; j < 3 && !sizeless; ++j) {
+			for (size_t k = 0; k < 3 && insn.ops[j].kind == OPND_MEM && !insn.ops[j].size; ++k) {
+				if (insn.ops[k].kind == OPND_REG) {
+					insn.ops[j].size = insn.ops[k].size;
+				}
+			}
+		}
+
+		if (!enc_encodable(insn)) {
+			err_source(tasm->file, ai->span, "no form of '%s' takes these operands", enc_opname(insn.op));
+		}
+
+		encode(gen, insn);
+	}
+
+	/* Outputs go back to their variables: those in memory first, as those in registers may be taken by others */
+	nmoves = 0;
+	for (size_t i = 0; i < tasm->nouts; ++i) {
+		Operand home = gen->vars[tasm->operands[i].expr->var];
+		Type *type = gen->tfile->types[tasm->operands[i].expr->type];
+
+		if (home.kind == OPND_MEM) {
+			emit(gen, X86_MOV, home, OPREG(regs[i], type->size));
+		} else if (home.reg != regs[i]) {
+			moves[nmoves++] = (Move){ .dest = home.reg, .src = regs[i] };
+		}
+	}
+
+	shuffle(gen, moves, nmoves);
+
+	/* The asm may have written part of a register only, or all of one that holds 32 bits */
+	for (size_t i = 0; i < tasm->nouts; ++i) {
+		Operand home = gen->vars[tasm->operands[i].expr->var];
+		Type *type = gen->tfile->types[tasm->operands[i].expr->type];
+
+		if (home.kind == OPND_REG && type->size < 4) {
+			narrow(gen, type, home.reg);
+		} else if (home.kind == OPND_REG && type->size == 4 && (resized & (1u << i))) {
+			emit(gen, X86_MOV, OPREG(home.reg, 4), OPREG(home.reg, 4));
+		}
+	}
+
+	gen->busy = busy;
+	restore(gen, saved);
+	xrestore(gen, tasm->xclobbers);
+}
+
+static bool endsinreturn(TBlock *block)
+{
+	if (!block->nstatements) {
+		return false;
+	}
+
+	t_node_variant variant = block->statements[block->nstatements - 1]->variant;
+	return variant == TSTATEMENT_RETURN || variant == TSTATEMENT_RETURN_NOVAL;
+}
+
+/* 'last' is whether the block ends the function, so a final return can fall through */
+static void gen_block(Gen *gen, TBlock *block, bool last)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		gen_statement(gen, block->statements[i], last && i == block->nstatements - 1);
+	}
+}
+
+static void gen_statement(Gen *gen, TStatement *statement, bool last)
+{
+	TExpression *expr = statement_expr(statement);
+
+	gen->ncses = 0;
+	if (expr) {
+		cse_collect(gen, expr, hascall(expr));
+	}
+
+	switch (statement->variant) {
+		case TSTATEMENT_RETURN: {
+			Type *type = gen->tfile->types[statement->expr->type];
+
+			/* xmm0 may hold a vector argument until the result is computed */
+			if (type->kind == TYPE_VECTOR) {
+				reg r = gen->xbusy & REGBIT(0) ? xtemp(gen, 0) : (reg)0;
+
+				xfree(gen, r);
+				gen_vexpr(gen, statement->expr, r);
+				vmove(gen, OPREG((reg)0, type->size), OPREG(r, type->size));
+			} else {
+				gen_expr(gen, statement->expr, RAX);
+			}
+
+			if (!last) {
+				emit(gen, X86_JMP, OPLABEL(gen->retlabel), OPNONE);
+			}
+
+			break;
+		}
+		case TSTATEMENT_RETURN_NOVAL: {
+			if (!last) {
+				emit(gen, X86_JMP, OPLABEL(gen->retlabel), OPNONE);
+			}
+
+			break;
+		}
+		case TSTATEMENT_SWITCH: gen_switch(gen, statement->sw, last); break;
+		case TSTATEMENT_IF: gen_if(gen, statement->tif, last); break;
+		case TSTATEMENT_WHILE: gen_while(gen, statement->loop); break;
+		case TSTATEMENT_VAR:
+		case TSTATEMENT_ASSIGN: gen_assign(gen, statement->assign); break;
+		case TSTATEMENT_STORE: gen_store(gen, statement->store->place, statement->store->value, X86_MOV, false); break;
+		case TSTATEMENT_CHECK: gen_check(gen, statement->check); break;
+		case TSTATEMENT_BUILTIN: gen_builtin(gen, statement->expr->builtin, NOREG); break;
+		case TSTATEMENT_ASM: gen_asm(gen, statement->tasm); break;
+		default: break;
+	}
+
+	cse_drop(gen);
+}
+
+/* Collect the variables a block (and those nested in it) declares */
+static void locals(Gen *gen, TBlock *block, size_t depth, Local **list, size_t *n)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		if (statement->variant == TSTATEMENT_VAR) {
+			Local local = { .var = statement->assign->var, .depth = depth };
+			vec_push(*list, &local, n, sizeof(Local));
+		}
+
+		TBlock *nested = NULL;
+		for (size_t j = 0; (nested = statement_block(statement, j)); ++j) {
+			/* A loop's preheader runs outside it */
+			bool inloop = statement->variant == TSTATEMENT_WHILE && nested == statement->loop->block;
+			locals(gen, nested, depth + inloop, list, n);
+		}
+	}
+}
+
+/* Most deeply nested first, then in order of declaration */
+static int localcmp(const void *a, const void *b)
+{
+	const Local *x = a;
+	const Local *y = b;
+
+	if (x->depth != y->depth) {
+		return x->depth < y->depth ? 1 : -1;
+	}
+
+	return (x->var > y->var) - (x->var < y->var);
+}
+
+/*
+ * Leaf functions keep register arguments where they arrive, and give locals
+ * scratch registers too, those in the innermost loops first, as long as
+ * MINFREE are left over; they do without a frame unless something lives on
+ * the stack. Vector arguments and locals are kept in XMM registers the same
+ * way, leaving XMINFREE for expressions. Other functions give every register argument and local a home
+ * in the frame, as calls clobber the scratch registers.
+ */
+static void gen_fun(Gen *gen, TFun *tfun, label entry, size_t sym)
+{
+	bool leaf = isleaf(tfun->block);
+
+	gen->enc = funenc(gen, tfun);
+	elf_set_section(gen->elf, funsection(tfun));
+
+	/* Cold functions are packed tightly; alignment only pays where code is hot */
+	align(gen, tfun->cold ? 1 : gen->funalign);
+	bind(gen, entry);
+	elf_set_symbol_value(gen->elf, sym, gen->enc->size);
+
+	gen->retlabel = enc_label(gen->enc);
+	gen->depth = 0;
+	gen->busy = 0;
+	gen->saved = 0;
+	gen->colds = NULL;
+	gen->ncolds = 0;
+	gen->traps = false;
+
+	gen->xbusy = 0;
+
+	/* Callee-saved registers used by common subexpressions across calls */
+	cse_scan(gen, tfun->block);
+
+	frame_run(gen->frame, gen->tfile, tfun);
+
+	/* Vector arguments are in XMM registers, and counted apart from the others */
+	size_t *slots = acalloc(tfun->nparams + 1, sizeof(size_t));
+	size_t nint = 0;
+	size_t nvector = 0;
+	Type *rettype = gen->tfile->types[tfun->rettype];
+
+	gen->ymm = funwide(gen, tfun);
+
+	for (size_t i = 0; i < tfun->nparams; ++i) {
+		varndx v = tfun->params[i];
+		Type *t = gen->tfile->types[gen->tfile->tvariables[v]->type];
+		bool vector = t->kind == TYPE_VECTOR;
+
+		slots[i] = vector ? nvector++ : nint++;
+
+		if (vector && leaf) {
+			gen->vars[v] = OPREG((reg)slots[i], t->size);
+			gen->xbusy |= REGBIT(slots[i]);
+		} else if (vector) {
+			frame_add(gen->frame, v);
+		} else if (slots[i] >= NPARAMREG) {
+			gen->vars[v] = OPMEM(RBP, NOREG, 1, STACKARG_OFFSET + 8 * (slots[i] - NPARAMREG), t->size);
+		} else if (leaf) {
+			gen->vars[v] = OPREG(paramreg[slots[i]], t->size);
+			gen->busy |= REGBIT(paramreg[slots[i]]);
+		} else {
+			frame_add(gen->frame, v);
+		}
+	}
+
+	gen->avx = gen->isa & ISA_AVX2;
+
+	Local *vars = NULL;
+	size_t nvars = 0;
+	locals(gen, tfun->block, 0, &vars, &nvars);
+
+	if (nvars) {
+		qsort(vars, nvars, sizeof(Local), localcmp);
+	}
+
+	for (size_t i = 0; i < nvars; ++i) {
+		varndx v = vars[i].var;
+		Type *t = gen->tfile->types[gen->tfile->tvariables[v]->type];
+		size_t nfree = 0;
+		reg r = NOREG;
+
+		for (size_t j = NSCRATCH; j-- > 0;) {
+			if (!(gen->busy & REGBIT(scratch[j]))) {
+				r = (r == NOREG ? scratch[j] : r);
+				++nfree;
+			}
+		}
+
+		size_t nxfree = 0;
+		reg x = NOREG;
+
+		for (size_t j = NXMM; j-- > 0;) {
+			if (!(gen->xbusy & REGBIT(j))) {
+				x = (x == NOREG ? (reg)j : x);
+				++nxfree;
+			}
+		}
+
+		/* Structs are addressed by their fields, so they live in the frame */
+		if (leaf && nfree > MINFREE && t->kind == TYPE_PRIMITIVE) {
+			gen->vars[v] = OPREG(r, t->size);
+			gen->busy |= REGBIT(r);
+		} else if (leaf && nxfree > XMINFREE && t->kind == TYPE_VECTOR) {
+			gen->vars[v] = OPREG(x, t->size);
+			gen->xbusy |= REGBIT(x);
+		} else {
+			frame_add(gen->frame, v);
+		}
+	}
+
+	afree(vars);
+
+	frame_layout(gen->frame);
+
+	/* rbp realigned is apart from the arguments on the stack, so they are copied into the frame */
+	bool realign = gen->frame->align > FRAME_MAXALIGN;
+
+	if (realign && nint > NPARAMREG) {
+		for (size_t i = 0; i < tfun->nparams; ++i) {
+			if (gen->vars[tfun->params[i]].kind == OPND_MEM && slots[i] >= NPARAMREG) {
+				frame_add(gen->frame, tfun->params[i]);
+			}
+		}
+
+		frame_layout(gen->frame);
+	}
+
+	for (size_t i = 0; i < gen->frame->nvars; ++i) {
+		varndx v = gen->frame->vars[i];
+		Type *t = gen->tfile->types[gen->tfile->tvariables[v]->type];
+
+		if (gen->frame->homed[v]) {
+			gen->vars[v] = OPMEM(RBP, NOREG, 1, frame_disp(gen->frame, v), t->size);
+		}
+	}
+
+	bool frame = !leaf || nint > NPARAMREG || gen->frame->size;
+	gen->framed = frame;
+
+	if (frame) {
+		emit(gen, X86_PUSH, OPREG(RBP, 8), OPNONE);
+		emit(gen, X86_MOV, OPREG(RBP, 8), OPREG(RSP, 8));
+
+		/*
+		 * The caller's rbp is pushed first, so nothing is written below rsp,
+		 * and stays in r11 until the arguments on the stack are homed
+		 */
+		if (realign) {
+			emit(gen, X86_MOV, OPREG(R11, 8), OPREG(RBP, 8));
+			emit(gen, X86_AND, OPREG(RBP, 8), OPIMM(-(int64_t)gen->frame->align));
+			emit(gen, X86_MOV, OPREG(RSP, 8), OPREG(RBP, 8));
+			emit(gen, X86_PUSH, OPREG(R11, 8), OPNONE);
+			emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(gen->frame->size - 8));
+		} else if (gen->frame->size) {
+			emit(gen, X86_SUB, OPREG(RSP, 8), OPIMM(gen->frame->size));
+		}
+	}
+
+	for (reg r = RAX; r <= R15; ++r) {
+		if (gen->saved & REGBIT(r)) {
+			emit(gen, X86_PUSH, OPREG(r, 8), OPNONE);
+			gen->depth += 8;
+		}
+	}
+
+	/* Home register arguments, and those on the stack if rbp is realigned */
+	for (size_t i = 0; i < tfun->nparams; ++i) {
+		Operand home = gen->vars[tfun->params[i]];
+		bool vector = gen->tfile->types[gen->tfile->tvariables[tfun->params[i]]->type]->kind == TYPE_VECTOR;
+
+		if (home.kind != OPND_MEM || (!vector && slots[i] >= NPARAMREG && !realign)) {
+			continue;
+		}
+
+		if (!vector && slots[i] >= NPARAMREG) {
+			emit(gen, X86_MOV, OPREG(RAX, home.size), OPMEM(R11, NOREG, 1, STACKARG_OFFSET + 8 * (slots[i] - NPARAMREG), home.size));
+			emit(gen, X86_MOV, home, OPREG(RAX, home.size));
+		} else if (vector) {
+			vmove(gen, home, OPREG((reg)slots[i], home.size));
+		} else {
+			emit(gen, X86_MOV, home, OPREG(paramreg[slots[i]], home.size));
+		}
+	}
+
+	afree(slots);
+
+	gen_block(gen, tfun->block, true);
+
+	bind(gen, gen->retlabel);
+
+	for (reg r = R15 + 1; r-- > RAX;) {
+		if (gen->saved & REGBIT(r)) {
+			emit(gen, X86_POP, OPREG(r, 8), OPNONE);
+			gen->depth -= 8;
+		}
+	}
+
+	if (frame && realign) {
+		emit(gen, X86_MOV, OPREG(RSP, 8), OPMEM(RBP, NOREG, 1, -8, 8));
+		emit(gen, X86_POP, OPREG(RBP, 8), OPNONE);
+	} else if (frame) {
+		emit(gen, X86_LEAVE, OPNONE, OPNONE);
+	}
+
+	/* The caller may use SSE; a YMM result keeps the upper halves dirty */
+	if (gen->ymm && !(rettype->kind == TYPE_VECTOR && rettype->size == 32)) {
+		vemit3(gen, X86_VZEROUPPER, OPNONE, OPNONE, OPNONE);
+	}
+
+	emit(gen, X86_RET, OPNONE, OPNONE);
+
+	/* Cold blocks, which may defer further blocks of their own */
+	for (size_t i = 0; i < gen->ncolds; ++i) {
+		ColdBlock cold = gen->colds[i];
+
+		bind(gen, cold.at);
+		gen->depth = cold.depth;
+		gen->busy = cold.busy;
+		gen->xbusy = cold.xbusy;
+
+		gen_block(gen, cold.block, false);
+
+		if (!endsinreturn(cold.block)) {
+			emit(gen, X86_JMP, OPLABEL(cold.resume), OPNONE);
+		}
+	}
+
+	if (gen->traps) {
+		bind(gen, gen->trap);
+		emit(gen, X86_UD2, OPNONE, OPNONE);
+	}
+
+	flush(gen);
+
+	afree(gen->colds);
+	gen->colds = NULL;
+	gen->ncolds = 0;
+}
+
+/*
+ * A function with target_clones is generated once per target, with the
+ * instructions that target has, under a local symbol of its own such as
+ * 'sum.x86-64-v3'; its own symbol is an STT_GNU_IFUNC one, whose value is a
+ * resolver. The dynamic linker, or the C runtime of a static executable,
+ * calls the resolver once at startup, and puts the address it returns in the
+ * PLT entry that calls go through (an R_X86_64_IRELATIVE relocation the
+ * linker makes). Targets replace -march= in their clones.
+ */
+static void gen_clones(Gen *gen, size_t ndx)
+{
+	TFun *tfun = gen->tfile->tfuns[ndx];
+	Clone *clones = acalloc(tfun->nclones, sizeof(Clone));
+	uint32_t isa = gen->isa;
+
+	for (size_t i = 0; i < tfun->nclones; ++i) {
+		Token target = tfun->clones[i];
+
+		/* Which machine compiles says nothing of which runs the program */
+		if (!strcmp(target.content, "native") || !gen_march(target.content, &clones[i].isa)) {
+			err_source(tfun->file, target.span, "unknown target '%s'", target.content);
+		}
+
+		/* A 256-bit vector a call returns is not caught by the typechecker */
+		if (!(clones[i].isa & ISA_AVX2) && funwide(gen, tfun)) {
+			err_source(tfun->file, target.span, "target '%s' has no AVX2, which the 256-bit vectors of '%s' need",
+				target.content, tfun->identifier.content);
+		}
+
+		for (size_t j = 0; j < i; ++j) {
+			if (clones[j].isa == clones[i].isa) {
+				err_source(tfun->file, target.span, "target '%s' selects the same instructions as '%s'",
+					target.content, clones[j].target.content);
+			}
+		}
+
+		size_t namelen = strlen(tfun->identifier.content) + strlen(target.content) + 2;
+		char *name = acalloc(namelen, sizeof(char));
+		snprintf(name, namelen, "%s.%s", tfun->identifier.content, target.content);
+
+		clones[i].target = target;
+		clones[i].entry = enc_label(funenc(gen, tfun));
+		elf_set_section(gen->elf, funsection(tfun));
+		clones[i].sym = elf_add_symbol(gen->elf, SHN_CUR, name, STB_LOCAL, STT_FUNC, 0);
+
+		afree(name);
+	}
+
+	for (size_t i = 0; i < tfun->nclones; ++i) {
+		gen->isa = clones[i].isa;
+		gen_fun(gen, tfun, clones[i].entry, clones[i].sym);
+	}
+
+	gen->isa = isa;
+
+	align(gen, tfun->cold ? 1 : gen->funalign);
+	bind(gen, gen->funs[ndx]);
+	elf_set_symbol_value(gen->elf, gen->funsyms[ndx], gen->enc->size);
+
+	qsort(clones, tfun->nclones, sizeof(Clone), clonecmp);
+	resolver(gen, clones, tfun->nclones);
+
+	afree(clones);
+}
+
+/* Clones with more extensions first; those of the targets of -march= are supersets of the ones before */
+static int clonecmp(const void *a, const void *b)
+{
+	int na = __builtin_popcount(((const Clone *)a)->isa);
+	int nb = __builtin_popcount(((const Clone *)b)->isa);
+
+	return nb - na;
+}
+
+/*
+ * The resolver of clones sorted by clonecmp(): it returns the address of the
+ * first the machine has every extension of, the last (baseline x86-64) if
+ * none. It runs before the program is relocated, so reads CPUID itself, as
+ * native() does, rather than call anything. Leaf 7 may be beyond the highest
+ * the processor has, which it then answers as that one; every x86-64
+ * processor has leaf 0x80000001.
+ */
+static void resolver(Gen *gen, Clone *clones, size_t nclones)
+{
+	static const reg words[CPUID_NWORDS] = { R8, R9, R10, R11 };
+	label no7 = enc_label(gen->enc);
+	label noxcr0 = enc_label(gen->enc);
+
+	/* cpuid writes rbx, which is callee-saved */
+	emit(gen, X86_PUSH, OPREG(RBX, 8), OPNONE);
+
+	emit(gen, X86_XOR, OPREG(RAX, 4), OPREG(RAX, 4));
+	emit(gen, X86_CPUID, OPNONE, OPNONE);
+	emit(gen, X86_MOV, OPREG(RSI, 4), OPREG(RAX, 4));
+
+	emit(gen, X86_MOV, OPREG(RAX, 4), OPIMM(1));
+	emit(gen, X86_CPUID, OPNONE, OPNONE);
+	emit(gen, X86_MOV, OPREG(words[CPUID_1ECX], 4), OPREG(RCX, 4));
+
+	emit(gen, X86_XOR, OPREG(words[CPUID_7EBX], 4), OPREG(words[CPUID_7EBX], 4));
+	emit(gen, X86_CMP, OPREG(RSI, 4), OPIMM(7));
+	emitcc(gen, X86_JCC, CC_B, OPLABEL(no7), OPNONE);
+	emit(gen, X86_MOV, OPREG(RAX, 4), OPIMM(7));
+	emit(gen, X86_XOR, OPREG(RCX, 4), OPREG(RCX, 4));
+	emit(gen, X86_CPUID, OPNONE, OPNONE);
+	emit(gen, X86_MOV, OPREG(words[CPUID_7EBX], 4), OPREG(RBX, 4));
+	bind(gen, no7);
+
+	emit(gen, X86_MOV, OPREG(RAX, 4), OPIMM(0x80000001));
+	emit(gen, X86_CPUID, OPNONE, OPNONE);
+	emit(gen, X86_MOV, OPREG(words[CPUID_X1ECX], 4), OPREG(RCX, 4));
+
+	emit(gen, X86_XOR, OPREG(words[CPUID_XCR0], 4), OPREG(words[CPUID_XCR0], 4));
+	emit(gen, X86_TEST, OPREG(words[CPUID_1ECX], 4), OPIMM(bit_OSXSAVE));
+	emitcc(gen, X86_JCC, CC_E, OPLABEL(noxcr0), OPNONE);
+	emit(gen, X86_XOR, OPREG(RCX, 4), OPREG(RCX, 4));
+	emit(gen, X86_XGETBV, OPNONE, OPNONE);
+	emit(gen, X86_MOV, OPREG(words[CPUID_XCR0], 4), OPREG(RAX, 4));
+	bind(gen, noxcr0);
+
+	emit(gen, X86_POP, OPREG(RBX, 8), OPNONE);
+
+	for (size_t i = 0; i < nclones; ++i) {
+		label next = enc_label(gen->enc);
+		uint32_t need[CPUID_NWORDS] = { 0 };
+
+		for (size_t j = 0; j < sizeof(features) / sizeof(*features); ++j) {
+			if (clones[i].isa & features[j].isa) {
+				need[features[j].word] |= features[j].bits;
+			}
+		}
+
+		/* A bit needed is clear where it is set in the complement */
+		for (cpuid_word w = 0; w < CPUID_NWORDS && i + 1 < nclones; ++w) {
+			if (need[w]) {
+				emit(gen, X86_MOV, OPREG(RAX, 4), OPREG(words[w], 4));
+				emit(gen, X86_NOT, OPREG(RAX, 4), OPNONE);
+				emit(gen, X86_TEST, OPREG(RAX, 4), OPIMM(need[w]));
+				emitcc(gen, X86_JCC, CC_NE, OPLABEL(next), OPNONE);
+			}
+		}
+
+		emit(gen, X86_LEA, OPREG(RAX, 8), OPMEM(RIP, NOREG, 1, 0, 0));
+		elf_add_reloc(gen->elf, gen->enc->ripdisp, R_X86_64_PC32, clones[i].sym, -(int64_t)(gen->enc->size - gen->enc->ripdisp));
+		emit(gen, X86_RET, OPNONE, OPNONE);
+		bind(gen, next);
+	}
 
-	return res;
+	flush(gen);
 }
@@ -7,15 +7,114 @@
 #pragma once
 
 #include "elf.h"
+#include "enc.h"
+#include "frame.h"
+#include "sched.h"
 #include "type.h"
 
+#define GEN_ALIGN_DEFAULT 16
+#define GEN_MAXCSE 16
+
+/* Extensions beyond baseline x86-64 that instructions may be selected from; see Gen.isa */
+#define ISA_POPCNT 0x1
+#define ISA_LZCNT 0x2
+#define ISA_BMI1 0x4 /* tzcnt, andn */
+#define ISA_BMI2 0x8 /* pdep, pext, shlx, bzhi */
+#define ISA_SSE4 0x10 /* SSE4.1 and SSE4.2: pmulld, pcmpeqq */
+#define ISA_MOVBE 0x20
+#define ISA_AVX2 0x40 /* and AVX: VEX forms of vector instructions */
+
+/* The extensions of the -march= levels; x86-64-v4 adds AVX-512, which nothing is selected from */
+#define ISA_V2 (ISA_POPCNT | ISA_SSE4)
+#define ISA_V3 (ISA_V2 | ISA_LZCNT | ISA_BMI1 | ISA_BMI2 | ISA_MOVBE | ISA_AVX2)
+
+/*
+ * How thread-locals are reached, as -ftls-model= selects. Local-exec has the
+ * linker put their offset from the thread pointer in the instruction, which
+ * only holds for an executable that defines them all; initial-exec loads it
+ * from the GOT, and so also works from a shared object loaded at startup.
+ */
+typedef enum tls_model {
+	TLS_LOCAL_EXEC,
+	TLS_INITIAL_EXEC,
+} tls_model;
+
+/* A common subexpression of the current statement, once computed */
+typedef struct Cse {
+	TExpression *expr;
+	reg reg; /* where its value is kept */
+	size_t left; /* uses still to come */
+	bool ready; /* reg holds the value */
+	bool fixed; /* reg is callee-saved, and reserved for the whole statement */
+} Cse;
+
+/* An entry of a jump table, to be relocated once its target is bound */
+typedef struct TableEntry {
+	size_t at; /* offset in .rodata */
+	size_t base; /* offset of the table in .rodata */
+	Enc *enc; /* the code buffer 'target' is in */
+	label target;
+} TableEntry;
+
+/* A rarely taken block, laid out after the body of its function */
+typedef struct ColdBlock {
+	label at;
+	TBlock *block;
+	label resume; /* where it rejoins the hot path */
+	size_t depth;
+	uint16_t busy;
+	uint16_t xbusy;
+} ColdBlock;
+
 typedef struct Gen {
 	TFile *tfile;
+	File *unit; /* the file whose functions are generated; NULL for all */
 	Elf *elf;
+	Enc *enc; /* that of the current function */
+	Enc *text; /* .text */
+	Enc *unlikely; /* .text.unlikely, for cold functions; NULL if there are none */
+
+	uint8_t *rodata; /* .rodata */
+	size_t rodatasize;
+	TableEntry *tableents;
+	size_t ntableents;
+
+	size_t textsym; /* section symbols, for relocations */
+	size_t rodatasym;
+	size_t unlikelysym;
+	size_t *globalsyms; /* globalndx -> symbol; those of other objects are added once used */
+
+	/* Per-function state */
+	Frame *frame; /* stack slots */
+	Operand *vars; /* varndx -> where the variable lives */
+	label *funs; /* funndx -> entry label */
+	size_t *funsyms; /* funndx -> symbol */
+	label retlabel; /* epilogue of the current function */
+	label trap; /* where an index out of bounds goes; made on first use */
+	bool traps;
+	size_t depth; /* bytes pushed below the fixed frame */
+	bool framed; /* the function has a frame, so rsp is 16-byte aligned where depth is 0; else it is 8 off */
+	uint16_t busy; /* registers holding live values (bit n: register n) */
+	uint16_t xbusy; /* the same, of XMM registers */
+	bool avx; /* vector instructions are VEX-encoded: the target has AVX2 */
+	bool ymm; /* the function has 256-bit vectors, so the upper halves of YMM registers may be dirty */
+	uint16_t saved; /* callee-saved registers the function uses */
+	ColdBlock *colds; /* blocks deferred to the end of the function */
+	size_t ncolds;
+
+	Cse cses[GEN_MAXCSE]; /* per statement */
+	size_t ncses;
 
-	uint8_t stackoff;
+	size_t funalign; /* alignment of function entries, in bytes (power of two) */
+	size_t loopalign; /* alignment of loop headers, in bytes (power of two) */
+	uint32_t isa; /* ISA_* extensions the target has; without them, builtins take longer sequences */
+	tls_model tls;
+	const Tune *tune; /* microarchitecture scheduled for */
+	bool schedule; /* reorder instructions within basic blocks */
+	Sched *sched; /* NULL if not scheduling */
 } Gen;
 
 Gen *gen_new();
-void gen_run(Gen *gen, const char *srcpath, TFile *tfile);
+bool gen_march(const char *name, uint32_t *isa);
+void gen_run(Gen *gen, const char *elfpath, TFile *tfile, File *unit);
 void gen_reset(Gen *gen);
@@ -0,0 +1,624 @@
+/*
+ * ipa.c
+ *
+ * This file is part of awl
+ */
+
+#include "ipa.h"
+
+#include <string.h>
+#include "vec.h"
+#include "mem.h"
+#include "err.h"
+
+typedef void (*visitor)(Ipa *ipa, TExpression **slot);
+
+static void visit_block(Ipa *ipa, TBlock *block, visitor fn);
+static void mark_exports(Ipa *ipa);
+static void collect_consts(Ipa *ipa, TExpression **slot);
+static void substitute(Ipa *ipa, TExpression **slot);
+static bool assigned(TBlock *block, varndx var);
+static void propagate(Ipa *ipa);
+static size_t nodes(TExpression *expression);
+static size_t refs(TExpression *expression, varndx var);
+static bool effects(Ipa *ipa, TExpression *expression);
+static bool inorder(Ipa *ipa, TExpression *expression, TCall *call, size_t *next);
+static bool inlinable(Ipa *ipa, TCall *call);
+static void expand(Ipa *ipa, TExpression **slot, size_t depth);
+static void inline_calls(Ipa *ipa, TExpression **slot);
+static void reach_calls(Ipa *ipa, TExpression **slot);
+static void reach(Ipa *ipa, TFun *tfun);
+
+Ipa *ipa_new()
+{
+	Ipa *ipa = alloct(Ipa);
+	ipa->tfile = NULL;
+	ipa->whole = false;
+	ipa->exports = NULL;
+	ipa->nexports = 0;
+	ipa->caller = NULL;
+	ipa->consts = NULL;
+	ipa->varies = NULL;
+
+	return ipa;
+}
+
+/* Make a function callable from outside the program, in whole-program mode */
+void ipa_export(Ipa *ipa, const char *name)
+{
+	vec_push(ipa->exports, &name, &ipa->nexports, sizeof(const char *));
+}
+
+void ipa_run(Ipa *ipa, TFile *tfile)
+{
+	ipa->tfile = tfile;
+
+	if (ipa->whole) {
+		mark_exports(ipa);
+		propagate(ipa);
+	}
+
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		ipa->caller = tfile->tfuns[i];
+		visit_block(ipa, ipa->caller->block, inline_calls);
+	}
+
+	ipa->caller = NULL;
+
+	/* Inlining may have left functions without callers */
+	if (ipa->whole) {
+		for (size_t i = 0; i < tfile->ntfuns; ++i) {
+			tfile->tfuns[i]->live = false;
+		}
+
+		for (size_t i = 0; i < tfile->ntfuns; ++i) {
+			if (tfile->tfuns[i]->exported) {
+				reach(ipa, tfile->tfuns[i]);
+			}
+		}
+	}
+}
+
+void ipa_reset(Ipa *ipa)
+{
+	ipa->tfile = NULL;
+	ipa->caller = NULL;
+}
+
+/*
+ * Call 'fn' on the slot holding every expression evaluated in a block. A
+ * loop's guard is its condition until the loop optimiser separates them, and
+ * is then visited once.
+ */
+static void visit_block(Ipa *ipa, TBlock *block, visitor fn)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		switch (statement->variant) {
+			case TSTATEMENT_RETURN:
+			case TSTATEMENT_BUILTIN: fn(ipa, &statement->expr); break;
+			case TSTATEMENT_VAR:
+			case TSTATEMENT_ASSIGN: fn(ipa, &statement->assign->value); break;
+			case TSTATEMENT_STORE: {
+				fn(ipa, &statement->store->value);
+				fn(ipa, &statement->store->place);
+				break;
+			}
+			case TSTATEMENT_SWITCH: {
+				fn(ipa, &statement->sw->expr);
+
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					visit_block(ipa, statement->sw->cases[j]->block, fn);
+				}
+
+				if (statement->sw->def) {
+					visit_block(ipa, statement->sw->def, fn);
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				fn(ipa, &statement->tif->cond);
+				visit_block(ipa, statement->tif->then, fn);
+
+				if (statement->tif->els) {
+					visit_block(ipa, statement->tif->els, fn);
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				TWhile *loop = statement->loop;
+				bool shared = loop->guard == loop->cond;
+
+				fn(ipa, &loop->cond);
+				if (shared) {
+					loop->guard = loop->cond;
+				} else {
+					fn(ipa, &loop->guard);
+				}
+
+				visit_block(ipa, loop->pre, fn);
+				visit_block(ipa, loop->block, fn);
+				break;
+			}
+			case TSTATEMENT_ASM: {
+				/* Outputs are only written */
+				for (size_t j = statement->tasm->nouts; j < statement->tasm->noperands; ++j) {
+					fn(ipa, &statement->tasm->operands[j].expr);
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+static void mark_exports(Ipa *ipa)
+{
+	for (size_t i = 0; i < ipa->tfile->ntfuns; ++i) {
+		TFun *tfun = ipa->tfile->tfuns[i];
+		tfun->exported = !strcmp(tfun->identifier.content, "main");
+	}
+
+	for (size_t i = 0; i < ipa->nexports; ++i) {
+		bool found = false;
+
+		for (size_t j = 0; j < ipa->tfile->ntfuns; ++j) {
+			TFun *tfun = ipa->tfile->tfuns[j];
+
+			if (!strcmp(tfun->identifier.content, ipa->exports[i])) {
+				tfun->exported = true;
+				found = true;
+			}
+		}
+
+		if (!found) {
+			err_user("no function '%s' to export", ipa->exports[i]);
+		}
+	}
+}
+
+/* Note the values calls pass to the parameters of functions that are not exported */
+static void collect_consts(Ipa *ipa, TExpression **slot)
+{
+	TExpression *expression = *slot;
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			TCall *call = expression->call;
+			TFun *callee = ipa->tfile->tfuns[call->fun];
+
+			for (size_t i = 0; i < call->nargs; ++i) {
+				TExpression *arg = call->args[i];
+				varndx p = callee->params[i];
+
+				collect_consts(ipa, &call->args[i]);
+
+				if (arg->variant != TEXPRESSION_NUMLIT) {
+					ipa->varies[p] = true;
+				} else if (!ipa->consts[p]) {
+					ipa->consts[p] = arg;
+				} else if (ipa->consts[p]->number->u64 != arg->number->u64) {
+					ipa->varies[p] = true;
+				}
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			collect_consts(ipa, &expression->binary->lhs);
+			collect_consts(ipa, &expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: collect_consts(ipa, &expression->unary->operand); break;
+		case TEXPRESSION_FIELD: collect_consts(ipa, &expression->field->base); break;
+		case TEXPRESSION_INDEX: {
+			collect_consts(ipa, &expression->index->base);
+			collect_consts(ipa, &expression->index->index);
+			break;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				collect_consts(ipa, &expression->builtin->args[i]);
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+/* Turn reads of parameters known to be constant into the constant */
+static void substitute(Ipa *ipa, TExpression **slot)
+{
+	TExpression *expression = *slot;
+
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: {
+			TExpression *c = ipa->consts[expression->var];
+
+			if (c && !ipa->varies[expression->var]) {
+				expression->variant = TEXPRESSION_NUMLIT;
+				expression->number = c->number;
+			}
+			break;
+		}
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				substitute(ipa, &expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			substitute(ipa, &expression->binary->lhs);
+			substitute(ipa, &expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: substitute(ipa, &expression->unary->operand); break;
+		case TEXPRESSION_FIELD: substitute(ipa, &expression->field->base); break;
+		case TEXPRESSION_INDEX: {
+			substitute(ipa, &expression->index->base);
+			substitute(ipa, &expression->index->index);
+			break;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				substitute(ipa, &expression->builtin->args[i]);
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+static bool assigned(TBlock *block, varndx var)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		if (statement->variant == TSTATEMENT_ASSIGN && statement->assign->var == var) {
+			return true;
+		}
+
+		for (size_t j = 0; statement->variant == TSTATEMENT_ASM && j < statement->tasm->nouts; ++j) {
+			if (statement->tasm->operands[j].expr->var == var) {
+				return true;
+			}
+		}
+
+		switch (statement->variant) {
+			case TSTATEMENT_SWITCH: {
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					if (assigned(statement->sw->cases[j]->block, var)) {
+						return true;
+					}
+				}
+
+				if (statement->sw->def && assigned(statement->sw->def, var)) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				if (assigned(statement->tif->then, var) || (statement->tif->els && assigned(statement->tif->els, var))) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				if (assigned(statement->loop->pre, var) || assigned(statement->loop->block, var)) {
+					return true;
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+
+	return false;
+}
+
+/* Interprocedural constant propagation, into the functions only the program calls */
+static void propagate(Ipa *ipa)
+{
+	TFile *tfile = ipa->tfile;
+
+	ipa->consts = acalloc(tfile->ntvariables + 1, sizeof(TExpression *));
+	ipa->varies = acalloc(tfile->ntvariables + 1, sizeof(bool));
+
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		visit_block(ipa, tfile->tfuns[i]->block, collect_consts);
+	}
+
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		TFun *tfun = tfile->tfuns[i];
+
+		for (size_t j = 0; j < tfun->nparams; ++j) {
+			varndx p = tfun->params[j];
+
+			if (tfun->exported || assigned(tfun->block, p)) {
+				ipa->varies[p] = true;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		visit_block(ipa, tfile->tfuns[i]->block, substitute);
+	}
+
+	afree(ipa->consts);
+	afree(ipa->varies);
+	ipa->consts = NULL;
+	ipa->varies = NULL;
+}
+
+static size_t nodes(TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			size_t n = 1;
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				n += nodes(expression->call->args[i]);
+			}
+			return n;
+		}
+		case TEXPRESSION_BINARY: return 1 + nodes(expression->binary->lhs) + nodes(expression->binary->rhs);
+		case TEXPRESSION_UNARY: return 1 + nodes(expression->unary->operand);
+		case TEXPRESSION_FIELD: return 1 + nodes(expression->field->base);
+		case TEXPRESSION_INDEX: return 1 + nodes(expression->index->base) + nodes(expression->index->index);
+		case TEXPRESSION_BUILTIN: {
+			size_t n = 1;
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				n += nodes(expression->builtin->args[i]);
+			}
+			return n;
+		}
+		default: return 1;
+	}
+}
+
+/* The number of places an expression reads a variable */
+static size_t refs(TExpression *expression, varndx var)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: return expression->var == var;
+		case TEXPRESSION_CALL: {
+			size_t n = 0;
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				n += refs(expression->call->args[i], var);
+			}
+			return n;
+		}
+		case TEXPRESSION_BINARY: return refs(expression->binary->lhs, var) + refs(expression->binary->rhs, var);
+		case TEXPRESSION_UNARY: return refs(expression->unary->operand, var);
+		case TEXPRESSION_FIELD: return refs(expression->field->base, var);
+		case TEXPRESSION_INDEX: return refs(expression->index->base, var) + refs(expression->index->index, var);
+		case TEXPRESSION_BUILTIN: {
+			size_t n = 0;
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				n += refs(expression->builtin->args[i], var);
+			}
+			return n;
+		}
+		default: return 0;
+	}
+}
+
+/* Whether evaluating an expression may do more than compute its value: call a function that is not pure, or a builtin */
+static bool effects(Ipa *ipa, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			if (ipa->tfile->tfuns[expression->call->fun]->effect != EFFECT_PURE) {
+				return true;
+			}
+
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				if (effects(ipa, expression->call->args[i])) {
+					return true;
+				}
+			}
+			return false;
+		}
+		case TEXPRESSION_BINARY: return effects(ipa, expression->binary->lhs) || effects(ipa, expression->binary->rhs);
+		case TEXPRESSION_UNARY: return effects(ipa, expression->unary->operand);
+		case TEXPRESSION_FIELD: return effects(ipa, expression->field->base);
+		case TEXPRESSION_INDEX: return effects(ipa, expression->index->base) || effects(ipa, expression->index->index);
+		case TEXPRESSION_BUILTIN: return true;
+		default: return false;
+	}
+}
+
+/*
+ * Whether a callee's body, evaluated from left to right, reads the arguments
+ * of a call that have effects in the order the call gives them, and before
+ * any effect of its own. 'next' is the first such argument it may still read;
+ * once the body has an effect, it may read none.
+ */
+static bool inorder(Ipa *ipa, TExpression *expression, TCall *call, size_t *next)
+{
+	TFun *callee = ipa->tfile->tfuns[call->fun];
+
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: {
+			for (size_t i = 0; i < call->nargs; ++i) {
+				if (expression->var == callee->params[i] && effects(ipa, call->args[i])) {
+					if (i < *next) {
+						return false;
+					}
+					*next = i + 1;
+				}
+			}
+			return true;
+		}
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				if (!inorder(ipa, expression->call->args[i], call, next)) {
+					return false;
+				}
+			}
+
+			if (ipa->tfile->tfuns[expression->call->fun]->effect != EFFECT_PURE) {
+				*next = call->nargs;
+			}
+			return true;
+		}
+		case TEXPRESSION_BINARY: {
+			return inorder(ipa, expression->binary->lhs, call, next) && inorder(ipa, expression->binary->rhs, call, next);
+		}
+		case TEXPRESSION_UNARY: return inorder(ipa, expression->unary->operand, call, next);
+		case TEXPRESSION_FIELD: return inorder(ipa, expression->field->base, call, next);
+		case TEXPRESSION_INDEX: {
+			return inorder(ipa, expression->index->base, call, next) && inorder(ipa, expression->index->index, call, next);
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				if (!inorder(ipa, expression->builtin->args[i], call, next)) {
+					return false;
+				}
+			}
+
+			*next = call->nargs;
+			return true;
+		}
+		default: return true;
+	}
+}
+
+/*
+ * Whether a call can be replaced by the callee's body: a single return of a
+ * small expression, in a function that is neither cold, cloned per target
+ * (its callers are compiled for one), nor the caller. The arguments take the
+ * place of the parameters, so an argument used other than exactly once must
+ * be a constant or a variable, to be neither dropped nor evaluated more than
+ * once. The call evaluates its arguments before the body, in order; the body
+ * must still do so for those with effects, as 'b * 10 + a' would not.
+ */
+static bool inlinable(Ipa *ipa, TCall *call)
+{
+	TFun *callee = ipa->tfile->tfuns[call->fun];
+
+	if (callee == ipa->caller || callee->cold || callee->nclones || callee->block->nstatements != 1
+			|| callee->block->statements[0]->variant != TSTATEMENT_RETURN) {
+		return false;
+	}
+
+	TExpression *body = callee->block->statements[0]->expr;
+	if (nodes(body) > IPA_INLINE_MAXNODES) {
+		return false;
+	}
+
+	for (size_t i = 0; i < call->nargs; ++i) {
+		t_node_variant v = call->args[i]->variant;
+
+		if (refs(body, callee->params[i]) != 1 && v != TEXPRESSION_NUMLIT && v != TEXPRESSION_VARIABLE) {
+			return false;
+		}
+	}
+
+	size_t next = 0;
+	return inorder(ipa, body, call, &next);
+}
+
+/*
+ * Inline the calls in an expression, innermost first, and then those the
+ * inlined bodies make, up to IPA_INLINE_DEPTH deep. The typechecker never
+ * shares a node containing a call, so each call is in one slot only.
+ */
+static void expand(Ipa *ipa, TExpression **slot, size_t depth)
+{
+	TExpression *expression = *slot;
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				expand(ipa, &expression->call->args[i], depth);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			expand(ipa, &expression->binary->lhs, depth);
+			expand(ipa, &expression->binary->rhs, depth);
+			return;
+		}
+		case TEXPRESSION_UNARY: expand(ipa, &expression->unary->operand, depth); return;
+		case TEXPRESSION_FIELD: expand(ipa, &expression->field->base, depth); return;
+		case TEXPRESSION_INDEX: {
+			expand(ipa, &expression->index->base, depth);
+			expand(ipa, &expression->index->index, depth);
+			return;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				expand(ipa, &expression->builtin->args[i], depth);
+			}
+			return;
+		}
+		default: return;
+	}
+
+	TCall *call = expression->call;
+	if (depth == IPA_INLINE_DEPTH || !inlinable(ipa, call)) {
+		return;
+	}
+
+	TFun *callee = ipa->tfile->tfuns[call->fun];
+	/* A copy of the body, reading the arguments in place of the parameters */
+	TExpression *body = texpression_copy(callee->block->statements[0]->expr, callee->params, call->args, call->nargs);
+
+	/* The call no longer reads its arguments; the body does, where it reads the parameters */
+	for (size_t i = 0; i < call->nargs; ++i) {
+		--call->args[i]->uses;
+	}
+
+	*slot = body;
+	expand(ipa, slot, depth + 1);
+}
+
+static void inline_calls(Ipa *ipa, TExpression **slot)
+{
+	expand(ipa, slot, 0);
+}
+
+static void reach_calls(Ipa *ipa, TExpression **slot)
+{
+	TExpression *expression = *slot;
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			reach(ipa, ipa->tfile->tfuns[expression->call->fun]);
+
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				reach_calls(ipa, &expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			reach_calls(ipa, &expression->binary->lhs);
+			reach_calls(ipa, &expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: reach_calls(ipa, &expression->unary->operand); break;
+		case TEXPRESSION_FIELD: reach_calls(ipa, &expression->field->base); break;
+		case TEXPRESSION_INDEX: {
+			reach_calls(ipa, &expression->index->base);
+			reach_calls(ipa, &expression->index->index);
+			break;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				reach_calls(ipa, &expression->builtin->args[i]);
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+static void reach(Ipa *ipa, TFun *tfun)
+{
+	if (tfun->live) {
+		return;
+	}
+
+	tfun->live = true;
+	visit_block(ipa, tfun->block, reach_calls);
+}
@@ -0,0 +1,38 @@
+/*
+ * ipa.h
+ *
+ * This file is part of awl
+ */
+
+#pragma once
+
+#include "type.h"
+
+#define IPA_INLINE_MAXNODES 24 /* largest expression inlined */
+#define IPA_INLINE_DEPTH 4 /* inlinings nested at one call */
+
+/*
+ * Interprocedural optimisations over the whole program the typechecker was
+ * given, which may have come from several files. Calls to functions whose
+ * body is a single return of a small expression are always inlined. In
+ * whole-program mode, only the exported functions (main, and those named by
+ * ipa_export()) may be called from outside the program; then parameters that
+ * every call passes the same constant are replaced by it, and functions no
+ * exported function can reach are dropped.
+ */
+typedef struct Ipa {
+	TFile *tfile;
+	bool whole;
+
+	const char **exports;
+	size_t nexports;
+
+	TFun *caller; /* the function calls are being inlined into */
+	TExpression **consts; /* varndx of a parameter -> the constant all calls pass, or NULL */
+	bool *varies; /* varndx of a parameter -> whether calls pass different values */
+} Ipa;
+
+Ipa *ipa_new();
+void ipa_export(Ipa *ipa, const char *name);
+void ipa_run(Ipa *ipa, TFile *tfile);
+void ipa_reset(Ipa *ipa);
@@ -15,6 +15,7 @@
 
 #define SB_INITALLOC_KWIDEN 50
 #define SB_INITALLOC_NUMLIT 25
+#define SB_INITALLOC_STRING 50
 
 /* One-width span for lexer errors */
 #define LEXERRSPAN (Span){ .linendx = lexer->linendx, .first = lexer->chndx, .last = lexer->chndx + 1 }
@@ -26,6 +27,7 @@ static char current(Lexer *lexer);
 static void linelex(Lexer *lexer, size_t linendx);
 static void lex_kwiden(Lexer *lexer);
 static void lex_numlit(Lexer *lexer);
+static void lex_string(Lexer *lexer);
 static void lex_op(Lexer *lexer);
 static token_kind kindofkwiden(const char *str);
 
@@ -34,17 +36,59 @@ static token_kind kindofkwiden(const char *str);
  * of the token kind, the content is the same as all other instances; e.g. the
  * content of each TOKEN_RETURN token is "return").
  */
-static const char *tktab[] = {
+static const char *tktab[_TOKEN_COUNT] = {
 	[TOKEN_FUN] = "fun",
 	[TOKEN_RETURN] = "return",
+	[TOKEN_SWITCH] = "switch",
+	[TOKEN_CASE] = "case",
+	[TOKEN_DEFAULT] = "default",
+	[TOKEN_IF] = "if",
+	[TOKEN_ELSE] = "else",
+	[TOKEN_LIKELY] = "likely",
+	[TOKEN_UNLIKELY] = "unlikely",
+	[TOKEN_COLD] = "cold",
+	[TOKEN_PURE] = "pure",
+	[TOKEN_TARGET_CLONES] = "target_clones",
+	[TOKEN_VAR] = "var",
+	[TOKEN_WHILE] = "while",
+	[TOKEN_STRUCT] = "struct",
+	[TOKEN_PACKED] = "packed",
+	[TOKEN_REORDER] = "reorder",
+	[TOKEN_ALIGN] = "align",
+	[TOKEN_SOA] = "soa",
+	[TOKEN_THREAD] = "thread",
+	[TOKEN_ASM] = "asm",
 
 	[TOKEN_ARROW] = "->",
 	[TOKEN_LPAREN] = "(",
 	[TOKEN_RPAREN] = ")",
 	[TOKEN_LBRACE] = "{",
 	[TOKEN_RBRACE] = "}",
+	[TOKEN_LBRACKET] = "[",
+	[TOKEN_RBRACKET] = "]",
 	[TOKEN_SEMICOLON] = ";",
 	[TOKEN_COMMA] = ",",
+	[TOKEN_COLON] = ":",
+	[TOKEN_DOT] = ".",
+	[TOKEN_ASSIGN] = "=",
+
+	[TOKEN_PLUS] = "+",
+	[TOKEN_MINUS] = "-",
+	[TOKEN_STAR] = "*",
+	[TOKEN_SLASH] = "/",
+	[TOKEN_PERCENT] = "%",
+	[TOKEN_AMP] = "&",
+	[TOKEN_PIPE] = "|",
+	[TOKEN_CARET] = "^",
+	[TOKEN_TILDE] = "~",
+	[TOKEN_SHL] = "<<",
+	[TOKEN_SHR] = ">>",
+	[TOKEN_EQ] = "==",
+	[TOKEN_NE] = "!=",
+	[TOKEN_LT] = "<",
+	[TOKEN_LE] = "<=",
+	[TOKEN_GT] = ">",
+	[TOKEN_GE] = ">=",
 };
 
 Lexer *lexer_new()
@@ -126,6 +170,10 @@ static void linelex(Lexer *lexer, size_t linendx)
 			/* Numeric literal */
 			lex_numlit(lexer);
 
+		} else if (c == '"') {
+			/* String literal; only the text of an asm statement */
+			lex_string(lexer);
+
 		} else {
 			/* Operator */
 			lex_op(lexer);
@@ -133,13 +181,14 @@ static void linelex(Lexer *lexer, size_t linendx)
 	}
 }
 
+/* Keywords and identifiers start with a letter, and may have underscores after it ("target_clones") */
 static void lex_kwiden(Lexer *lexer)
 {
 	StrBuf *sb = strbuf_new(SB_INITALLOC_KWIDEN);
 	size_t first = lexer->chndx;
 
 	char c = 0;
-	while ((c = current(lexer)) && isalnum(c)) {
+	while ((c = current(lexer)) && (isalnum(c) || c == '_')) {
 		strbuf_putc(sb, c);
 		advance(lexer);
 	}
@@ -200,30 +249,61 @@ static void lex_numlit(Lexer *lexer)
 	vec_push(lexer->tokens, &token, &lexer->ntokens, sizeof(Token));
 }
 
+/* Strings are on one line and have no escapes; the content leaves out the quotes */
+static void lex_string(Lexer *lexer)
+{
+	StrBuf *sb = strbuf_new(SB_INITALLOC_STRING);
+	size_t first = lexer->chndx;
+
+	advance(lexer); /* " */
+
+	char c = 0;
+	while ((c = current(lexer)) && c != '"') {
+		strbuf_putc(sb, c);
+		advance(lexer);
+	}
+
+	if (!c) {
+		lexer->chndx = first;
+		err_source(lexer->file, LEXERRSPAN, "unterminated string");
+	}
+
+	advance(lexer); /* " */
+
+	const char *str = strbuf_release(sb);
+
+	Span span = {
+		.linendx = lexer->linendx,
+		.first = first,
+		.last = lexer->chndx,
+	};
+
+	Token token = {
+		.kind = TOKEN_STRING,
+		.content = str,
+		.span = span,
+	};
+
+	vec_push(lexer->tokens, &token, &lexer->ntokens, sizeof(Token));
+}
+
 static void lex_op(Lexer *lexer)
 {
 	token_kind kind = _TOKEN_NULL;
 	size_t first = lexer->chndx;
+	const char *at = lexer->file->lines[lexer->linendx] + lexer->chndx;
 
-	char c = current(lexer);
-	if (c == '-') {
-		if (peek(lexer, 1) == '>') {
-			kind = TOKEN_ARROW;
+	/* Longest operator matching at the cursor */
+	for (token_kind k = TOKEN_ARROW; k < _TOKEN_COUNT; ++k) {
+		const char *op = tktab[k];
+
+		if (op && !strncmp(at, op, strlen(op)) && (!kind || strlen(op) > strlen(tktab[kind]))) {
+			kind = k;
 		}
-	} else if (c == '(') {
-		kind = TOKEN_LPAREN;
-	} else if (c == ')') {
-		kind = TOKEN_RPAREN;
-	} else if (c == '{') {
-		kind = TOKEN_LBRACE;
-	} else if (c == '}') {
-		kind = TOKEN_RBRACE;
-	} else if (c == ';') {
-		kind = TOKEN_SEMICOLON;
-	} else if (c == ',') {
-		kind = TOKEN_COMMA;
-	} else {
-		err_source(lexer->file, LEXERRSPAN, "unexpected character '%c'", c);
+	}
+
+	if (kind == _TOKEN_NULL) {
+		err_source(lexer->file, LEXERRSPAN, "unexpected character '%c'", current(lexer));
 	}
 
 	const char *str = tktab[kind];
@@ -251,6 +331,25 @@ static token_kind kindofkwiden(const char *str)
 #define CMP(kind) if (!strcmp(str, tktab[kind])) return kind;
 	CMP(TOKEN_FUN);
 	CMP(TOKEN_RETURN);
+	CMP(TOKEN_SWITCH);
+	CMP(TOKEN_CASE);
+	CMP(TOKEN_DEFAULT);
+	CMP(TOKEN_IF);
+	CMP(TOKEN_ELSE);
+	CMP(TOKEN_LIKELY);
+	CMP(TOKEN_UNLIKELY);
+	CMP(TOKEN_COLD);
+	CMP(TOKEN_PURE);
+	CMP(TOKEN_TARGET_CLONES);
+	CMP(TOKEN_VAR);
+	CMP(TOKEN_WHILE);
+	CMP(TOKEN_STRUCT);
+	CMP(TOKEN_PACKED);
+	CMP(TOKEN_REORDER);
+	CMP(TOKEN_ALIGN);
+	CMP(TOKEN_SOA);
+	CMP(TOKEN_THREAD);
+	CMP(TOKEN_ASM);
 #undef CMP
 	return TOKEN_IDENTIFIER;
 }
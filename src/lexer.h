@@ -15,22 +15,67 @@
 typedef enum token_kind {
 	_TOKEN_NULL = 0,
 
-	TOKEN_EOF = 0x01,
-
-	TOKEN_IDENTIFIER = 0x02,
-	TOKEN_NUMLIT_INT = 0x04,
-	TOKEN_NUMLIT_FLT = 0x08,
-
-	TOKEN_FUN = 0x10,
-	TOKEN_RETURN = 0x20,
-
-	TOKEN_ARROW = 0x40,
-	TOKEN_LPAREN = 0x80,
-	TOKEN_RPAREN = 0x100,
-	TOKEN_LBRACE = 0x200,
-	TOKEN_RBRACE = 0x300,
-	TOKEN_SEMICOLON = 0x400,
-	TOKEN_COMMA = 0x600,
+	TOKEN_EOF,
+
+	TOKEN_IDENTIFIER,
+	TOKEN_NUMLIT_INT,
+	TOKEN_NUMLIT_FLT,
+	TOKEN_STRING,
+
+	TOKEN_FUN,
+	TOKEN_RETURN,
+	TOKEN_SWITCH,
+	TOKEN_CASE,
+	TOKEN_DEFAULT,
+	TOKEN_IF,
+	TOKEN_ELSE,
+	TOKEN_LIKELY,
+	TOKEN_UNLIKELY,
+	TOKEN_COLD,
+	TOKEN_PURE,
+	TOKEN_TARGET_CLONES,
+	TOKEN_VAR,
+	TOKEN_WHILE,
+	TOKEN_STRUCT,
+	TOKEN_PACKED,
+	TOKEN_REORDER,
+	TOKEN_ALIGN,
+	TOKEN_SOA,
+	TOKEN_THREAD,
+	TOKEN_ASM,
+
+	TOKEN_ARROW,
+	TOKEN_LPAREN,
+	TOKEN_RPAREN,
+	TOKEN_LBRACE,
+	TOKEN_RBRACE,
+	TOKEN_LBRACKET,
+	TOKEN_RBRACKET,
+	TOKEN_SEMICOLON,
+	TOKEN_COMMA,
+	TOKEN_COLON,
+	TOKEN_DOT,
+	TOKEN_ASSIGN,
+
+	TOKEN_PLUS,
+	TOKEN_MINUS,
+	TOKEN_STAR,
+	TOKEN_SLASH,
+	TOKEN_PERCENT,
+	TOKEN_AMP,
+	TOKEN_PIPE,
+	TOKEN_CARET,
+	TOKEN_TILDE,
+	TOKEN_SHL,
+	TOKEN_SHR,
+	TOKEN_EQ,
+	TOKEN_NE,
+	TOKEN_LT,
+	TOKEN_LE,
+	TOKEN_GT,
+	TOKEN_GE,
+
+	_TOKEN_COUNT,
 } token_kind;
 
 typedef struct Token {
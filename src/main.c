@@ -4,7 +4,168 @@
  * This file is part of awl
  */
 
-int main(void)
+#include <stdlib.h>
+#include <string.h>
+#include "file.h"
+#include "parser.h"
+#include "type.h"
+#include "ipa.h"
+#include "opt.h"
+#include "gen.h"
+#include "vec.h"
+#include "mem.h"
+#include "err.h"
+
+static size_t optalign(const char *opt, const char *val);
+static const char *fileext(const char *path);
+
+/*
+ * All source files given make one program, with one namespace for their
+ * functions. It is compiled into an object per source file, next to it, or
+ * into the one object named by -o. With -fwhole-program, nothing outside the
+ * program calls its functions but main and those named by -fexport=.
+ * -fopt-info has the optimiser say what it did to each function, and
+ * -fno-tree-vectorize keeps it from vectorizing loops. -march= selects
+ * instructions for x86-64, the default, for the x86-64-v2, -v3 and -v4 levels
+ * of the psABI, or for the machine compiling (native); -mpopcnt, -mlzcnt,
+ * -mbmi and -mbmi2 add those extensions to it. Vector types of 32 bytes need
+ * AVX2, as in x86-64-v3.
+ * -ftls-model=initial-exec reaches thread-locals through the GOT, as a shared
+ * object must; local-exec, the default, is for executables.
+ */
+int main(int argc, char **argv)
 {
+	const char **srcpaths = NULL;
+	size_t nsrcpaths = 0;
+	const char *outpath = NULL;
+	Gen *gen = gen_new();
+	Ipa *ipa = ipa_new();
+	Opt *opt = opt_new();
+	uint32_t march = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "-falign-functions=", 18)) {
+			gen->funalign = optalign(arg, arg + 18);
+		} else if (!strncmp(arg, "-falign-loops=", 14)) {
+			gen->loopalign = optalign(arg, arg + 14);
+		} else if (!strncmp(arg, "-mtune=", 7)) {
+			gen->tune = sched_tune(arg + 7);
+			if (!gen->tune) {
+				err_user("unknown CPU '%s' for '-mtune='", arg + 7);
+			}
+		} else if (!strncmp(arg, "-march=", 7)) {
+			if (!gen_march(arg + 7, &march)) {
+				err_user("unknown target '%s' for '-march='", arg + 7);
+			}
+		} else if (!strcmp(arg, "-mpopcnt")) {
+			gen->isa |= ISA_POPCNT;
+		} else if (!strcmp(arg, "-mlzcnt")) {
+			gen->isa |= ISA_LZCNT;
+		} else if (!strcmp(arg, "-mbmi")) {
+			gen->isa |= ISA_BMI1;
+		} else if (!strcmp(arg, "-mbmi2")) {
+			gen->isa |= ISA_BMI2;
+		} else if (!strcmp(arg, "-ftls-model=local-exec")) {
+			gen->tls = TLS_LOCAL_EXEC;
+		} else if (!strcmp(arg, "-ftls-model=initial-exec")) {
+			gen->tls = TLS_INITIAL_EXEC;
+		} else if (!strncmp(arg, "-ftls-model=", 12)) {
+			err_user("unknown model '%s' for '-ftls-model='", arg + 12);
+		} else if (!strcmp(arg, "-fschedule-insns")) {
+			gen->schedule = true;
+		} else if (!strcmp(arg, "-fno-schedule-insns")) {
+			gen->schedule = false;
+		} else if (!strcmp(arg, "-fwhole-program")) {
+			ipa->whole = true;
+		} else if (!strncmp(arg, "-fexport=", 9)) {
+			ipa_export(ipa, arg + 9);
+		} else if (!strcmp(arg, "-fopt-info")) {
+			opt->report = true;
+		} else if (!strcmp(arg, "-fno-tree-vectorize")) {
+			opt->vectorize = false;
+		} else if (!strcmp(arg, "-o")) {
+			if (++i == argc) {
+				err_user("missing file name after '-o'");
+			}
+			outpath = argv[i];
+		} else if (arg[0] == '-') {
+			err_user("unknown option '%s'", arg);
+		} else {
+			vec_push(srcpaths, &arg, &nsrcpaths, sizeof(const char *));
+		}
+	}
+
+	if (!nsrcpaths) {
+		err_user("no source file given");
+	}
+
+	gen->isa |= march;
+	opt->vsize = (gen->isa & ISA_AVX2) ? OPT_VECTOR_AVX2 : OPT_VECTOR;
+	opt->pmulld = gen->isa & (ISA_SSE4 | ISA_AVX2);
+
+	File **files = acalloc(nsrcpaths, sizeof(File *));
+	PFile *program = alloct(PFile);
+	program->pfuns = NULL;
+	program->npfuns = 0;
+	program->pstructs = NULL;
+	program->npstructs = 0;
+	program->pglobals = NULL;
+	program->npglobals = 0;
+
+	Parser *parser = parser_new();
+
+	for (size_t i = 0; i < nsrcpaths; ++i) {
+		files[i] = file_new(srcpaths[i]);
+
+		PFile *pfile = parser_run(parser, files[i]);
+		vec_join(program->pfuns, pfile->pfuns, &program->npfuns, pfile->npfuns, sizeof(PFun *));
+		vec_join(program->pstructs, pfile->pstructs, &program->npstructs, pfile->npstructs, sizeof(PStruct *));
+		vec_join(program->pglobals, pfile->pglobals, &program->npglobals, pfile->npglobals, sizeof(PGlobal *));
+		parser_reset(parser);
+	}
+
+	Typechecker *tc = typechecker_new();
+	tc->wide = gen->isa & ISA_AVX2;
+	TFile *tfile = typechecker_run(tc, program);
+
+	ipa_run(ipa, tfile);
+
+	opt_run(opt, tfile);
+
+	if (outpath) {
+		gen_run(gen, outpath, tfile, NULL);
+	} else {
+		for (size_t i = 0; i < nsrcpaths; ++i) {
+			gen_run(gen, fileext(srcpaths[i]), tfile, nsrcpaths > 1 ? files[i] : NULL);
+		}
+	}
+
 	return 0;
 }
+
+/* Parse the value of an -falign-* option; must be a power of two */
+static size_t optalign(const char *opt, const char *val)
+{
+	char *end = NULL;
+	unsigned long n = strtoul(val, &end, 10);
+
+	if (!*val || *end || n == 0 || (n & (n - 1))) {
+		err_user("bad value for '%s'; expected a power of two", opt);
+	}
+
+	return n;
+}
+
+/* The path of the object for a source file: the source's, with ".o" appended */
+static const char *fileext(const char *path)
+{
+	size_t length = strlen(path);
+	char *res = acalloc(length + 3, sizeof(char));
+
+	memcpy(res, path, length);
+	memcpy(res + length, ".o", 3);
+
+	return res;
+}
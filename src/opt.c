@@ -0,0 +1,1999 @@
+/*
+ * opt.c
+ *
+ * This file is part of awl
+ */
+
+#include "opt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "vec.h"
+#include "mem.h"
+
+typedef void (*visitor)(Opt *opt, TExpression *expression);
+
+static void opt_fun(Opt *opt, TFun *tfun);
+static void opt_block(Opt *opt, TBlock *block);
+static void opt_loop(Opt *opt, TWhile *loop, TStatement *before, size_t number);
+static void visit_block(Opt *opt, TBlock *block, visitor fn);
+static void count_writes(Opt *opt, TBlock *block);
+static void count_stores(Opt *opt, TExpression *expression);
+static void count_reads(Opt *opt, TExpression *expression);
+static bool prune(Opt *opt, TBlock *block);
+static void merge_calls(Opt *opt, TExpression *expression);
+static TExpression *merge(Opt *opt, TExpression *expression);
+static bool written(Opt *opt, varndx var);
+static bool pure(Opt *opt, TCall *call);
+static bool maytrap(Opt *opt, TBinary *binary);
+static bool harmless(Opt *opt, TExpression *expression);
+static bool invariant(Opt *opt, TExpression *expression);
+static bool hasvar(TExpression *expression);
+static varndx root(TExpression *place);
+static bool same(Opt *opt, TExpression *a, TExpression *b);
+static TExpression *clone(TExpression *expression);
+static TExpression *constant(Opt *opt, typendx type, uint64_t value);
+static TExpression *variable(Opt *opt, varndx var);
+static TExpression *binary_new(binop op, typendx type, TExpression *lhs, TExpression *rhs);
+static TExpression *unary_new(unop op, typendx type, TExpression *operand);
+static TBlock *block_new(scopendx scope);
+static varndx temporary(Opt *opt, TBlock *block, TExpression *value);
+static void unuse(TExpression *expression);
+static void replace(TExpression *expression, varndx var);
+static varndx preheader(Opt *opt, TExpression *expression, bool *fresh);
+static void hoist(Opt *opt, TExpression *expression);
+static bool isstep(TStatement *statement, binop *op, uint64_t *step);
+static TStatement *findstep(Opt *opt, varndx var);
+static void reduce(Opt *opt, TExpression *expression);
+static void insert(TBlock *block, TStatement *after, TStatement *statement);
+static bool observable(Opt *opt, TBlock *block);
+static bool impure(Opt *opt, TExpression *expression);
+static void bce(Opt *opt, TWhile *loop, TStatement *before);
+static void bce_statement(Opt *opt, TStatement *statement);
+static void bce_nested(Opt *opt, TExpression *expression);
+static void bce_expr(Opt *opt, TExpression *expression);
+static void check_before(Opt *opt, TIndex *index, varndx bound);
+static void vectorize(Opt *opt, TWhile *loop, TStatement *before, size_t number);
+static size_t vsize(Opt *opt);
+static const char *vectorizable(Opt *opt, TWhile *loop, TStatement *before);
+static void vector_loop(Opt *opt, TWhile *loop);
+static const char *lanewise(Opt *opt, TExpression *expression);
+static const char *contiguous(Opt *opt, TExpression *expression, bool store);
+static const char *accumulates(Opt *opt, TAssign *assign);
+static TExpression *widen(Opt *opt, TExpression *expression);
+static TExpression *apart(Opt *opt, varndx a, varndx b);
+
+Opt *opt_new()
+{
+	Opt *opt = alloct(Opt);
+	opt->tfile = NULL;
+	opt->report = false;
+	opt->vectorize = true;
+	opt->vsize = OPT_VECTOR;
+	opt->pmulld = false;
+	opt->fun = NULL;
+	opt->nloops = 0;
+	opt->reads = NULL;
+	opt->calls = NULL;
+	opt->ncalls = 0;
+	opt->unchecked = 0;
+	opt->hoisted = 0;
+	opt->loop = NULL;
+	opt->writes = NULL;
+	opt->nwrites = 0;
+	opt->steps = NULL;
+	opt->nsteps = 0;
+	opt->inserts = NULL;
+	opt->ninserts = 0;
+	opt->iv = NONDX;
+	opt->end = NULL;
+	opt->below = false;
+	opt->every = false;
+	opt->lane = NONDX;
+	opt->vector = NONDX;
+	opt->nlanes = 0;
+	opt->widened = NULL;
+	opt->slices = NULL;
+	opt->nslices = 0;
+	opt->shortest = SIZE_MAX;
+	opt->reductions = NULL;
+	opt->nreductions = 0;
+	opt->scost = 0;
+	opt->vcost = 0;
+	opt->setup = NULL;
+
+	return opt;
+}
+
+void opt_run(Opt *opt, TFile *tfile)
+{
+	opt->tfile = tfile;
+
+	for (size_t i = 0; i < tfile->ntfuns; ++i) {
+		opt_fun(opt, tfile->tfuns[i]);
+	}
+}
+
+void opt_reset(Opt *opt)
+{
+	opt->tfile = NULL;
+	opt->loop = NULL;
+}
+
+/*
+ * Calls to pure functions are dealt with first: a variable nothing reads is
+ * not computed, where that has no effect, and repeated calls with the same
+ * arguments within an expression become a common subexpression. Loop
+ * optimisation may then hoist what is left of them.
+ */
+static void opt_fun(Opt *opt, TFun *tfun)
+{
+	bool pruned = true;
+
+	while (pruned) {
+		opt->reads = acalloc(opt->tfile->ntvariables + 1, sizeof(size_t));
+		visit_block(opt, tfun->block, count_reads);
+		pruned = prune(opt, tfun->block);
+
+		afree(opt->reads);
+		opt->reads = NULL;
+	}
+
+	visit_block(opt, tfun->block, merge_calls);
+	afree(opt->calls);
+	opt->calls = NULL;
+	opt->ncalls = 0;
+
+	opt->fun = tfun;
+	opt->nloops = 0;
+	opt->unchecked = 0;
+	opt->hoisted = 0;
+	opt_block(opt, tfun->block);
+
+	if (opt->report && opt->unchecked) {
+		fprintf(stderr, "%s: '%s': %zu bounds check%s eliminated (%zu hoisted out of a loop)\n", tfun->file->path,
+			tfun->identifier.content, opt->unchecked, opt->unchecked == 1 ? "" : "s", opt->hoisted);
+	}
+}
+
+/* Loops are optimised innermost first, so that what is hoisted out of one may be hoisted further */
+static void opt_block(Opt *opt, TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		switch (statement->variant) {
+			case TSTATEMENT_SWITCH: {
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					opt_block(opt, statement->sw->cases[j]->block);
+				}
+
+				if (statement->sw->def) {
+					opt_block(opt, statement->sw->def);
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				opt_block(opt, statement->tif->then);
+
+				if (statement->tif->els) {
+					opt_block(opt, statement->tif->els);
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				size_t number = ++opt->nloops;
+
+				opt_block(opt, statement->loop->block);
+				opt_loop(opt, statement->loop, i ? block->statements[i - 1] : NULL, number);
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+/*
+ * Bounds-check elimination, then loop-invariant code motion, then
+ * vectorization, then strength reduction of induction variables:
+ *
+ *  - Elements indexed by a variable the loop condition bounds need not be
+ *    checked, where the bound is within the length; see bce().
+ *  - Computations whose operands no statement of the loop assigns are moved
+ *    into the preheader, each into a variable of its own. None of them can
+ *    trap, so they may be computed even where the loop would not have.
+ *  - A simple counted loop may do most of its iterations several at once,
+ *    in a vector loop in the preheader; see vectorize().
+ *  - A basic induction variable is one the loop assigns only by 'i = i + c'
+ *    (or i - c) in the body proper, not in a nested block. Each i * k or
+ *    i << k is replaced by a variable t, set to i * k in the preheader and
+ *    stepped by c * k right after i is. Arithmetic wraps, so t == i * k
+ *    holds everywhere else in the loop.
+ *
+ * The condition is evaluated once in front of the loop, to decide whether to
+ * enter it; that evaluation ('guard') keeps the original form, as it comes
+ * before the preheader. The exit test at the bottom of the loop then compares
+ * against the hoisted end value, and derived variables in place of products.
+ */
+static void opt_loop(Opt *opt, TWhile *loop, TStatement *before, size_t number)
+{
+	TBlock *body = loop->block;
+
+	opt->loop = loop;
+	opt->nwrites = opt->tfile->ntvariables;
+	opt->writes = acalloc(opt->nwrites + 1, sizeof(size_t));
+
+	if (loop->guard == loop->cond) {
+		loop->guard = clone(loop->cond);
+	}
+
+	count_writes(opt, body);
+	count_stores(opt, loop->cond);
+	visit_block(opt, body, count_stores);
+
+	bce(opt, loop, before);
+
+	size_t npre = loop->pre->nstatements;
+	hoist(opt, loop->cond);
+	visit_block(opt, body, hoist);
+
+	if (opt->report && loop->pre->nstatements > npre) {
+		size_t n = loop->pre->nstatements - npre;
+		fprintf(stderr, "%s: '%s': loop %zu: %zu invariant computation%s hoisted\n", opt->fun->file->path,
+			opt->fun->identifier.content, number, n, n == 1 ? "" : "s");
+	}
+
+	if (opt->vectorize) {
+		vectorize(opt, loop, before, number);
+	}
+
+	opt->steps = NULL;
+	opt->nsteps = 0;
+	for (size_t i = 0; i < body->nstatements; ++i) {
+		binop op = BINOP_ADD;
+		uint64_t c = 0;
+
+		if (isstep(body->statements[i], &op, &c) && opt->writes[body->statements[i]->assign->var] == 1) {
+			vec_push(opt->steps, &body->statements[i], &opt->nsteps, sizeof(TStatement *));
+		}
+	}
+
+	opt->inserts = NULL;
+	opt->ninserts = 0;
+	if (opt->nsteps) {
+		reduce(opt, loop->cond);
+		visit_block(opt, body, reduce);
+	}
+
+	for (size_t i = 0; i < opt->ninserts; ++i) {
+		insert(body, opt->inserts[i].after, opt->inserts[i].statement);
+	}
+
+	afree(opt->inserts);
+	afree(opt->steps);
+	afree(opt->writes);
+	opt->inserts = NULL;
+	opt->steps = NULL;
+	opt->writes = NULL;
+	opt->loop = NULL;
+}
+
+/* Call 'fn' on every expression evaluated in a block, including in blocks nested in it */
+static void visit_block(Opt *opt, TBlock *block, visitor fn)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		switch (statement->variant) {
+			case TSTATEMENT_RETURN:
+			case TSTATEMENT_BUILTIN: fn(opt, statement->expr); break;
+			case TSTATEMENT_VAR:
+			case TSTATEMENT_ASSIGN: fn(opt, statement->assign->value); break;
+			case TSTATEMENT_STORE: {
+				fn(opt, statement->store->value);
+				fn(opt, statement->store->place);
+				break;
+			}
+			case TSTATEMENT_CHECK: fn(opt, statement->check->index); break;
+			case TSTATEMENT_SWITCH: {
+				fn(opt, statement->sw->expr);
+
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					visit_block(opt, statement->sw->cases[j]->block, fn);
+				}
+
+				if (statement->sw->def) {
+					visit_block(opt, statement->sw->def, fn);
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				fn(opt, statement->tif->cond);
+				visit_block(opt, statement->tif->then, fn);
+
+				if (statement->tif->els) {
+					visit_block(opt, statement->tif->els, fn);
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				fn(opt, statement->loop->guard);
+				visit_block(opt, statement->loop->pre, fn);
+				fn(opt, statement->loop->cond);
+				visit_block(opt, statement->loop->block, fn);
+				break;
+			}
+			case TSTATEMENT_ASM: {
+				/* Outputs too, as variables; the asm needs them whether or not they are read after it */
+				for (size_t j = 0; j < statement->tasm->noperands; ++j) {
+					fn(opt, statement->tasm->operands[j].expr);
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+static void count_writes(Opt *opt, TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		switch (statement->variant) {
+			case TSTATEMENT_VAR:
+			case TSTATEMENT_ASSIGN: ++opt->writes[statement->assign->var]; break;
+			case TSTATEMENT_STORE: {
+				varndx var = root(statement->store->place);
+
+				if (var != NONDX) {
+					++opt->writes[var];
+				}
+				break;
+			}
+			case TSTATEMENT_SWITCH: {
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					count_writes(opt, statement->sw->cases[j]->block);
+				}
+
+				if (statement->sw->def) {
+					count_writes(opt, statement->sw->def);
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				count_writes(opt, statement->tif->then);
+
+				if (statement->tif->els) {
+					count_writes(opt, statement->tif->els);
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				count_writes(opt, statement->loop->pre);
+				count_writes(opt, statement->loop->block);
+				break;
+			}
+			case TSTATEMENT_ASM: {
+				/* It may write to its memory operands as well as its outputs */
+				TAsm *tasm = statement->tasm;
+
+				for (size_t j = 0; j < tasm->noperands; ++j) {
+					varndx var = NONDX;
+
+					if (j < tasm->nouts) {
+						++opt->writes[tasm->operands[j].expr->var];
+					} else if (tasm->operands[j].constraint == 'm' && (var = root(tasm->operands[j].expr)) != NONDX) {
+						++opt->writes[var];
+					}
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+/* Builtins that store count as writes to the variable they store into, wherever they are in an expression */
+static void count_stores(Opt *opt, TExpression *expression)
+{
+	varndx var = NONDX;
+
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				count_stores(opt, expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			count_stores(opt, expression->binary->lhs);
+			count_stores(opt, expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: count_stores(opt, expression->unary->operand); break;
+		case TEXPRESSION_FIELD: count_stores(opt, expression->field->base); break;
+		case TEXPRESSION_BUILTIN: {
+			TBuiltin *builtin = expression->builtin;
+
+			if ((builtin->op == BUILTIN_STREAM || builtin->op > BUILTIN_LOAD) && (var = root(builtin->args[0])) != NONDX) {
+				++opt->writes[var];
+			}
+
+			for (size_t i = 0; i < builtin->nargs; ++i) {
+				count_stores(opt, builtin->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			count_stores(opt, expression->index->base);
+			count_stores(opt, expression->index->index);
+			break;
+		}
+		default: break;
+	}
+}
+
+static void count_reads(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: ++opt->reads[expression->var]; break;
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				count_reads(opt, expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			count_reads(opt, expression->binary->lhs);
+			count_reads(opt, expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: count_reads(opt, expression->unary->operand); break;
+		case TEXPRESSION_FIELD: count_reads(opt, expression->field->base); break;
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				count_reads(opt, expression->builtin->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			count_reads(opt, expression->index->base);
+			count_reads(opt, expression->index->index);
+			break;
+		}
+		default: break;
+	}
+}
+
+/* Remove the definitions of, and assignments to, variables nothing reads; returns whether any were */
+static bool prune(Opt *opt, TBlock *block)
+{
+	bool pruned = false;
+	size_t kept = 0;
+
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		switch (statement->variant) {
+			case TSTATEMENT_VAR:
+			case TSTATEMENT_ASSIGN: {
+				if (!opt->reads[statement->assign->var] && harmless(opt, statement->assign->value)) {
+					pruned = true;
+					continue;
+				}
+				break;
+			}
+			case TSTATEMENT_SWITCH: {
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					pruned |= prune(opt, statement->sw->cases[j]->block);
+				}
+
+				if (statement->sw->def) {
+					pruned |= prune(opt, statement->sw->def);
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				pruned |= prune(opt, statement->tif->then);
+
+				if (statement->tif->els) {
+					pruned |= prune(opt, statement->tif->els);
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: pruned |= prune(opt, statement->loop->block); break;
+			default: break;
+		}
+
+		block->statements[kept++] = statement;
+	}
+
+	block->nstatements = kept;
+	return pruned;
+}
+
+/* Make repeated calls of pure functions with the same arguments, within an expression, one node */
+static void merge_calls(Opt *opt, TExpression *expression)
+{
+	opt->ncalls = 0;
+	merge(opt, expression);
+}
+
+/* The node to use in place of an expression: an equal pure call seen before, or the expression itself */
+static TExpression *merge(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				expression->call->args[i] = merge(opt, expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			expression->binary->lhs = merge(opt, expression->binary->lhs);
+			expression->binary->rhs = merge(opt, expression->binary->rhs);
+			return expression;
+		}
+		case TEXPRESSION_UNARY: {
+			expression->unary->operand = merge(opt, expression->unary->operand);
+			return expression;
+		}
+		case TEXPRESSION_FIELD: {
+			expression->field->base = merge(opt, expression->field->base);
+			return expression;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				expression->builtin->args[i] = merge(opt, expression->builtin->args[i]);
+			}
+			return expression;
+		}
+		case TEXPRESSION_INDEX: {
+			expression->index->base = merge(opt, expression->index->base);
+			expression->index->index = merge(opt, expression->index->index);
+			return expression;
+		}
+		default: return expression;
+	}
+
+	if (!pure(opt, expression->call)) {
+		return expression;
+	}
+
+	for (size_t i = 0; i < opt->ncalls; ++i) {
+		TExpression *seen = opt->calls[i];
+
+		if (seen == expression) {
+			return expression;
+		}
+
+		if (same(opt, seen, expression)) {
+			unuse(expression);
+			++seen->uses;
+			return seen;
+		}
+	}
+
+	vec_push(opt->calls, &expression, &opt->ncalls, sizeof(TExpression *));
+	return expression;
+}
+
+/* Variables made since the loop's writes were counted are those hoisted out of it */
+static bool written(Opt *opt, varndx var)
+{
+	return (size_t)var < opt->nwrites && opt->writes[var];
+}
+
+static bool pure(Opt *opt, TCall *call)
+{
+	return opt->tfile->tfuns[call->fun]->effect == EFFECT_PURE;
+}
+
+/* Only division by a constant other than 0 (and -1, for signed types) is sure not to trap */
+static bool maytrap(Opt *opt, TBinary *binary)
+{
+	if (binary->op != BINOP_DIV && binary->op != BINOP_MOD) {
+		return false;
+	}
+
+	if (binary->rhs->variant != TEXPRESSION_NUMLIT) {
+		return true;
+	}
+
+	Type *type = opt->tfile->types[binary->rhs->type];
+	uint64_t mask = type->size == 8 ? UINT64_MAX : ((uint64_t)1 << (type->size * 8)) - 1;
+	uint64_t d = binary->rhs->number->u64 & mask;
+
+	return d == 0 || (type->signd && d == mask);
+}
+
+/* Whether evaluating an expression can make no difference but for its value: no effects, traps or loops */
+static bool harmless(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT:
+		case TEXPRESSION_VARIABLE:
+		case TEXPRESSION_GLOBAL: return true;
+		case TEXPRESSION_CALL: {
+			TCall *call = expression->call;
+
+			if (!pure(opt, call) || !opt->tfile->tfuns[call->fun]->total) {
+				return false;
+			}
+
+			for (size_t i = 0; i < call->nargs; ++i) {
+				if (!harmless(opt, call->args[i])) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+		case TEXPRESSION_BINARY: {
+			TBinary *binary = expression->binary;
+			return !maytrap(opt, binary) && harmless(opt, binary->lhs) && harmless(opt, binary->rhs);
+		}
+		case TEXPRESSION_UNARY: return harmless(opt, expression->unary->operand);
+		case TEXPRESSION_FIELD: return harmless(opt, expression->field->base);
+		case TEXPRESSION_INDEX: {
+			TIndex *index = expression->index;
+			return !index->checked && harmless(opt, index->base) && harmless(opt, index->index);
+		}
+		default: return false;
+	}
+}
+
+/* Whether an expression has the same value throughout the loop, and is harmless to compute where it was not */
+static bool invariant(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT: return true;
+		case TEXPRESSION_VARIABLE: return !written(opt, expression->var);
+		case TEXPRESSION_CALL: {
+			TCall *call = expression->call;
+
+			if (!pure(opt, call) || !opt->tfile->tfuns[call->fun]->total) {
+				return false;
+			}
+
+			for (size_t i = 0; i < call->nargs; ++i) {
+				if (!invariant(opt, call->args[i])) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+		case TEXPRESSION_BINARY: {
+			TBinary *binary = expression->binary;
+			return !maytrap(opt, binary) && invariant(opt, binary->lhs) && invariant(opt, binary->rhs);
+		}
+		case TEXPRESSION_UNARY: return invariant(opt, expression->unary->operand);
+		case TEXPRESSION_FIELD: return invariant(opt, expression->field->base);
+		case TEXPRESSION_INDEX: {
+			/* The memory of a slice may be written through another one, or by any call */
+			TIndex *index = expression->index;
+			bool slice = opt->tfile->types[index->base->type]->kind == TYPE_SLICE;
+			return !index->checked && !slice && invariant(opt, index->base) && invariant(opt, index->index);
+		}
+		default: return false;
+	}
+}
+
+static bool hasvar(TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_VARIABLE: return true;
+		case TEXPRESSION_BINARY: return hasvar(expression->binary->lhs) || hasvar(expression->binary->rhs);
+		case TEXPRESSION_UNARY: return hasvar(expression->unary->operand);
+		case TEXPRESSION_FIELD:
+		case TEXPRESSION_INDEX:
+		case TEXPRESSION_GLOBAL: return true;
+		default: return false;
+	}
+}
+
+/* The variable a store writes part of, or NONDX if it is a thread-local */
+static varndx root(TExpression *place)
+{
+	while (place->variant != TEXPRESSION_VARIABLE) {
+		if (place->variant == TEXPRESSION_GLOBAL) {
+			return NONDX;
+		}
+
+		place = place->variant == TEXPRESSION_FIELD ? place->field->base : place->index->base;
+	}
+
+	return place->var;
+}
+
+/* Structural equality of expressions; calls are equal only if their function is pure */
+static bool same(Opt *opt, TExpression *a, TExpression *b)
+{
+	if (a == b) {
+		return true;
+	}
+
+	if (a->variant != b->variant || a->type != b->type) {
+		return false;
+	}
+
+	switch (a->variant) {
+		case TEXPRESSION_NUMLIT: return a->number->u64 == b->number->u64;
+		case TEXPRESSION_VARIABLE: return a->var == b->var;
+		case TEXPRESSION_GLOBAL: return a->global == b->global;
+		case TEXPRESSION_BINARY: {
+			return a->binary->op == b->binary->op && same(opt, a->binary->lhs, b->binary->lhs)
+				&& same(opt, a->binary->rhs, b->binary->rhs);
+		}
+		case TEXPRESSION_UNARY: {
+			return a->unary->op == b->unary->op && !memcmp(a->unary->lanes, b->unary->lanes, TYPE_MAXLANES)
+				&& same(opt, a->unary->operand, b->unary->operand);
+		}
+		case TEXPRESSION_FIELD: return a->field->field == b->field->field && same(opt, a->field->base, b->field->base);
+		case TEXPRESSION_INDEX: {
+			return a->index->offset == b->index->offset && a->index->stride == b->index->stride
+				&& same(opt, a->index->base, b->index->base) && same(opt, a->index->index, b->index->index);
+		}
+		case TEXPRESSION_CALL: {
+			if (a->call->fun != b->call->fun || !pure(opt, a->call)) {
+				return false;
+			}
+
+			for (size_t i = 0; i < a->call->nargs; ++i) {
+				if (!same(opt, a->call->args[i], b->call->args[i])) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+		default: return false;
+	}
+}
+
+/* A copy of an expression sharing no nodes with it; the copy has no common subexpressions */
+static TExpression *clone(TExpression *expression)
+{
+	return texpression_copy(expression, NULL, NULL, 0);
+}
+
+static TExpression *constant(Opt *opt, typendx type, uint64_t value)
+{
+	Type *t = opt->tfile->types[type];
+
+	Number *number = alloct(Number);
+	number->span = (Span){ 0 };
+	number->bits = t->size * 8;
+	number->sig = t->signd;
+	number->u64 = value & (t->size == 8 ? UINT64_MAX : ((uint64_t)1 << (t->size * 8)) - 1);
+
+	TExpression *expression = alloct(TExpression);
+	expression->variant = TEXPRESSION_NUMLIT;
+	expression->type = type;
+	expression->uses = 1;
+	expression->number = number;
+
+	return expression;
+}
+
+static TExpression *variable(Opt *opt, varndx var)
+{
+	TExpression *expression = alloct(TExpression);
+	expression->variant = TEXPRESSION_VARIABLE;
+	expression->type = opt->tfile->tvariables[var]->type;
+	expression->uses = 1;
+	expression->var = var;
+
+	return expression;
+}
+
+static TExpression *binary_new(binop op, typendx type, TExpression *lhs, TExpression *rhs)
+{
+	TExpression *expression = alloct(TExpression);
+	expression->variant = TEXPRESSION_BINARY;
+	expression->type = type;
+	expression->uses = 1;
+	expression->binary = alloct(TBinary);
+	expression->binary->op = op;
+	expression->binary->lhs = lhs;
+	expression->binary->rhs = rhs;
+
+	return expression;
+}
+
+static TExpression *unary_new(unop op, typendx type, TExpression *operand)
+{
+	TExpression *expression = alloct(TExpression);
+	expression->variant = TEXPRESSION_UNARY;
+	expression->type = type;
+	expression->uses = 1;
+	expression->unary = alloct(TUnary);
+	expression->unary->op = op;
+	expression->unary->operand = operand;
+	memset(expression->unary->lanes, 0, TYPE_MAXLANES);
+
+	return expression;
+}
+
+static TBlock *block_new(scopendx scope)
+{
+	TBlock *block = alloct(TBlock);
+	block->scope = scope;
+	block->statements = NULL;
+	block->nstatements = 0;
+
+	return block;
+}
+
+/* A new, unnamed variable, defined by a value at the end of a block */
+static varndx temporary(Opt *opt, TBlock *block, TExpression *value)
+{
+	TVariable *tvar = alloct(TVariable);
+	tvar->identifier = EMPTYTOKEN;
+	tvar->type = value->type;
+	tvar->length = NONDX;
+	tvar->align = 0;
+
+	varndx var = opt->tfile->ntvariables;
+	vec_push(opt->tfile->tvariables, &tvar, &opt->tfile->ntvariables, sizeof(TVariable *));
+
+	TStatement *statement = alloct(TStatement);
+	statement->variant = TSTATEMENT_VAR;
+	statement->assign = alloct(TAssign);
+	statement->assign->var = var;
+	statement->assign->value = value;
+	vec_push(block->statements, &statement, &block->nstatements, sizeof(TStatement *));
+
+	return var;
+}
+
+/* A node has stopped referring to its children; those it was the last use of stop referring to theirs */
+static void unuse(TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				if (--expression->call->args[i]->uses == 0) {
+					unuse(expression->call->args[i]);
+				}
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			if (--expression->binary->lhs->uses == 0) {
+				unuse(expression->binary->lhs);
+			}
+			if (--expression->binary->rhs->uses == 0) {
+				unuse(expression->binary->rhs);
+			}
+			break;
+		}
+		case TEXPRESSION_UNARY: {
+			if (--expression->unary->operand->uses == 0) {
+				unuse(expression->unary->operand);
+			}
+			break;
+		}
+		case TEXPRESSION_FIELD: {
+			if (--expression->field->base->uses == 0) {
+				unuse(expression->field->base);
+			}
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			if (--expression->index->base->uses == 0) {
+				unuse(expression->index->base);
+			}
+			if (--expression->index->index->uses == 0) {
+				unuse(expression->index->index);
+			}
+			break;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				if (--expression->builtin->args[i]->uses == 0) {
+					unuse(expression->builtin->args[i]);
+				}
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+/* Turn a node into a read of a variable; every use of the node in its statement sees the change */
+static void replace(TExpression *expression, varndx var)
+{
+	unuse(expression);
+
+	expression->variant = TEXPRESSION_VARIABLE;
+	expression->var = var;
+}
+
+/* The variable the preheader sets to an expression, made (and 'fresh' set) if there is none yet */
+static varndx preheader(Opt *opt, TExpression *expression, bool *fresh)
+{
+	TBlock *pre = opt->loop->pre;
+
+	for (size_t i = 0; i < pre->nstatements; ++i) {
+		if (pre->statements[i]->variant == TSTATEMENT_VAR && same(opt, pre->statements[i]->assign->value, expression)) {
+			*fresh = false;
+			return pre->statements[i]->assign->var;
+		}
+	}
+
+	*fresh = true;
+	return temporary(opt, pre, clone(expression));
+}
+
+/* Hoist the largest invariant computations of an expression into the preheader */
+static void hoist(Opt *opt, TExpression *expression)
+{
+	if (invariant(opt, expression)) {
+		bool fresh = false;
+
+		/* Constants and lone variables are as cheap to use as a hoisted copy; calls never are */
+		if (expression->variant == TEXPRESSION_CALL || ((expression->variant == TEXPRESSION_BINARY
+				|| expression->variant == TEXPRESSION_UNARY) && hasvar(expression))) {
+			replace(expression, preheader(opt, expression, &fresh));
+		}
+
+		return;
+	}
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				hoist(opt, expression->call->args[i]);
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			hoist(opt, expression->binary->lhs);
+			hoist(opt, expression->binary->rhs);
+			break;
+		}
+		case TEXPRESSION_UNARY: hoist(opt, expression->unary->operand); break;
+		case TEXPRESSION_FIELD: hoist(opt, expression->field->base); break;
+		case TEXPRESSION_INDEX: {
+			hoist(opt, expression->index->base);
+			hoist(opt, expression->index->index);
+			break;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				hoist(opt, expression->builtin->args[i]);
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+/* Whether a statement is 'i = i + c', 'i = c + i' or 'i = i - c' */
+static bool isstep(TStatement *statement, binop *op, uint64_t *step)
+{
+	if (statement->variant != TSTATEMENT_ASSIGN || statement->assign->value->variant != TEXPRESSION_BINARY) {
+		return false;
+	}
+
+	varndx var = statement->assign->var;
+	TBinary *binary = statement->assign->value->binary;
+	TExpression *lhs = binary->lhs;
+	TExpression *rhs = binary->rhs;
+
+	if (binary->op == BINOP_ADD && lhs->variant == TEXPRESSION_NUMLIT) {
+		lhs = binary->rhs;
+		rhs = binary->lhs;
+	} else if (binary->op != BINOP_SUB && binary->op != BINOP_ADD) {
+		return false;
+	}
+
+	if (lhs->variant != TEXPRESSION_VARIABLE || lhs->var != var || rhs->variant != TEXPRESSION_NUMLIT) {
+		return false;
+	}
+
+	*op = binary->op;
+	*step = rhs->number->u64;
+	return true;
+}
+
+static TStatement *findstep(Opt *opt, varndx var)
+{
+	for (size_t i = 0; i < opt->nsteps; ++i) {
+		if (opt->steps[i]->assign->var == var) {
+			return opt->steps[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Replace products of basic induction variables and constants by derived induction variables */
+static void reduce(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				reduce(opt, expression->call->args[i]);
+			}
+			return;
+		}
+		case TEXPRESSION_BINARY: break;
+		case TEXPRESSION_UNARY: reduce(opt, expression->unary->operand); return;
+		case TEXPRESSION_FIELD: reduce(opt, expression->field->base); return;
+		case TEXPRESSION_INDEX: {
+			reduce(opt, expression->index->base);
+			reduce(opt, expression->index->index);
+			return;
+		}
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				reduce(opt, expression->builtin->args[i]);
+			}
+			return;
+		}
+		default: return;
+	}
+
+	TBinary *binary = expression->binary;
+	TExpression *iv = binary->lhs;
+	TExpression *k = binary->rhs;
+
+	if (binary->op == BINOP_MUL && iv->variant == TEXPRESSION_NUMLIT) {
+		iv = binary->rhs;
+		k = binary->lhs;
+	}
+
+	Type *type = opt->tfile->types[expression->type];
+	TStatement *step = NULL;
+	uint64_t factor = 0;
+
+	/* Vectors step every lane at once, and are no induction variables */
+	if (type->kind == TYPE_PRIMITIVE && iv->variant == TEXPRESSION_VARIABLE && k->variant == TEXPRESSION_NUMLIT
+			&& (step = findstep(opt, iv->var))) {
+		if (binary->op == BINOP_MUL) {
+			factor = k->number->u64;
+		} else if (binary->op == BINOP_SHL && k->number->u64 < type->size * 8) {
+			factor = (uint64_t)1 << k->number->u64;
+		}
+	}
+
+	if (factor < 2) {
+		reduce(opt, binary->lhs);
+		reduce(opt, binary->rhs);
+		return;
+	}
+
+	bool fresh = false;
+	varndx var = preheader(opt, expression, &fresh);
+
+	if (fresh) {
+		binop op = BINOP_ADD;
+		uint64_t c = 0;
+		isstep(step, &op, &c);
+
+		TExpression *value = binary_new(op, expression->type, variable(opt, var), constant(opt, expression->type, c * factor));
+
+		TStatement *update = alloct(TStatement);
+		update->variant = TSTATEMENT_ASSIGN;
+		update->assign = alloct(TAssign);
+		update->assign->var = var;
+		update->assign->value = value;
+
+		Insert ins = { .after = step, .statement = update };
+		vec_push(opt->inserts, &ins, &opt->ninserts, sizeof(Insert));
+	}
+
+	replace(expression, var);
+}
+
+static void insert(TBlock *block, TStatement *after, TStatement *statement)
+{
+	size_t at = 0;
+	while (block->statements[at] != after) {
+		++at;
+	}
+
+	vec_push(block->statements, &statement, &block->nstatements, sizeof(TStatement *));
+	memmove(&block->statements[at + 2], &block->statements[at + 1], (block->nstatements - at - 2) * sizeof(TStatement *));
+	block->statements[at + 1] = statement;
+}
+
+/* Whether anything outside the function could see what a block does: it returns, calls what is not pure, or stores to a slice or thread-local */
+static bool observable(Opt *opt, TBlock *block)
+{
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+
+		switch (statement->variant) {
+			case TSTATEMENT_RETURN:
+			case TSTATEMENT_RETURN_NOVAL:
+			case TSTATEMENT_ASM: return true;
+			case TSTATEMENT_BUILTIN: {
+				/* A prefetch only warms the cache; the others store, or order stores */
+				if (statement->expr->builtin->op != BUILTIN_PREFETCH) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_VAR:
+			case TSTATEMENT_ASSIGN: {
+				if (impure(opt, statement->assign->value)) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_STORE: {
+				varndx var = root(statement->store->place);
+
+				if (var == NONDX || opt->tfile->types[opt->tfile->tvariables[var]->type]->kind == TYPE_SLICE
+						|| impure(opt, statement->store->value) || impure(opt, statement->store->place)) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_SWITCH: {
+				if (impure(opt, statement->sw->expr)) {
+					return true;
+				}
+
+				for (size_t j = 0; j < statement->sw->ncases; ++j) {
+					if (observable(opt, statement->sw->cases[j]->block)) {
+						return true;
+					}
+				}
+
+				if (statement->sw->def && observable(opt, statement->sw->def)) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				TIf *tif = statement->tif;
+
+				if (impure(opt, tif->cond) || observable(opt, tif->then) || (tif->els && observable(opt, tif->els))) {
+					return true;
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				TWhile *loop = statement->loop;
+
+				if (impure(opt, loop->guard) || observable(opt, loop->pre) || observable(opt, loop->block)) {
+					return true;
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+
+	return false;
+}
+
+/* Whether an expression calls a function that is not pure, or has a builtin with effects */
+static bool impure(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			if (!pure(opt, expression->call)) {
+				return true;
+			}
+
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				if (impure(opt, expression->call->args[i])) {
+					return true;
+				}
+			}
+
+			return false;
+		}
+		case TEXPRESSION_BINARY: return impure(opt, expression->binary->lhs) || impure(opt, expression->binary->rhs);
+		case TEXPRESSION_UNARY: return impure(opt, expression->unary->operand);
+		case TEXPRESSION_FIELD: return impure(opt, expression->field->base);
+		case TEXPRESSION_INDEX: return impure(opt, expression->index->base) || impure(opt, expression->index->index);
+		case TEXPRESSION_BUILTIN: return true;
+		default: return false;
+	}
+}
+
+/*
+ * Bounds-check elimination, by the range of an induction variable. A loop
+ * 'while i < n' (or i <= n) with an invariant n, whose body assigns i in its
+ * last statement only, has i < n everywhere before that assignment; and i is
+ * not negative if it is unsigned, or starts at a constant that is not and
+ * only ever goes up by 1. An element indexed by i there needs no check if n
+ * is at most the length of the array, or is the length of the slice.
+ *
+ * Failing that, if i goes up by 1 and the element is indexed on every
+ * iteration, every index from the first up to n - 1 is used, unless the loop
+ * traps before: so checking n - 1 once, in the preheader, traps exactly when
+ * the loop would have. It traps sooner, though, so the loop must do nothing
+ * anything outside the function could see until then.
+ */
+static void bce(Opt *opt, TWhile *loop, TStatement *before)
+{
+	TBlock *body = loop->block;
+
+	if (loop->cond->variant != TEXPRESSION_BINARY) {
+		return;
+	}
+
+	TBinary *binary = loop->cond->binary;
+	TExpression *iv = binary->lhs;
+	TExpression *end = binary->rhs;
+	binop op = binary->op;
+
+	if (op == BINOP_GT || op == BINOP_GE) {
+		iv = binary->rhs;
+		end = binary->lhs;
+		op = op == BINOP_GT ? BINOP_LT : BINOP_LE;
+	}
+
+	if ((op != BINOP_LT && op != BINOP_LE) || iv->variant != TEXPRESSION_VARIABLE
+			|| !(end->variant == TEXPRESSION_NUMLIT || (end->variant == TEXPRESSION_VARIABLE && !written(opt, end->var)))) {
+		return;
+	}
+
+	varndx var = iv->var;
+	size_t last = body->nstatements;
+
+	if (opt->writes[var] > 1) {
+		return;
+	}
+
+	if (opt->writes[var] == 1) {
+		TStatement *step = last ? body->statements[last - 1] : NULL;
+
+		if (!step || step->variant != TSTATEMENT_ASSIGN || step->assign->var != var) {
+			return;
+		}
+
+		--last;
+	}
+
+	binop stepop = BINOP_SUB;
+	uint64_t c = 0;
+	bool up = last < body->nstatements && isstep(body->statements[last], &stepop, &c) && stepop == BINOP_ADD && c == 1;
+
+	Type *type = opt->tfile->types[iv->type];
+	if (type->signd) {
+		/* Then it must not overflow either, which 'i <= n' would for the greatest n */
+		bool start = before && (before->variant == TSTATEMENT_VAR || before->variant == TSTATEMENT_ASSIGN)
+			&& before->assign->var == var && before->assign->value->variant == TEXPRESSION_NUMLIT
+			&& !((before->assign->value->number->u64 >> (type->size * 8 - 1)) & 1);
+
+		if (!start || !up || op != BINOP_LT) {
+			return;
+		}
+	}
+
+	opt->iv = var;
+	opt->end = end;
+	opt->below = op == BINOP_LT;
+	bool every = up && !observable(opt, body);
+
+	for (size_t i = 0; i < last; ++i) {
+		opt->every = every;
+		bce_statement(opt, body->statements[i]);
+	}
+
+	/* The step's own value is computed before i changes */
+	if (last < body->nstatements) {
+		opt->every = every;
+		bce_expr(opt, body->statements[last]->assign->value);
+	}
+
+	opt->iv = NONDX;
+	opt->end = NULL;
+	opt->every = false;
+}
+
+/* Eliminate the checks of a statement of the loop body; those of blocks nested in it are not made on every iteration */
+static void bce_statement(Opt *opt, TStatement *statement)
+{
+	switch (statement->variant) {
+		case TSTATEMENT_RETURN:
+		case TSTATEMENT_BUILTIN: bce_expr(opt, statement->expr); break;
+		case TSTATEMENT_VAR:
+		case TSTATEMENT_ASSIGN: bce_expr(opt, statement->assign->value); break;
+		case TSTATEMENT_STORE: {
+			bce_expr(opt, statement->store->value);
+			bce_expr(opt, statement->store->place);
+			break;
+		}
+		case TSTATEMENT_SWITCH: {
+			bce_expr(opt, statement->sw->expr);
+			opt->every = false;
+
+			for (size_t j = 0; j < statement->sw->ncases; ++j) {
+				visit_block(opt, statement->sw->cases[j]->block, bce_nested);
+			}
+
+			if (statement->sw->def) {
+				visit_block(opt, statement->sw->def, bce_nested);
+			}
+			break;
+		}
+		case TSTATEMENT_IF: {
+			bce_expr(opt, statement->tif->cond);
+			opt->every = false;
+			visit_block(opt, statement->tif->then, bce_nested);
+
+			if (statement->tif->els) {
+				visit_block(opt, statement->tif->els, bce_nested);
+			}
+			break;
+		}
+		case TSTATEMENT_WHILE: {
+			bce_expr(opt, statement->loop->guard);
+			opt->every = false;
+			visit_block(opt, statement->loop->pre, bce_nested);
+			bce_expr(opt, statement->loop->cond);
+			visit_block(opt, statement->loop->block, bce_nested);
+			break;
+		}
+		case TSTATEMENT_ASM: {
+			for (size_t j = statement->tasm->nouts; j < statement->tasm->noperands; ++j) {
+				bce_expr(opt, statement->tasm->operands[j].expr);
+			}
+			break;
+		}
+		default: break;
+	}
+}
+
+static void bce_nested(Opt *opt, TExpression *expression)
+{
+	opt->every = false;
+	bce_expr(opt, expression);
+}
+
+static void bce_expr(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				bce_expr(opt, expression->call->args[i]);
+			}
+			return;
+		}
+		case TEXPRESSION_BINARY: {
+			bce_expr(opt, expression->binary->lhs);
+			bce_expr(opt, expression->binary->rhs);
+			return;
+		}
+		case TEXPRESSION_UNARY: bce_expr(opt, expression->unary->operand); return;
+		case TEXPRESSION_FIELD: bce_expr(opt, expression->field->base); return;
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				bce_expr(opt, expression->builtin->args[i]);
+			}
+			return;
+		}
+		case TEXPRESSION_INDEX: {
+			bce_expr(opt, expression->index->base);
+			bce_expr(opt, expression->index->index);
+			break;
+		}
+		default: return;
+	}
+
+	TIndex *index = expression->index;
+	TExpression *end = opt->end;
+
+	if (!index->checked || index->index->variant != TEXPRESSION_VARIABLE || index->index->var != opt->iv) {
+		return;
+	}
+
+	Type *base = opt->tfile->types[index->base->type];
+	varndx bound = base->kind == TYPE_SLICE ? opt->tfile->tvariables[index->base->var]->length : NONDX;
+
+	if (bound != NONDX && opt->below && end->variant == TEXPRESSION_VARIABLE && end->var == bound) {
+		index->checked = false;
+	} else if (bound == NONDX && end->variant == TEXPRESSION_NUMLIT
+			&& (opt->below ? end->number->u64 <= index->length : end->number->u64 < index->length)) {
+		index->checked = false;
+	} else if (opt->every) {
+		check_before(opt, index, bound);
+		index->checked = false;
+		++opt->hoisted;
+	}
+
+	opt->unchecked += !index->checked;
+}
+
+/* Check the greatest index the loop uses in its preheader, once for each length it is used with */
+static void check_before(Opt *opt, TIndex *index, varndx bound)
+{
+	TExpression *greatest = clone(opt->end);
+
+	if (opt->below) {
+		greatest = binary_new(BINOP_SUB, greatest->type, greatest, constant(opt, greatest->type, 1));
+	}
+
+	TBlock *pre = opt->loop->pre;
+
+	for (size_t i = 0; i < pre->nstatements; ++i) {
+		TCheck *check = pre->statements[i]->variant == TSTATEMENT_CHECK ? pre->statements[i]->check : NULL;
+
+		if (check && check->bound == bound && check->length == index->length && same(opt, check->index, greatest)) {
+			return;
+		}
+	}
+
+	TStatement *statement = alloct(TStatement);
+	statement->variant = TSTATEMENT_CHECK;
+	statement->check = alloct(TCheck);
+	statement->check->index = greatest;
+	statement->check->length = index->length;
+	statement->check->bound = bound;
+	vec_push(pre->statements, &statement, &pre->nstatements, sizeof(TStatement *));
+}
+
+/*
+ * Vectorization of innermost loops of the form
+ *
+ *	while i < n { ...; i = i + 1; }
+ *
+ * with an invariant n, whose other statements store to elements indexed by
+ * i, define variables, or accumulate into a variable with an associative
+ * operator ('s = s + e', or -, &, | or ^) that the loop reads nowhere else.
+ * Their values are computed lane-wise from elements indexed by i, those
+ * variables, and invariants. Every element is of one integer type, and
+ * indexed by i alone. Those bce() left bounds checks on are not checked in
+ * the vector loop, which is only entered if n is within every length they
+ * are checked against: then none of its iterations would have trapped.
+ *
+ * The vector loop goes in the preheader, after what is hoisted there, and
+ * does a vector's worth of iterations (vsize() bytes) at once while more than that
+ * are left. The original loop is entered without testing its condition
+ * again, and does the rest: at least one iteration. Each accumulator starts
+ * out with the identity of its operator in every lane, and its lanes are
+ * combined into its variable after the vector loop.
+ *
+ * A slice may have elements in common with another, and the vector loop is
+ * only entered where each slice it stores to is at the same address as each
+ * other slice it indexes, or a vector or more apart: then no lane of a vector
+ * depends on another. Arrays are variables of their own, which no slice
+ * points into.
+ *
+ * The loop is left as it is unless the vector loop looks faster: an
+ * estimate, in instructions, of an iteration of each is compared, the
+ * scalar one times the number of lanes.
+ */
+static void vectorize(Opt *opt, TWhile *loop, TStatement *before, size_t number)
+{
+	TBlock *body = loop->block;
+
+	opt->reads = acalloc(opt->tfile->ntvariables + 1, sizeof(size_t));
+	count_reads(opt, loop->cond);
+	visit_block(opt, body, count_reads);
+
+	opt->widened = acalloc(opt->tfile->ntvariables + 1, sizeof(varndx));
+	for (size_t i = 0; i < opt->tfile->ntvariables; ++i) {
+		opt->widened[i] = NONDX;
+	}
+
+	opt->lane = NONDX;
+	opt->vector = NONDX;
+	opt->nlanes = 0;
+	opt->slices = NULL;
+	opt->nslices = 0;
+	opt->shortest = SIZE_MAX;
+	opt->reductions = NULL;
+	opt->nreductions = 0;
+	opt->scost = 0;
+	opt->vcost = 0;
+
+	const char *why = vectorizable(opt, loop, before);
+	TFun *tfun = opt->fun;
+
+	if (opt->report && why) {
+		fprintf(stderr, "%s: '%s': loop %zu not vectorized: %s\n", tfun->file->path, tfun->identifier.content, number, why);
+	} else if (opt->report) {
+		fprintf(stderr, "%s: '%s': loop %zu vectorized, %zu lanes of %s\n", tfun->file->path, tfun->identifier.content,
+			number, opt->nlanes, opt->tfile->types[opt->lane]->name);
+	}
+
+	if (!why) {
+		vector_loop(opt, loop);
+	}
+
+	afree(opt->reads);
+	afree(opt->widened);
+	afree(opt->slices);
+	afree(opt->reductions);
+	opt->reads = NULL;
+	opt->widened = NULL;
+	opt->slices = NULL;
+	opt->reductions = NULL;
+	opt->setup = NULL;
+	opt->iv = NONDX;
+	opt->end = NULL;
+}
+
+/* Put the vector loop in the preheader of the scalar one, with all it needs */
+static void vector_loop(Opt *opt, TWhile *loop)
+{
+	TBlock *body = loop->block;
+	TExpression *iv = variable(opt, opt->iv);
+	typendx itype = iv->type;
+	typendx cmp = loop->cond->type;
+
+	opt->setup = block_new(loop->pre->scope);
+	TBlock *vbody = block_new(body->scope);
+	size_t nreductions = 0;
+
+	for (size_t i = 0; i + 1 < body->nstatements; ++i) {
+		TStatement *statement = body->statements[i];
+
+		if (statement->variant == TSTATEMENT_VAR) {
+			opt->widened[statement->assign->var] = temporary(opt, vbody, widen(opt, statement->assign->value));
+			continue;
+		}
+
+		TStatement *copy = alloct(TStatement);
+		copy->variant = statement->variant;
+
+		if (statement->variant == TSTATEMENT_STORE) {
+			copy->store = alloct(TStore);
+			copy->store->place = widen(opt, statement->store->place);
+			copy->store->value = widen(opt, statement->store->value);
+		} else {
+			Reduction *reduction = &opt->reductions[nreductions++];
+			TBinary *value = statement->assign->value->binary;
+			TExpression *e = value->lhs->variant == TEXPRESSION_VARIABLE && value->lhs->var == reduction->var
+				? value->rhs : value->lhs;
+
+			TExpression *identity = constant(opt, opt->lane, reduction->op == BINOP_AND ? UINT64_MAX : 0);
+			identity->type = opt->vector;
+			reduction->acc = temporary(opt, opt->setup, identity);
+
+			copy->assign = alloct(TAssign);
+			copy->assign->var = reduction->acc;
+			copy->assign->value = binary_new(reduction->op, opt->vector, variable(opt, reduction->acc), widen(opt, e));
+		}
+
+		vec_push(vbody->statements, &copy, &vbody->nstatements, sizeof(TStatement *));
+	}
+
+	TStatement *step = alloct(TStatement);
+	step->variant = TSTATEMENT_ASSIGN;
+	step->assign = alloct(TAssign);
+	step->assign->var = opt->iv;
+	step->assign->value = binary_new(BINOP_ADD, itype, clone(iv), constant(opt, itype, opt->nlanes));
+	vec_push(vbody->statements, &step, &vbody->nstatements, sizeof(TStatement *));
+
+	/* The vector loop stops with more than 0, and at most 'nlanes', iterations left */
+	varndx last = temporary(opt, opt->setup, binary_new(BINOP_SUB, itype, clone(opt->end), constant(opt, itype, opt->nlanes)));
+
+	TStatement *vloop = alloct(TStatement);
+	vloop->variant = TSTATEMENT_WHILE;
+	vloop->loop = alloct(TWhile);
+	vloop->loop->cond = binary_new(BINOP_LT, cmp, clone(iv), variable(opt, last));
+	vloop->loop->guard = clone(vloop->loop->cond);
+	vloop->loop->pre = block_new(loop->pre->scope);
+	vloop->loop->block = vbody;
+	vec_push(opt->setup->statements, &vloop, &opt->setup->nstatements, sizeof(TStatement *));
+
+	for (size_t i = 0; i < opt->nreductions; ++i) {
+		Reduction *reduction = &opt->reductions[i];
+		static const unop combine[] = {
+			[BINOP_ADD] = UNOP_REDUCE_ADD, [BINOP_SUB] = UNOP_REDUCE_ADD, [BINOP_AND] = UNOP_REDUCE_AND,
+			[BINOP_OR] = UNOP_REDUCE_OR, [BINOP_XOR] = UNOP_REDUCE_XOR,
+		};
+
+		/* s - a - b is s + (0 - a - b) */
+		TExpression *lanes = unary_new(combine[reduction->op], opt->lane, variable(opt, reduction->acc));
+		binop op = reduction->op == BINOP_SUB ? BINOP_ADD : reduction->op;
+
+		TStatement *statement = alloct(TStatement);
+		statement->variant = TSTATEMENT_ASSIGN;
+		statement->assign = alloct(TAssign);
+		statement->assign->var = reduction->var;
+		statement->assign->value = binary_new(op, opt->lane, variable(opt, reduction->var), lanes);
+		vec_push(opt->setup->statements, &statement, &opt->setup->nstatements, sizeof(TStatement *));
+	}
+
+	/* i < n on entry to the preheader, so n - i neither wraps nor overflows */
+	TExpression *left = binary_new(BINOP_SUB, itype, clone(opt->end), clone(iv));
+	TExpression *enter = binary_new(BINOP_GT, cmp, left, constant(opt, itype, opt->nlanes));
+
+	Type *t = opt->tfile->types[itype];
+	uint64_t greatest = t->size == 8 ? UINT64_MAX >> t->signd : ((uint64_t)1 << (t->size * 8 - t->signd)) - 1;
+
+	if (opt->shortest < greatest) {
+		enter = binary_new(BINOP_AND, cmp, enter, binary_new(BINOP_LE, cmp, clone(opt->end), constant(opt, itype, opt->shortest)));
+	}
+
+	for (size_t i = 0; i < opt->nslices; ++i) {
+		if (opt->slices[i].checked) {
+			varndx length = opt->tfile->tvariables[opt->slices[i].var]->length;
+			enter = binary_new(BINOP_AND, cmp, enter, binary_new(BINOP_LE, cmp, clone(opt->end), variable(opt, length)));
+		}
+
+		for (size_t j = i + 1; j < opt->nslices; ++j) {
+			if (opt->slices[i].stored || opt->slices[j].stored) {
+				enter = binary_new(BINOP_AND, cmp, enter, apart(opt, opt->slices[i].var, opt->slices[j].var));
+			}
+		}
+	}
+
+	TStatement *statement = alloct(TStatement);
+	statement->variant = TSTATEMENT_IF;
+	statement->tif = alloct(TIf);
+	statement->tif->cond = enter;
+	statement->tif->hint = HINT_NONE;
+	statement->tif->then = opt->setup;
+	statement->tif->els = NULL;
+	vec_push(loop->pre->statements, &statement, &loop->pre->nstatements, sizeof(TStatement *));
+}
+
+/*
+ * Bytes in a vector of the current function. The clones of a function share
+ * its body, so theirs are as wide as the baseline, which is one of them, has.
+ */
+static size_t vsize(Opt *opt)
+{
+	return opt->fun->nclones ? OPT_VECTOR : opt->vsize;
+}
+
+/* NULL if a loop can be vectorized, else why not; sets up the state vectorize() builds the vector loop from */
+static const char *vectorizable(Opt *opt, TWhile *loop, TStatement *before)
+{
+	TBlock *body = loop->block;
+	TStatement *step = body->nstatements ? body->statements[body->nstatements - 1] : NULL;
+
+	if (loop->cond->variant != TEXPRESSION_BINARY || !step) {
+		return "not a counted loop";
+	}
+
+	TBinary *cond = loop->cond->binary;
+	TExpression *iv = cond->op == BINOP_GT ? cond->rhs : cond->lhs;
+	TExpression *end = cond->op == BINOP_GT ? cond->lhs : cond->rhs;
+	binop op = BINOP_SUB;
+	uint64_t c = 0;
+
+	if ((cond->op != BINOP_LT && cond->op != BINOP_GT) || iv->variant != TEXPRESSION_VARIABLE
+			|| !(end->variant == TEXPRESSION_NUMLIT || (end->variant == TEXPRESSION_VARIABLE && !written(opt, end->var)))
+			|| !isstep(step, &op, &c) || step->assign->var != iv->var || op != BINOP_ADD || c != 1 || opt->writes[iv->var] != 1) {
+		return "not a counted loop";
+	}
+
+	/* The count of iterations left must not overflow; see bce() */
+	Type *type = opt->tfile->types[iv->type];
+	bool start = before && (before->variant == TSTATEMENT_VAR || before->variant == TSTATEMENT_ASSIGN)
+		&& before->assign->var == iv->var && before->assign->value->variant == TEXPRESSION_NUMLIT
+		&& !(type->signd && ((before->assign->value->number->u64 >> (type->size * 8 - 1)) & 1));
+
+	if (type->signd && !start) {
+		return "its signed index may start out negative";
+	}
+
+	opt->iv = iv->var;
+	opt->end = end;
+
+	if (body->nstatements == 1) {
+		return "nothing to vectorize";
+	}
+
+	TStatement *first = body->statements[0];
+	switch (first->variant) {
+		case TSTATEMENT_STORE: opt->lane = first->store->place->type; break;
+		case TSTATEMENT_VAR:
+		case TSTATEMENT_ASSIGN: opt->lane = opt->tfile->tvariables[first->assign->var]->type; break;
+		default: break;
+	}
+
+	for (size_t i = 0; i < opt->tfile->ntypes && opt->lane != NONDX; ++i) {
+		Type *t = opt->tfile->types[i];
+
+		if (t->kind == TYPE_VECTOR && t->elem == opt->lane && t->size == vsize(opt)) {
+			opt->vector = i;
+			opt->nlanes = t->length;
+		}
+	}
+
+	if (opt->lane != NONDX && opt->vector == NONDX) {
+		return "no vector has lanes of its type";
+	}
+
+	for (size_t i = 0; i + 1 < body->nstatements; ++i) {
+		TStatement *statement = body->statements[i];
+		const char *why = NULL;
+
+		switch (statement->variant) {
+			case TSTATEMENT_STORE: {
+				TExpression *place = statement->store->place;
+
+				if (place->variant != TEXPRESSION_INDEX || place->type != opt->lane) {
+					why = place->variant != TEXPRESSION_INDEX ? "stores to other than an element" : "mixes types";
+				} else if (!(why = contiguous(opt, place, true))) {
+					why = lanewise(opt, statement->store->value);
+				}
+				break;
+			}
+			case TSTATEMENT_VAR: {
+				why = lanewise(opt, statement->assign->value);
+				opt->widened[statement->assign->var] = statement->assign->var;
+				break;
+			}
+			case TSTATEMENT_ASSIGN: why = accumulates(opt, statement->assign); break;
+			case TSTATEMENT_WHILE: why = "has a loop in it"; break;
+			case TSTATEMENT_BUILTIN: why = "calls a builtin for its effect"; break;
+			case TSTATEMENT_ASM: why = "has inline assembly"; break;
+			default: why = "is not straight-line code"; break;
+		}
+
+		if (why) {
+			return why;
+		}
+	}
+
+	/* The step and exit test */
+	opt->scost += 2;
+	opt->vcost += 2;
+
+	if (opt->vcost >= opt->scost * opt->nlanes) {
+		return "would be no faster";
+	}
+
+	if (start && end->variant == TEXPRESSION_NUMLIT && end->number->u64 - before->assign->value->number->u64 <= opt->nlanes) {
+		return "has too few iterations";
+	}
+
+	return NULL;
+}
+
+/* NULL if an expression can be computed in every lane at once, else why not; adds its cost, both ways */
+static const char *lanewise(Opt *opt, TExpression *expression)
+{
+	if (expression->type != opt->lane) {
+		return "mixes types";
+	}
+
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT: return NULL;
+		case TEXPRESSION_VARIABLE: {
+			varndx var = expression->var;
+
+			if (opt->widened[var] != NONDX || !written(opt, var)) {
+				return NULL;
+			}
+
+			return var == opt->iv ? "uses its index as a value" : "reads a variable it assigns";
+		}
+		case TEXPRESSION_INDEX: return contiguous(opt, expression, false);
+		case TEXPRESSION_UNARY: {
+			if (expression->unary->op >= UNOP_POPCOUNT) {
+				return "counts or swaps bits";
+			}
+
+			if (expression->unary->op != UNOP_NEG && expression->unary->op != UNOP_NOT) {
+				return "uses vector operations";
+			}
+
+			/* pxor or pcmpeqd to make 0 or all ones, then psub or pxor */
+			opt->scost += 1;
+			opt->vcost += 2;
+			return lanewise(opt, expression->unary->operand);
+		}
+		case TEXPRESSION_BINARY: break;
+		case TEXPRESSION_CALL: return "makes calls";
+		case TEXPRESSION_BUILTIN: return "reads the time-stamp counter";
+		case TEXPRESSION_GLOBAL: return "uses a thread-local";
+		default: return "reads fields";
+	}
+
+	TBinary *binary = expression->binary;
+	Type *lane = opt->tfile->types[opt->lane];
+
+	switch (binary->op) {
+		case BINOP_ADD:
+		case BINOP_SUB:
+		case BINOP_AND:
+		case BINOP_OR:
+		case BINOP_XOR: {
+			opt->scost += 1;
+			opt->vcost += 1;
+			break;
+		}
+		case BINOP_MUL: {
+			if (lane->size != 2 && lane->size != 4) {
+				return "multiplies lanes SSE2 cannot";
+			}
+
+			/* SSE2 has pmullw, but pmulld takes seven instructions before SSE4.1; see vmul32() */
+			opt->scost += 3;
+			opt->vcost += lane->size == 2 || (opt->pmulld && !opt->fun->nclones) ? 1 : 7;
+			break;
+		}
+		case BINOP_SHL:
+		case BINOP_SHR: {
+			if (binary->rhs->variant != TEXPRESSION_NUMLIT || binary->rhs->number->u64 >= lane->size * 8) {
+				return "shifts by other than a constant";
+			}
+
+			if (lane->size == 1 || (binary->op == BINOP_SHR && lane->signd && lane->size == 8)) {
+				return "shifts lanes SSE2 cannot";
+			}
+
+			opt->scost += 1;
+			opt->vcost += 1;
+			return lanewise(opt, binary->lhs);
+		}
+		case BINOP_ROTL:
+		case BINOP_ROTR:
+		case BINOP_PDEP:
+		case BINOP_PEXT: return "rotates or scatters bits";
+		default: return "divides";
+	}
+
+	const char *why = lanewise(opt, binary->lhs);
+	return why ? why : lanewise(opt, binary->rhs);
+}
+
+/* NULL if an element is the i-th of consecutive ones, without a check, else why not; notes the slices the loop indexes */
+static const char *contiguous(Opt *opt, TExpression *expression, bool store)
+{
+	TIndex *index = expression->index;
+	TExpression *base = index->base;
+
+	if (index->index->variant != TEXPRESSION_VARIABLE || index->index->var != opt->iv) {
+		return "indexes elements by other than its index";
+	}
+
+	if (index->stride != opt->tfile->types[opt->lane]->size) {
+		return "indexes elements that are not next to each other";
+	}
+
+	while (base->variant == TEXPRESSION_FIELD) {
+		base = base->field->base;
+	}
+
+	if (base->variant == TEXPRESSION_GLOBAL) {
+		return "indexes a thread-local";
+	} else if (base->variant != TEXPRESSION_VARIABLE) {
+		return "indexes elements of elements";
+	}
+
+	/* The vector loop is only entered if n is within the length; see vector_loop() */
+	bool slice = opt->tfile->types[base->type]->kind == TYPE_SLICE;
+	if (index->checked && slice && opt->tfile->tvariables[opt->tfile->tvariables[base->var]->length]->type != opt->end->type) {
+		return "has bounds checks against a length of another type than its index";
+	} else if (index->checked && !slice && index->length < opt->shortest) {
+		opt->shortest = index->length;
+	}
+
+	if (slice) {
+		size_t at = 0;
+		while (at < opt->nslices && opt->slices[at].var != base->var) {
+			++at;
+		}
+
+		if (at == opt->nslices) {
+			SliceUse use = { .var = base->var, .stored = false, .checked = false };
+			vec_push(opt->slices, &use, &opt->nslices, sizeof(SliceUse));
+		}
+
+		opt->slices[at].stored |= store;
+		opt->slices[at].checked |= index->checked;
+	}
+
+	opt->scost += 1;
+	opt->vcost += 1;
+	return NULL;
+}
+
+/* NULL if an assignment accumulates into a variable the loop reads nowhere else, else why not */
+static const char *accumulates(Opt *opt, TAssign *assign)
+{
+	TExpression *value = assign->value;
+	varndx var = assign->var;
+	TBinary *binary = value->variant == TEXPRESSION_BINARY ? value->binary : NULL;
+	TExpression *e = NULL;
+
+	if (binary && binary->lhs->variant == TEXPRESSION_VARIABLE && binary->lhs->var == var) {
+		e = binary->rhs;
+	} else if (binary && binary->op != BINOP_SUB && binary->rhs->variant == TEXPRESSION_VARIABLE && binary->rhs->var == var) {
+		e = binary->lhs;
+	}
+
+	if (!e || opt->writes[var] != 1 || opt->reads[var] != 1 || opt->widened[var] != NONDX || (binary->op != BINOP_ADD
+			&& binary->op != BINOP_SUB && binary->op != BINOP_AND && binary->op != BINOP_OR && binary->op != BINOP_XOR)) {
+		return "assigns a variable other than by accumulating";
+	}
+
+	if (value->type != opt->lane) {
+		return "mixes types";
+	}
+
+	Reduction reduction = { .var = var, .acc = NONDX, .op = binary->op };
+	vec_push(opt->reductions, &reduction, &opt->nreductions, sizeof(Reduction));
+
+	opt->scost += 1;
+	opt->vcost += 1;
+	return lanewise(opt, e);
+}
+
+/*
+ * The vector form of a lane-wise expression: elements are loaded a vector at
+ * a time, in place of one, and invariants are put in every lane in front of
+ * the vector loop. Constants take an instruction or more to put there, but
+ * for 0 and all ones, which are no invariants the accumulators share.
+ */
+static TExpression *widen(Opt *opt, TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT: {
+			uint64_t ones = opt->tfile->types[opt->lane]->size == 8 ? UINT64_MAX : ((uint64_t)1 << (opt->tfile->types[opt->lane]->size * 8)) - 1;
+
+			if (expression->number->u64 == 0 || expression->number->u64 == ones) {
+				TExpression *copy = clone(expression);
+				copy->type = opt->vector;
+				return copy;
+			}
+			break;
+		}
+		case TEXPRESSION_VARIABLE: {
+			if (opt->widened[expression->var] != NONDX) {
+				return variable(opt, opt->widened[expression->var]);
+			}
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			TExpression *copy = clone(expression);
+			copy->type = opt->vector;
+			copy->index->checked = false;
+			return copy;
+		}
+		case TEXPRESSION_UNARY: return unary_new(expression->unary->op, opt->vector, widen(opt, expression->unary->operand));
+		case TEXPRESSION_BINARY: {
+			TBinary *b = expression->binary;
+			bool shift = b->op == BINOP_SHL || b->op == BINOP_SHR;
+			return binary_new(b->op, opt->vector, widen(opt, b->lhs), shift ? clone(b->rhs) : widen(opt, b->rhs));
+		}
+		default: break;
+	}
+
+	TExpression *value = NULL;
+	if (expression->variant == TEXPRESSION_NUMLIT) {
+		value = clone(expression);
+		value->type = opt->vector;
+	} else {
+		value = unary_new(UNOP_SPLAT, opt->vector, clone(expression));
+	}
+
+	for (size_t i = 0; i < opt->setup->nstatements; ++i) {
+		TStatement *statement = opt->setup->statements[i];
+
+		if (statement->variant == TSTATEMENT_VAR && same(opt, statement->assign->value, value)) {
+			return variable(opt, statement->assign->var);
+		}
+	}
+
+	return variable(opt, temporary(opt, opt->setup, value));
+}
+
+/*
+ * Whether two slices are at the same address, or at least a vector apart:
+ * for d = a - b, d == 0 or d + (v - 1) > 2v - 2, unsigned, as the values
+ * -(v - 1) to v - 1 are those that do not wrap past 2v - 2.
+ */
+static TExpression *apart(Opt *opt, varndx a, varndx b)
+{
+	typendx u64 = opt->tfile->tvariables[opt->tfile->tvariables[a]->length]->type;
+	typendx cmp = opt->loop->cond->type;
+	uint64_t v = opt->nlanes * opt->tfile->types[opt->lane]->size;
+
+	TExpression *d = binary_new(BINOP_SUB, u64, unary_new(UNOP_ADDRESS, u64, variable(opt, a)), unary_new(UNOP_ADDRESS, u64, variable(opt, b)));
+	TExpression *same = binary_new(BINOP_EQ, cmp, d, constant(opt, u64, 0));
+	TExpression *far = binary_new(BINOP_GT, cmp, binary_new(BINOP_ADD, u64, clone(d), constant(opt, u64, v - 1)), constant(opt, u64, 2 * v - 2));
+
+	return binary_new(BINOP_OR, cmp, same, far);
+}
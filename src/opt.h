@@ -0,0 +1,87 @@
+/*
+ * opt.h
+ *
+ * This file is part of awl
+ */
+
+#pragma once
+
+#include "type.h"
+
+#define OPT_VECTOR 16 /* bytes in a vector of a vectorized loop: an SSE2 register */
+#define OPT_VECTOR_AVX2 32 /* the same, where the target has AVX2: a YMM register */
+
+/* A statement to be placed after another in the body of a loop */
+typedef struct Insert {
+	TStatement *after;
+	TStatement *statement;
+} Insert;
+
+/* A slice a vectorized loop indexes */
+typedef struct SliceUse {
+	varndx var;
+	bool stored; /* to, as well as loaded from */
+	bool checked; /* some element of it is bounds-checked */
+} SliceUse;
+
+/* An accumulator of a vectorized loop, and the variable its lanes are combined into after it */
+typedef struct Reduction {
+	varndx var;
+	varndx acc;
+	binop op;
+} Reduction;
+
+/*
+ * Optimisations over the typed tree, between the typechecker and the code
+ * generator. Loops are 'while' statements, which are natural loops by
+ * construction: the condition is their only entry, and dominates the body.
+ */
+typedef struct Opt {
+	TFile *tfile;
+	bool report; /* say what was done to each function, on stderr */
+	bool vectorize; /* turn simple counted loops into vector ones */
+	size_t vsize; /* bytes in a vector of a vectorized loop; OPT_VECTOR or OPT_VECTOR_AVX2 */
+	bool pmulld; /* the target multiplies lanes of doublewords in one instruction (SSE4.1) */
+
+	/* Per-function state */
+	TFun *fun;
+	size_t nloops; /* numbered in the order they are written, for reports */
+	size_t *reads; /* varndx -> uses of the variable */
+	TExpression **calls; /* pure calls of the current expression */
+	size_t ncalls;
+	size_t unchecked; /* bounds checks eliminated */
+	size_t hoisted; /* of those, the ones a check in front of their loop stands for */
+
+	/* Per-loop state */
+	TWhile *loop;
+	size_t *writes; /* varndx -> assignments to the variable in the loop */
+	size_t nwrites;
+
+	TStatement **steps; /* increments of the basic induction variables */
+	size_t nsteps;
+	Insert *inserts; /* updates of derived induction variables */
+	size_t ninserts;
+
+	varndx iv; /* an index known to be at least 0, and below 'end' (or at most, unless 'below') */
+	TExpression *end;
+	bool below;
+	bool every; /* the expression being visited is evaluated on every iteration, and may be checked in front */
+
+	/* Vectorization of the current loop; see vectorize() */
+	typendx lane; /* of every element, local and accumulator */
+	typendx vector;
+	size_t nlanes;
+	varndx *widened; /* varndx -> the vector variable in place of a local of the body, else NONDX */
+	SliceUse *slices;
+	size_t nslices;
+	size_t shortest; /* of the arrays whose elements are bounds-checked; SIZE_MAX if none are */
+	Reduction *reductions;
+	size_t nreductions;
+	size_t scost; /* of an iteration */
+	size_t vcost; /* of an iteration of the vector loop, which does 'nlanes' */
+	TBlock *setup; /* in front of the vector loop: its accumulators, and invariants in every lane */
+} Opt;
+
+Opt *opt_new();
+void opt_run(Opt *opt, TFile *tfile);
+void opt_reset(Opt *opt);
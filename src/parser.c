@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include "vec.h"
 #include "mem.h"
 #include "err.h"
@@ -18,12 +19,49 @@ static Token peek(Parser *parser, size_t n);
 static Token current(Parser *parser);
 static token_kind istk(Parser *parser, token_kind kind);
 
+static bool iscall(Parser *parser);
+static bool isglobal(Parser *parser);
 static PType *parse_type(Parser *parser);
 static PVariable *parse_variable(Parser *parser);
+static PCall *parse_call(Parser *parser);
+static Number *parse_align(Parser *parser);
+static PExpression *parse_primary(Parser *parser);
+static PExpression *parse_unary(Parser *parser);
+static PExpression *parse_binary(Parser *parser, int minprec);
 static PExpression *parse_expression(Parser *parser);
+static PSwitch *parse_switch(Parser *parser);
+static PIf *parse_if(Parser *parser);
+static PVar *parse_var(Parser *parser);
+static PAssign *parse_assign(Parser *parser);
+static PWhile *parse_while(Parser *parser);
+static void parse_asm_operands(Parser *parser, PAsmOperand **operands, size_t *noperands);
+static PAsm *parse_asm(Parser *parser);
 static PStatement *parse_statement(Parser *parser);
 static PBlock *parse_block(Parser *parser);
+static void parse_clones(Parser *parser, PFun *pfun);
 static PFun *parse_fun(Parser *parser);
+static PStruct *parse_struct(Parser *parser);
+static PGlobal *parse_global(Parser *parser);
+
+/* Binding strength of binary operators; 0 for tokens that are not binary operators */
+static const int binprec[_TOKEN_COUNT] = {
+	[TOKEN_STAR] = 10,
+	[TOKEN_SLASH] = 10,
+	[TOKEN_PERCENT] = 10,
+	[TOKEN_PLUS] = 9,
+	[TOKEN_MINUS] = 9,
+	[TOKEN_SHL] = 8,
+	[TOKEN_SHR] = 8,
+	[TOKEN_LT] = 7,
+	[TOKEN_LE] = 7,
+	[TOKEN_GT] = 7,
+	[TOKEN_GE] = 7,
+	[TOKEN_EQ] = 6,
+	[TOKEN_NE] = 6,
+	[TOKEN_AMP] = 5,
+	[TOKEN_CARET] = 4,
+	[TOKEN_PIPE] = 3,
+};
 
 static __int128 atoi128(const char *s)
 {
@@ -122,16 +160,39 @@ PFile *parser_run(Parser *parser, File *file)
 	parser->pfile = alloct(PFile);
 	parser->pfile->pfuns = NULL;
 	parser->pfile->npfuns = 0;
-
+	parser->pfile->pstructs = NULL;
+	parser->pfile->npstructs = 0;
+	parser->pfile->pglobals = NULL;
+	parser->pfile->npglobals = 0;
 
 	while (current(parser).kind != TOKEN_EOF) {
-		switch (istk(parser, TOKEN_FUN)) {
+		switch (current(parser).kind) {
+			case TOKEN_COLD:
+			case TOKEN_PURE:
+			case TOKEN_TARGET_CLONES:
 			case TOKEN_FUN: {
 				PFun *pfun = parse_fun(parser);
 				vec_push(parser->pfile->pfuns, &pfun, &parser->pfile->npfuns, sizeof(PFun *));
 
 				break;
 			}
+			case TOKEN_PACKED:
+			case TOKEN_REORDER:
+			case TOKEN_ALIGN:
+			case TOKEN_THREAD:
+			case TOKEN_STRUCT: {
+				if (isglobal(parser)) {
+					PGlobal *pglobal = parse_global(parser);
+					vec_push(parser->pfile->pglobals, &pglobal, &parser->pfile->npglobals, sizeof(PGlobal *));
+
+					break;
+				}
+
+				PStruct *pstruct = parse_struct(parser);
+				vec_push(parser->pfile->pstructs, &pstruct, &parser->pfile->npstructs, sizeof(PStruct *));
+
+				break;
+			}
 			default: err_source(parser->file, current(parser).span, "unexpected token");
 		}
 	}
@@ -171,17 +232,52 @@ static Token current(Parser *parser)
 static token_kind istk(Parser *parser, token_kind kind)
 {
 	token_kind cursor = current(parser).kind;
-	return (cursor & kind ? cursor : _TOKEN_NULL);
+	return (cursor == kind ? cursor : _TOKEN_NULL);
 }
 
-/* type = typename */
+/* type = typename | ["soa"] "[" numeric-literal "]" type | "[" "]" type */
 static PType *parse_type(Parser *parser)
 {
 	PType *ptype = alloct(PType);
 	ptype->variant = _PNODE_NULL;
+	ptype->span = current(parser).span;
 	ptype->name = EMPTYTOKEN;
 
-	if (istk(parser, TOKEN_IDENTIFIER)) {
+	if (istk(parser, TOKEN_SOA) || istk(parser, TOKEN_LBRACKET)) {
+		PArray *parray = alloct(PArray);
+		parray->soa = current(parser).kind == TOKEN_SOA;
+
+		if (parray->soa) {
+			advance(parser); /* soa */
+
+			if (!istk(parser, TOKEN_LBRACKET)) {
+				err_source(parser->file, current(parser).span, "expected '['");
+			}
+		}
+
+		advance(parser); /* [ */
+
+		/* A slice has no length of its own; that of whatever it refers to is passed with it */
+		if (istk(parser, TOKEN_RBRACKET) && !parray->soa) {
+			parray->length = NULL;
+		} else if (!istk(parser, TOKEN_NUMLIT_INT)) {
+			err_source(parser->file, current(parser).span, "expected array length");
+		} else {
+			parray->length = number_make(current(parser));
+			advance(parser); /* numeric-literal */
+		}
+
+		if (!istk(parser, TOKEN_RBRACKET)) {
+			err_source(parser->file, current(parser).span, "expected ']'");
+		}
+
+		advance(parser); /* ] */
+
+		parray->elem = parse_type(parser);
+
+		ptype->variant = PTYPE_ARRAY;
+		ptype->array = parray;
+	} else if (istk(parser, TOKEN_IDENTIFIER)) {
 		ptype->variant = PTYPE_NAMED;
 		ptype->name = current(parser);
 
@@ -212,14 +308,148 @@ static PVariable *parse_variable(Parser *parser)
 	return pvariable;
 }
 
-/* expression = numeric-literal */
-static PExpression *parse_expression(Parser *parser)
+/* Whether the identifier at the cursor starts a call, with or without type arguments */
+static bool iscall(Parser *parser)
 {
+	size_t n = 1;
+
+	/* Brackets may also index an array, whose index may itself contain brackets */
+	if (peek(parser, n).kind == TOKEN_LBRACKET) {
+		size_t depth = 0;
+
+		do {
+			token_kind k = peek(parser, n++).kind;
+
+			if (k == TOKEN_EOF) {
+				return false;
+			}
+
+			depth += (k == TOKEN_LBRACKET) - (k == TOKEN_RBRACKET);
+		} while (depth > 0);
+	}
+
+	return peek(parser, n).kind == TOKEN_LPAREN;
+}
+
+/* Whether the cursor starts a global; align(N) comes before 'thread' as it does before 'struct' */
+static bool isglobal(Parser *parser)
+{
+	size_t n = 0;
+
+	if (istk(parser, TOKEN_ALIGN)) {
+		while (peek(parser, n).kind != TOKEN_RPAREN) {
+			if (peek(parser, n++).kind == TOKEN_EOF) {
+				return false;
+			}
+		}
+
+		++n;
+	}
+
+	return peek(parser, n).kind == TOKEN_THREAD;
+}
+
+/* call = identifier ["[" type {"," type} "]"] "(" [expression {"," expression}] ")" */
+static PCall *parse_call(Parser *parser)
+{
+	PCall *pcall = alloct(PCall);
+	pcall->identifier = current(parser);
+	pcall->typeargs = NULL;
+	pcall->ntypeargs = 0;
+	pcall->args = NULL;
+	pcall->nargs = 0;
+
+	advance(parser); /* identifier */
+
+	if (istk(parser, TOKEN_LBRACKET)) {
+		advance(parser); /* [ */
+
+		while (!istk(parser, TOKEN_RBRACKET)) {
+			if (pcall->ntypeargs > 0) {
+				if (!istk(parser, TOKEN_COMMA)) {
+					err_source(parser->file, current(parser).span, "expected ',' or ']'");
+				}
+
+				advance(parser); /* , */
+			}
+
+			PType *typearg = parse_type(parser);
+			vec_push(pcall->typeargs, &typearg, &pcall->ntypeargs, sizeof(PType *));
+		}
+
+		advance(parser); /* ] */
+	}
+
+	advance(parser); /* ( */
+
+	while (!istk(parser, TOKEN_RPAREN)) {
+		if (pcall->nargs > 0) {
+			if (!istk(parser, TOKEN_COMMA)) {
+				err_source(parser->file, current(parser).span, "expected ',' or ')'");
+			}
+
+			advance(parser); /* , */
+		}
+
+		PExpression *arg = parse_expression(parser);
+		vec_push(pcall->args, &arg, &pcall->nargs, sizeof(PExpression *));
+	}
+
+	advance(parser); /* ) */
+
+	return pcall;
+}
+
+/* align = "align" "(" numeric-literal ")" */
+static Number *parse_align(Parser *parser)
+{
+	advance(parser); /* align */
+
+	if (!istk(parser, TOKEN_LPAREN)) {
+		err_source(parser->file, current(parser).span, "expected '('");
+	}
+
+	advance(parser); /* ( */
+
+	if (!istk(parser, TOKEN_NUMLIT_INT)) {
+		err_source(parser->file, current(parser).span, "expected alignment");
+	}
+
+	Number *align = number_make(current(parser));
+	advance(parser); /* numeric-literal */
+
+	if (!istk(parser, TOKEN_RPAREN)) {
+		err_source(parser->file, current(parser).span, "expected ')'");
+	}
+
+	advance(parser); /* ) */
+
+	return align;
+}
+
+/* primary = numeric-literal | identifier {"." identifier | "[" expression "]"} | call | "(" expression ")" */
+static PExpression *parse_primary(Parser *parser)
+{
+	if (istk(parser, TOKEN_LPAREN)) {
+		advance(parser); /* ( */
+
+		PExpression *inner = parse_expression(parser);
+
+		if (!istk(parser, TOKEN_RPAREN)) {
+			err_source(parser->file, current(parser).span, "expected ')'");
+		}
+
+		advance(parser); /* ) */
+
+		return inner;
+	}
+
 	PExpression *pexpression = alloct(PExpression);
 	pexpression->variant = _PNODE_NULL;
+	pexpression->span = current(parser).span;
 	pexpression->number = NULL;
 
-	switch (istk(parser, TOKEN_NUMLIT_INT | TOKEN_NUMLIT_FLT)) {
+	switch (current(parser).kind) {
 		case TOKEN_NUMLIT_INT:
 		case TOKEN_NUMLIT_FLT: {
 			pexpression->variant = PEXPRESSION_NUMLIT;
@@ -228,13 +458,385 @@ static PExpression *parse_expression(Parser *parser)
 			advance(parser); /* numeric-literal */
 			break;
 		}
+		case TOKEN_IDENTIFIER: {
+			if (iscall(parser)) {
+				pexpression->variant = PEXPRESSION_CALL;
+				pexpression->call = parse_call(parser);
+				break;
+			}
+
+			pexpression->variant = PEXPRESSION_IDENTIFIER;
+			pexpression->identifier = current(parser);
+
+			advance(parser); /* identifier */
+
+			while (istk(parser, TOKEN_DOT) || istk(parser, TOKEN_LBRACKET)) {
+				if (istk(parser, TOKEN_LBRACKET)) {
+					PExpression *element = alloct(PExpression);
+					element->variant = PEXPRESSION_INDEX;
+					element->span = current(parser).span;
+					element->index = alloct(PIndex);
+					element->index->base = pexpression;
+
+					advance(parser); /* [ */
+
+					element->index->index = parse_expression(parser);
+
+					if (!istk(parser, TOKEN_RBRACKET)) {
+						err_source(parser->file, current(parser).span, "expected ']'");
+					}
+
+					advance(parser); /* ] */
+					pexpression = element;
+					continue;
+				}
+
+				advance(parser); /* . */
+
+				if (!istk(parser, TOKEN_IDENTIFIER)) {
+					err_source(parser->file, current(parser).span, "expected field identifier");
+				}
+
+				PExpression *field = alloct(PExpression);
+				field->variant = PEXPRESSION_FIELD;
+				field->span = current(parser).span;
+				field->field = alloct(PField);
+				field->field->base = pexpression;
+				field->field->field = current(parser);
+
+				advance(parser); /* identifier */
+				pexpression = field;
+			}
+			break;
+		}
 		default: err_source(parser->file, current(parser).span, "expected expression");
 	}
 
 	return pexpression;
 }
 
-/* statement = "return" expression ";" */
+/* unary = ("-" | "~") unary | primary */
+static PExpression *parse_unary(Parser *parser)
+{
+	if (!istk(parser, TOKEN_MINUS) && !istk(parser, TOKEN_TILDE)) {
+		return parse_primary(parser);
+	}
+
+	PExpression *pexpression = alloct(PExpression);
+	pexpression->variant = PEXPRESSION_UNARY;
+	pexpression->span = current(parser).span;
+	pexpression->unary = alloct(PUnary);
+	pexpression->unary->op = current(parser);
+
+	advance(parser); /* operator */
+
+	pexpression->unary->operand = parse_unary(parser);
+
+	return pexpression;
+}
+
+/* binary = unary {operator unary}, where operators bind by binprec[] */
+static PExpression *parse_binary(Parser *parser, int minprec)
+{
+	PExpression *lhs = parse_unary(parser);
+
+	int prec = 0;
+	while ((prec = binprec[current(parser).kind]) >= minprec) {
+		Token op = current(parser);
+		advance(parser); /* operator */
+
+		/* All binary operators are left-associative */
+		PExpression *rhs = parse_binary(parser, prec + 1);
+
+		PExpression *pexpression = alloct(PExpression);
+		pexpression->variant = PEXPRESSION_BINARY;
+		pexpression->span = op.span;
+		pexpression->binary = alloct(PBinary);
+		pexpression->binary->op = op;
+		pexpression->binary->lhs = lhs;
+		pexpression->binary->rhs = rhs;
+
+		lhs = pexpression;
+	}
+
+	return lhs;
+}
+
+/* expression = binary */
+static PExpression *parse_expression(Parser *parser)
+{
+	return parse_binary(parser, 1);
+}
+
+/*
+ * switch = "switch" expression "{" {case} ["default" block] "}"
+ * case = "case" expression {"," expression} block
+ */
+static PSwitch *parse_switch(Parser *parser)
+{
+	PSwitch *pswitch = alloct(PSwitch);
+	pswitch->cases = NULL;
+	pswitch->ncases = 0;
+	pswitch->def = NULL;
+
+	advance(parser); /* switch */
+
+	pswitch->expr = parse_expression(parser);
+
+	if (!istk(parser, TOKEN_LBRACE)) {
+		err_source(parser->file, current(parser).span, "expected '{'");
+	}
+
+	advance(parser); /* { */
+
+	while (istk(parser, TOKEN_CASE)) {
+		PCase *pcase = alloct(PCase);
+		pcase->values = NULL;
+		pcase->nvalues = 0;
+
+		advance(parser); /* case */
+
+		do {
+			if (pcase->nvalues > 0) {
+				advance(parser); /* , */
+			}
+
+			PExpression *value = parse_expression(parser);
+			vec_push(pcase->values, &value, &pcase->nvalues, sizeof(PExpression *));
+		} while (istk(parser, TOKEN_COMMA));
+
+		pcase->block = parse_block(parser);
+		vec_push(pswitch->cases, &pcase, &pswitch->ncases, sizeof(PCase *));
+	}
+
+	if (istk(parser, TOKEN_DEFAULT)) {
+		advance(parser); /* default */
+		pswitch->def = parse_block(parser);
+	}
+
+	if (!istk(parser, TOKEN_RBRACE)) {
+		err_source(parser->file, current(parser).span, "expected 'case', 'default' or '}'");
+	}
+
+	advance(parser); /* } */
+
+	return pswitch;
+}
+
+/* if = "if" ["likely" | "unlikely"] expression block ["else" (block | if)] */
+static PIf *parse_if(Parser *parser)
+{
+	PIf *pif = alloct(PIf);
+	pif->hint = HINT_NONE;
+	pif->els = NULL;
+
+	advance(parser); /* if */
+
+	if (istk(parser, TOKEN_LIKELY)) {
+		pif->hint = HINT_LIKELY;
+		advance(parser); /* likely */
+	} else if (istk(parser, TOKEN_UNLIKELY)) {
+		pif->hint = HINT_UNLIKELY;
+		advance(parser); /* unlikely */
+	}
+
+	pif->cond = parse_expression(parser);
+	pif->then = parse_block(parser);
+
+	if (!istk(parser, TOKEN_ELSE)) {
+		return pif;
+	}
+
+	advance(parser); /* else */
+
+	if (istk(parser, TOKEN_IF)) {
+		PStatement *pstatement = alloct(PStatement);
+		pstatement->variant = PSTATEMENT_IF;
+		pstatement->span = current(parser).span;
+		pstatement->pif = parse_if(parser);
+
+		pif->els = alloct(PBlock);
+		pif->els->statements = NULL;
+		pif->els->nstatements = 0;
+		vec_push(pif->els->statements, &pstatement, &pif->els->nstatements, sizeof(PStatement *));
+	} else {
+		pif->els = parse_block(parser);
+	}
+
+	return pif;
+}
+
+/* var = [align] "var" variable ["=" expression] */
+static PVar *parse_var(Parser *parser)
+{
+	PVar *pvar = alloct(PVar);
+	pvar->value = NULL;
+	pvar->align = NULL;
+
+	if (istk(parser, TOKEN_ALIGN)) {
+		pvar->align = parse_align(parser);
+
+		if (!istk(parser, TOKEN_VAR)) {
+			err_source(parser->file, current(parser).span, "expected 'var'");
+		}
+	}
+
+	advance(parser); /* var */
+
+	pvar->var = parse_variable(parser);
+
+	if (istk(parser, TOKEN_ASSIGN)) {
+		advance(parser); /* = */
+
+		pvar->value = parse_expression(parser);
+	}
+
+	return pvar;
+}
+
+/* assign = identifier {"." identifier | "[" expression "]"} "=" expression */
+static PAssign *parse_assign(Parser *parser)
+{
+	PAssign *passign = alloct(PAssign);
+	passign->place = parse_primary(parser);
+
+	if (!istk(parser, TOKEN_ASSIGN)) {
+		err_source(parser->file, current(parser).span, "expected '='");
+	}
+
+	advance(parser); /* = */
+
+	passign->value = parse_expression(parser);
+
+	return passign;
+}
+
+/* while = "while" expression block */
+static PWhile *parse_while(Parser *parser)
+{
+	PWhile *pwhile = alloct(PWhile);
+
+	advance(parser); /* while */
+
+	pwhile->cond = parse_expression(parser);
+	pwhile->block = parse_block(parser);
+
+	return pwhile;
+}
+
+/* [operand {"," operand}], where operand = string "(" expression ")" */
+static void parse_asm_operands(Parser *parser, PAsmOperand **operands, size_t *noperands)
+{
+	if (!istk(parser, TOKEN_STRING)) {
+		return;
+	}
+
+	do {
+		if (*noperands > 0) {
+			advance(parser); /* , */
+		}
+
+		if (!istk(parser, TOKEN_STRING)) {
+			err_source(parser->file, current(parser).span, "expected constraint");
+		}
+
+		PAsmOperand operand;
+		operand.constraint = current(parser);
+		advance(parser); /* constraint */
+
+		if (!istk(parser, TOKEN_LPAREN)) {
+			err_source(parser->file, current(parser).span, "expected '('");
+		}
+
+		advance(parser); /* ( */
+
+		operand.expr = parse_expression(parser);
+
+		if (!istk(parser, TOKEN_RPAREN)) {
+			err_source(parser->file, current(parser).span, "expected ')'");
+		}
+
+		advance(parser); /* ) */
+
+		vec_push(*operands, &operand, noperands, sizeof(PAsmOperand));
+	} while (istk(parser, TOKEN_COMMA));
+}
+
+/*
+ * asm = "asm" "(" string {string} [":" outputs [":" inputs [":" clobbers]]] ")"
+ * outputs = inputs = [operand {"," operand}]
+ * clobbers = [string {"," string}]
+ */
+static PAsm *parse_asm(Parser *parser)
+{
+	PAsm *pasm = alloct(PAsm);
+	pasm->texts = NULL;
+	pasm->ntexts = 0;
+	pasm->outs = NULL;
+	pasm->nouts = 0;
+	pasm->ins = NULL;
+	pasm->nins = 0;
+	pasm->clobbers = NULL;
+	pasm->nclobbers = 0;
+
+	advance(parser); /* asm */
+
+	if (!istk(parser, TOKEN_LPAREN)) {
+		err_source(parser->file, current(parser).span, "expected '('");
+	}
+
+	advance(parser); /* ( */
+
+	if (!istk(parser, TOKEN_STRING)) {
+		err_source(parser->file, current(parser).span, "expected assembly text");
+	}
+
+	while (istk(parser, TOKEN_STRING)) {
+		Token text = current(parser);
+		vec_push(pasm->texts, &text, &pasm->ntexts, sizeof(Token));
+		advance(parser); /* text */
+	}
+
+	if (istk(parser, TOKEN_COLON)) {
+		advance(parser); /* : */
+		parse_asm_operands(parser, &pasm->outs, &pasm->nouts);
+	}
+
+	if (istk(parser, TOKEN_COLON)) {
+		advance(parser); /* : */
+		parse_asm_operands(parser, &pasm->ins, &pasm->nins);
+	}
+
+	if (istk(parser, TOKEN_COLON)) {
+		advance(parser); /* : */
+
+		while (istk(parser, TOKEN_STRING)) {
+			Token clobber = current(parser);
+			vec_push(pasm->clobbers, &clobber, &pasm->nclobbers, sizeof(Token));
+			advance(parser); /* clobber */
+
+			if (!istk(parser, TOKEN_COMMA)) {
+				break;
+			}
+
+			advance(parser); /* , */
+
+			if (!istk(parser, TOKEN_STRING)) {
+				err_source(parser->file, current(parser).span, "expected register, \"cc\" or \"memory\"");
+			}
+		}
+	}
+
+	if (!istk(parser, TOKEN_RPAREN)) {
+		err_source(parser->file, current(parser).span, "expected ')'");
+	}
+
+	advance(parser); /* ) */
+
+	return pasm;
+}
+
+/* statement = "return" [expression] ";" | var ";" | assign ";" | call ";" | asm ";" | switch | if | while */
 static PStatement *parse_statement(Parser *parser)
 {
 	PStatement *pstatement = alloct(PStatement);
@@ -243,7 +845,65 @@ static PStatement *parse_statement(Parser *parser)
 
 	bool reqsemi = false;
 
-	switch (istk(parser, TOKEN_RETURN)) {
+	switch (current(parser).kind) {
+		case TOKEN_SWITCH: {
+			pstatement->span = current(parser).span;
+			pstatement->variant = PSTATEMENT_SWITCH;
+			pstatement->sw = parse_switch(parser);
+			break;
+		}
+		case TOKEN_IF: {
+			pstatement->span = current(parser).span;
+			pstatement->variant = PSTATEMENT_IF;
+			pstatement->pif = parse_if(parser);
+			break;
+		}
+		case TOKEN_WHILE: {
+			pstatement->span = current(parser).span;
+			pstatement->variant = PSTATEMENT_WHILE;
+			pstatement->loop = parse_while(parser);
+			break;
+		}
+		case TOKEN_ALIGN:
+		case TOKEN_VAR: {
+			pstatement->span = current(parser).span;
+			pstatement->variant = PSTATEMENT_VAR;
+			pstatement->var = parse_var(parser);
+
+			reqsemi = true;
+			break;
+		}
+		case TOKEN_IDENTIFIER: {
+			token_kind next = peek(parser, 1).kind;
+
+			if (iscall(parser)) {
+				pstatement->span = current(parser).span;
+				pstatement->variant = PSTATEMENT_CALL;
+				pstatement->expr = parse_primary(parser);
+
+				reqsemi = true;
+				break;
+			}
+
+			if (next != TOKEN_ASSIGN && next != TOKEN_DOT && next != TOKEN_LBRACKET) {
+				err_source(parser->file, current(parser).span, "expected statement");
+			}
+
+			pstatement->span = current(parser).span;
+			pstatement->variant = PSTATEMENT_ASSIGN;
+			pstatement->assign = parse_assign(parser);
+
+			reqsemi = true;
+			break;
+		}
+		case TOKEN_ASM: {
+			pstatement->span = current(parser).span;
+			pstatement->variant = PSTATEMENT_ASM;
+			pstatement->pasm = parse_asm(parser);
+
+			reqsemi = true;
+			break;
+		}
 		case TOKEN_RETURN: {
 			pstatement->span = current(parser).span;
 			advance(parser); /* return */
@@ -296,15 +956,101 @@ static PBlock *parse_block(Parser *parser)
 	return pblock;
 }
 
-/* fun = "fun" identifier "(" [{parameters}] ")" [type] block */
+/*
+ * clones = "target_clones" "(" string {"," string} ")"
+ *
+ * One of the targets is baseline x86-64, which machines without the
+ * extensions of the others fall back to.
+ */
+static void parse_clones(Parser *parser, PFun *pfun)
+{
+	Token attr = current(parser);
+
+	advance(parser); /* target_clones */
+
+	if (!istk(parser, TOKEN_LPAREN)) {
+		err_source(parser->file, current(parser).span, "expected '('");
+	}
+
+	advance(parser); /* ( */
+
+	bool baseline = false;
+
+	while (true) {
+		if (!istk(parser, TOKEN_STRING)) {
+			err_source(parser->file, current(parser).span, "expected target");
+		}
+
+		for (size_t i = 0; i < pfun->nclones; ++i) {
+			if (!strcmp(pfun->clones[i].content, current(parser).content)) {
+				err_source(parser->file, current(parser).span, "repeated target '%s'", current(parser).content);
+			}
+		}
+
+		Token target = current(parser);
+		vec_push(pfun->clones, &target, &pfun->nclones, sizeof(Token));
+		baseline |= !strcmp(target.content, "x86-64");
+		advance(parser); /* target */
+
+		if (!istk(parser, TOKEN_COMMA)) {
+			break;
+		}
+
+		advance(parser); /* , */
+	}
+
+	if (!istk(parser, TOKEN_RPAREN)) {
+		err_source(parser->file, current(parser).span, "expected ',' or ')'");
+	}
+
+	if (!baseline) {
+		err_source(parser->file, attr.span, "target_clones needs \"x86-64\", which other machines fall back to");
+	}
+
+	advance(parser); /* ) */
+}
+
+/*
+ * fun = {"cold" | "pure" | clones} "fun" identifier ["[" identifier {"," identifier} "]"]
+ *       "(" [{parameters}] ")" [type] block
+ */
 static PFun *parse_fun(Parser *parser)
 {
 	PFun *pfun = alloct(PFun);
+	pfun->file = parser->file;
 	pfun->identifier = EMPTYTOKEN;
+	pfun->cold = false;
+	pfun->pure = false;
+	pfun->clones = NULL;
+	pfun->nclones = 0;
+	pfun->typeparams = NULL;
+	pfun->ntypeparams = 0;
 	pfun->params = NULL;
 	pfun->nparams = 0;
 	pfun->rettype = NULL;
 
+	while (istk(parser, TOKEN_COLD) || istk(parser, TOKEN_PURE) || istk(parser, TOKEN_TARGET_CLONES)) {
+		if (istk(parser, TOKEN_TARGET_CLONES) && pfun->nclones) {
+			err_source(parser->file, current(parser).span, "repeated attribute '%s'", current(parser).content);
+		} else if (istk(parser, TOKEN_TARGET_CLONES)) {
+			parse_clones(parser, pfun);
+			continue;
+		}
+
+		bool *attr = istk(parser, TOKEN_COLD) ? &pfun->cold : &pfun->pure;
+
+		if (*attr) {
+			err_source(parser->file, current(parser).span, "repeated attribute '%s'", current(parser).content);
+		}
+
+		*attr = true;
+		advance(parser); /* cold or pure */
+	}
+
+	if (!istk(parser, TOKEN_FUN)) {
+		err_source(parser->file, current(parser).span, "expected 'fun'");
+	}
+
 	advance(parser); /* fun */
 
 	if (!istk(parser, TOKEN_IDENTIFIER)) {
@@ -314,6 +1060,38 @@ static PFun *parse_fun(Parser *parser)
 	pfun->identifier = current(parser);
 	advance(parser); /* identifier */
 
+	if (istk(parser, TOKEN_LBRACKET)) {
+		advance(parser); /* [ */
+
+		while (true) {
+			if (!istk(parser, TOKEN_IDENTIFIER)) {
+				err_source(parser->file, current(parser).span, "expected type parameter");
+			}
+
+			for (size_t i = 0; i < pfun->ntypeparams; ++i) {
+				if (!strcmp(pfun->typeparams[i].content, current(parser).content)) {
+					err_source(parser->file, current(parser).span, "repeated type parameter '%s'", current(parser).content);
+				}
+			}
+
+			Token typeparam = current(parser);
+			vec_push(pfun->typeparams, &typeparam, &pfun->ntypeparams, sizeof(Token));
+			advance(parser); /* identifier */
+
+			if (!istk(parser, TOKEN_COMMA)) {
+				break;
+			}
+
+			advance(parser); /* , */
+		}
+
+		if (!istk(parser, TOKEN_RBRACKET)) {
+			err_source(parser->file, current(parser).span, "expected ',' or ']'");
+		}
+
+		advance(parser); /* ] */
+	}
+
 	if (!istk(parser, TOKEN_LPAREN)) {
 		err_source(parser->file, current(parser).span, "expected '('");
 	}
@@ -358,3 +1136,107 @@ static PFun *parse_fun(Parser *parser)
 
 	return pfun;
 }
+
+/*
+ * struct = {"packed" | "reorder" | align} "struct" identifier
+ *          "{" {variable ";"} "}"
+ */
+static PStruct *parse_struct(Parser *parser)
+{
+	PStruct *pstruct = alloct(PStruct);
+	pstruct->file = parser->file;
+	pstruct->identifier = EMPTYTOKEN;
+	pstruct->packed = false;
+	pstruct->reorder = false;
+	pstruct->align = NULL;
+	pstruct->fields = NULL;
+	pstruct->nfields = 0;
+
+	while (!istk(parser, TOKEN_STRUCT)) {
+		Token attr = current(parser);
+		bool repeated = false;
+
+		switch (attr.kind) {
+			case TOKEN_PACKED: repeated = pstruct->packed; pstruct->packed = true; break;
+			case TOKEN_REORDER: repeated = pstruct->reorder; pstruct->reorder = true; break;
+			case TOKEN_ALIGN: repeated = pstruct->align != NULL; break;
+			default: err_source(parser->file, attr.span, "expected 'struct'");
+		}
+
+		if (repeated) {
+			err_source(parser->file, attr.span, "repeated attribute '%s'", attr.content);
+		}
+
+		if (attr.kind == TOKEN_ALIGN) {
+			pstruct->align = parse_align(parser);
+		} else {
+			advance(parser); /* attribute */
+		}
+	}
+
+	advance(parser); /* struct */
+
+	if (!istk(parser, TOKEN_IDENTIFIER)) {
+		err_source(parser->file, current(parser).span, "expected struct identifier");
+	}
+
+	pstruct->identifier = current(parser);
+	advance(parser); /* identifier */
+
+	if (!istk(parser, TOKEN_LBRACE)) {
+		err_source(parser->file, current(parser).span, "expected '{'");
+	}
+
+	advance(parser); /* { */
+
+	while (!istk(parser, TOKEN_RBRACE)) {
+		PVariable *field = parse_variable(parser);
+
+		for (size_t i = 0; i < pstruct->nfields; ++i) {
+			if (!strcmp(pstruct->fields[i]->identifier.content, field->identifier.content)) {
+				err_source(parser->file, field->identifier.span, "repeated field '%s'", field->identifier.content);
+			}
+		}
+
+		vec_push(pstruct->fields, &field, &pstruct->nfields, sizeof(PVariable *));
+
+		if (!istk(parser, TOKEN_SEMICOLON)) {
+			err_source(parser->file, current(parser).span, "expected ';'");
+		}
+
+		advance(parser); /* ; */
+	}
+
+	advance(parser); /* } */
+
+	return pstruct;
+}
+
+/* global = [align] "thread" var ";" */
+static PGlobal *parse_global(Parser *parser)
+{
+	PGlobal *pglobal = alloct(PGlobal);
+	pglobal->file = parser->file;
+
+	Number *align = NULL;
+	if (istk(parser, TOKEN_ALIGN)) {
+		align = parse_align(parser);
+	}
+
+	advance(parser); /* thread */
+
+	if (!istk(parser, TOKEN_VAR)) {
+		err_source(parser->file, current(parser).span, "expected 'var'");
+	}
+
+	pglobal->var = parse_var(parser);
+	pglobal->var->align = align;
+
+	if (!istk(parser, TOKEN_SEMICOLON)) {
+		err_source(parser->file, current(parser).span, "expected ';'");
+	}
+
+	advance(parser); /* ; */
+
+	return pglobal;
+}
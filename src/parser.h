@@ -38,40 +38,128 @@ typedef enum p_node_variant {
 	_PNODE_NULL,
 
 	PTYPE_NAMED,
+	PTYPE_ARRAY,
 
 	PEXPRESSION_NUMLIT,
+	PEXPRESSION_IDENTIFIER,
+	PEXPRESSION_CALL,
+	PEXPRESSION_BINARY,
+	PEXPRESSION_UNARY,
+	PEXPRESSION_FIELD,
+	PEXPRESSION_INDEX,
 
 	PSTATEMENT_RETURN,
 	PSTATEMENT_RETURN_NOVAL,
+	PSTATEMENT_SWITCH,
+	PSTATEMENT_IF,
+	PSTATEMENT_VAR,
+	PSTATEMENT_ASSIGN,
+	PSTATEMENT_WHILE,
+	PSTATEMENT_CALL, /* of a builtin, for its effect */
+	PSTATEMENT_ASM,
 } p_node_variant;
 
+/* Expected outcome of a condition, as annotated in the source */
+typedef enum branch_hint {
+	HINT_NONE,
+	HINT_LIKELY,
+	HINT_UNLIKELY,
+} branch_hint;
+
+typedef struct PArray PArray;
+
 typedef struct PType {
 	p_node_variant variant;
+	Span span;
 
 	union {
 		Token name;
+		PArray *array;
 	};
 } PType;
 
+struct PArray {
+	Number *length; /* NULL for a slice */
+	PType *elem;
+	bool soa; /* stored as one column per field of the (struct) element type */
+};
+
 typedef struct PVariable {
 	Token identifier;
 	PType *type;
 } PVariable;
 
+typedef struct PCall PCall;
+typedef struct PBinary PBinary;
+typedef struct PUnary PUnary;
+typedef struct PField PField;
+typedef struct PIndex PIndex;
+
 typedef struct PExpression {
 	p_node_variant variant;
+	Span span;
 
 	union {
 		Number *number;
+		Token identifier;
+		PCall *call;
+		PBinary *binary;
+		PUnary *unary;
+		PField *field;
+		PIndex *index;
 	};
 } PExpression;
 
+struct PCall {
+	Token identifier;
+
+	PType **typeargs; /* given explicitly; otherwise inferred from the args */
+	size_t ntypeargs;
+
+	struct PExpression **args;
+	size_t nargs;
+};
+
+struct PBinary {
+	Token op;
+	struct PExpression *lhs;
+	struct PExpression *rhs;
+};
+
+struct PUnary {
+	Token op;
+	struct PExpression *operand;
+};
+
+struct PField {
+	struct PExpression *base;
+	Token field;
+};
+
+struct PIndex {
+	struct PExpression *base;
+	struct PExpression *index;
+};
+
+typedef struct PSwitch PSwitch;
+typedef struct PIf PIf;
+typedef struct PVar PVar;
+typedef struct PAssign PAssign;
+typedef struct PWhile PWhile;
+typedef struct PAsm PAsm;
+
 typedef struct PStatement {
 	p_node_variant variant;
 	Span span;
 
 	union {
 		PExpression *expr;
+		PSwitch *sw;
+		PIf *pif;
+		PVar *var;
+		PAssign *assign;
+		PWhile *loop;
+		PAsm *pasm;
 	};
 } PStatement;
 
@@ -80,8 +168,77 @@ typedef struct PBlock {
 	size_t nstatements;
 } PBlock;
 
+typedef struct PCase {
+	PExpression **values;
+	size_t nvalues;
+
+	PBlock *block;
+} PCase;
+
+struct PSwitch {
+	PExpression *expr;
+
+	PCase **cases;
+	size_t ncases;
+
+	PBlock *def; /* NULL if there is no default */
+};
+
+struct PIf {
+	PExpression *cond;
+	branch_hint hint;
+
+	PBlock *then;
+	PBlock *els; /* NULL if there is no else; an 'else if' is a block of one if */
+};
+
+struct PVar {
+	PVariable *var;
+	PExpression *value; /* NULL if not given */
+	Number *align; /* least alignment of its slot in the frame; NULL if not given */
+};
+
+struct PAssign {
+	PExpression *place; /* a variable, or a field or element of one */
+	PExpression *value;
+};
+
+struct PWhile {
+	PExpression *cond;
+	PBlock *block;
+};
+
+/* A value an asm statement takes or gives, and the register or kind of operand it is in */
+typedef struct PAsmOperand {
+	Token constraint;
+	PExpression *expr;
+} PAsmOperand;
+
+struct PAsm {
+	Token *texts; /* one or more instructions each, separated by ';' */
+	size_t ntexts;
+
+	PAsmOperand *outs;
+	size_t nouts;
+
+	PAsmOperand *ins;
+	size_t nins;
+
+	Token *clobbers; /* registers, "cc" or "memory" */
+	size_t nclobbers;
+};
+
 typedef struct PFun {
+	File *file; /* defined in */
 	Token identifier;
+	bool cold; /* rarely called; placed in .text.unlikely */
+	bool pure; /* declared to depend on its arguments alone */
+
+	Token *clones; /* targets it is compiled for, once each, as target_clones names them; none if empty */
+	size_t nclones;
+
+	Token *typeparams; /* generic over these when any; instantiated per call */
+	size_t ntypeparams;
 
 	PVariable **params;
 	size_t nparams;
@@ -91,9 +248,33 @@ typedef struct PFun {
 	PBlock *block;
 } PFun;
 
+/* Fields are laid out in order, each naturally aligned, unless attributes say otherwise */
+typedef struct PStruct {
+	File *file; /* defined in */
+	Token identifier;
+	bool packed; /* no padding; every field at alignment 1 */
+	bool reorder; /* fields may be laid out in another order, to need less padding */
+	Number *align; /* least alignment of the whole; NULL if not given */
+
+	PVariable **fields;
+	size_t nfields;
+} PStruct;
+
+/* A variable outside any function, of which each thread has its own */
+typedef struct PGlobal {
+	File *file; /* defined in */
+	PVar *var;
+} PGlobal;
+
 typedef struct PFile {
 	PFun **pfuns;
 	size_t npfuns;
+
+	PStruct **pstructs;
+	size_t npstructs;
+
+	PGlobal **pglobals;
+	size_t npglobals;
 } PFile;
 
 typedef struct Parser {
@@ -0,0 +1,564 @@
+/*
+ * sched.c
+ *
+ * This file is part of awl
+ */
+
+#include "sched.h"
+
+#include <string.h>
+#include "vec.h"
+#include "mem.h"
+
+/* Accesses to an operand */
+#define A_R 0x1
+#define A_W 0x2
+#define A_RW (A_R | A_W)
+#define A_ADDR 0x4 /* memory operand whose address alone is used (lea) */
+
+/* Accesses to the flags */
+#define FL_R 0x1
+#define FL_W 0x2
+
+#define REGBIT(r) ((uint32_t)1 << (r))
+#define XMMBIT(r) ((uint32_t)1 << (16 + (r))) /* XMM registers follow the general purpose ones */
+
+/* What an instruction reads and writes, besides its explicit operands where 'acc' says */
+typedef struct Effect {
+	uint8_t acc[3];
+	uint32_t iread; /* implicit registers */
+	uint32_t iwrite;
+	uint8_t flags;
+	bool stack; /* pushes or pops */
+} Effect;
+
+static const Effect effects[_X86_COUNT] = {
+	[X86_MOV] = { .acc = { A_W, A_R } },
+	[X86_MOVZX] = { .acc = { A_W, A_R } },
+	[X86_MOVSX] = { .acc = { A_W, A_R } },
+	[X86_MOVSXD] = { .acc = { A_W, A_R } },
+	[X86_LEA] = { .acc = { A_W, A_ADDR } },
+	[X86_XCHG] = { .acc = { A_RW, A_RW } },
+	[X86_XADD] = { .acc = { A_RW, A_RW }, .flags = FL_W },
+	[X86_CMPXCHG] = { .acc = { A_RW, A_R }, .iread = REGBIT(RAX), .iwrite = REGBIT(RAX), .flags = FL_W },
+
+	[X86_ADD] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_OR] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_AND] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_SUB] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_XOR] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_CMP] = { .acc = { A_R, A_R }, .flags = FL_W },
+	[X86_TEST] = { .acc = { A_R, A_R }, .flags = FL_W },
+
+	[X86_IMUL] = { .acc = { A_RW, A_R, A_R }, .flags = FL_W },
+	[X86_MUL] = { .acc = { A_R }, .iread = REGBIT(RAX), .iwrite = REGBIT(RAX) | REGBIT(RDX), .flags = FL_W },
+	[X86_IMUL1] = { .acc = { A_R }, .iread = REGBIT(RAX), .iwrite = REGBIT(RAX) | REGBIT(RDX), .flags = FL_W },
+	[X86_DIV] = { .acc = { A_R }, .iread = REGBIT(RAX) | REGBIT(RDX), .iwrite = REGBIT(RAX) | REGBIT(RDX), .flags = FL_W },
+	[X86_IDIV] = { .acc = { A_R }, .iread = REGBIT(RAX) | REGBIT(RDX), .iwrite = REGBIT(RAX) | REGBIT(RDX), .flags = FL_W },
+	[X86_NEG] = { .acc = { A_RW }, .flags = FL_W },
+	[X86_NOT] = { .acc = { A_RW } },
+
+	/* A shift by cl leaves the flags alone when cl is 0; see analyse() */
+	[X86_ROL] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_ROR] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_SHL] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_SHR] = { .acc = { A_RW, A_R }, .flags = FL_W },
+	[X86_SAR] = { .acc = { A_RW, A_R }, .flags = FL_W },
+
+	[X86_BSF] = { .acc = { A_W, A_R }, .flags = FL_W },
+	[X86_BSR] = { .acc = { A_W, A_R }, .flags = FL_W },
+	[X86_BSWAP] = { .acc = { A_RW } },
+	[X86_POPCNT] = { .acc = { A_W, A_R }, .flags = FL_W },
+	[X86_LZCNT] = { .acc = { A_W, A_R }, .flags = FL_W },
+	[X86_TZCNT] = { .acc = { A_W, A_R }, .flags = FL_W },
+	[X86_PDEP] = { .acc = { A_W, A_R, A_R } },
+	[X86_PEXT] = { .acc = { A_W, A_R, A_R } },
+	[X86_ANDN] = { .acc = { A_W, A_R, A_R }, .flags = FL_W },
+	[X86_BZHI] = { .acc = { A_W, A_R, A_R }, .flags = FL_W },
+	[X86_SHLX] = { .acc = { A_W, A_R, A_R } },
+	[X86_SHRX] = { .acc = { A_W, A_R, A_R } },
+	[X86_SARX] = { .acc = { A_W, A_R, A_R } },
+	[X86_MOVBE] = { .acc = { A_W, A_R } },
+	[X86_RDTSC] = { .iwrite = REGBIT(RAX) | REGBIT(RDX) },
+	[X86_CPUID] = { .iread = REGBIT(RAX) | REGBIT(RCX), .iwrite = REGBIT(RAX) | REGBIT(RBX) | REGBIT(RCX) | REGBIT(RDX) },
+	[X86_XGETBV] = { .iread = REGBIT(RCX), .iwrite = REGBIT(RAX) | REGBIT(RDX) },
+	[X86_PREFETCHT0] = { .acc = { A_R } },
+	[X86_PREFETCHT1] = { .acc = { A_R } },
+	[X86_PREFETCHT2] = { .acc = { A_R } },
+	[X86_PREFETCHNTA] = { .acc = { A_R } },
+	[X86_MOVNTI] = { .acc = { A_W, A_R } },
+
+	[X86_CDQ] = { .iread = REGBIT(RAX), .iwrite = REGBIT(RDX) },
+	[X86_CQO] = { .iread = REGBIT(RAX), .iwrite = REGBIT(RDX) },
+
+	[X86_PUSH] = { .acc = { A_R }, .iread = REGBIT(RSP), .iwrite = REGBIT(RSP), .stack = true },
+	[X86_POP] = { .acc = { A_W }, .iread = REGBIT(RSP), .iwrite = REGBIT(RSP), .stack = true },
+	[X86_SETCC] = { .acc = { A_W }, .flags = FL_R },
+	[X86_CMOVCC] = { .acc = { A_RW, A_R }, .flags = FL_R },
+
+	/* In their VEX forms, SSE operations write their first operand without reading it; see analyse() */
+	[X86_MOVDQA] = { .acc = { A_W, A_R } },
+	[X86_MOVDQU] = { .acc = { A_W, A_R } },
+	[X86_MOVNTDQ] = { .acc = { A_W, A_R } },
+	[X86_MOVD] = { .acc = { A_W, A_R } },
+	[X86_PADDB] = { .acc = { A_RW, A_R } },
+	[X86_PADDW] = { .acc = { A_RW, A_R } },
+	[X86_PADDD] = { .acc = { A_RW, A_R } },
+	[X86_PADDQ] = { .acc = { A_RW, A_R } },
+	[X86_PSUBB] = { .acc = { A_RW, A_R } },
+	[X86_PSUBW] = { .acc = { A_RW, A_R } },
+	[X86_PSUBD] = { .acc = { A_RW, A_R } },
+	[X86_PSUBQ] = { .acc = { A_RW, A_R } },
+	[X86_PMULLW] = { .acc = { A_RW, A_R } },
+	[X86_PMULLD] = { .acc = { A_RW, A_R } },
+	[X86_PMULUDQ] = { .acc = { A_RW, A_R } },
+	[X86_PAND] = { .acc = { A_RW, A_R } },
+	[X86_POR] = { .acc = { A_RW, A_R } },
+	[X86_PXOR] = { .acc = { A_RW, A_R } },
+	[X86_PCMPEQB] = { .acc = { A_RW, A_R } },
+	[X86_PCMPEQW] = { .acc = { A_RW, A_R } },
+	[X86_PCMPEQD] = { .acc = { A_RW, A_R } },
+	[X86_PCMPEQQ] = { .acc = { A_RW, A_R } },
+	[X86_PCMPGTB] = { .acc = { A_RW, A_R } },
+	[X86_PCMPGTW] = { .acc = { A_RW, A_R } },
+	[X86_PCMPGTD] = { .acc = { A_RW, A_R } },
+	[X86_PCMPGTQ] = { .acc = { A_RW, A_R } },
+	[X86_PSLLW] = { .acc = { A_RW, A_R } },
+	[X86_PSLLD] = { .acc = { A_RW, A_R } },
+	[X86_PSLLQ] = { .acc = { A_RW, A_R } },
+	[X86_PSRLW] = { .acc = { A_RW, A_R } },
+	[X86_PSRLD] = { .acc = { A_RW, A_R } },
+	[X86_PSRLQ] = { .acc = { A_RW, A_R } },
+	[X86_PSRAW] = { .acc = { A_RW, A_R } },
+	[X86_PSRAD] = { .acc = { A_RW, A_R } },
+	[X86_PSHUFD] = { .acc = { A_W, A_R } },
+	[X86_PSHUFLW] = { .acc = { A_W, A_R } },
+	[X86_PSHUFHW] = { .acc = { A_W, A_R } },
+	[X86_PUNPCKLBW] = { .acc = { A_RW, A_R } },
+	[X86_PUNPCKLWD] = { .acc = { A_RW, A_R } },
+	[X86_PUNPCKLDQ] = { .acc = { A_RW, A_R } },
+	[X86_PUNPCKLQDQ] = { .acc = { A_RW, A_R } },
+	[X86_PACKSSWB] = { .acc = { A_RW, A_R } },
+	[X86_PMOVMSKB] = { .acc = { A_W, A_R } },
+	[X86_MOVMSKPS] = { .acc = { A_W, A_R } },
+	[X86_MOVMSKPD] = { .acc = { A_W, A_R } },
+	[X86_PEXTRW] = { .acc = { A_W, A_R } },
+	[X86_PSADBW] = { .acc = { A_RW, A_R } },
+	[X86_VPBROADCASTB] = { .acc = { A_W, A_R } },
+	[X86_VPBROADCASTW] = { .acc = { A_W, A_R } },
+	[X86_VPBROADCASTD] = { .acc = { A_W, A_R } },
+	[X86_VPBROADCASTQ] = { .acc = { A_W, A_R } },
+	[X86_VPERMQ] = { .acc = { A_W, A_R } },
+	[X86_VEXTRACTI128] = { .acc = { A_W, A_R } },
+};
+
+/*
+ * Approximate figures, after Agner Fog's instruction tables; what matters is
+ * their proportions, which decide which chains are started first.
+ */
+static const Tune tunes[] = {
+	{ .name = "generic", .width = 4, .load = 5, .store = 5, .imul = 3, .mul = 4, .div32 = 26, .div64 = 40, .lea3 = 3, .xchgm = 20, .vmul = 10, .bits = 3 },
+	{ .name = "skylake", .width = 4, .load = 5, .store = 4, .imul = 3, .mul = 4, .div32 = 26, .div64 = 42, .lea3 = 3, .xchgm = 18, .vmul = 10, .bits = 3 },
+	{ .name = "znver3", .width = 4, .load = 4, .store = 7, .imul = 3, .mul = 3, .div32 = 10, .div64 = 14, .lea3 = 2, .xchgm = 8, .vmul = 3, .bits = 2 },
+};
+
+/* An instruction of the block being scheduled */
+typedef struct Node {
+	Insn insn;
+
+	uint32_t reads; /* registers */
+	uint32_t writes;
+	uint8_t flags;
+	uint8_t memacc; /* A_R and/or A_W */
+	Operand mem; /* the memory operand, if any; pushes and pops have none */
+	bool stack;
+
+	size_t lat;
+	size_t height; /* cycles from its issue to the end of the longest chain it starts */
+	size_t earliest; /* cycle at which its operands are ready */
+	size_t npreds; /* predecessors not yet scheduled */
+	bool done;
+} Node;
+
+static void analyse(const Tune *tune, Node *node);
+static bool alias(Node *a, Node *b);
+static bool moves(Node *a, Node *b);
+static void depend(Sched *sched, Node *nodes, int16_t *edges);
+
+/* The figures for a microarchitecture, or NULL if there are none for it */
+const Tune *sched_tune(const char *name)
+{
+	for (size_t i = 0; i < sizeof(tunes) / sizeof(*tunes); ++i) {
+		if (!strcmp(tunes[i].name, name)) {
+			return &tunes[i];
+		}
+	}
+
+	return NULL;
+}
+
+Sched *sched_new(const Tune *tune)
+{
+	Sched *sched = alloct(Sched);
+	sched->tune = tune ? tune : &tunes[0];
+	sched->insns = NULL;
+	sched->ninsns = 0;
+
+	return sched;
+}
+
+/* Whether an instruction ends a block: jumps, and anything whose position must be known as it is encoded */
+bool sched_barrier(Insn insn)
+{
+	/* Locked instructions are fences, and ordered atomic accesses stay where they are among the others */
+	if (insn.lock || insn.ordered) {
+		return true;
+	}
+
+	switch (insn.op) {
+		case X86_CALL:
+		case X86_JMP:
+		case X86_JCC:
+		case X86_RET:
+		case X86_LEAVE:
+		case X86_NOP:
+		case X86_UD2:
+		case X86_RDTSC: /* what is timed stays on its side of it */
+		case X86_CPUID: /* serializing */
+		case X86_SFENCE: /* as do the stores it orders */
+		case X86_VZEROUPPER: return true;
+		default: break;
+	}
+
+	for (size_t i = 0; i < 3; ++i) {
+		/* A thread-local is relocated where it is encoded, or based at an offset alias() knows nothing of */
+		if (insn.ops[i].kind == OPND_LABEL || (insn.ops[i].kind == OPND_MEM && (insn.ops[i].mem.base == RIP || insn.ops[i].mem.fs))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void sched_insn(Sched *sched, Enc *enc, Insn insn)
+{
+	vec_push(sched->insns, &insn, &sched->ninsns, sizeof(Insn));
+
+	if (sched->ninsns == SCHED_MAXBLOCK) {
+		sched_flush(sched, enc);
+	}
+}
+
+/*
+ * List scheduling: issue, cycle by cycle and up to the issue width, those
+ * instructions whose operands are ready, greatest height first (the original
+ * order breaking ties); when none is ready, skip to the cycle at which the
+ * first one will be.
+ */
+void sched_flush(Sched *sched, Enc *enc)
+{
+	size_t n = sched->ninsns;
+	if (n == 0) {
+		return;
+	}
+
+	Node *nodes = acalloc(n, sizeof(Node));
+	int16_t *edges = acalloc(n * n, sizeof(int16_t));
+
+	for (size_t i = 0; i < n; ++i) {
+		nodes[i].insn = sched->insns[i];
+		analyse(sched->tune, &nodes[i]);
+	}
+
+	memset(edges, 0xFF, n * n * sizeof(int16_t));
+	depend(sched, nodes, edges);
+
+	for (size_t i = n; i-- > 0;) {
+		nodes[i].height = nodes[i].lat;
+
+		for (size_t j = i + 1; j < n; ++j) {
+			if (edges[i * n + j] >= 0 && edges[i * n + j] + nodes[j].height > nodes[i].height) {
+				nodes[i].height = edges[i * n + j] + nodes[j].height;
+			}
+		}
+	}
+
+	size_t cycle = 0;
+	size_t issued = 0;
+
+	for (size_t left = n; left > 0;) {
+		size_t best = n;
+		size_t next = SIZE_MAX;
+
+		for (size_t i = 0; i < n; ++i) {
+			Node *node = &nodes[i];
+
+			if (node->done || node->npreds) {
+				continue;
+			}
+
+			if (node->earliest > cycle) {
+				next = node->earliest < next ? node->earliest : next;
+			} else if (best == n || node->height > nodes[best].height) {
+				best = i;
+			}
+		}
+
+		if (best == n) {
+			cycle = next;
+			issued = 0;
+			continue;
+		}
+
+		nodes[best].done = true;
+		enc_insn(enc, nodes[best].insn);
+		--left;
+
+		for (size_t j = best + 1; j < n; ++j) {
+			int16_t lat = edges[best * n + j];
+
+			if (lat >= 0) {
+				--nodes[j].npreds;
+				if (cycle + lat > nodes[j].earliest) {
+					nodes[j].earliest = cycle + lat;
+				}
+			}
+		}
+
+		if (++issued == sched->tune->width) {
+			++cycle;
+			issued = 0;
+		}
+	}
+
+	afree(edges);
+	afree(nodes);
+	afree(sched->insns);
+	sched->insns = NULL;
+	sched->ninsns = 0;
+}
+
+static void analyse(const Tune *tune, Node *node)
+{
+	Insn *insn = &node->insn;
+	const Effect *effect = &effects[insn->op];
+
+	node->reads = effect->iread;
+	node->writes = effect->iwrite;
+	node->flags = effect->flags;
+	node->memacc = effect->stack ? (insn->op == X86_PUSH ? A_W : A_R) : 0;
+	node->mem = OPNONE;
+	node->stack = effect->stack;
+
+	for (size_t i = 0; i < 3; ++i) {
+		Operand *op = &insn->ops[i];
+		uint8_t acc = effect->acc[i];
+
+		/* The three-operand imul writes its first operand without reading it */
+		if (insn->op == X86_IMUL && i == 0 && insn->ops[2].kind != OPND_NONE) {
+			acc = A_W;
+		}
+
+		if (insn->vex) {
+			acc = i == 0 ? A_W : A_R;
+		}
+
+		if (op->kind == OPND_REG) {
+			uint32_t bit = op->size >= 16 ? XMMBIT(op->reg) : REGBIT(op->reg);
+
+			/* Writing 8 or 16 bits of a register merges with the rest of it */
+			if ((acc & A_W) && op->size < 4) {
+				acc |= A_R;
+			}
+
+			node->reads |= (acc & A_R) ? bit : 0;
+			node->writes |= (acc & A_W) ? bit : 0;
+		} else if (op->kind == OPND_MEM) {
+			node->reads |= (op->mem.base != NOREG && op->mem.base != RIP) ? REGBIT(op->mem.base) : 0;
+			node->reads |= (op->mem.index != NOREG) ? REGBIT(op->mem.index) : 0;
+
+			if (!(acc & A_ADDR)) {
+				node->memacc |= acc;
+				node->mem = *op;
+			}
+		}
+	}
+
+	/* xor r, r and sub r, r do not depend on r; nor do pxor and pcmpeq of a register with itself */
+	if ((insn->op == X86_XOR || insn->op == X86_SUB) && insn->ops[0].kind == OPND_REG
+			&& insn->ops[1].kind == OPND_REG && insn->ops[0].reg == insn->ops[1].reg) {
+		node->reads &= ~REGBIT(insn->ops[0].reg);
+	}
+
+	Operand *a = &insn->ops[insn->vex ? 1 : 0];
+	Operand *b = &insn->ops[insn->vex ? 2 : 1];
+	bool idiom = insn->op == X86_PXOR || (insn->op >= X86_PCMPEQB && insn->op <= X86_PCMPEQQ);
+
+	if (idiom && a->kind == OPND_REG && b->kind == OPND_REG && a->reg == b->reg) {
+		node->reads &= ~XMMBIT(a->reg);
+	}
+
+	if (insn->op >= X86_ROL && insn->op <= X86_SAR && insn->ops[1].kind == OPND_REG) {
+		node->flags |= FL_R;
+	}
+
+	bool load = (node->memacc & A_R) && !node->stack;
+
+	switch (insn->op) {
+		case X86_MOV:
+		case X86_MOVZX:
+		case X86_MOVSX:
+		case X86_MOVSXD:
+		case X86_MOVDQA:
+		case X86_MOVDQU:
+		case X86_MOVD:
+		case X86_MOVBE: node->lat = load ? tune->load : 1; return;
+		case X86_PMULLW:
+		case X86_PMULLD:
+		case X86_PMULUDQ: node->lat = tune->vmul; break;
+		case X86_IMUL: node->lat = tune->imul; break;
+		case X86_BSF:
+		case X86_BSR:
+		case X86_POPCNT:
+		case X86_LZCNT:
+		case X86_TZCNT:
+		case X86_PDEP:
+		case X86_PEXT: node->lat = tune->bits; break;
+		case X86_MUL:
+		case X86_IMUL1: node->lat = tune->mul; break;
+		case X86_DIV:
+		case X86_IDIV: node->lat = insn->ops[0].size == 8 ? tune->div64 : tune->div32; break;
+		case X86_LEA: {
+			Operand *a = &insn->ops[1];
+			node->lat = (a->mem.base != NOREG && a->mem.index != NOREG && a->mem.disp) ? tune->lea3 : 1;
+			return;
+		}
+		case X86_XCHG: node->lat = node->memacc ? tune->xchgm : 2; return;
+		case X86_POP: node->lat = tune->load; return;
+		default: node->lat = 1; break;
+	}
+
+	if (load) {
+		node->lat += tune->load;
+	}
+}
+
+/* Whether two memory accesses may overlap; all memory is the stack for now */
+static bool alias(Node *a, Node *b)
+{
+	/* Pushes and pops go below the frame; slots off rbp are within it */
+	if (a->stack != b->stack) {
+		Node *other = a->stack ? b : a;
+		return other->mem.mem.base != RBP;
+	}
+
+	if (a->mem.kind == OPND_MEM && b->mem.kind == OPND_MEM && a->mem.mem.base == RBP && b->mem.mem.base == RBP
+			&& a->mem.mem.index == NOREG && b->mem.mem.index == NOREG) {
+		int64_t x = a->mem.mem.disp;
+		int64_t y = b->mem.mem.disp;
+		return x < y + b->mem.size && y < x + a->mem.size;
+	}
+
+	return true;
+}
+
+/*
+ * Whether one of two instructions moves rsp, other than by a push or pop,
+ * and the other accesses the frame off rbp: a prologue lowers rsp below the
+ * frame only after rbp is set, and until then a slot of it may be below rsp,
+ * where a signal handler may write.
+ */
+static bool moves(Node *a, Node *b)
+{
+	Node *nodes[2] = { a, b };
+
+	for (size_t i = 0; i < 2; ++i) {
+		Node *x = nodes[i];
+		Node *y = nodes[1 - i];
+
+		if ((x->writes & REGBIT(RSP)) && !x->stack && y->memacc && !y->stack && y->mem.kind == OPND_MEM && y->mem.mem.base == RBP) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * edges[j * n + i] is the latency after the issue of j at which i may issue,
+ * or -1 if i does not depend on j. Most instructions write the flags, and
+ * few of those writes are read; only those are ordered against other writes,
+ * and the last write of the block is taken to be read after it.
+ */
+static void depend(Sched *sched, Node *nodes, int16_t *edges)
+{
+	size_t n = sched->ninsns;
+
+	#define EDGE(j, i, l) do { \
+		if (edges[(j) * n + (i)] < 0) { \
+			++nodes[i].npreds; \
+		} \
+		if ((l) > edges[(j) * n + (i)]) { \
+			edges[(j) * n + (i)] = (l); \
+		} \
+	} while (0)
+
+	bool *live = acalloc(n, sizeof(bool));
+	size_t last = n;
+
+	for (size_t i = 0; i < n; ++i) {
+		Node *ni = &nodes[i];
+
+		for (size_t j = 0; j < i; ++j) {
+			Node *nj = &nodes[j];
+
+			if (nj->writes & ni->reads) {
+				EDGE(j, i, (int16_t)nj->lat);
+			}
+			if ((nj->reads & ni->writes) || (nj->writes & ni->writes)) {
+				EDGE(j, i, 0);
+			}
+
+			if (nj->memacc && ni->memacc && ((nj->memacc | ni->memacc) & A_W) && alias(nj, ni)) {
+				EDGE(j, i, (nj->memacc & A_W) && (ni->memacc & A_R) ? (int16_t)sched->tune->store : 0);
+			}
+
+			if (moves(nj, ni)) {
+				EDGE(j, i, 0);
+			}
+
+			if ((nj->flags & FL_R) && (ni->flags & FL_W)) {
+				EDGE(j, i, 0);
+			}
+		}
+
+		if ((ni->flags & FL_R) && last < n) {
+			EDGE(last, i, 1);
+			live[last] = true;
+		}
+
+		if (ni->flags & FL_W) {
+			last = i;
+		}
+	}
+
+	if (last < n) {
+		live[last] = true;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (!live[i]) {
+			continue;
+		}
+
+		for (size_t j = 0; j < i; ++j) {
+			if (nodes[j].flags & FL_W) {
+				EDGE(j, i, 0);
+			}
+		}
+	}
+
+	#undef EDGE
+
+	afree(live);
+}
@@ -0,0 +1,49 @@
+/*
+ * sched.h
+ *
+ * This file is part of awl
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "enc.h"
+
+/* Most instructions a block is scheduled in at once; longer blocks are split */
+#define SCHED_MAXBLOCK 128
+
+/* Latencies (in cycles) and issue width of a microarchitecture, as -mtune= selects */
+typedef struct Tune {
+	const char *name;
+	uint8_t width; /* instructions issued per cycle */
+	uint8_t load; /* L1 hit */
+	uint8_t store; /* store-to-load forwarding */
+	uint8_t imul;
+	uint8_t mul; /* one-operand mul and imul; rdx:rax */
+	uint8_t div32;
+	uint8_t div64;
+	uint8_t lea3; /* lea with base, index and displacement */
+	uint8_t xchgm; /* xchg with memory, which is locked */
+	uint8_t vmul; /* lane-wise multiplication; pmulld */
+	uint8_t bits; /* popcnt, lzcnt, tzcnt, bsf, bsr, pdep and pext */
+} Tune;
+
+/*
+ * Instructions are collected until the end of a basic block (a label, or an
+ * instruction that jumps or refers to a location, which is encoded in place),
+ * and then encoded in an order that respects their dependencies and starts
+ * the longest chains of latency first. Registers are allocated beforehand,
+ * so reordering never needs more of them.
+ */
+typedef struct Sched {
+	const Tune *tune;
+
+	Insn *insns;
+	size_t ninsns;
+} Sched;
+
+const Tune *sched_tune(const char *name);
+Sched *sched_new(const Tune *tune);
+bool sched_barrier(Insn insn);
+void sched_insn(Sched *sched, Enc *enc, Insn insn);
+void sched_flush(Sched *sched, Enc *enc);
@@ -6,8 +6,11 @@
 
 #include "type.h"
 
+#include <ctype.h>
+#include <stdio.h>
 #include <string.h>
 #include "vec.h"
+#include "strbuf.h"
 #include "err.h"
 #include "mem.h"
 
@@ -22,10 +25,26 @@ typedef enum primitive_kind {
 	PRIM_S32,
 	PRIM_S64,
 	PRIM_BOOL,
+	PRIM_U8X16,
+	PRIM_U16X8,
+	PRIM_U32X4,
+	PRIM_U64X2,
+	PRIM_S8X16,
+	PRIM_S16X8,
+	PRIM_S32X4,
+	PRIM_S64X2,
+	PRIM_U8X32,
+	PRIM_U16X16,
+	PRIM_U32X8,
+	PRIM_U64X4,
+	PRIM_S8X32,
+	PRIM_S16X16,
+	PRIM_S32X8,
+	PRIM_S64X4,
 } primitive_kind;
 
 static const Type *primitives[] = {
-#define PRIMADD(pk, nm, sz, sig) [pk] = &(Type) { .kind = TYPE_PRIMITIVE, .name = nm, .size = sz, .signd = sig }
+#define PRIMADD(pk, nm, sz, sig) [pk] = &(Type) { .kind = TYPE_PRIMITIVE, .name = nm, .size = sz, .align = (sz ? sz : 1), .signd = sig }
 	PRIMADD(PRIM_U0, "u0", 0, false),
 	PRIMADD(PRIM_U8, "u8", 1, false),
 	PRIMADD(PRIM_U16, "u16", 2, false),
@@ -37,29 +56,168 @@ static const Type *primitives[] = {
 	PRIMADD(PRIM_S64, "s64", 8, true),
 	PRIMADD(PRIM_BOOL, "bool", 1, false),
 #undef PRIMADD
+#define VECADD(pk, nm, lane, n, sz, sig) [pk] = &(Type) { .kind = TYPE_VECTOR, .name = nm, .size = sz, .align = sz, .signd = sig, .elem = lane, .length = n }
+	VECADD(PRIM_U8X16, "u8x16", PRIM_U8, 16, 16, false),
+	VECADD(PRIM_U16X8, "u16x8", PRIM_U16, 8, 16, false),
+	VECADD(PRIM_U32X4, "u32x4", PRIM_U32, 4, 16, false),
+	VECADD(PRIM_U64X2, "u64x2", PRIM_U64, 2, 16, false),
+	VECADD(PRIM_S8X16, "s8x16", PRIM_S8, 16, 16, true),
+	VECADD(PRIM_S16X8, "s16x8", PRIM_S16, 8, 16, true),
+	VECADD(PRIM_S32X4, "s32x4", PRIM_S32, 4, 16, true),
+	VECADD(PRIM_S64X2, "s64x2", PRIM_S64, 2, 16, true),
+	VECADD(PRIM_U8X32, "u8x32", PRIM_U8, 32, 32, false),
+	VECADD(PRIM_U16X16, "u16x16", PRIM_U16, 16, 32, false),
+	VECADD(PRIM_U32X8, "u32x8", PRIM_U32, 8, 32, false),
+	VECADD(PRIM_U64X4, "u64x4", PRIM_U64, 4, 32, false),
+	VECADD(PRIM_S8X32, "s8x32", PRIM_S8, 32, 32, true),
+	VECADD(PRIM_S16X16, "s16x16", PRIM_S16, 16, 32, true),
+	VECADD(PRIM_S32X8, "s32x8", PRIM_S32, 8, 32, true),
+	VECADD(PRIM_S64X4, "s64x4", PRIM_S64, 4, 32, true),
+#undef VECADD
 };
 static const size_t nprimitives = (sizeof(primitives) / sizeof(*primitives));
 
+/* Operations on vectors written as calls; a function of the same name hides one */
+static const struct {
+	const char *name;
+	unop op;
+} intrinsics[] = {
+	{ "splat", UNOP_SPLAT },
+	{ "lane", UNOP_LANE },
+	{ "shuffle", UNOP_SHUFFLE },
+	{ "hadd", UNOP_REDUCE_ADD },
+	{ "hand", UNOP_REDUCE_AND },
+	{ "hor", UNOP_REDUCE_OR },
+	{ "hxor", UNOP_REDUCE_XOR },
+	{ "mask", UNOP_MASK },
+};
+static const size_t nintrinsics = (sizeof(intrinsics) / sizeof(*intrinsics));
+
+/* Operations written as calls, each one instruction where the CPU has it; a function hides one too */
+static const struct {
+	const char *name;
+	t_node_variant variant;
+	int op; /* a unop, binop or builtin, as 'variant' says */
+	size_t nargs;
+} builtins[] = {
+	{ "popcount", TEXPRESSION_UNARY, UNOP_POPCOUNT, 1 },
+	{ "clz", TEXPRESSION_UNARY, UNOP_CLZ, 1 },
+	{ "ctz", TEXPRESSION_UNARY, UNOP_CTZ, 1 },
+	{ "bswap", TEXPRESSION_UNARY, UNOP_BSWAP, 1 },
+	{ "rotl", TEXPRESSION_BINARY, BINOP_ROTL, 2 },
+	{ "rotr", TEXPRESSION_BINARY, BINOP_ROTR, 2 },
+	{ "pdep", TEXPRESSION_BINARY, BINOP_PDEP, 2 },
+	{ "pext", TEXPRESSION_BINARY, BINOP_PEXT, 2 },
+	{ "rdtsc", TEXPRESSION_BUILTIN, BUILTIN_RDTSC, 0 },
+	{ "prefetch", TEXPRESSION_BUILTIN, BUILTIN_PREFETCH, 2 },
+	{ "stream", TEXPRESSION_BUILTIN, BUILTIN_STREAM, 2 },
+	{ "sfence", TEXPRESSION_BUILTIN, BUILTIN_SFENCE, 0 },
+	{ "load", TEXPRESSION_BUILTIN, BUILTIN_LOAD, 2 },
+	{ "store", TEXPRESSION_BUILTIN, BUILTIN_STORE, 3 },
+	{ "fetchadd", TEXPRESSION_BUILTIN, BUILTIN_FETCHADD, 3 },
+	{ "exchange", TEXPRESSION_BUILTIN, BUILTIN_EXCHANGE, 3 },
+	{ "cmpxchg", TEXPRESSION_BUILTIN, BUILTIN_CMPXCHG, 4 },
+};
+static const size_t nbuiltins = (sizeof(builtins) / sizeof(*builtins));
+
+/* Names of the orderings, as the last argument of an atomic builtin */
+static const char *orders[] = {
+	[ORDER_RELAXED] = "relaxed",
+	[ORDER_ACQUIRE] = "acquire",
+	[ORDER_RELEASE] = "release",
+	[ORDER_SEQCST] = "seqcst",
+};
+static const size_t norders = (sizeof(orders) / sizeof(*orders));
+
+/* Binary operator of each binary operator token */
+static const binop binops[_TOKEN_COUNT] = {
+	[TOKEN_PLUS] = BINOP_ADD,
+	[TOKEN_MINUS] = BINOP_SUB,
+	[TOKEN_STAR] = BINOP_MUL,
+	[TOKEN_SLASH] = BINOP_DIV,
+	[TOKEN_PERCENT] = BINOP_MOD,
+	[TOKEN_AMP] = BINOP_AND,
+	[TOKEN_PIPE] = BINOP_OR,
+	[TOKEN_CARET] = BINOP_XOR,
+	[TOKEN_SHL] = BINOP_SHL,
+	[TOKEN_SHR] = BINOP_SHR,
+	[TOKEN_EQ] = BINOP_EQ,
+	[TOKEN_NE] = BINOP_NE,
+	[TOKEN_LT] = BINOP_LT,
+	[TOKEN_LE] = BINOP_LE,
+	[TOKEN_GT] = BINOP_GT,
+	[TOKEN_GE] = BINOP_GE,
+};
+
+static void check_structs(Typechecker *tc);
+static void layout(Typechecker *tc, size_t ndx, uint8_t *state);
+static void check_globals(Typechecker *tc);
 static typendx check_type(Typechecker *tc, PType *ptype);
+static typendx find_array(Typechecker *tc, typendx elem, size_t length, bool soa);
+static typendx find_slice(Typechecker *tc, typendx elem);
+static bool shared(Typechecker *tc, TExpression *place);
+static void notwhole(Typechecker *tc, Span span, typendx type);
+static TExpression *check_place(Typechecker *tc, PExpression *pexpression, scopendx scope, bool share);
 static TVariable *check_variable(Typechecker *tc, PVariable *pvar, scopendx scope);
-static TExpression *check_expression(Typechecker *tc, PExpression *pexpression, typendx ex);
-static TStatement *check_statement(Typechecker *tc, PStatement *pstatement);
+static typendx infer_expression(Typechecker *tc, PExpression *pexpression, scopendx scope);
+static TExpression *check_expression(Typechecker *tc, PExpression *pexpression, typendx ex, scopendx scope);
+static void check_args(Typechecker *tc, PCall *pcall, funndx fun, TCall *tcall, scopendx scope);
+static int find_intrinsic(Typechecker *tc, PCall *pcall);
+static typendx infer_intrinsic(Typechecker *tc, PCall *pcall, int intrinsic, scopendx scope);
+static void check_intrinsic(Typechecker *tc, PCall *pcall, int intrinsic, TExpression *texpression, scopendx scope);
+static void veccompat(Typechecker *tc, Token optoken, binop op, typendx ndx);
+static int find_builtin(Typechecker *tc, PCall *pcall);
+static typendx infer_builtin(Typechecker *tc, PCall *pcall, int builtin, scopendx scope);
+static void check_builtin(Typechecker *tc, PCall *pcall, int builtin, TExpression *texpression, scopendx scope);
+static TExpression *check_builtin_place(Typechecker *tc, PCall *pcall, scopendx scope);
+static void check_atomic(Typechecker *tc, PCall *pcall, TBuiltin *tbuiltin, TExpression *place, scopendx scope);
+static uint64_t check_literal(Typechecker *tc, PExpression *pexpression, typendx type, const char *what);
+static TSwitch *check_switch(Typechecker *tc, PSwitch *pswitch, scopendx scope);
+static TIf *check_if(Typechecker *tc, PIf *pif, scopendx scope);
+static TAssign *check_var(Typechecker *tc, PVar *pvar, scopendx scope);
+static TAssign *check_assign(Typechecker *tc, PAssign *passign, scopendx scope);
+static TStore *check_store(Typechecker *tc, PAssign *passign, scopendx scope);
+static TWhile *check_while(Typechecker *tc, PWhile *pwhile, scopendx scope);
+static bool hascall(TExpression *expression);
+static TAsm *check_asm(Typechecker *tc, PAsm *pasm, scopendx scope);
+static TStatement *check_statement(Typechecker *tc, PStatement *pstatement, scopendx scope);
 static TBlock *check_block(Typechecker *tc, PBlock *pblock, scopendx scope);
 static TFun *check_fun(Typechecker *tc, PFun *pfun);
+static void check_fun_block(Typechecker *tc, TFun *tfun, PFun *pfun);
+static typendx infer_typearg(Typechecker *tc, PFun *generic, size_t param, PCall *pcall, scopendx scope);
+static funndx instantiate(Typechecker *tc, int generic, typendx *typeargs);
+static funndx resolve_call(Typechecker *tc, PCall *pcall, scopendx scope);
+static bool maytrap(Typechecker *tc, TBinary *binary);
+static effect effect_expr(Typechecker *tc, TExpression *expression, bool *total);
+static effect effect_block(Typechecker *tc, TBlock *block, bool *total);
+static void check_effects(Typechecker *tc);
+
+static size_t value_hash(TExpression *expression);
+static bool value_equal(TExpression *a, TExpression *b);
+static TExpression *value_intern(Typechecker *tc, TExpression *expression);
+static void value_reset(Typechecker *tc);
 
 static void add_variable(Typechecker *tc, TVariable *tvar, scopendx scope);
 static void add_fun(Typechecker *tc, TFun *tfun);
 
 static typendx find_type_name(Typechecker *tc, Token name);
 static varndx find_variable(Typechecker *tc, Token iden, scopendx scope);
+static globalndx find_global(Typechecker *tc, Token iden);
 static funndx find_fun(Typechecker *tc, Token iden);
+static int find_generic(Typechecker *tc, Token iden);
 
 static scopendx scope_add(Typechecker *tc, scopendx parent);
 static Scope *scope_get(Typechecker *tc, scopendx scope);
 
+/* A literal where a vector is expected is that value in every lane */
 static void numcompat(Typechecker *tc, Number *n, typendx ndx)
 {
 	Type *t = tc->tfile->types[ndx];
+
+	if (t->kind == TYPE_VECTOR) {
+		t = tc->tfile->types[t->elem];
+	}
+
 	size_t tbits = t->size * 8;
 	
 	if (n->bits > tbits) {
@@ -67,19 +225,50 @@ static void numcompat(Typechecker *tc, Number *n, typendx ndx)
 	}
 }
 
+static void typecompat(Typechecker *tc, Span span, typendx got, typendx ex)
+{
+	if (ex != NONDX && got != ex) {
+		const char *gotname = tc->tfile->types[got]->name;
+		const char *exname = tc->tfile->types[ex]->name;
+		err_source(tc->file, span, "type mismatch; expected '%s' but got '%s'", exname, gotname);
+	}
+}
+
+/* Whether an operator may be applied to operands of some type */
+static void opcompat(Typechecker *tc, Token op, bool arith, typendx ndx)
+{
+	Type *t = tc->tfile->types[ndx];
+
+	if (ndx == PRIM_U0 || (arith && ndx == PRIM_BOOL)) {
+		err_source(tc->file, op.span, "operator '%s' cannot be applied to type '%s'", op.content, t->name);
+	}
+}
+
 Typechecker *typechecker_new()
 {
 	Typechecker *tc = alloct(Typechecker);
 	tc->file = NULL;
 	tc->pfile = NULL;
 	tc->tfile = NULL;
+	tc->wide = false;
+	tc->cloned = false;
+	tc->generics = NULL;
+	tc->ngenerics = 0;
+	tc->instances = NULL;
+	tc->ninstances = 0;
+	tc->nchecked = 0;
+	tc->generic = NULL;
+	tc->typeargs = NULL;
+	tc->values = NULL;
+	tc->nvalues = 0;
+	tc->valuecap = 0;
 
 	return tc;
 }
 
-TFile *typechecker_run(Typechecker *tc, File *file, PFile *pfile)
+/* Check a program, whose functions may come from several files; they share one namespace */
+TFile *typechecker_run(Typechecker *tc, PFile *pfile)
 {
-	tc->file = file;
 	tc->pfile = pfile;
 	tc->tfile = alloct(TFile);
 
@@ -91,6 +280,8 @@ TFile *typechecker_run(Typechecker *tc, File *file, PFile *pfile)
 	tc->tfile->funret = NONDX;
 	tc->tfile->tvariables = 0;
 	tc->tfile->ntvariables = 0;
+	tc->tfile->tglobals = NULL;
+	tc->tfile->ntglobals = 0;
 	tc->tfile->types = NULL;
 	tc->tfile->ntypes = 0;
 
@@ -100,12 +291,62 @@ TFile *typechecker_run(Typechecker *tc, File *file, PFile *pfile)
 	/* Create the root scope */
 	scope_add(tc, NONDX);
 
-	/* Check functions */
+	check_structs(tc);
+	check_globals(tc);
+
+	/*
+	 * Check function signatures first, so that functions may be called before
+	 * (or from within) their own definition
+	 */
 	for (size_t i = 0; i < pfile->npfuns; ++i) {
-		TFun *tfun = check_fun(tc, pfile->pfuns[i]);
+		PFun *pfun = pfile->pfuns[i];
+		Token iden = pfun->identifier;
+		tc->file = pfun->file;
+
+		if (find_generic(tc, iden) != NONDX) {
+			err_source(tc->file, iden.span, "redefinition of function '%s'", iden.content);
+		}
+
+		if (pfun->ntypeparams > 0) {
+			if (find_fun(tc, iden) != NONDX) {
+				err_source(tc->file, iden.span, "redefinition of function '%s'", iden.content);
+			}
+
+			vec_push(tc->generics, &pfun, &tc->ngenerics, sizeof(PFun *));
+			continue;
+		}
+
+		TFun *tfun = check_fun(tc, pfun);
 		add_fun(tc, tfun);
 	}
 
+	/* Check function blocks; generic functions have no TFun of their own */
+	funndx ndx = 0;
+	for (size_t i = 0; i < pfile->npfuns; ++i) {
+		if (pfile->pfuns[i]->ntypeparams > 0) {
+			continue;
+		}
+
+		tc->file = pfile->pfuns[i]->file;
+		check_fun_block(tc, tc->tfile->tfuns[ndx++], pfile->pfuns[i]);
+	}
+
+	/* Check the blocks of instances, which may instantiate more as they are checked */
+	while (tc->nchecked < tc->ninstances) {
+		Instance *instance = &tc->instances[tc->nchecked++];
+		PFun *generic = tc->generics[instance->generic];
+
+		tc->file = generic->file;
+		tc->generic = generic;
+		tc->typeargs = instance->typeargs;
+		check_fun_block(tc, tc->tfile->tfuns[instance->fun], generic);
+	}
+
+	tc->generic = NULL;
+	tc->typeargs = NULL;
+
+	check_effects(tc);
+
 	return tc->tfile;
 }
 
@@ -114,6 +355,296 @@ void typechecker_reset(Typechecker *tc)
 	tc->file = NULL;
 	tc->pfile = NULL;
 	tc->tfile = NULL;
+	tc->generics = NULL;
+	tc->ngenerics = 0;
+	tc->instances = NULL;
+	tc->ninstances = 0;
+	tc->nchecked = 0;
+	tc->generic = NULL;
+	tc->typeargs = NULL;
+	value_reset(tc);
+}
+
+TExpression *texpression_copy(TExpression *expression, const varndx *vars, TExpression **values, size_t nvars)
+{
+	if (expression->variant == TEXPRESSION_VARIABLE) {
+		for (size_t i = 0; i < nvars; ++i) {
+			if (expression->var == vars[i]) {
+				++values[i]->uses;
+				return values[i];
+			}
+		}
+	}
+
+	TExpression *copy = alloct(TExpression);
+	*copy = *expression;
+	copy->uses = 1;
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			copy->call = alloct(TCall);
+			copy->call->fun = expression->call->fun;
+			copy->call->args = NULL;
+			copy->call->nargs = 0;
+
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				TExpression *arg = texpression_copy(expression->call->args[i], vars, values, nvars);
+				vec_push(copy->call->args, &arg, &copy->call->nargs, sizeof(TExpression *));
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			copy->binary = alloct(TBinary);
+			copy->binary->op = expression->binary->op;
+			copy->binary->lhs = texpression_copy(expression->binary->lhs, vars, values, nvars);
+			copy->binary->rhs = texpression_copy(expression->binary->rhs, vars, values, nvars);
+			break;
+		}
+		case TEXPRESSION_UNARY: {
+			copy->unary = alloct(TUnary);
+			*copy->unary = *expression->unary;
+			copy->unary->operand = texpression_copy(expression->unary->operand, vars, values, nvars);
+			break;
+		}
+		case TEXPRESSION_FIELD: {
+			copy->field = alloct(TField);
+			*copy->field = *expression->field;
+			copy->field->base = texpression_copy(expression->field->base, vars, values, nvars);
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			copy->index = alloct(TIndex);
+			*copy->index = *expression->index;
+			copy->index->base = texpression_copy(expression->index->base, vars, values, nvars);
+			copy->index->index = texpression_copy(expression->index->index, vars, values, nvars);
+			break;
+		}
+		case TEXPRESSION_BUILTIN: {
+			copy->builtin = alloct(TBuiltin);
+			copy->builtin->op = expression->builtin->op;
+			copy->builtin->order = expression->builtin->order;
+			copy->builtin->args = NULL;
+			copy->builtin->nargs = 0;
+
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				TExpression *arg = texpression_copy(expression->builtin->args[i], vars, values, nvars);
+				vec_push(copy->builtin->args, &arg, &copy->builtin->nargs, sizeof(TExpression *));
+			}
+			break;
+		}
+		default: break;
+	}
+
+	return copy;
+}
+
+/*
+ * Declare every struct first, so that fields may be of any of them, then lay
+ * each out. Structs follow the primitives in the TFile's types, in order of
+ * declaration.
+ */
+static void check_structs(Typechecker *tc)
+{
+	PFile *pfile = tc->pfile;
+
+	for (size_t i = 0; i < pfile->npstructs; ++i) {
+		Token iden = pfile->pstructs[i]->identifier;
+		tc->file = pfile->pstructs[i]->file;
+
+		if (find_type_name(tc, iden) != NONDX) {
+			err_source(tc->file, iden.span, "redefinition of type '%s'", iden.content);
+		}
+
+		Type *type = alloct(Type);
+		type->kind = TYPE_STRUCT;
+		type->name = iden.content;
+		type->size = 0;
+		type->align = 1;
+		type->signd = false;
+		type->fields = NULL;
+		type->nfields = 0;
+		type->elem = NONDX;
+		type->length = 0;
+		type->soa = false;
+		type->columns = NULL;
+
+		vec_push(tc->tfile->types, &type, &tc->tfile->ntypes, sizeof(Type *));
+	}
+
+	/* 0: not laid out, 1: being laid out, 2: laid out */
+	uint8_t *state = acalloc(pfile->npstructs + 1, sizeof(uint8_t));
+
+	for (size_t i = 0; i < pfile->npstructs; ++i) {
+		layout(tc, i, state);
+	}
+
+	afree(state);
+}
+
+/*
+ * Lay out the i-th struct, and first those its fields are of. Each field is
+ * placed at the next offset its alignment allows (1 where the struct is
+ * packed), and the whole is as aligned as its most aligned field, or as
+ * align(N) asks if that is more, and padded to a multiple of that. Where it
+ * may be reordered, fields are placed most aligned first, which leaves no
+ * padding between them, as every alignment is a power of two.
+ */
+static void layout(Typechecker *tc, size_t ndx, uint8_t *state)
+{
+	PStruct *pstruct = tc->pfile->pstructs[ndx];
+	Type *type = tc->tfile->types[nprimitives + ndx];
+
+	if (state[ndx] == 2) {
+		return;
+	}
+
+	tc->file = pstruct->file;
+	state[ndx] = 1;
+
+	if (!pstruct->nfields) {
+		err_source(tc->file, pstruct->identifier.span, "struct '%s' has no fields", type->name);
+	}
+
+	for (size_t i = 0; i < pstruct->nfields; ++i) {
+		PVariable *pfield = pstruct->fields[i];
+
+		/* An array's size is that of its elements, so a struct they are must be laid out first */
+		PType *named = pfield->type;
+		while (named->variant == PTYPE_ARRAY) {
+			named = named->array->elem;
+		}
+
+		typendx inner = check_type(tc, named);
+		Type *it = tc->tfile->types[inner];
+
+		if (it->kind == TYPE_STRUCT) {
+			if (state[inner - nprimitives] == 1) {
+				err_source(tc->file, named->span, "struct '%s' cannot contain itself", it->name);
+			}
+
+			layout(tc, inner - nprimitives, state);
+			tc->file = pstruct->file;
+		}
+
+		typendx ftype = check_type(tc, pfield->type);
+		if (ftype == PRIM_U0) {
+			err_source(tc->file, pfield->type->span, "field cannot be of type 'u0'");
+		}
+
+		if (tc->tfile->types[ftype]->kind == TYPE_SLICE) {
+			err_source(tc->file, pfield->type->span, "slices can only be parameters");
+		}
+
+		Field field = {
+			.identifier = pfield->identifier,
+			.type = ftype,
+			.offset = 0,
+		};
+		vec_push(type->fields, &field, &type->nfields, sizeof(Field));
+	}
+
+	/* Order of placement; a stable sort keeps fields of equal alignment in order of declaration */
+	size_t *order = acalloc(type->nfields, sizeof(size_t));
+	for (size_t i = 0; i < type->nfields; ++i) {
+		size_t j = i;
+		size_t a = tc->tfile->types[type->fields[i].type]->align;
+
+		while (pstruct->reorder && j > 0 && tc->tfile->types[type->fields[order[j - 1]].type]->align < a) {
+			order[j] = order[j - 1];
+			--j;
+		}
+
+		order[j] = i;
+	}
+
+	size_t offset = 0;
+	size_t align = 1;
+
+	for (size_t i = 0; i < type->nfields; ++i) {
+		Field *field = &type->fields[order[i]];
+		Type *ft = tc->tfile->types[field->type];
+		size_t a = pstruct->packed ? 1 : ft->align;
+
+		offset = (offset + a - 1) & ~(a - 1);
+		field->offset = offset;
+		offset += ft->size;
+		align = a > align ? a : align;
+
+		if (offset > TYPE_MAXSIZE) {
+			err_source(tc->file, pstruct->identifier.span, "struct '%s' is larger than %d bytes", type->name, TYPE_MAXSIZE);
+		}
+	}
+
+	afree(order);
+
+	if (pstruct->align) {
+		Number *n = pstruct->align;
+
+		if (n->u64 == 0 || (n->u64 & (n->u64 - 1)) || n->u64 > TYPE_MAXALIGN) {
+			err_source(tc->file, n->span, "alignment must be a power of two, at most %d", TYPE_MAXALIGN);
+		}
+
+		align = n->u64 > align ? n->u64 : align;
+	}
+
+	type->align = align;
+	type->size = (offset + align - 1) & ~(align - 1);
+	state[ndx] = 2;
+}
+
+/*
+ * Check the thread-locals, after the structs, which they may be of. There is
+ * one namespace for them, which locals hide, so a function reads one only
+ * where it has no variable of the same name.
+ */
+static void check_globals(Typechecker *tc)
+{
+	PFile *pfile = tc->pfile;
+
+	for (size_t i = 0; i < pfile->npglobals; ++i) {
+		PVar *pvar = pfile->pglobals[i]->var;
+		Token iden = pvar->var->identifier;
+		tc->file = pfile->pglobals[i]->file;
+
+		if (find_global(tc, iden) != NONDX) {
+			err_source(tc->file, iden.span, "redefinition of thread-local '%s'", iden.content);
+		}
+
+		typendx type = check_type(tc, pvar->var->type);
+		Type *t = tc->tfile->types[type];
+
+		if (t->kind == TYPE_SLICE || type == PRIM_U0) {
+			err_source(tc->file, pvar->var->type->span, "a thread-local cannot be of type '%s'", t->name);
+		}
+
+		TGlobal *tglobal = alloct(TGlobal);
+		tglobal->file = tc->file;
+		tglobal->identifier = iden;
+		tglobal->type = type;
+		tglobal->align = 0;
+		tglobal->value = 0;
+
+		if (pvar->value) {
+			if (type < PRIM_U8 || type > PRIM_S64) {
+				err_source(tc->file, pvar->value->span, "only integer thread-locals take an initial value; others start zeroed");
+			}
+
+			uint64_t v = check_literal(tc, pvar->value, type, "initial value");
+			tglobal->value = t->size == 8 ? v : v & (((uint64_t)1 << (t->size * 8)) - 1);
+		}
+
+		if (pvar->align) {
+			Number *n = pvar->align;
+
+			if (n->u64 == 0 || (n->u64 & (n->u64 - 1)) || n->u64 > TYPE_MAXALIGN) {
+				err_source(tc->file, n->span, "alignment must be a power of two, at most %d", TYPE_MAXALIGN);
+			}
+
+			tglobal->align = n->u64 > t->align ? n->u64 : 0;
+		}
+
+		vec_push(tc->tfile->tglobals, &tglobal, &tc->tfile->ntglobals, sizeof(TGlobal *));
+	}
 }
 
 static typendx check_type(Typechecker *tc, PType *ptype)
@@ -126,60 +657,1406 @@ static typendx check_type(Typechecker *tc, PType *ptype)
 				err_source(tc->file, name.span, "unknown typename '%s'", name.content);
 			}
 
-			return ndx;
+			/* Only AVX2 has instructions for YMM registers */
+			Type *t = tc->tfile->types[ndx];
+			if (t->kind == TYPE_VECTOR && t->size == 32 && tc->cloned) {
+				err_source(tc->file, name.span, "'%s' needs AVX2, which the \"x86-64\" clone lacks", t->name);
+			} else if (t->kind == TYPE_VECTOR && t->size == 32 && !tc->wide) {
+				err_source(tc->file, name.span, "'%s' needs AVX2; use -march=x86-64-v3", t->name);
+			}
+
+			return ndx;
+		}
+		case PTYPE_ARRAY: {
+			PArray *parray = ptype->array;
+			typendx elem = check_type(tc, parray->elem);
+			Type *et = tc->tfile->types[elem];
+			Number *n = parray->length;
+
+			if (elem == PRIM_U0) {
+				err_source(tc->file, parray->elem->span, "array element cannot be of type 'u0'");
+			}
+
+			if (et->kind == TYPE_SLICE) {
+				err_source(tc->file, parray->elem->span, "slices can only be parameters");
+			}
+
+			if (!n) {
+				return find_slice(tc, elem);
+			}
+
+			if (n->u64 == 0) {
+				err_source(tc->file, n->span, "array length must be positive");
+			}
+
+			if (parray->soa && et->kind != TYPE_STRUCT) {
+				err_source(tc->file, ptype->span, "soa needs an array of structs, not of '%s'", et->name);
+			}
+
+			/* Leaving room for the padding of soa columns, at most TYPE_MAXALIGN each */
+			size_t room = TYPE_MAXSIZE - (parray->soa ? et->nfields * TYPE_MAXALIGN : 0);
+			if (n->u64 > room / et->size) {
+				err_source(tc->file, ptype->span, "array is larger than %d bytes", TYPE_MAXSIZE);
+			}
+
+			return find_array(tc, elem, n->u64, parray->soa);
+		}
+		default: break;
+	}
+
+	return NONDX;
+}
+
+/*
+ * The array type of some elements, made if there is none yet. Elements are
+ * laid out one after another, unless the array is soa: then each field of
+ * the element struct has a column of its own, of as many values as there
+ * are elements, starting on a TYPE_SOAALIGN boundary (or the field's own
+ * alignment, if more). A loop over one field then reads that field alone,
+ * and a vector's worth of it at once.
+ */
+static typendx find_array(Typechecker *tc, typendx elem, size_t length, bool soa)
+{
+	for (size_t i = 0; i < tc->tfile->ntypes; ++i) {
+		Type *t = tc->tfile->types[i];
+
+		if (t->kind == TYPE_ARRAY && t->elem == elem && t->length == length && t->soa == soa) {
+			return i;
+		}
+	}
+
+	Type *et = tc->tfile->types[elem];
+
+	size_t namelen = strlen(et->name) + 32;
+	char *name = acalloc(namelen, sizeof(char));
+	snprintf(name, namelen, "%s[%zu]%s", soa ? "soa " : "", length, et->name);
+
+	Type *type = alloct(Type);
+	type->kind = TYPE_ARRAY;
+	type->name = name;
+	type->size = length * et->size;
+	type->align = et->align;
+	type->signd = false;
+	type->fields = NULL;
+	type->nfields = 0;
+	type->elem = elem;
+	type->length = length;
+	type->soa = soa;
+	type->columns = NULL;
+
+	if (soa) {
+		size_t offset = 0;
+		size_t align = TYPE_SOAALIGN;
+		type->columns = acalloc(et->nfields, sizeof(size_t));
+
+		for (size_t i = 0; i < et->nfields; ++i) {
+			Type *ft = tc->tfile->types[et->fields[i].type];
+			size_t a = ft->align > TYPE_SOAALIGN ? ft->align : TYPE_SOAALIGN;
+
+			offset = (offset + a - 1) & ~(a - 1);
+			type->columns[i] = offset;
+			offset += length * ft->size;
+			align = a > align ? a : align;
+		}
+
+		type->align = align;
+		type->size = (offset + align - 1) & ~(align - 1);
+	}
+
+	typendx ndx = tc->tfile->ntypes;
+	vec_push(tc->tfile->types, &type, &tc->tfile->ntypes, sizeof(Type *));
+
+	return ndx;
+}
+
+/* The slice type of some elements, made if there is none yet; a slice is held as a pointer to the first */
+static typendx find_slice(Typechecker *tc, typendx elem)
+{
+	for (size_t i = 0; i < tc->tfile->ntypes; ++i) {
+		Type *t = tc->tfile->types[i];
+
+		if (t->kind == TYPE_SLICE && t->elem == elem) {
+			return i;
+		}
+	}
+
+	Type *et = tc->tfile->types[elem];
+
+	size_t namelen = strlen(et->name) + 3;
+	char *name = acalloc(namelen, sizeof(char));
+	snprintf(name, namelen, "[]%s", et->name);
+
+	Type *type = alloct(Type);
+	type->kind = TYPE_SLICE;
+	type->name = name;
+	type->size = 8;
+	type->align = 8;
+	type->signd = false;
+	type->fields = NULL;
+	type->nfields = 0;
+	type->elem = elem;
+	type->length = 0;
+	type->soa = false;
+	type->columns = NULL;
+
+	typendx ndx = tc->tfile->ntypes;
+	vec_push(tc->tfile->types, &type, &tc->tfile->ntypes, sizeof(Type *));
+
+	return ndx;
+}
+
+/* Whether a place is in memory other functions see: in a slice, or in a thread-local */
+static bool shared(Typechecker *tc, TExpression *place)
+{
+	while (place->variant == TEXPRESSION_FIELD || place->variant == TEXPRESSION_INDEX) {
+		place = place->variant == TEXPRESSION_FIELD ? place->field->base : place->index->base;
+	}
+
+	return place->variant == TEXPRESSION_GLOBAL || tc->tfile->types[place->type]->kind == TYPE_SLICE;
+}
+
+/*
+ * Structs and arrays are used through their fields and elements only; they
+ * are never values of their own. Nor are slices, which may be passed on as
+ * well, but only as arguments; see check_args().
+ */
+static void notwhole(Typechecker *tc, Span span, typendx type)
+{
+	Type *t = tc->tfile->types[type];
+
+	if (t->kind == TYPE_STRUCT) {
+		err_source(tc->file, span, "struct '%s' can only be used through its fields", t->name);
+	} else if (t->kind == TYPE_ARRAY) {
+		err_source(tc->file, span, "array '%s' can only be used through its elements", t->name);
+	} else if (t->kind == TYPE_SLICE) {
+		err_source(tc->file, span, "slice '%s' can only be used through its elements and length, or passed on", t->name);
+	}
+}
+
+/*
+ * A variable, or a field or element of one, which may be of struct or array
+ * type. Nodes are interned as values are unless 'share' is false; a store
+ * must have a place of its own, whose address it computes instead of reading
+ * it. A constant index is checked here, and needs no check at run time.
+ */
+static TExpression *check_place(Typechecker *tc, PExpression *pexpression, scopendx scope, bool share)
+{
+	TExpression *texpression = alloct(TExpression);
+	texpression->variant = _TNODE_NULL;
+	texpression->type = NONDX;
+	texpression->uses = 1;
+	texpression->number = NULL;
+
+	switch (pexpression->variant) {
+		case PEXPRESSION_IDENTIFIER: {
+			Token iden = pexpression->identifier;
+			varndx ndx = find_variable(tc, iden, scope);
+			globalndx global = ndx == NONDX ? find_global(tc, iden) : NONDX;
+
+			if (global != NONDX) {
+				texpression->variant = TEXPRESSION_GLOBAL;
+				texpression->global = global;
+				texpression->type = tc->tfile->tglobals[global]->type;
+				break;
+			}
+
+			if (ndx == NONDX) {
+				err_source(tc->file, iden.span, "unknown variable '%s'", iden.content);
+			}
+
+			texpression->variant = TEXPRESSION_VARIABLE;
+			texpression->var = ndx;
+			texpression->type = tc->tfile->tvariables[ndx]->type;
+			break;
+		}
+		case PEXPRESSION_FIELD: {
+			PField *pfield = pexpression->field;
+			TExpression *base = check_place(tc, pfield->base, scope, false);
+			Type *t = tc->tfile->types[base->type];
+
+			/* The length of a slice is a parameter of its own */
+			if (t->kind == TYPE_SLICE) {
+				if (strcmp(pfield->field.content, "len")) {
+					err_source(tc->file, pfield->field.span, "slice '%s' has no field '%s'", t->name, pfield->field.content);
+				}
+
+				texpression->variant = TEXPRESSION_VARIABLE;
+				texpression->var = tc->tfile->tvariables[base->var]->length;
+				texpression->type = PRIM_U64;
+				afree(base);
+				break;
+			}
+
+			if (t->kind != TYPE_STRUCT) {
+				err_source(tc->file, pfield->field.span, "type '%s' has no fields", t->name);
+			}
+
+			size_t i = 0;
+			while (i < t->nfields && strcmp(t->fields[i].identifier.content, pfield->field.content)) {
+				++i;
+			}
+
+			if (i == t->nfields) {
+				err_source(tc->file, pfield->field.span, "struct '%s' has no field '%s'", t->name, pfield->field.content);
+			}
+
+			/* A field of an element of an soa array is an element of the field's column */
+			Type *array = base->variant == TEXPRESSION_INDEX ? tc->tfile->types[base->index->base->type] : NULL;
+			if (array && array->soa && base->type == array->elem) {
+				base->index->offset = array->columns[i];
+				base->index->stride = tc->tfile->types[t->fields[i].type]->size;
+				base->type = t->fields[i].type;
+
+				afree(texpression);
+				texpression = base;
+				break;
+			}
+
+			base = value_intern(tc, base);
+
+			TField *tfield = alloct(TField);
+			tfield->base = base;
+			tfield->field = i;
+			tfield->offset = t->fields[i].offset;
+
+			texpression->variant = TEXPRESSION_FIELD;
+			texpression->field = tfield;
+			texpression->type = t->fields[i].type;
+			break;
+		}
+		case PEXPRESSION_INDEX: {
+			PIndex *pindex = pexpression->index;
+			TExpression *base = check_place(tc, pindex->base, scope, true);
+			Type *t = tc->tfile->types[base->type];
+
+			if (t->kind != TYPE_ARRAY && t->kind != TYPE_SLICE) {
+				err_source(tc->file, pexpression->span, "type '%s' cannot be indexed", t->name);
+			}
+
+			typendx itype = infer_expression(tc, pindex->index, scope);
+			if (itype == NONDX) {
+				itype = PRIM_U64;
+			}
+
+			if (tc->tfile->types[itype]->kind != TYPE_PRIMITIVE || itype == PRIM_U0 || itype == PRIM_BOOL) {
+				err_source(tc->file, pindex->index->span, "array index must be an integer, not '%s'", tc->tfile->types[itype]->name);
+			}
+
+			TIndex *tindex = alloct(TIndex);
+			tindex->base = base;
+			tindex->index = check_expression(tc, pindex->index, itype, scope);
+			tindex->stride = tc->tfile->types[t->elem]->size;
+			tindex->offset = 0;
+			tindex->length = t->length;
+			tindex->checked = true;
+
+			/* The length of a slice is only known at run time */
+			if (tindex->index->variant == TEXPRESSION_NUMLIT && t->kind == TYPE_ARRAY) {
+				if (tindex->index->number->u64 >= t->length) {
+					err_source(tc->file, pindex->index->span, "index %lu is out of bounds of '%s'", tindex->index->number->u64, t->name);
+				}
+
+				tindex->checked = false;
+			}
+
+			texpression->variant = TEXPRESSION_INDEX;
+			texpression->index = tindex;
+			texpression->type = t->elem;
+			break;
+		}
+		default: err_source(tc->file, pexpression->span, "cannot assign to expression");
+	}
+
+	return share ? value_intern(tc, texpression) : texpression;
+}
+
+static TVariable *check_variable(Typechecker *tc, PVariable *pvar, scopendx scope)
+{
+	TVariable *tvariable = alloct(TVariable);
+	tvariable->identifier = pvar->identifier;
+	tvariable->type = NONDX;
+	tvariable->length = NONDX;
+	tvariable->align = 0;
+
+	{
+		Token iden = tvariable->identifier;
+		varndx ndx = NONDX;
+		if ((ndx = find_variable(tc, iden, scope)) != NONDX) {
+			err_source(tc->file, iden.span, "redefinition of variable '%s'", iden.content);
+		}
+	}
+
+	tvariable->type = check_type(tc, pvar->type);
+
+	return tvariable;
+}
+
+/*
+ * The type of an expression regardless of where it appears, or NONDX where it
+ * takes its type from its context (e.g. numeric literals)
+ */
+static typendx infer_expression(Typechecker *tc, PExpression *pexpression, scopendx scope)
+{
+	switch (pexpression->variant) {
+		case PEXPRESSION_IDENTIFIER: {
+			varndx ndx = find_variable(tc, pexpression->identifier, scope);
+			globalndx global = ndx == NONDX ? find_global(tc, pexpression->identifier) : NONDX;
+
+			if (global != NONDX) {
+				return tc->tfile->tglobals[global]->type;
+			}
+
+			return ndx == NONDX ? NONDX : tc->tfile->tvariables[ndx]->type;
+		}
+		case PEXPRESSION_CALL: {
+			int intrinsic = find_intrinsic(tc, pexpression->call);
+			if (intrinsic != NONDX) {
+				return infer_intrinsic(tc, pexpression->call, intrinsic, scope);
+			}
+
+			int builtin = find_builtin(tc, pexpression->call);
+			if (builtin != NONDX) {
+				return infer_builtin(tc, pexpression->call, builtin, scope);
+			}
+
+			funndx ndx = resolve_call(tc, pexpression->call, scope);
+			return tc->tfile->tfuns[ndx]->rettype;
+		}
+		case PEXPRESSION_BINARY: {
+			typendx lhs = infer_expression(tc, pexpression->binary->lhs, scope);
+			if (lhs == NONDX) {
+				lhs = infer_expression(tc, pexpression->binary->rhs, scope);
+			}
+
+			/* Vectors are compared lane by lane, into a vector of masks */
+			if (binops[pexpression->binary->op.kind] >= BINOP_EQ) {
+				return lhs != NONDX && tc->tfile->types[lhs]->kind == TYPE_VECTOR ? lhs : PRIM_BOOL;
+			}
+
+			return lhs;
+		}
+		case PEXPRESSION_UNARY: return infer_expression(tc, pexpression->unary->operand, scope);
+		case PEXPRESSION_FIELD: {
+			typendx base = infer_expression(tc, pexpression->field->base, scope);
+			Type *t = base == NONDX ? NULL : tc->tfile->types[base];
+
+			if (t && t->kind == TYPE_SLICE) {
+				return PRIM_U64;
+			}
+
+			for (size_t i = 0; t && i < t->nfields; ++i) {
+				if (!strcmp(t->fields[i].identifier.content, pexpression->field->field.content)) {
+					return t->fields[i].type;
+				}
+			}
+
+			return NONDX;
+		}
+		case PEXPRESSION_INDEX: {
+			typendx base = infer_expression(tc, pexpression->index->base, scope);
+			Type *t = base == NONDX ? NULL : tc->tfile->types[base];
+
+			return t && (t->kind == TYPE_ARRAY || t->kind == TYPE_SLICE) ? t->elem : NONDX;
+		}
+		default: return NONDX;
+	}
+}
+
+static TExpression *check_expression(Typechecker *tc, PExpression *pexpression, typendx ex, scopendx scope)
+{
+	TExpression *texpression = alloct(TExpression);
+	texpression->variant = _TNODE_NULL;
+	texpression->type = ex;
+	texpression->uses = 1;
+	texpression->number = NULL;
+
+	switch (pexpression->variant) {
+		case PEXPRESSION_NUMLIT: {
+			Number *n = pexpression->number;
+			numcompat(tc, n, ex);
+
+			texpression->variant = TEXPRESSION_NUMLIT;
+			texpression->number = n;
+			break;
+		}
+		case PEXPRESSION_IDENTIFIER:
+		case PEXPRESSION_FIELD:
+		case PEXPRESSION_INDEX: {
+			/* Interned by check_place() */
+			afree(texpression);
+			texpression = check_place(tc, pexpression, scope, true);
+
+			notwhole(tc, pexpression->span, texpression->type);
+			typecompat(tc, pexpression->span, texpression->type, ex);
+			return texpression;
+		}
+		case PEXPRESSION_CALL: {
+			PCall *pcall = pexpression->call;
+			int intrinsic = find_intrinsic(tc, pcall);
+
+			if (intrinsic != NONDX) {
+				check_intrinsic(tc, pcall, intrinsic, texpression, scope);
+				break;
+			}
+
+			int builtin = find_builtin(tc, pcall);
+			if (builtin != NONDX) {
+				check_builtin(tc, pcall, builtin, texpression, scope);
+
+				if (texpression->type == PRIM_U0) {
+					err_source(tc->file, pexpression->span, "'%s' has no value; call it as a statement", pcall->identifier.content);
+				}
+				break;
+			}
+
+			funndx ndx = resolve_call(tc, pcall, scope);
+
+			TCall *tcall = alloct(TCall);
+			tcall->fun = ndx;
+			tcall->args = NULL;
+			tcall->nargs = 0;
+
+			check_args(tc, pcall, ndx, tcall, scope);
+
+			texpression->variant = TEXPRESSION_CALL;
+			texpression->call = tcall;
+			texpression->type = tc->tfile->tfuns[ndx]->rettype;
+			break;
+		}
+		case PEXPRESSION_BINARY: {
+			PBinary *pbinary = pexpression->binary;
+			binop op = binops[pbinary->op.kind];
+			bool cmp = op >= BINOP_EQ;
+			bool arith = !(op == BINOP_AND || op == BINOP_OR || op == BINOP_XOR || op == BINOP_EQ || op == BINOP_NE);
+
+			/*
+			 * Operands of arithmetic take the type of the expression; operands of
+			 * comparisons take the type of whichever operand has one
+			 */
+			typendx operand = cmp ? NONDX : ex;
+			if (operand == NONDX) {
+				operand = infer_expression(tc, pbinary->lhs, scope);
+			}
+			if (operand == NONDX) {
+				operand = infer_expression(tc, pbinary->rhs, scope);
+			}
+			if (operand == NONDX) {
+				operand = PRIM_U64;
+			}
+
+			opcompat(tc, pbinary->op, arith, operand);
+
+			bool vector = tc->tfile->types[operand]->kind == TYPE_VECTOR;
+			if (vector) {
+				veccompat(tc, pbinary->op, op, operand);
+			}
+
+			TBinary *tbinary = alloct(TBinary);
+			tbinary->op = op;
+			tbinary->lhs = check_expression(tc, pbinary->lhs, operand, scope);
+
+			/* Each lane of a vector is shifted by the same constant */
+			if (vector && (op == BINOP_SHL || op == BINOP_SHR)) {
+				size_t bits = tc->tfile->types[tc->tfile->types[operand]->elem]->size * 8;
+
+				tbinary->rhs = check_expression(tc, pbinary->rhs, PRIM_U8, scope);
+				if (tbinary->rhs->variant != TEXPRESSION_NUMLIT || tbinary->rhs->number->u64 >= bits) {
+					err_source(tc->file, pbinary->rhs->span, "a vector can only be shifted by a constant less than %ld", bits);
+				}
+			} else {
+				tbinary->rhs = check_expression(tc, pbinary->rhs, operand, scope);
+			}
+
+			texpression->variant = TEXPRESSION_BINARY;
+			texpression->binary = tbinary;
+			texpression->type = cmp && !vector ? PRIM_BOOL : operand;
+			break;
+		}
+		case PEXPRESSION_UNARY: {
+			PUnary *punary = pexpression->unary;
+			typendx operand = ex != NONDX ? ex : infer_expression(tc, punary->operand, scope);
+			if (operand == NONDX) {
+				operand = PRIM_U64;
+			}
+
+			opcompat(tc, punary->op, true, operand);
+
+			TUnary *tunary = alloct(TUnary);
+			tunary->op = (punary->op.kind == TOKEN_MINUS ? UNOP_NEG : UNOP_NOT);
+			tunary->operand = check_expression(tc, punary->operand, operand, scope);
+
+			texpression->variant = TEXPRESSION_UNARY;
+			texpression->unary = tunary;
+			texpression->type = operand;
+			break;
+		}
+		default: break;
+	}
+
+	typecompat(tc, pexpression->span, texpression->type, ex);
+
+	return value_intern(tc, texpression);
+}
+
+/*
+ * The arguments of a call, one per parameter. A slice is passed as a pointer
+ * and a length, which the callee has as two parameters; the argument must be
+ * a slice the caller has, and its length is passed after it.
+ */
+static void check_args(Typechecker *tc, PCall *pcall, funndx fun, TCall *tcall, scopendx scope)
+{
+	Token iden = pcall->identifier;
+	TFun *callee = tc->tfile->tfuns[fun];
+	size_t nparams = callee->nparams;
+
+	for (size_t i = 0; i < callee->nparams; ++i) {
+		nparams -= tc->tfile->types[tc->tfile->tvariables[callee->params[i]]->type]->kind == TYPE_SLICE;
+	}
+
+	if (pcall->nargs != nparams) {
+		err_source(tc->file, iden.span, "'%s' takes %ld arguments but got %ld", iden.content, nparams, pcall->nargs);
+	}
+
+	for (size_t i = 0, j = 0; i < pcall->nargs; ++i, ++j) {
+		typendx ptype = tc->tfile->tvariables[callee->params[j]]->type;
+		PExpression *parg = pcall->args[i];
+
+		if (tc->tfile->types[ptype]->kind != TYPE_SLICE) {
+			TExpression *arg = check_expression(tc, parg, ptype, scope);
+			vec_push(tcall->args, &arg, &tcall->nargs, sizeof(TExpression *));
+			continue;
+		}
+
+		if (parg->variant != PEXPRESSION_IDENTIFIER) {
+			err_source(tc->file, parg->span, "expected a slice to pass as '%s'", tc->tfile->types[ptype]->name);
+		}
+
+		TExpression *arg = check_place(tc, parg, scope, true);
+		typecompat(tc, parg->span, arg->type, ptype);
+
+		TExpression *length = alloct(TExpression);
+		length->variant = TEXPRESSION_VARIABLE;
+		length->type = PRIM_U64;
+		length->uses = 1;
+		length->var = tc->tfile->tvariables[arg->var]->length;
+		length = value_intern(tc, length);
+
+		vec_push(tcall->args, &arg, &tcall->nargs, sizeof(TExpression *));
+		vec_push(tcall->args, &length, &tcall->nargs, sizeof(TExpression *));
+		++j;
+	}
+}
+
+/* The intrinsic a call is of, or NONDX if it calls a function */
+static int find_intrinsic(Typechecker *tc, PCall *pcall)
+{
+	Token iden = pcall->identifier;
+
+	if (find_fun(tc, iden) != NONDX || find_generic(tc, iden) != NONDX) {
+		return NONDX;
+	}
+
+	for (size_t i = 0; i < nintrinsics; ++i) {
+		if (!strcmp(intrinsics[i].name, iden.content)) {
+			return (int)i;
+		}
+	}
+
+	return NONDX;
+}
+
+/* The type of an intrinsic's result; a splat without a type argument takes its type from the context */
+static typendx infer_intrinsic(Typechecker *tc, PCall *pcall, int intrinsic, scopendx scope)
+{
+	unop op = intrinsics[intrinsic].op;
+
+	if (op == UNOP_SPLAT) {
+		return pcall->ntypeargs == 1 ? check_type(tc, pcall->typeargs[0]) : NONDX;
+	}
+
+	if (op == UNOP_MASK) {
+		return PRIM_U32;
+	}
+
+	typendx vector = pcall->nargs ? infer_expression(tc, pcall->args[0], scope) : NONDX;
+	if (vector == NONDX || tc->tfile->types[vector]->kind != TYPE_VECTOR) {
+		return NONDX;
+	}
+
+	return op == UNOP_SHUFFLE ? vector : tc->tfile->types[vector]->elem;
+}
+
+/*
+ * An intrinsic, as a unary expression: its first argument is the operand,
+ * and any others are lanes, which must be constants. 'texpression' has the
+ * type expected of it, if any, and is given its own.
+ */
+static void check_intrinsic(Typechecker *tc, PCall *pcall, int intrinsic, TExpression *texpression, scopendx scope)
+{
+	Token iden = pcall->identifier;
+	unop op = intrinsics[intrinsic].op;
+	size_t nargs = op == UNOP_LANE ? 2 : 1;
+	typendx vector = NONDX;
+
+	if (op == UNOP_SPLAT) {
+		vector = pcall->ntypeargs == 1 ? check_type(tc, pcall->typeargs[0]) : texpression->type;
+		if (pcall->ntypeargs > 1 || vector == NONDX || tc->tfile->types[vector]->kind != TYPE_VECTOR) {
+			err_source(tc->file, iden.span, "'splat' needs a vector type, as in 'splat[u32x4](x)'");
+		}
+	} else if (!pcall->nargs) {
+		/* A shuffle takes a lane per lane of its vector, and there is no vector to count them in */
+		err_source(tc->file, iden.span, "'%s' takes %s%ld arguments but got 0", iden.content,
+			op == UNOP_SHUFFLE ? "at least " : "", op == UNOP_SHUFFLE ? 2 : nargs);
+	} else {
+		vector = infer_expression(tc, pcall->args[0], scope);
+		if (vector == NONDX || tc->tfile->types[vector]->kind != TYPE_VECTOR) {
+			err_source(tc->file, pcall->args[0]->span, "'%s' needs a vector", iden.content);
+		}
+	}
+
+	Type *t = tc->tfile->types[vector];
+	if (op == UNOP_SHUFFLE) {
+		nargs = 1 + t->length;
+	}
+
+	if (pcall->ntypeargs && op != UNOP_SPLAT) {
+		err_source(tc->file, iden.span, "'%s' takes no type arguments", iden.content);
+	}
+
+	if (pcall->nargs != nargs) {
+		err_source(tc->file, iden.span, "'%s' takes %ld arguments but got %ld", iden.content, nargs, pcall->nargs);
+	}
+
+	TUnary *tunary = alloct(TUnary);
+	tunary->op = op;
+	tunary->operand = check_expression(tc, pcall->args[0], op == UNOP_SPLAT ? t->elem : vector, scope);
+
+	for (size_t i = 1; i < nargs; ++i) {
+		PExpression *parg = pcall->args[i];
+
+		if (parg->variant != PEXPRESSION_NUMLIT || parg->number->u64 >= t->length) {
+			err_source(tc->file, parg->span, "a lane of '%s' must be a constant less than %ld", t->name, t->length);
+		}
+
+		tunary->lanes[i - 1] = parg->number->u64;
+	}
+
+	texpression->variant = TEXPRESSION_UNARY;
+	texpression->unary = tunary;
+
+	switch (op) {
+		case UNOP_SPLAT:
+		case UNOP_SHUFFLE: texpression->type = vector; break;
+		case UNOP_MASK: texpression->type = PRIM_U32; break;
+		default: texpression->type = t->elem; break;
+	}
+}
+
+/*
+ * Operators apply to each lane of a vector, as far as SSE2 and AVX2 have
+ * instructions for them: there is no lane-wise division, nor multiplication
+ * of bytes or quadwords, nor shift of bytes, nor arithmetic shift of
+ * quadwords; and SSE2 cannot order quadwords, only compare them for equality.
+ */
+static void veccompat(Typechecker *tc, Token optoken, binop op, typendx ndx)
+{
+	Type *t = tc->tfile->types[ndx];
+	Type *lane = tc->tfile->types[t->elem];
+	bool ok = true;
+
+	switch (op) {
+		case BINOP_DIV:
+		case BINOP_MOD: ok = false; break;
+		case BINOP_MUL: ok = lane->size == 2 || lane->size == 4; break;
+		case BINOP_SHL: ok = lane->size > 1; break;
+		case BINOP_SHR: ok = lane->size > 1 && !(lane->signd && lane->size == 8); break;
+		case BINOP_LT:
+		case BINOP_LE:
+		case BINOP_GT:
+		case BINOP_GE: ok = lane->size < 8 || t->size == 32; break;
+		default: break;
+	}
+
+	if (!ok) {
+		err_source(tc->file, optoken.span, "operator '%s' cannot be applied to type '%s'", optoken.content, t->name);
+	}
+}
+
+/* The builtin a call is of, or NONDX if it calls a function */
+static int find_builtin(Typechecker *tc, PCall *pcall)
+{
+	Token iden = pcall->identifier;
+
+	if (find_fun(tc, iden) != NONDX || find_generic(tc, iden) != NONDX) {
+		return NONDX;
+	}
+
+	for (size_t i = 0; i < nbuiltins; ++i) {
+		if (!strcmp(builtins[i].name, iden.content)) {
+			return (int)i;
+		}
+	}
+
+	return NONDX;
+}
+
+/* The type of a builtin's result: that of its first argument, whose type may come from the context */
+static typendx infer_builtin(Typechecker *tc, PCall *pcall, int builtin, scopendx scope)
+{
+	if (builtins[builtin].variant == TEXPRESSION_BUILTIN) {
+		switch (builtins[builtin].op) {
+			case BUILTIN_RDTSC: return PRIM_U64;
+			case BUILTIN_LOAD:
+			case BUILTIN_FETCHADD:
+			case BUILTIN_EXCHANGE:
+			case BUILTIN_CMPXCHG: return pcall->nargs ? infer_expression(tc, pcall->args[0], scope) : NONDX;
+			default: return PRIM_U0;
+		}
+	}
+
+	return pcall->nargs ? infer_expression(tc, pcall->args[0], scope) : NONDX;
+}
+
+/*
+ * A builtin on integers, as a unary or binary expression whose operands
+ * are its arguments; all of them, and the result, have one integer type.
+ * The others are builtin expressions of their own, of type u0 but for rdtsc
+ * and the atomics that give a value.
+ */
+static void check_builtin(Typechecker *tc, PCall *pcall, int builtin, TExpression *texpression, scopendx scope)
+{
+	Token iden = pcall->identifier;
+	size_t nargs = builtins[builtin].nargs;
+
+	if (pcall->ntypeargs) {
+		err_source(tc->file, iden.span, "'%s' takes no type arguments", iden.content);
+	}
+
+	if (pcall->nargs != nargs) {
+		err_source(tc->file, iden.span, "'%s' takes %ld arguments but got %ld", iden.content, nargs, pcall->nargs);
+	}
+
+	if (builtins[builtin].variant == TEXPRESSION_BUILTIN) {
+		TBuiltin *tbuiltin = alloct(TBuiltin);
+		tbuiltin->op = builtins[builtin].op;
+		tbuiltin->order = ORDER_RELAXED;
+		tbuiltin->args = NULL;
+		tbuiltin->nargs = 0;
+
+		texpression->variant = TEXPRESSION_BUILTIN;
+		texpression->builtin = tbuiltin;
+		texpression->type = infer_builtin(tc, pcall, builtin, scope);
+
+		if (nargs == 0) {
+			return;
+		}
+
+		TExpression *place = check_builtin_place(tc, pcall, scope);
+		TExpression *arg = NULL;
+
+		if (tbuiltin->op >= BUILTIN_LOAD) {
+			check_atomic(tc, pcall, tbuiltin, place, scope);
+			return;
+		}
+
+		if (tbuiltin->op == BUILTIN_PREFETCH) {
+			/* The address is computed, never loaded from, so no element on the way need be in bounds */
+			for (TExpression *e = place; e->variant == TEXPRESSION_INDEX || e->variant == TEXPRESSION_FIELD;) {
+				if (e->variant == TEXPRESSION_INDEX) {
+					e->index->checked = false;
+				}
+
+				e = e->variant == TEXPRESSION_INDEX ? e->index->base : e->field->base;
+			}
+
+			arg = check_expression(tc, pcall->args[1], PRIM_U8, scope);
+			if (arg->variant != TEXPRESSION_NUMLIT || arg->number->u64 > 3) {
+				err_source(tc->file, pcall->args[1]->span, "locality of 'prefetch' must be a constant from 0 to 3");
+			}
+		} else {
+			Type *t = tc->tfile->types[place->type];
+
+			if (t->kind != TYPE_VECTOR && (t->kind != TYPE_PRIMITIVE || t->size < 4)) {
+				err_source(tc->file, pcall->args[0]->span, "'stream' cannot be applied to type '%s'", t->name);
+			}
+
+			arg = check_expression(tc, pcall->args[1], place->type, scope);
+		}
+
+		vec_push(tbuiltin->args, &place, &tbuiltin->nargs, sizeof(TExpression *));
+		vec_push(tbuiltin->args, &arg, &tbuiltin->nargs, sizeof(TExpression *));
+		return;
+	}
+
+	typendx operand = texpression->type;
+	for (size_t i = 0; i < nargs && operand == NONDX; ++i) {
+		operand = infer_expression(tc, pcall->args[i], scope);
+	}
+	if (operand == NONDX) {
+		operand = PRIM_U64;
+	}
+
+	if (operand < PRIM_U8 || operand > PRIM_S64) {
+		err_source(tc->file, iden.span, "'%s' cannot be applied to type '%s'", iden.content, tc->tfile->types[operand]->name);
+	}
+
+	if (builtins[builtin].variant == TEXPRESSION_UNARY) {
+		TUnary *tunary = alloct(TUnary);
+		tunary->op = builtins[builtin].op;
+		tunary->operand = check_expression(tc, pcall->args[0], operand, scope);
+
+		texpression->variant = TEXPRESSION_UNARY;
+		texpression->unary = tunary;
+	} else {
+		TBinary *tbinary = alloct(TBinary);
+		tbinary->op = builtins[builtin].op;
+		tbinary->lhs = check_expression(tc, pcall->args[0], operand, scope);
+		tbinary->rhs = check_expression(tc, pcall->args[1], operand, scope);
+
+		texpression->variant = TEXPRESSION_BINARY;
+		texpression->binary = tbinary;
+	}
+
+	texpression->type = operand;
+}
+
+/* The place a builtin refers to memory by: an element, a thread-local, or a field of one or of a variable, of any type */
+static TExpression *check_builtin_place(Typechecker *tc, PCall *pcall, scopendx scope)
+{
+	PExpression *parg = pcall->args[0];
+	bool global = parg->variant == PEXPRESSION_IDENTIFIER && find_variable(tc, parg->identifier, scope) == NONDX
+		&& find_global(tc, parg->identifier) != NONDX;
+
+	if (parg->variant != PEXPRESSION_FIELD && parg->variant != PEXPRESSION_INDEX && !global) {
+		err_source(tc->file, parg->span, "'%s' takes an element, a field or a thread-local", pcall->identifier.content);
+	}
+
+	TExpression *place = check_place(tc, parg, scope, false);
+
+	if (place->variant == TEXPRESSION_VARIABLE) {
+		err_source(tc->file, parg->span, "the length of a slice is not in memory");
+	}
+
+	return place;
+}
+
+/*
+ * An atomic builtin, of an integer place. The arguments between the place and
+ * the ordering are of its type. Loads cannot release, and stores cannot acquire.
+ */
+static void check_atomic(Typechecker *tc, PCall *pcall, TBuiltin *tbuiltin, TExpression *place, scopendx scope)
+{
+	Token iden = pcall->identifier;
+
+	if (place->type < PRIM_U8 || place->type > PRIM_S64) {
+		err_source(tc->file, pcall->args[0]->span, "'%s' cannot be applied to type '%s'", iden.content, tc->tfile->types[place->type]->name);
+	}
+
+	vec_push(tbuiltin->args, &place, &tbuiltin->nargs, sizeof(TExpression *));
+
+	for (size_t i = 1; i + 1 < pcall->nargs; ++i) {
+		TExpression *arg = check_expression(tc, pcall->args[i], place->type, scope);
+		vec_push(tbuiltin->args, &arg, &tbuiltin->nargs, sizeof(TExpression *));
+	}
+
+	PExpression *porder = pcall->args[pcall->nargs - 1];
+	size_t order = 0;
+
+	while (porder->variant == PEXPRESSION_IDENTIFIER && order < norders
+			&& strcmp(orders[order], porder->identifier.content)) {
+		++order;
+	}
+
+	if (porder->variant != PEXPRESSION_IDENTIFIER || order == norders) {
+		err_source(tc->file, porder->span, "expected an ordering: 'relaxed', 'acquire', 'release' or 'seqcst'");
+	}
+
+	if ((tbuiltin->op == BUILTIN_LOAD && order == ORDER_RELEASE) || (tbuiltin->op == BUILTIN_STORE && order == ORDER_ACQUIRE)) {
+		err_source(tc->file, porder->span, "'%s' cannot be '%s'", iden.content, orders[order]);
+	}
+
+	tbuiltin->order = (memorder)order;
+}
+
+/* A case value or initial value is an integer literal, negated for signed types, in range of the type */
+static uint64_t check_literal(Typechecker *tc, PExpression *pexpression, typendx type, const char *what)
+{
+	Type *t = tc->tfile->types[type];
+	bool neg = false;
+	PExpression *lit = pexpression;
+
+	if (lit->variant == PEXPRESSION_UNARY && lit->unary->op.kind == TOKEN_MINUS) {
+		neg = true;
+		lit = lit->unary->operand;
+	}
+
+	if (lit->variant != PEXPRESSION_NUMLIT) {
+		err_source(tc->file, pexpression->span, "%s must be an integer literal", what);
+	}
+
+	uint64_t v = lit->number->u64;
+	uint64_t max = (t->size == 8 ? UINT64_MAX : ((uint64_t)1 << (t->size * 8)) - 1);
+	if (t->signd) {
+		max = (max >> 1) + neg;
+	}
+
+	if ((neg && !t->signd) || v > max) {
+		err_source(tc->file, pexpression->span, "%s out of range of type '%s'", what, t->name);
+	}
+
+	return neg ? -v : v;
+}
+
+static TSwitch *check_switch(Typechecker *tc, PSwitch *pswitch, scopendx scope)
+{
+	typendx type = infer_expression(tc, pswitch->expr, scope);
+	if (type == NONDX) {
+		type = PRIM_U64;
+	}
+
+	if (type == PRIM_U0 || type == PRIM_BOOL || tc->tfile->types[type]->kind == TYPE_VECTOR) {
+		err_source(tc->file, pswitch->expr->span, "cannot switch on type '%s'", tc->tfile->types[type]->name);
+	}
+
+	TSwitch *tswitch = alloct(TSwitch);
+	tswitch->expr = check_expression(tc, pswitch->expr, type, scope);
+	tswitch->cases = NULL;
+	tswitch->ncases = 0;
+	tswitch->def = NULL;
+
+	for (size_t i = 0; i < pswitch->ncases; ++i) {
+		PCase *pcase = pswitch->cases[i];
+
+		TCase *tcase = alloct(TCase);
+		tcase->values = NULL;
+		tcase->nvalues = 0;
+
+		for (size_t j = 0; j < pcase->nvalues; ++j) {
+			uint64_t v = check_literal(tc, pcase->values[j], type, "case value");
+
+			for (size_t k = 0; k < tswitch->ncases; ++k) {
+				for (size_t l = 0; l < tswitch->cases[k]->nvalues; ++l) {
+					if (tswitch->cases[k]->values[l] == v) {
+						err_source(tc->file, pcase->values[j]->span, "duplicate case value");
+					}
+				}
+			}
+
+			for (size_t l = 0; l < tcase->nvalues; ++l) {
+				if (tcase->values[l] == v) {
+					err_source(tc->file, pcase->values[j]->span, "duplicate case value");
+				}
+			}
+
+			vec_push(tcase->values, &v, &tcase->nvalues, sizeof(uint64_t));
+		}
+
+		tcase->block = check_block(tc, pcase->block, scope);
+		vec_push(tswitch->cases, &tcase, &tswitch->ncases, sizeof(TCase *));
+	}
+
+	if (pswitch->def) {
+		tswitch->def = check_block(tc, pswitch->def, scope);
+	}
+
+	return tswitch;
+}
+
+static TIf *check_if(Typechecker *tc, PIf *pif, scopendx scope)
+{
+	TIf *tif = alloct(TIf);
+	tif->cond = check_expression(tc, pif->cond, PRIM_BOOL, scope);
+	tif->hint = pif->hint;
+	tif->then = check_block(tc, pif->then, scope);
+	tif->els = pif->els ? check_block(tc, pif->els, scope) : NULL;
+
+	return tif;
+}
+
+/*
+ * The variable comes into scope after its initial value, which cannot refer
+ * to it. Struct and array variables take no initial value, and start zeroed.
+ */
+static TAssign *check_var(Typechecker *tc, PVar *pvar, scopendx scope)
+{
+	TAssign *tassign = alloct(TAssign);
+	typendx type = check_type(tc, pvar->var->type);
+	Type *t = tc->tfile->types[type];
+
+	if (t->kind == TYPE_SLICE) {
+		err_source(tc->file, pvar->var->type->span, "slices can only be parameters");
+	}
+
+	if (t->kind == TYPE_STRUCT || t->kind == TYPE_ARRAY) {
+		if (pvar->value) {
+			bool fields = t->kind == TYPE_STRUCT;
+			err_source(tc->file, pvar->value->span, "%s variables start zeroed; assign to their %s instead",
+				fields ? "struct" : "array", fields ? "fields" : "elements");
+		}
+
+		Number *zero = alloct(Number);
+		zero->span = pvar->var->identifier.span;
+		zero->bits = 0;
+		zero->sig = false;
+		zero->u64 = 0;
+
+		tassign->value = alloct(TExpression);
+		tassign->value->variant = TEXPRESSION_NUMLIT;
+		tassign->value->type = type;
+		tassign->value->uses = 1;
+		tassign->value->number = zero;
+	} else if (!pvar->value) {
+		err_source(tc->file, pvar->var->identifier.span, "variable '%s' needs an initial value", pvar->var->identifier.content);
+	} else {
+		tassign->value = check_expression(tc, pvar->value, type, scope);
+	}
+
+	TVariable *tvar = check_variable(tc, pvar->var, scope);
+	tassign->var = tc->tfile->ntvariables;
+	add_variable(tc, tvar, scope);
+
+	if (pvar->align) {
+		Number *n = pvar->align;
+
+		if (n->u64 == 0 || (n->u64 & (n->u64 - 1)) || n->u64 > TYPE_MAXALIGN) {
+			err_source(tc->file, n->span, "alignment must be a power of two, at most %d", TYPE_MAXALIGN);
+		}
+
+		tvar->align = n->u64 > t->align ? n->u64 : 0;
+	}
+
+	return tassign;
+}
+
+static TAssign *check_assign(Typechecker *tc, PAssign *passign, scopendx scope)
+{
+	Token iden = passign->place->identifier;
+	varndx ndx = find_variable(tc, iden, scope);
+	if (ndx == NONDX) {
+		err_source(tc->file, iden.span, "unknown variable '%s'", iden.content);
+	}
+
+	notwhole(tc, iden.span, tc->tfile->tvariables[ndx]->type);
+
+	TAssign *tassign = alloct(TAssign);
+	tassign->var = ndx;
+	tassign->value = check_expression(tc, passign->value, tc->tfile->tvariables[ndx]->type, scope);
+
+	return tassign;
+}
+
+static TStore *check_store(Typechecker *tc, PAssign *passign, scopendx scope)
+{
+	TStore *tstore = alloct(TStore);
+	tstore->place = check_place(tc, passign->place, scope, false);
+
+	/* Only a slice's length is a variable in the place of a field */
+	if (tstore->place->variant == TEXPRESSION_VARIABLE) {
+		err_source(tc->file, passign->place->span, "the length of a slice cannot be assigned");
+	}
+
+	notwhole(tc, passign->place->span, tstore->place->type);
+	tstore->value = check_expression(tc, passign->value, tstore->place->type, scope);
+
+	return tstore;
+}
+
+static TWhile *check_while(Typechecker *tc, PWhile *pwhile, scopendx scope)
+{
+	TWhile *twhile = alloct(TWhile);
+	twhile->cond = check_expression(tc, pwhile->cond, PRIM_BOOL, scope);
+	twhile->guard = twhile->cond;
+
+	twhile->pre = alloct(TBlock);
+	twhile->pre->scope = scope;
+	twhile->pre->statements = NULL;
+	twhile->pre->nstatements = 0;
+
+	twhile->block = check_block(tc, pwhile->block, scope);
+
+	return twhile;
+}
+
+static bool hascall(TExpression *expression)
+{
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: return true;
+		case TEXPRESSION_BINARY: return hascall(expression->binary->lhs) || hascall(expression->binary->rhs);
+		case TEXPRESSION_UNARY: return hascall(expression->unary->operand);
+		case TEXPRESSION_FIELD: return hascall(expression->field->base);
+		case TEXPRESSION_INDEX: return hascall(expression->index->base) || hascall(expression->index->index);
+		case TEXPRESSION_BUILTIN: {
+			for (size_t i = 0; i < expression->builtin->nargs; ++i) {
+				if (hascall(expression->builtin->args[i])) {
+					return true;
+				}
+			}
+			return false;
+		}
+		default: return false;
+	}
+}
+
+/*
+ * An asm statement. Outputs are integer variables of the function, and are
+ * written with '=' or, where the asm reads them too, '+'; each '+' adds an
+ * input tied to its output after those written. Inputs are integers, or
+ * slices, whose pointer is taken, or literals ('i'), or elements, fields and
+ * thread-locals ('m'); they make no calls, as the registers of the operands
+ * are taken before they are all computed. Registers named by letter are
+ * given to one operand only, and are not clobbered besides. The flags and
+ * memory are always assumed clobbered, so "cc" and "memory" are accepted
+ * but change nothing.
+ */
+static TAsm *check_asm(Typechecker *tc, PAsm *pasm, scopendx scope)
+{
+	TAsm *tasm = alloct(TAsm);
+	tasm->file = tc->file;
+	tasm->span = pasm->texts[0].span;
+	tasm->insns = NULL;
+	tasm->ninsns = 0;
+	tasm->operands = NULL;
+	tasm->noperands = 0;
+	tasm->nouts = pasm->nouts;
+	tasm->clobbers = 0;
+	tasm->xclobbers = 0;
+
+	bool tied[ASM_MAXOPERANDS] = { false };
+	uint16_t named = 0; /* registers named by letter (bit n: register n) */
+
+	if (pasm->nouts + pasm->nins > ASM_MAXOPERANDS) {
+		err_source(tc->file, tasm->span, "asm takes at most %d operands", ASM_MAXOPERANDS);
+	}
+
+	for (size_t i = 0; i < pasm->nouts; ++i) {
+		PAsmOperand *pout = &pasm->outs[i];
+		const char *c = pout->constraint.content;
+
+		if ((c[0] != '=' && c[0] != '+') || !c[1] || c[2] || (c[1] != 'r' && asm_letter(c[1]) == NOREG)) {
+			err_source(tc->file, pout->constraint.span, "output constraint must be '=' or '+' and 'r' or a register letter");
+		}
+
+		varndx ndx = pout->expr->variant == PEXPRESSION_IDENTIFIER ? find_variable(tc, pout->expr->identifier, scope) : NONDX;
+		if (ndx == NONDX) {
+			err_source(tc->file, pout->expr->span, "an output of asm must be a variable of the function");
+		}
+
+		typendx type = tc->tfile->tvariables[ndx]->type;
+		if (type < PRIM_U8 || type > PRIM_S64) {
+			err_source(tc->file, pout->expr->span, "asm operands must be integers, not '%s'", tc->tfile->types[type]->name);
+		}
+
+		for (size_t j = 0; j < i; ++j) {
+			if (tasm->operands[j].expr->var == ndx) {
+				err_source(tc->file, pout->expr->span, "variable '%s' is given two outputs", pout->expr->identifier.content);
+			}
+		}
+
+		reg r = asm_letter(c[1]);
+		if (r != NOREG && (named & (1 << r))) {
+			err_source(tc->file, pout->constraint.span, "register '%c' is given two operands", c[1]);
+		}
+		if (r != NOREG) {
+			named |= 1 << r;
+		}
+
+		TExpression *var = alloct(TExpression);
+		var->variant = TEXPRESSION_VARIABLE;
+		var->type = type;
+		var->uses = 1;
+		var->var = ndx;
+
+		TAsmOperand out = { .constraint = c[1], .expr = var };
+		vec_push(tasm->operands, &out, &tasm->noperands, sizeof(TAsmOperand));
+	}
+
+	for (size_t i = 0; i < pasm->nins; ++i) {
+		PAsmOperand *pin = &pasm->ins[i];
+		const char *c = pin->constraint.content;
+		TAsmOperand in = { .constraint = c[0], .expr = NULL };
+
+		if (!c[0] || c[1] || (!isdigit(c[0]) && !strchr("rim", c[0]) && asm_letter(c[0]) == NOREG)) {
+			err_source(tc->file, pin->constraint.span, "input constraint must be 'r', 'i', 'm', a register letter or an output number");
+		}
+
+		if (c[0] == 'i') {
+			Number *n = alloct(Number);
+			n->span = pin->expr->span;
+			n->bits = 64;
+			n->sig = true;
+			n->u64 = check_literal(tc, pin->expr, PRIM_S64, "an immediate");
+
+			in.expr = alloct(TExpression);
+			in.expr->variant = TEXPRESSION_NUMLIT;
+			in.expr->type = PRIM_S64;
+			in.expr->uses = 1;
+			in.expr->number = n;
+		} else if (c[0] == 'm') {
+			PExpression *parg = pin->expr;
+			bool global = parg->variant == PEXPRESSION_IDENTIFIER && find_variable(tc, parg->identifier, scope) == NONDX
+				&& find_global(tc, parg->identifier) != NONDX;
+
+			if (parg->variant != PEXPRESSION_FIELD && parg->variant != PEXPRESSION_INDEX && !global) {
+				err_source(tc->file, parg->span, "a memory operand must be an element, a field or a thread-local");
+			}
+
+			in.expr = check_place(tc, parg, scope, false);
+
+			if (in.expr->variant == TEXPRESSION_VARIABLE) {
+				err_source(tc->file, parg->span, "the length of a slice is not in memory");
+			}
+
+			notwhole(tc, parg->span, in.expr->type);
+		} else {
+			typendx type = NONDX;
+
+			if (isdigit(c[0])) {
+				size_t out = c[0] - '0';
+
+				if (out >= pasm->nouts) {
+					err_source(tc->file, pin->constraint.span, "no output %ld to tie the input to", out);
+				}
+				if (tied[out]) {
+					err_source(tc->file, pin->constraint.span, "output %ld is already tied to an input", out);
+				}
+
+				tied[out] = true;
+				type = tasm->operands[out].expr->type;
+			} else if ((type = infer_expression(tc, pin->expr, scope)) == NONDX) {
+				type = PRIM_U64;
+			}
+
+			/* A slice in a register is its pointer */
+			bool slice = tc->tfile->types[type]->kind == TYPE_SLICE && pin->expr->variant == PEXPRESSION_IDENTIFIER;
+
+			if ((type < PRIM_U8 || type > PRIM_S64) && !slice) {
+				err_source(tc->file, pin->expr->span, "asm operands must be integers, not '%s'", tc->tfile->types[type]->name);
+			}
+
+			reg r = asm_letter(c[0]);
+			if (r != NOREG && (named & (1 << r))) {
+				err_source(tc->file, pin->constraint.span, "register '%c' is given two operands", c[0]);
+			}
+			if (r != NOREG) {
+				named |= 1 << r;
+			}
+
+			in.expr = slice ? check_place(tc, pin->expr, scope, true) : check_expression(tc, pin->expr, type, scope);
+		}
+
+		if (hascall(in.expr)) {
+			err_source(tc->file, pin->expr->span, "an input of asm cannot make calls");
+		}
+
+		vec_push(tasm->operands, &in, &tasm->noperands, sizeof(TAsmOperand));
+	}
+
+	/* An output the asm reads as well is an input tied to it */
+	for (size_t i = 0; i < pasm->nouts; ++i) {
+		if (pasm->outs[i].constraint.content[0] != '+') {
+			continue;
+		}
+
+		if (tied[i]) {
+			err_source(tc->file, pasm->outs[i].constraint.span, "output %ld is already tied to an input", i);
+		}
+
+		if (tasm->noperands == ASM_MAXOPERANDS) {
+			err_source(tc->file, pasm->outs[i].constraint.span, "asm takes at most %d operands, counting one input for each '+'", ASM_MAXOPERANDS);
+		}
+
+		/* A node of its own, as passes may rewrite inputs in place */
+		TAsmOperand in = { .constraint = '0' + i, .expr = alloct(TExpression) };
+		*in.expr = *tasm->operands[i].expr;
+		vec_push(tasm->operands, &in, &tasm->noperands, sizeof(TAsmOperand));
+	}
+
+	for (size_t i = 0; i < pasm->nclobbers; ++i) {
+		Token clobber = pasm->clobbers[i];
+		reg r = NOREG;
+		uint8_t size = 0;
+
+		if (!strcmp(clobber.content, "cc") || !strcmp(clobber.content, "memory")) {
+			continue;
+		}
+
+		if (!asm_register(clobber.content, &r, &size) || (size != 8 && size < 16)) {
+			err_source(tc->file, clobber.span, "expected a 64-bit, XMM or YMM register, \"cc\" or \"memory\"");
+		}
+
+		if (size == 8 && (r == RSP || r == RBP)) {
+			err_source(tc->file, clobber.span, "'%s' cannot be clobbered", clobber.content);
+		}
+
+		if (size == 8 && (named & (1 << r))) {
+			err_source(tc->file, clobber.span, "'%s' is clobbered but has an operand", clobber.content);
+		}
+
+		if (size == 8) {
+			tasm->clobbers |= 1 << r;
+		} else {
+			tasm->xclobbers |= 1 << r;
 		}
-		default: break;
 	}
 
-	return NONDX;
-}
+	for (size_t i = 0; i < pasm->ntexts; ++i) {
+		asm_parse(tc->file, pasm->texts[i], tasm->noperands, &tasm->insns, &tasm->ninsns);
+	}
 
-static TVariable *check_variable(Typechecker *tc, PVariable *pvar, scopendx scope)
-{
-	TVariable *tvariable = alloct(TVariable);
-	tvariable->identifier = pvar->identifier;
-	tvariable->type = NONDX;
+	/* Registers of a memory operand cannot be taken from a constant or from memory */
+	for (size_t i = 0; i < tasm->ninsns; ++i) {
+		for (size_t j = 0; j < 3; ++j) {
+			AsmOperand *op = &tasm->insns[i].ops[j];
+			int refs[2] = { op->base, op->index };
 
-	{
-		Token iden = tvariable->identifier;
-		varndx ndx = NONDX;
-		if ((ndx = find_variable(tc, iden, scope)) != NONDX) {
-			err_source(tc->file, iden.span, "redefinition of variable '%s'", iden.content);
+			for (size_t k = 0; k < 2; ++k) {
+				if (refs[k] != ASM_NOREF && (tasm->operands[refs[k]].constraint == 'i' || tasm->operands[refs[k]].constraint == 'm')) {
+					err_source(tc->file, tasm->insns[i].span, "operand %d is not in a register", refs[k]);
+				}
+			}
 		}
 	}
 
-	tvariable->type = check_type(tc, pvar->type);
-
-	return tvariable;
-}
+	/* The lock prefix faults but on a read-modify-write of memory */
+	for (size_t i = 0; i < tasm->ninsns; ++i) {
+		AsmInsn *insn = &tasm->insns[i];
+		AsmOperand *dest = &insn->ops[0];
 
-static TExpression *check_expression(Typechecker *tc, PExpression *pexpression, typendx ex)
-{
-	TExpression *texpression = alloct(TExpression);
-	texpression->variant = _TNODE_NULL;
-	texpression->number = NULL;
+		if (!insn->lock) {
+			continue;
+		}
 
-	switch (pexpression->variant) {
-		case PEXPRESSION_NUMLIT: {
-			Number *n = pexpression->number;
-			numcompat(tc, n, ex);
+		switch (insn->op) {
+			case X86_ADD:
+			case X86_OR:
+			case X86_AND:
+			case X86_SUB:
+			case X86_XOR:
+			case X86_NOT:
+			case X86_NEG:
+			case X86_XADD:
+			case X86_CMPXCHG:
+			case X86_XCHG: break;
+			default: err_source(tc->file, insn->span, "'lock' cannot prefix this instruction");
+		}
 
-			texpression->variant = TEXPRESSION_NUMLIT;
-			texpression->number = n;
-			break;
+		if (dest->op.kind != OPND_MEM && (dest->ref == ASM_NOREF || tasm->operands[dest->ref].constraint != 'm')) {
+			err_source(tc->file, insn->span, "'lock' needs a destination in memory");
 		}
-		default: break;
 	}
 
-	return texpression;
+	return tasm;
 }
 
-static TStatement *check_statement(Typechecker *tc, PStatement *pstatement)
+static TStatement *check_statement(Typechecker *tc, PStatement *pstatement, scopendx scope)
 {
 	TStatement *tstatement = alloct(TStatement);
 	tstatement->variant = _TNODE_NULL;
 	tstatement->expr = NULL;
 
+	/* Values are only reused within a statement; see value_intern() */
+	value_reset(tc);
+
 	switch (pstatement->variant) {
 		case PSTATEMENT_RETURN: {
 			if (tc->tfile->funret == PRIM_U0) {
@@ -187,7 +2064,7 @@ static TStatement *check_statement(Typechecker *tc, PStatement *pstatement)
 			}
 
 			tstatement->variant = TSTATEMENT_RETURN;
-			tstatement->expr = check_expression(tc, pstatement->expr, tc->tfile->funret);
+			tstatement->expr = check_expression(tc, pstatement->expr, tc->tfile->funret, scope);
 			break;
 		}
 		case PSTATEMENT_RETURN_NOVAL: {
@@ -195,6 +2072,69 @@ static TStatement *check_statement(Typechecker *tc, PStatement *pstatement)
 				err_source(tc->file, pstatement->span, "should return a value");
 			}
 			tstatement->variant = TSTATEMENT_RETURN_NOVAL;
+			break;
+		}
+		case PSTATEMENT_SWITCH: {
+			tstatement->variant = TSTATEMENT_SWITCH;
+			tstatement->sw = check_switch(tc, pstatement->sw, scope);
+			break;
+		}
+		case PSTATEMENT_IF: {
+			tstatement->variant = TSTATEMENT_IF;
+			tstatement->tif = check_if(tc, pstatement->pif, scope);
+			break;
+		}
+		case PSTATEMENT_VAR: {
+			tstatement->variant = TSTATEMENT_VAR;
+			tstatement->assign = check_var(tc, pstatement->var, scope);
+			break;
+		}
+		case PSTATEMENT_ASSIGN: {
+			PExpression *place = pstatement->assign->place;
+
+			/* A thread-local is in memory, and stored to as an element is */
+			if (place->variant != PEXPRESSION_IDENTIFIER
+					|| (find_variable(tc, place->identifier, scope) == NONDX && find_global(tc, place->identifier) != NONDX)) {
+				tstatement->variant = TSTATEMENT_STORE;
+				tstatement->store = check_store(tc, pstatement->assign, scope);
+				break;
+			}
+
+			tstatement->variant = TSTATEMENT_ASSIGN;
+			tstatement->assign = check_assign(tc, pstatement->assign, scope);
+			break;
+		}
+		case PSTATEMENT_WHILE: {
+			tstatement->variant = TSTATEMENT_WHILE;
+			tstatement->loop = check_while(tc, pstatement->loop, scope);
+			break;
+		}
+		case PSTATEMENT_CALL: {
+			PCall *pcall = pstatement->expr->call;
+			int builtin = find_builtin(tc, pcall);
+
+			/* Those that change memory may be called for that alone; the value, if any, is dropped */
+			if (builtin == NONDX || builtins[builtin].variant != TEXPRESSION_BUILTIN
+					|| builtins[builtin].op == BUILTIN_RDTSC || builtins[builtin].op == BUILTIN_LOAD) {
+				err_source(tc->file, pstatement->span, "only builtins with an effect can be called as statements");
+			}
+
+			TExpression *texpression = alloct(TExpression);
+			texpression->variant = _TNODE_NULL;
+			texpression->type = PRIM_U0;
+			texpression->uses = 1;
+			texpression->number = NULL;
+
+			check_builtin(tc, pcall, builtin, texpression, scope);
+
+			tstatement->variant = TSTATEMENT_BUILTIN;
+			tstatement->expr = texpression;
+			break;
+		}
+		case PSTATEMENT_ASM: {
+			tstatement->variant = TSTATEMENT_ASM;
+			tstatement->tasm = check_asm(tc, pstatement->pasm, scope);
+			break;
 		}
 		default: break;
 	}
@@ -211,7 +2151,7 @@ static TBlock *check_block(Typechecker *tc, PBlock *pblock, scopendx parent)
 
 	for (size_t i = 0; i < pblock->nstatements; ++i) {
 		PStatement *ps = pblock->statements[i];
-		TStatement *ts = check_statement(tc, ps);
+		TStatement *ts = check_statement(tc, ps, tblock->scope);
 
 		vec_push(tblock->statements, &ts, &tblock->nstatements, sizeof(TStatement *));
 	}
@@ -219,13 +2159,28 @@ static TBlock *check_block(Typechecker *tc, PBlock *pblock, scopendx parent)
 	return tblock;
 }
 
+/* Check the signature of a function; its block is checked in check_fun_block() */
 static TFun *check_fun(Typechecker *tc, PFun *pfun)
 {
 	TFun *tfun = alloct(TFun);
 	tfun->scope = scope_add(tc, 0);
+	tfun->file = pfun->file;
 	tfun->identifier = pfun->identifier;
+	tfun->cold = pfun->cold;
+	tfun->pure = pfun->pure;
+	tfun->clones = pfun->clones;
+	tfun->nclones = pfun->nclones;
+	tfun->effect = EFFECT_PURE;
+	tfun->total = false;
+	tfun->exported = true;
+	tfun->live = true;
 	tfun->rettype = NONDX;
 	tfun->block = NULL;
+	tfun->params = NULL;
+	tfun->nparams = 0;
+	size_t nvectors = 0;
+	bool cloned = tc->cloned;
+	tc->cloned = pfun->nclones > 0;
 
 	{
 		Token iden = tfun->identifier;
@@ -238,7 +2193,33 @@ static TFun *check_fun(Typechecker *tc, PFun *pfun)
 	for (size_t i = 0; i < pfun->nparams; ++i) {
 		PVariable *pvar = pfun->params[i];
 		TVariable *tvar = check_variable(tc, pvar, tfun->scope);
+		varndx ndx = tc->tfile->ntvariables;
+
+		type_kind kind = tc->tfile->types[tvar->type]->kind;
+		if (kind != TYPE_PRIMITIVE && kind != TYPE_SLICE && kind != TYPE_VECTOR) {
+			err_source(tc->file, pvar->type->span, "'%s' cannot be passed by value", tc->tfile->types[tvar->type]->name);
+		}
+
+		if (kind == TYPE_VECTOR && ++nvectors > TYPE_MAXVECPARAMS) {
+			err_source(tc->file, pvar->type->span, "a function takes at most %d vector parameters", TYPE_MAXVECPARAMS);
+		}
+
 		add_variable(tc, tvar, tfun->scope);
+
+		vec_push(tfun->params, &ndx, &tfun->nparams, sizeof(varndx));
+
+		/* The length of a slice follows it; it has no name, and is read as 's.len' */
+		if (kind == TYPE_SLICE) {
+			TVariable *length = alloct(TVariable);
+			length->identifier = EMPTYTOKEN;
+			length->type = PRIM_U64;
+			length->length = NONDX;
+			length->align = 0;
+
+			tvar->length = tc->tfile->ntvariables;
+			vec_push(tc->tfile->tvariables, &length, &tc->tfile->ntvariables, sizeof(TVariable *));
+			vec_push(tfun->params, &tvar->length, &tfun->nparams, sizeof(varndx));
+		}
 	}
 
 	/* If no type has been specified, default to u0 */
@@ -246,13 +2227,494 @@ static TFun *check_fun(Typechecker *tc, PFun *pfun)
 		tfun->rettype = PRIM_U0;
 	} else {
 		tfun->rettype = check_type(tc, pfun->rettype);
+
+		type_kind kind = tc->tfile->types[tfun->rettype]->kind;
+		if (kind != TYPE_PRIMITIVE && kind != TYPE_VECTOR) {
+			err_source(tc->file, pfun->rettype->span, "'%s' cannot be returned by value", tc->tfile->types[tfun->rettype]->name);
+		}
 	}
 
+	tc->cloned = cloned;
+
+	return tfun;
+}
+
+static void check_fun_block(Typechecker *tc, TFun *tfun, PFun *pfun)
+{
+	bool cloned = tc->cloned;
+	tc->cloned = pfun->nclones > 0;
 	tc->tfile->funret = tfun->rettype;
 
 	tfun->block = check_block(tc, pfun->block, tfun->scope);
 
-	return tfun;
+	tc->cloned = cloned;
+}
+
+/*
+ * A type argument left out of a call, as the type of the first argument whose
+ * parameter has that type, or the element type of the first slice argument
+ * whose parameter is a slice of it
+ */
+static typendx infer_typearg(Typechecker *tc, PFun *generic, size_t param, PCall *pcall, scopendx scope)
+{
+	Token typeparam = generic->typeparams[param];
+
+	for (size_t i = 0; i < generic->nparams && i < pcall->nargs; ++i) {
+		PType *ptype = generic->params[i]->type;
+		bool slice = ptype->variant == PTYPE_ARRAY && !ptype->array->length;
+
+		if (slice) {
+			ptype = ptype->array->elem;
+		}
+
+		if (ptype->variant != PTYPE_NAMED || strcmp(ptype->name.content, typeparam.content)) {
+			continue;
+		}
+
+		typendx type = infer_expression(tc, pcall->args[i], scope);
+		if (type != NONDX && slice) {
+			type = tc->tfile->types[type]->kind == TYPE_SLICE ? tc->tfile->types[type]->elem : NONDX;
+		}
+
+		if (type != NONDX) {
+			return type;
+		}
+	}
+
+	err_source(tc->file, pcall->identifier.span, "cannot infer type argument '%s' of '%s'", typeparam.content, generic->identifier.content);
+	return NONDX;
+}
+
+/*
+ * The function a generic becomes with some type arguments. Its signature is
+ * checked here, so that the call can be checked against it; its block is
+ * checked once all others have been. Takes ownership of 'typeargs'.
+ */
+static funndx instantiate(Typechecker *tc, int generic, typendx *typeargs)
+{
+	PFun *pfun = tc->generics[generic];
+
+	for (size_t i = 0; i < tc->ninstances; ++i) {
+		Instance *instance = &tc->instances[i];
+		if (instance->generic == generic && !memcmp(instance->typeargs, typeargs, pfun->ntypeparams * sizeof(typendx))) {
+			afree(typeargs);
+			return instance->fun;
+		}
+	}
+
+	File *file = tc->file;
+	PFun *bound = tc->generic;
+	typendx *boundargs = tc->typeargs;
+
+	tc->file = pfun->file;
+	tc->generic = pfun;
+	tc->typeargs = typeargs;
+	TFun *tfun = check_fun(tc, pfun);
+
+	/* Name each instance after its type arguments, e.g. 'max.u32' */
+	StrBuf *sb = strbuf_new(32);
+	for (const char *c = pfun->identifier.content; *c; ++c) {
+		strbuf_putc(sb, *c);
+	}
+
+	for (size_t i = 0; i < pfun->ntypeparams; ++i) {
+		strbuf_putc(sb, '.');
+		for (const char *c = tc->tfile->types[typeargs[i]]->name; *c; ++c) {
+			strbuf_putc(sb, *c);
+		}
+	}
+
+	tfun->identifier.content = strbuf_release(sb);
+
+	funndx ndx = tc->tfile->ntfuns;
+	add_fun(tc, tfun);
+
+	Instance instance = {
+		.generic = generic,
+		.typeargs = typeargs,
+		.fun = ndx,
+	};
+	vec_push(tc->instances, &instance, &tc->ninstances, sizeof(Instance));
+
+	tc->file = file;
+	tc->generic = bound;
+	tc->typeargs = boundargs;
+
+	return ndx;
+}
+
+/* The function a call refers to; generic functions are instantiated with the call's type arguments */
+static funndx resolve_call(Typechecker *tc, PCall *pcall, scopendx scope)
+{
+	Token iden = pcall->identifier;
+	int generic = find_generic(tc, iden);
+
+	if (generic == NONDX) {
+		funndx ndx = find_fun(tc, iden);
+		if (ndx == NONDX) {
+			err_source(tc->file, iden.span, "unknown function '%s'", iden.content);
+		}
+
+		if (pcall->ntypeargs > 0) {
+			err_source(tc->file, iden.span, "'%s' is not generic", iden.content);
+		}
+
+		return ndx;
+	}
+
+	PFun *pfun = tc->generics[generic];
+	if (pcall->ntypeargs > 0 && pcall->ntypeargs != pfun->ntypeparams) {
+		err_source(tc->file, iden.span, "'%s' takes %ld type arguments but got %ld", iden.content, pfun->ntypeparams, pcall->ntypeargs);
+	}
+
+	typendx *typeargs = acalloc(pfun->ntypeparams, sizeof(typendx));
+	for (size_t i = 0; i < pfun->ntypeparams; ++i) {
+		if (pcall->ntypeargs > 0) {
+			typeargs[i] = check_type(tc, pcall->typeargs[i]);
+		} else {
+			typeargs[i] = infer_typearg(tc, pfun, i, pcall, scope);
+		}
+	}
+
+	return instantiate(tc, generic, typeargs);
+}
+
+/* Whether a division may trap: by 0, or (signed) by -1, which overflows for the least value */
+static bool maytrap(Typechecker *tc, TBinary *binary)
+{
+	if (binary->op != BINOP_DIV && binary->op != BINOP_MOD) {
+		return false;
+	}
+
+	if (binary->rhs->variant != TEXPRESSION_NUMLIT) {
+		return true;
+	}
+
+	Type *type = tc->tfile->types[binary->rhs->type];
+	uint64_t mask = type->size == 8 ? UINT64_MAX : ((uint64_t)1 << (type->size * 8)) - 1;
+	uint64_t d = binary->rhs->number->u64 & mask;
+
+	return d == 0 || (type->signd && d == mask);
+}
+
+static effect effect_expr(Typechecker *tc, TExpression *expression, bool *total)
+{
+	effect e = EFFECT_PURE;
+
+	switch (expression->variant) {
+		case TEXPRESSION_CALL: {
+			TFun *callee = tc->tfile->tfuns[expression->call->fun];
+			e = callee->effect;
+			*total = *total && callee->total;
+
+			for (size_t i = 0; i < expression->call->nargs; ++i) {
+				effect arg = effect_expr(tc, expression->call->args[i], total);
+				e = arg > e ? arg : e;
+			}
+			break;
+		}
+		case TEXPRESSION_BINARY: {
+			effect lhs = effect_expr(tc, expression->binary->lhs, total);
+			effect rhs = effect_expr(tc, expression->binary->rhs, total);
+			e = lhs > rhs ? lhs : rhs;
+			*total = *total && !maytrap(tc, expression->binary);
+			break;
+		}
+		case TEXPRESSION_UNARY: e = effect_expr(tc, expression->unary->operand, total); break;
+		case TEXPRESSION_FIELD: e = effect_expr(tc, expression->field->base, total); break;
+		case TEXPRESSION_GLOBAL: e = EFFECT_READ; break;
+		case TEXPRESSION_BUILTIN: {
+			TBuiltin *builtin = expression->builtin;
+
+			for (size_t i = 0; i < builtin->nargs; ++i) {
+				effect arg = effect_expr(tc, builtin->args[i], total);
+				e = arg > e ? arg : e;
+			}
+
+			/*
+			 * rdtsc reads a counter that changes by itself, sfence orders stores,
+			 * and atomics share memory with other threads; none is ever pure
+			 */
+			if ((builtin->op == BUILTIN_STREAM && shared(tc, builtin->args[0]))
+					|| builtin->op == BUILTIN_RDTSC || builtin->op == BUILTIN_SFENCE || builtin->op >= BUILTIN_LOAD) {
+				e = EFFECT_ANY;
+			}
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			effect base = effect_expr(tc, expression->index->base, total);
+			effect index = effect_expr(tc, expression->index->index, total);
+			e = base > index ? base : index;
+			*total = *total && !expression->index->checked;
+
+			if (tc->tfile->types[expression->index->base->type]->kind == TYPE_SLICE) {
+				e = EFFECT_READ > e ? EFFECT_READ : e;
+			}
+			break;
+		}
+		default: break;
+	}
+
+	return e;
+}
+
+/* The effects of a block, given those of the functions it calls; clears 'total' if it may not return */
+static effect effect_block(Typechecker *tc, TBlock *block, bool *total)
+{
+	effect e = EFFECT_PURE;
+
+	for (size_t i = 0; i < block->nstatements; ++i) {
+		TStatement *statement = block->statements[i];
+		effect s = EFFECT_PURE;
+
+		switch (statement->variant) {
+			case TSTATEMENT_RETURN:
+			case TSTATEMENT_BUILTIN: s = effect_expr(tc, statement->expr, total); break;
+			case TSTATEMENT_VAR:
+			case TSTATEMENT_ASSIGN: s = effect_expr(tc, statement->assign->value, total); break;
+			case TSTATEMENT_STORE: {
+				effect p = effect_expr(tc, statement->store->place, total);
+				effect v = effect_expr(tc, statement->store->value, total);
+				s = p > v ? p : v;
+
+				if (shared(tc, statement->store->place)) {
+					s = EFFECT_ANY;
+				}
+				break;
+			}
+			case TSTATEMENT_SWITCH: {
+				TSwitch *sw = statement->sw;
+				s = effect_expr(tc, sw->expr, total);
+
+				for (size_t j = 0; j < sw->ncases; ++j) {
+					effect c = effect_block(tc, sw->cases[j]->block, total);
+					s = c > s ? c : s;
+				}
+
+				if (sw->def) {
+					effect c = effect_block(tc, sw->def, total);
+					s = c > s ? c : s;
+				}
+				break;
+			}
+			case TSTATEMENT_IF: {
+				effect c = effect_expr(tc, statement->tif->cond, total);
+				effect t = effect_block(tc, statement->tif->then, total);
+				s = c > t ? c : t;
+
+				if (statement->tif->els) {
+					effect f = effect_block(tc, statement->tif->els, total);
+					s = f > s ? f : s;
+				}
+				break;
+			}
+			case TSTATEMENT_WHILE: {
+				/* Whether a loop ends is not worked out */
+				effect c = effect_expr(tc, statement->loop->cond, total);
+				effect b = effect_block(tc, statement->loop->block, total);
+				s = c > b ? c : b;
+				*total = false;
+				break;
+			}
+			case TSTATEMENT_ASM: {
+				/* What the instructions do is not worked out */
+				s = EFFECT_ANY;
+				*total = false;
+				break;
+			}
+			default: break;
+		}
+
+		e = s > e ? s : e;
+	}
+
+	return e;
+}
+
+/*
+ * Classify every function by what it may do besides computing its result.
+ * A function's effects are its own and those of the functions it calls, so
+ * every function starts pure and is raised until nothing changes. Totality
+ * goes the other way: no function is total until all it calls are, so none
+ * in a cycle of calls ever is. Struct and array variables are in the
+ * function's own frame, which no other function sees; the memory a slice
+ * refers to and the thread-locals are the only memory shared, so reading
+ * them reads memory, and storing to them is a side effect. An index out of
+ * bounds traps, so a function that indexes may not return.
+ */
+static void check_effects(Typechecker *tc)
+{
+	bool changed = true;
+
+	while (changed) {
+		changed = false;
+
+		for (size_t i = 0; i < tc->tfile->ntfuns; ++i) {
+			TFun *tfun = tc->tfile->tfuns[i];
+			bool total = true;
+			effect e = effect_block(tc, tfun->block, &total);
+
+			if (e > tfun->effect) {
+				tfun->effect = e;
+				changed = true;
+			}
+
+			if (total && !tfun->total) {
+				tfun->total = true;
+				changed = true;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < tc->tfile->ntfuns; ++i) {
+		TFun *tfun = tc->tfile->tfuns[i];
+
+		if (tfun->pure && tfun->effect != EFFECT_PURE) {
+			err_source(tfun->file, tfun->identifier.span, "function '%s' is declared pure, but %s", tfun->identifier.content,
+				tfun->effect == EFFECT_READ ? "reads memory" : "has side effects");
+		}
+	}
+}
+
+static size_t value_hash(TExpression *expression)
+{
+	size_t h = (size_t)expression->variant * 31 + (size_t)expression->type;
+
+	switch (expression->variant) {
+		case TEXPRESSION_NUMLIT: h = h * 31 + expression->number->u64; break;
+		case TEXPRESSION_VARIABLE: h = h * 31 + (size_t)expression->var; break;
+		case TEXPRESSION_GLOBAL: h = h * 31 + (size_t)expression->global; break;
+		case TEXPRESSION_BINARY: {
+			h = h * 31 + expression->binary->op;
+			h = h * 31 + (size_t)expression->binary->lhs;
+			h = h * 31 + (size_t)expression->binary->rhs;
+			break;
+		}
+		case TEXPRESSION_UNARY: {
+			h = h * 31 + expression->unary->op;
+			h = h * 31 + (size_t)expression->unary->operand;
+			h = h * 31 + expression->unary->lanes[0];
+			break;
+		}
+		case TEXPRESSION_FIELD: {
+			h = h * 31 + expression->field->offset;
+			h = h * 31 + (size_t)expression->field->base;
+			break;
+		}
+		case TEXPRESSION_INDEX: {
+			h = h * 31 + expression->index->offset;
+			h = h * 31 + (size_t)expression->index->base;
+			h = h * 31 + (size_t)expression->index->index;
+			break;
+		}
+		default: break;
+	}
+
+	return h ^ (h >> 17);
+}
+
+/* Operands are interned before their parents, so they compare by identity */
+static bool value_equal(TExpression *a, TExpression *b)
+{
+	if (a->variant != b->variant || a->type != b->type) {
+		return false;
+	}
+
+	switch (a->variant) {
+		case TEXPRESSION_NUMLIT: return a->number->u64 == b->number->u64;
+		case TEXPRESSION_VARIABLE: return a->var == b->var;
+		case TEXPRESSION_GLOBAL: return a->global == b->global;
+		case TEXPRESSION_BINARY: {
+			return a->binary->op == b->binary->op
+				&& a->binary->lhs == b->binary->lhs
+				&& a->binary->rhs == b->binary->rhs;
+		}
+		case TEXPRESSION_UNARY: {
+			return a->unary->op == b->unary->op && a->unary->operand == b->unary->operand
+				&& !memcmp(a->unary->lanes, b->unary->lanes, TYPE_MAXLANES);
+		}
+		case TEXPRESSION_FIELD: return a->field->field == b->field->field && a->field->base == b->field->base;
+		case TEXPRESSION_INDEX: {
+			return a->index->offset == b->index->offset && a->index->stride == b->index->stride
+				&& a->index->base == b->index->base && a->index->index == b->index->index;
+		}
+		default: return false;
+	}
+}
+
+/*
+ * Return the node already computing the same value as 'expression', if there
+ * is one, or record 'expression' as computing it. Calls and builtins are
+ * never interned, as they may have side effects; nor, then, is anything
+ * containing one. Reuse is limited to a statement: there is no assignment
+ * yet, but a statement is the largest region in which the first evaluation of
+ * a node is known to happen before the others.
+ */
+static TExpression *value_intern(Typechecker *tc, TExpression *expression)
+{
+	if (expression->variant == TEXPRESSION_CALL || expression->variant == TEXPRESSION_BUILTIN || expression->variant == _TNODE_NULL) {
+		return expression;
+	}
+
+	if ((tc->nvalues + 1) * 4 > tc->valuecap * 3) {
+		TExpression **old = tc->values;
+		size_t oldcap = tc->valuecap;
+
+		tc->valuecap = oldcap ? oldcap * 2 : 64;
+		tc->values = acalloc(tc->valuecap, sizeof(TExpression *));
+
+		for (size_t i = 0; i < oldcap; ++i) {
+			if (old[i]) {
+				size_t j = value_hash(old[i]) & (tc->valuecap - 1);
+				while (tc->values[j]) {
+					j = (j + 1) & (tc->valuecap - 1);
+				}
+				tc->values[j] = old[i];
+			}
+		}
+
+		afree(old);
+	}
+
+	size_t i = value_hash(expression) & (tc->valuecap - 1);
+
+	while (tc->values[i]) {
+		TExpression *found = tc->values[i];
+
+		if (value_equal(found, expression)) {
+			/* The duplicate's operands are used once fewer than was counted */
+			if (expression->variant == TEXPRESSION_BINARY) {
+				--expression->binary->lhs->uses;
+				--expression->binary->rhs->uses;
+			} else if (expression->variant == TEXPRESSION_UNARY) {
+				--expression->unary->operand->uses;
+			} else if (expression->variant == TEXPRESSION_FIELD) {
+				--expression->field->base->uses;
+			} else if (expression->variant == TEXPRESSION_INDEX) {
+				--expression->index->base->uses;
+				--expression->index->index->uses;
+			}
+
+			++found->uses;
+			return found;
+		}
+
+		i = (i + 1) & (tc->valuecap - 1);
+	}
+
+	tc->values[i] = expression;
+	++tc->nvalues;
+
+	return expression;
+}
+
+static void value_reset(Typechecker *tc)
+{
+	if (tc->values) {
+		memset(tc->values, 0, tc->valuecap * sizeof(TExpression *));
+	}
+
+	tc->nvalues = 0;
 }
 
 static void add_variable(Typechecker *tc, TVariable *tvar, scopendx scope)
@@ -277,10 +2739,19 @@ static void add_fun(Typechecker *tc, TFun *tfun) {
 
 static typendx find_type_name(Typechecker *tc, Token name)
 {
+	/* Type parameters of the generic being instantiated hide the types they share a name with */
+	if (tc->generic) {
+		for (size_t i = 0; i < tc->generic->ntypeparams; ++i) {
+			if (!strcmp(name.content, tc->generic->typeparams[i].content)) {
+				return tc->typeargs[i];
+			}
+		}
+	}
+
 	for (size_t i = 0; i < tc->tfile->ntypes; ++i) {
 		Type *type = tc->tfile->types[i];
 
-		if (type->kind == TYPE_PRIMITIVE && !strcmp(name.content, type->name)) {
+		if (!strcmp(name.content, type->name)) {
 			return i;
 		}
 	}
@@ -301,7 +2772,7 @@ static varndx find_variable(Typechecker *tc, Token iden, scopendx scope)
 			TVariable *var = tc->tfile->tvariables[v];
 
 			if (!strcmp(iden.content, var->identifier.content)) {
-				return ndx;
+				return v;
 			}
 		}
 
@@ -311,6 +2782,17 @@ static varndx find_variable(Typechecker *tc, Token iden, scopendx scope)
 	return NONDX;
 }
 
+static globalndx find_global(Typechecker *tc, Token iden)
+{
+	for (size_t i = 0; i < tc->tfile->ntglobals; ++i) {
+		if (!strcmp(iden.content, tc->tfile->tglobals[i]->identifier.content)) {
+			return i;
+		}
+	}
+
+	return NONDX;
+}
+
 static funndx find_fun(Typechecker *tc, Token iden)
 {
 	Scope *scope = scope_get(tc, 0);
@@ -327,6 +2809,17 @@ static funndx find_fun(Typechecker *tc, Token iden)
 	return NONDX;
 }
 
+static int find_generic(Typechecker *tc, Token iden)
+{
+	for (size_t i = 0; i < tc->ngenerics; ++i) {
+		if (!strcmp(iden.content, tc->generics[i]->identifier.content)) {
+			return i;
+		}
+	}
+
+	return NONDX;
+}
+
 static scopendx scope_add(Typechecker *tc, scopendx parent)
 {
 	Scope *obj = alloct(Scope);
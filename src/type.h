@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include "asm.h"
 #include "parser.h"
 
 /*
@@ -18,18 +19,46 @@ typedef int scopendx;
 typedef int typendx;
 typedef int varndx;
 typedef int funndx;
+typedef int globalndx;
 
 #define NONDX -1 /* Default value for *ndx variables */
 
+#define TYPE_MAXALIGN 4096 /* a page */
+#define TYPE_MAXSIZE 0x40000000 /* 1 GiB; frame displacements are 32-bit */
+#define TYPE_SOAALIGN 16 /* columns of soa arrays start on an SSE vector boundary */
+#define TYPE_MAXLANES 32 /* of a vector: bytes in a YMM register */
+#define TYPE_MAXVECPARAMS 8 /* xmm0 to xmm7 */
+
 typedef enum type_kind {
 	TYPE_PRIMITIVE,
+	TYPE_STRUCT,
+	TYPE_ARRAY,
+	TYPE_SLICE, /* a pointer to elements, passed with their number */
+	TYPE_VECTOR, /* lanes of an integer type, in an XMM register (16 bytes, SSE2) or a YMM one (32, AVX2) */
 } type_kind;
 
+typedef struct Field {
+	Token identifier;
+	typendx type;
+	size_t offset; /* bytes from the start of the struct */
+} Field;
+
 typedef struct Type {
 	type_kind kind;
 	const char *name;
-	size_t size; /* Bytes */
+	size_t size; /* Bytes; a multiple of 'align' */
+	size_t align; /* Bytes; a power of two */
 	bool signd;
+
+	/* TYPE_STRUCT; in order of declaration, whatever order they are laid out in */
+	Field *fields;
+	size_t nfields;
+
+	/* TYPE_ARRAY and TYPE_SLICE; TYPE_VECTOR has 'length' lanes of type 'elem' */
+	typendx elem;
+	size_t length;
+	bool soa; /* one column per field of 'elem', in place of one element after another */
+	size_t *columns; /* where soa: the offset of each field's column */
 } Type;
 
 /* Akin to p_node_variant, but for Typechecker nodes */
@@ -37,9 +66,26 @@ typedef enum t_node_variant {
 	_TNODE_NULL,
 
 	TEXPRESSION_NUMLIT,
+	TEXPRESSION_VARIABLE,
+	TEXPRESSION_CALL,
+	TEXPRESSION_BINARY,
+	TEXPRESSION_UNARY,
+	TEXPRESSION_FIELD,
+	TEXPRESSION_INDEX,
+	TEXPRESSION_BUILTIN,
+	TEXPRESSION_GLOBAL,
 
 	TSTATEMENT_RETURN,
 	TSTATEMENT_RETURN_NOVAL,
+	TSTATEMENT_SWITCH,
+	TSTATEMENT_IF,
+	TSTATEMENT_VAR,
+	TSTATEMENT_ASSIGN,
+	TSTATEMENT_WHILE,
+	TSTATEMENT_STORE,
+	TSTATEMENT_CHECK,
+	TSTATEMENT_BUILTIN,
+	TSTATEMENT_ASM,
 } t_node_variant;
 
 typedef struct Scope {
@@ -61,21 +107,203 @@ typedef struct Scope {
 typedef struct TVariable {
 	Token identifier;
 	typendx type;
+	varndx length; /* of a slice: the (unnamed) parameter after it, holding its length; else NONDX */
+	size_t align; /* of its slot in the frame, where asked for more than its type's; else 0 */
 } TVariable;
 
+/*
+ * A thread-local: a variable outside any function, of which each thread has
+ * its own, at a fixed offset from the thread pointer. It is in memory, and
+ * read and written as a place, as an element of a slice is; a local of the
+ * same name hides it.
+ */
+typedef struct TGlobal {
+	File *file; /* defined in */
+	Token identifier;
+	typendx type;
+	size_t align; /* where asked for more than its type's; else 0 */
+	uint64_t value; /* initially; only integers may start other than zeroed */
+} TGlobal;
+
+typedef enum binop {
+	BINOP_ADD,
+	BINOP_SUB,
+	BINOP_MUL,
+	BINOP_DIV,
+	BINOP_MOD,
+	BINOP_AND,
+	BINOP_OR,
+	BINOP_XOR,
+	BINOP_SHL,
+	BINOP_SHR,
+	BINOP_ROTL, /* rotl(x, n) to pext(x, m): builtins written as calls, of two operands */
+	BINOP_ROTR,
+	BINOP_PDEP, /* the low bits of x, deposited at the set bits of m */
+	BINOP_PEXT, /* the bits of x at the set bits of m, gathered into the low bits */
+	BINOP_EQ,
+	BINOP_NE,
+	BINOP_LT,
+	BINOP_LE,
+	BINOP_GT,
+	BINOP_GE,
+} binop;
+
+/*
+ * Operations on vectors are unary too, taking one operand and any number
+ * of constant lanes; they are written as calls of their names. In place of
+ * these, operators apply to each lane of a vector separately.
+ */
+typedef enum unop {
+	UNOP_NEG,
+	UNOP_NOT,
+	UNOP_SPLAT, /* splat(x): the scalar operand in every lane */
+	UNOP_LANE, /* lane(v, i): lane i of the operand */
+	UNOP_SHUFFLE, /* shuffle(v, i, j, ...): lanes of the operand, in the given order */
+	UNOP_REDUCE_ADD, /* hadd(v), hand, hor and hxor: the lanes of the operand combined, into one of them */
+	UNOP_REDUCE_AND,
+	UNOP_REDUCE_OR,
+	UNOP_REDUCE_XOR,
+	UNOP_MASK, /* mask(v): the top bit of each lane, that of lane i as bit i of a u32 */
+	UNOP_ADDRESS, /* the address a slice holds, as a u64; only the optimiser makes these */
+	UNOP_POPCOUNT, /* popcount(x) to bswap(x): builtins of one integer, of its type */
+	UNOP_CLZ, /* leading zero bits; the width of the type for 0 */
+	UNOP_CTZ, /* trailing zero bits; likewise */
+	UNOP_BSWAP,
+} unop;
+
+/*
+ * Builtins that read or change the state of the machine; they are never
+ * shared, moved or vectorized. Those without a value are statements.
+ */
+typedef enum builtin {
+	BUILTIN_RDTSC, /* rdtsc(): the time-stamp counter, as a u64 */
+	BUILTIN_PREFETCH, /* prefetch(place, locality): its cache line, kept from 0 (once) to 3 (in every level) */
+	BUILTIN_STREAM, /* stream(place, value): a store that bypasses the caches */
+	BUILTIN_SFENCE, /* sfence(): streamed stores are seen before those after it */
+	BUILTIN_LOAD, /* load(place, order) to cmpxchg(...): atomic accesses of an integer, in some memorder */
+	BUILTIN_STORE, /* store(place, value, order) */
+	BUILTIN_FETCHADD, /* fetchadd(place, value, order): adds, and gives the value before */
+	BUILTIN_EXCHANGE, /* exchange(place, value, order): likewise, but stores the value */
+	BUILTIN_CMPXCHG, /* cmpxchg(place, expected, desired, order): stores 'desired' if it held 'expected'; gives what it held */
+} builtin;
+
+/* Orderings of atomic accesses with those around them, weakest first; as in C11, but for acq_rel */
+typedef enum memorder {
+	ORDER_RELAXED,
+	ORDER_ACQUIRE, /* none after it may come before */
+	ORDER_RELEASE, /* none before it may come after */
+	ORDER_SEQCST, /* both, and all seqcst accesses happen in one order */
+} memorder;
+
+typedef struct TCall TCall;
+typedef struct TBinary TBinary;
+typedef struct TUnary TUnary;
+typedef struct TField TField;
+typedef struct TIndex TIndex;
+typedef struct TBuiltin TBuiltin;
+
+/*
+ * Pure expressions (those without calls) are hash-consed within a statement,
+ * so that each distinct computation is one node; 'uses' counts the places the
+ * node appears, and is more than one for common subexpressions. The optimiser
+ * later does the same for calls to pure functions.
+ */
 typedef struct TExpression {
 	t_node_variant variant;
+	typendx type;
+	size_t uses;
 
 	union {
 		Number *number;
+		varndx var;
+		TCall *call;
+		TBinary *binary;
+		TUnary *unary;
+		TField *field;
+		TIndex *index;
+		TBuiltin *builtin;
+		globalndx global;
 	};
 } TExpression;
 
+struct TCall {
+	funndx fun;
+
+	struct TExpression **args;
+	size_t nargs;
+};
+
+struct TBinary {
+	binop op;
+	struct TExpression *lhs;
+	struct TExpression *rhs;
+};
+
+struct TUnary {
+	unop op;
+	struct TExpression *operand;
+	uint8_t lanes[TYPE_MAXLANES]; /* UNOP_LANE: the lane, first; UNOP_SHUFFLE: the lane of the operand each lane takes */
+};
+
+/*
+ * A field of a struct in memory: of a variable or thread-local, or of a field
+ * of one. Structs are only ever used through their fields, so expressions of
+ * struct type appear as the base of a field and nowhere else.
+ */
+struct TField {
+	struct TExpression *base;
+	size_t field; /* index into the fields of the base's type */
+	size_t offset; /* of the field, from the start of the base */
+};
+
+/*
+ * An element of an array in memory, at base + offset + index * stride. The
+ * elements of an soa array are only ever the base of a field, and the
+ * typechecker folds the two into one index of that field's column. A slice
+ * is only ever a variable, and its elements are at the address it holds.
+ */
+struct TIndex {
+	struct TExpression *base; /* of array or slice type */
+	struct TExpression *index;
+	size_t stride;
+	size_t offset;
+	size_t length; /* of the array; for a slice, that is in its variable's 'length' */
+	bool checked; /* the index is compared with the length before use */
+};
+
+/*
+ * The place of prefetch, stream and the atomic builtins is the first argument;
+ * that of prefetch is not bounds-checked, as it cannot fault. The ordering of
+ * an atomic builtin is not an argument here.
+ */
+struct TBuiltin {
+	builtin op;
+	memorder order;
+
+	struct TExpression **args;
+	size_t nargs;
+};
+
+typedef struct TSwitch TSwitch;
+typedef struct TIf TIf;
+typedef struct TAssign TAssign;
+typedef struct TWhile TWhile;
+typedef struct TStore TStore;
+typedef struct TCheck TCheck;
+typedef struct TAsm TAsm;
+
 typedef struct TStatement {
 	t_node_variant variant;
 
 	union {
-		TExpression *expr;
+		TExpression *expr; /* TSTATEMENT_RETURN, and the builtin of TSTATEMENT_BUILTIN */
+		TSwitch *sw;
+		TIf *tif;
+		TAssign *assign; /* TSTATEMENT_VAR and TSTATEMENT_ASSIGN */
+		TWhile *loop;
+		TStore *store;
+		TCheck *check;
+		TAsm *tasm;
 	};
 } TStatement;
 
@@ -86,12 +314,125 @@ typedef struct TBlock {
 	size_t nstatements;
 } TBlock;
 
+typedef struct TCase {
+	uint64_t *values; /* sign-extended to 64 bits for signed types */
+	size_t nvalues;
+
+	TBlock *block;
+} TCase;
+
+struct TSwitch {
+	TExpression *expr;
+
+	TCase **cases;
+	size_t ncases;
+
+	TBlock *def; /* NULL if there is no default */
+};
+
+struct TIf {
+	TExpression *cond; /* bool */
+	branch_hint hint;
+
+	TBlock *then;
+	TBlock *els; /* NULL if there is no else */
+};
+
+/* A struct or array variable is defined by a zero of its type, and assigned through its fields or elements only */
+struct TAssign {
+	varndx var;
+	TExpression *value;
+};
+
+/* An assignment to memory; the place is never shared with the value, even where the two are equal */
+struct TStore {
+	TExpression *place;
+	TExpression *value;
+};
+
+/*
+ * A bounds check on its own, which traps unless index < length, unsigned. The
+ * optimiser puts one in front of a loop in place of the checks of an element
+ * the loop indexes on every iteration, against the greatest index it uses.
+ */
+struct TCheck {
+	TExpression *index;
+	size_t length; /* of an array */
+	varndx bound; /* for a slice, the variable holding its length, in place of 'length'; else NONDX */
+};
+
+/*
+ * An operand of an asm statement. Outputs come first, and are variables,
+ * in a register; the asm sets them. Inputs are values in a register,
+ * constants ('i'), or places in memory ('m'). The register is any free one
+ * ('r'), the one a letter names ('a', 'b', 'c', 'd', 'S' or 'D' for rax,
+ * rbx, rcx, rdx, rsi and rdi), or, for an input whose constraint is the
+ * number of an output, that of the output, which it gives its initial value.
+ */
+typedef struct TAsmOperand {
+	char constraint;
+	TExpression *expr; /* an output's is its variable */
+} TAsmOperand;
+
+/*
+ * Instructions written out, with operands the code generator puts in place
+ * around them. They are assumed to read and write any memory, so the
+ * statement is never moved or removed, and to leave the flags changed.
+ */
+struct TAsm {
+	File *file; /* written in */
+	Span span; /* of its first string */
+
+	AsmInsn *insns;
+	size_t ninsns;
+
+	TAsmOperand *operands; /* those referred to as %0, %1 and so on */
+	size_t noperands;
+	size_t nouts;
+
+	uint16_t clobbers; /* general purpose registers changed besides the outputs (bit n: register n) */
+	uint16_t xclobbers; /* the same, of XMM registers */
+};
+
+/*
+ * The loop is entered if 'guard' holds, and repeated while 'cond' does. They
+ * are the same condition, but the loop optimiser rewrites 'cond' in terms of
+ * the variables it sets up in 'pre', which runs once, just before the first
+ * iteration.
+ */
+struct TWhile {
+	TExpression *cond; /* bool */
+	TExpression *guard;
+
+	TBlock *pre;
+	TBlock *block;
+};
+
+/* What a function may do besides computing its result; each level includes those before it */
+typedef enum effect {
+	EFFECT_PURE, /* depends on its arguments alone */
+	EFFECT_READ, /* reads memory as well, but writes none */
+	EFFECT_ANY,
+} effect;
+
 typedef struct TFun {
 	scopendx scope;
 
+	File *file; /* defined in */
 	Token identifier;
+	bool cold;
+	bool pure; /* declared pure; checked against 'effect' */
+	Token *clones; /* targets of target_clones, each with a clone of its own; see gen_clones() */
+	size_t nclones;
+	effect effect;
+	bool total; /* sure to return: no loops, no division that may trap, and calls to total functions only */
+	bool exported; /* may be called from outside the program */
+	bool live; /* may be called at all; others are not emitted */
 	typendx rettype;
 	TBlock *block;
+
+	varndx *params;
+	size_t nparams;
 } TFun;
 
 typedef struct TFile {
@@ -105,16 +446,54 @@ typedef struct TFile {
 	TVariable **tvariables;
 	size_t ntvariables;
 
+	TGlobal **tglobals;
+	size_t ntglobals;
+
 	Type **types;
 	size_t ntypes;
 } TFile;
 
+/* A generic function instantiated with some type arguments */
+typedef struct Instance {
+	int generic; /* index into the Typechecker's generics */
+	typendx *typeargs; /* one per type parameter */
+	funndx fun;
+} Instance;
+
 typedef struct Typechecker {
 	File *file;
 	PFile *pfile;
 	TFile *tfile;
+	bool wide; /* 32-byte vector types may be used: the target has AVX2 */
+	bool cloned; /* in a function with target_clones, whose "x86-64" clone has no AVX2 */
+
+	/*
+	 * Generic functions are not checked as written, but once for each distinct
+	 * list of type arguments they are called with; each instantiation is then an
+	 * ordinary function whose parameters have concrete types
+	 */
+	PFun **generics;
+	size_t ngenerics;
+	Instance *instances; /* cache, keyed by (generic, type arguments) */
+	size_t ninstances;
+	size_t nchecked; /* instances whose blocks have been checked */
+
+	PFun *generic; /* being instantiated; its type parameters name 'typeargs' */
+	typendx *typeargs;
+
+	/* Open-addressed table of the pure expressions of the current statement */
+	TExpression **values;
+	size_t nvalues;
+	size_t valuecap; /* power of two */
 } Typechecker;
 
 Typechecker *typechecker_new();
-TFile *typechecker_run(Typechecker *tc, File *file, PFile *pfile);
+TFile *typechecker_run(Typechecker *tc, PFile *pfile);
 void typechecker_reset(Typechecker *tc);
+
+/*
+ * A copy of an expression sharing no nodes with it, but for the variables
+ * 'vars' it reads, which are replaced by the expressions 'values' (one more
+ * use of each). Passes that rewrite the tree copy through this alone.
+ */
+TExpression *texpression_copy(TExpression *expression, const varndx *vars, TExpression **values, size_t nvars);
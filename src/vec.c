@@ -19,6 +19,11 @@ void *_vec_push(void *vec, void *elem, size_t *length, size_t size)
 
 void *_vec_join(void *va, void *vb, size_t *alen, size_t blen, size_t size)
 {
+	/* Reallocating to no bytes may free the vector */
+	if (!blen) {
+		return va;
+	}
+
 	char *temp = arecalloc(va, *alen + blen, size);
 	memcpy(temp + *alen * size, vb, blen * size);
 	*alen += blen;